@@ -0,0 +1,11 @@
+include (../../KDUpdater.pri)
+
+TEMPLATE = app
+TARGET = CatalogBenchmark
+QT -= gui
+CONFIG += console
+macx:CONFIG -= app_bundle
+
+DESTDIR = $$KDUPDATER_BIN_PATH
+
+SOURCES     += main.cpp
@@ -0,0 +1,170 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+/*
+   Measures the memory taken by the updates a check finds in a large catalog. It generates a
+   target with <count> installed packages and an update source offering a new version of each,
+   runs an UpdateFinder on it and reports the resident set size before and after, and the
+   objects owned by the updates.
+
+   The file downloader of an update is created on first use. With --eager, canDownload() is
+   called on every update found, which creates all downloaders as the constructor of Update
+   did before, for comparison.
+*/
+
+#include <kdupdatertarget.h>
+#include <kdupdaterupdate.h>
+#include <kdupdaterupdatefinder.h>
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QStringList>
+#include <QUrl>
+#include <QUuid>
+
+#include <iostream>
+#include <cstdlib>
+
+/*
+   Returns the resident set size of this process in kB, or -1 if it is not known.
+*/
+static qint64 residentSetSize()
+{
+#ifdef Q_OS_LINUX
+    QFile status( QLatin1String( "/proc/self/status" ) );
+    if( !status.open( QIODevice::ReadOnly | QIODevice::Text ) )
+        return -1;
+    while( !status.atEnd() )
+    {
+        const QByteArray line = status.readLine();
+        if( line.startsWith( "VmRSS:" ) )
+            return line.mid( 6 ).trimmed().split( ' ' ).first().toLongLong();
+    }
+#endif
+    return -1;
+}
+
+static bool writeFile( const QString& fileName, const QByteArray& contents )
+{
+    QFile file( fileName );
+    return file.open( QIODevice::WriteOnly ) && file.write( contents ) == contents.size();
+}
+
+/*
+   Writes a target with \a count packages into \a directory, and an update source offering
+   version 2.0 of each of them into \a repository.
+*/
+static bool generateCatalog( const QString& directory, const QString& repository, int count )
+{
+    QByteArray packages = "<Packages><TargetName>Benchmark</TargetName><TargetVersion>1.0</TargetVersion>";
+    QByteArray updates = "<Updates><TargetName>{AnyTarget}</TargetName><TargetVersion>1.0</TargetVersion>";
+    for( int i = 0; i < count; ++i )
+    {
+        const QByteArray name = "Package" + QByteArray::number( i );
+        packages += "<Package><Name>" + name + "</Name><Version>1.0</Version><LastUpdateDate>2000-01-01</LastUpdateDate></Package>";
+        updates += "<PackageUpdate><Name>" + name + "</Name><Version>2.0</Version><ReleaseDate>2012-01-01</ReleaseDate>"
+                   "<UpdateFile CompressedSize=\"1024\" UncompressedSize=\"4096\">" + name + ".kvz</UpdateFile></PackageUpdate>";
+    }
+    packages += "</Packages>";
+    updates += "</Updates>";
+
+    return QDir().mkpath( repository ) &&
+           writeFile( QDir( directory ).filePath( QLatin1String( "Packages.xml" ) ), packages ) &&
+           writeFile( QDir( directory ).filePath( QLatin1String( "UpdateSources.xml" ) ),
+                      "<UpdateSources><UpdateSource><Name>Benchmark</Name><Url>" + QUrl::fromLocalFile( repository ).toEncoded() +
+                      "</Url><Priority>1</Priority></UpdateSource></UpdateSources>" ) &&
+           writeFile( QDir( repository ).filePath( QLatin1String( "Updates.xml" ) ), updates );
+}
+
+int main( int argc, char** argv )
+{
+    QCoreApplication app( argc, argv );
+
+    QStringList args = app.arguments().mid( 1 );
+    const bool eager = args.removeAll( QLatin1String( "--eager" ) ) > 0;
+    bool ok = true;
+    const int count = args.isEmpty() ? 10000 : args.first().toInt( &ok );
+    if( !ok || count <= 0 || args.count() > 1 )
+    {
+        std::cerr << "Usage: " << argv[0] << " [--eager] [<count>]\n"
+                     "Finds <count> updates, 10000 by default, in a generated catalog and reports\n"
+                     "the memory they take. --eager creates the file downloaders of all updates." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const QString directory = QDir::temp().filePath( QString::fromLatin1( "kdupdater-catalog-benchmark%1" ).arg( QUuid::createUuid().toString() ) );
+    const QString repository = QDir( directory ).filePath( QLatin1String( "repository" ) );
+    if( !generateCatalog( directory, repository, count ) )
+    {
+        std::cerr << "Cannot write the catalog into " << qPrintable( QDir::toNativeSeparators( directory ) ) << std::endl;
+        QDir( directory ).removeRecursively();
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    {
+        KDUpdater::Target target;
+        target.setDirectory( directory );
+
+        const qint64 rssBefore = residentSetSize();
+        QElapsedTimer timer;
+        timer.start();
+
+        KDUpdater::UpdateFinder finder( &target );
+        finder.run();
+        const QList< KDUpdater::Update* > updates = finder.updates();
+
+        int downloadable = 0;
+        if( eager )
+        {
+            for( QList< KDUpdater::Update* >::const_iterator it = updates.begin(); it != updates.end(); ++it )
+                downloadable += (*it)->canDownload() ? 1 : 0;
+        }
+
+        const qint64 elapsed = timer.elapsed();
+        const qint64 rssAfter = residentSetSize();
+
+        int children = 0;
+        for( QList< KDUpdater::Update* >::const_iterator it = updates.begin(); it != updates.end(); ++it )
+            children += (*it)->children().count();
+
+        std::cout << "Updates found:            " << updates.count() << " of " << count << "\n"
+                  << "File downloaders:         " << ( eager ? "created for all updates" : "created on first use" ) << "\n"
+                  << "Objects owned by updates: " << children << "\n"
+                  << "Time:                     " << elapsed << " ms" << std::endl;
+        if( eager )
+            std::cout << "Downloadable updates:     " << downloadable << std::endl;
+        if( rssBefore >= 0 && rssAfter >= 0 )
+            std::cout << "Resident set size:        " << rssBefore << " kB before, " << rssAfter << " kB after, "
+                      << ( rssAfter - rssBefore ) * 1024 / qMax( updates.count(), 1 ) << " bytes per update" << std::endl;
+        else
+            std::cout << "Resident set size:        not known on this platform" << std::endl;
+
+        if( updates.count() != count )
+            status = EXIT_FAILURE;
+    }
+
+    QDir( directory ).removeRecursively();
+    return status;
+}
@@ -2,7 +2,7 @@ TEMPLATE = subdirs
 
 CONFIG      += ordered
 
-SUBDIRS     += simpleexample kdupdaterdemo
+SUBDIRS     += simpleexample kdupdaterdemo catalogbenchmark
 qtHaveModule(script) {
         SUBDIRS += compatexample
         SUBDIRS += firmwaredemo
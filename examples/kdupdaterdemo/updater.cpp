@@ -123,11 +123,11 @@ bool Updater::Private::checkForUpdates()
     m_updateFinder->run();
     Q_FOREACH( const KDUpdater::Update* info, m_updateFinder->updates() )
     {
-        if ( m_updaterapp.packagesInfo()->findPackageInfo( info->data( QLatin1String( "Name" ) ).toString() ) > -1 )
+        if ( m_updaterapp.packagesInfo()->findPackageInfo( info->packageName() ) > -1 )
         {
-            m_updateVersion = info->data( QLatin1String( "Version" ) ).toString();
-            m_componentName = info->data( QLatin1String( "Name" ) ).toString();
-            m_updateDate = info->data( QLatin1String( "ReleaseDate" ) ).toDate();
+            m_updateVersion = info->version();
+            m_componentName = info->packageName();
+            m_updateDate = info->releaseDate();
             m_foundUpdates = true;
         }
     }
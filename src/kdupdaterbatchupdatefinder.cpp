@@ -0,0 +1,476 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#include "kdupdaterbatchupdatefinder.h"
+#include "kdupdaterupdatefinder.h"
+#include "kdupdatertarget.h"
+#include "kdupdaterupdatesourcesinfo.h"
+#include "kdupdaterfiledownloader_p.h"
+#include "kdupdaterfiledownloaderfactory.h"
+#include "kdupdaterupdatesinfo_p.h"
+
+#include <QCoreApplication>
+#include <QHash>
+#include <QVector>
+#include <QtConcurrentMap>
+
+/*!
+   \ingroup kdupdater
+   \class KDUpdater::BatchUpdateFinder kdupdaterbatchupdatefinder.h KDUpdaterBatchUpdateFinder
+   \brief Finds updates for many \ref KDUpdater::Target objects at once
+
+   Running one \ref KDUpdater::UpdateFinder per target downloads and parses the Updates.xml of
+   an update source once for every target using it. KDUpdater::BatchUpdateFinder fetches and
+   parses the Updates.xml of each distinct update source only once and shares the result
+   between all targets. The Updates.xml files are parsed in parallel, and so are the package
+   updates applicable to each target computed.
+
+   For each target, the batch finder creates an \ref KDUpdater::UpdateFinder holding the
+   result, see \ref updateFinder(). The update objects are created in the thread of the batch
+   finder, as with \ref KDUpdater::UpdateFinder.
+
+   Usage:
+   \code
+   KDUpdater::BatchUpdateFinder finder;
+   finder.addTarget( pluginTarget );
+   finder.addTarget( dataTarget );
+   finder.run();
+
+   const QList<KDUpdater::Update*> pluginUpdates = finder.updates( pluginTarget );
+   \endcode
+*/
+
+using namespace KDUpdater;
+
+/*!
+   \internal An Updates.xml downloaded for the update source \c url, and its parsed content.
+ */
+struct Catalog
+{
+    QUrl url;
+    QString fileName;
+    UpdatesInfo info;
+};
+
+/*!
+   \internal Parses the downloaded Updates.xml of \a catalog. Called from worker threads.
+ */
+static void parseCatalog( Catalog& catalog )
+{
+    catalog.info.setFileName( catalog.fileName );
+}
+
+//
+// Private
+//
+class BatchUpdateFinder::Private
+{
+public:
+    Private( BatchUpdateFinder* qq ) :
+        q( qq ),
+        updateType( PackageUpdate ),
+        cancel( false ),
+        downloadCompleteCount( 0 )
+    {}
+
+    ~Private()
+    {
+        clear();
+    }
+
+    BatchUpdateFinder* q;
+    QList<Target*> targets;
+    UpdateTypes updateType;
+    QString platformIdentifier;
+
+    QHash<Target*, UpdateFinder*> finders;
+    QList<QUrl> failedSources;
+
+    bool cancel;
+    int downloadCompleteCount;
+    QList<QUrl> sourceUrls;
+    QList<FileDownloader*> downloaders;
+
+    void clear();
+    bool downloadUpdateXMLFiles();
+    QHash<QUrl, UpdatesInfo> parseUpdateXMLFiles();
+    void slotDownloadDone();
+};
+
+/*!
+   \internal
+
+   Deletes the finders of the last run and all download resources.
+*/
+void BatchUpdateFinder::Private::clear()
+{
+    qDeleteAll( finders );
+    finders.clear();
+    qDeleteAll( downloaders );
+    downloaders.clear();
+    sourceUrls.clear();
+    failedSources.clear();
+    downloadCompleteCount = 0;
+}
+
+/*!
+   \internal
+
+   Downloads the Updates.xml of every distinct update source of all targets. Waits in an event
+   loop until all downloads are complete.
+*/
+bool BatchUpdateFinder::Private::downloadUpdateXMLFiles()
+{
+    for( QList< Target* >::const_iterator it = targets.begin(); it != targets.end(); ++it )
+    {
+        const UpdateSourcesInfo * const updateSources = (*it)->updateSourcesInfo();
+        if( !updateSources || !updateSources->isValid() )
+            continue;
+
+        for(int i=0; i<updateSources->updateSourceInfoCount(); i++)
+        {
+            const QUrl url = updateSources->updateSourceInfo(i).url;
+            if( sourceUrls.contains( url ) )
+                continue;
+
+            const QUrl updateXmlUrl = QString::fromLatin1("%1/Updates.xml").arg(url.toString());
+            FileDownloader* const downloader = FileDownloaderFactory::instance().create(updateXmlUrl.scheme(), q);
+            if( !downloader )
+                continue;
+
+            downloader->setUrl(updateXmlUrl);
+            downloader->setAutoRemoveDownloadedFile(true);
+            sourceUrls.append(url);
+            downloaders.append(downloader);
+
+            connect(downloader, SIGNAL(downloadCompleted()),
+                    q, SLOT(slotDownloadDone()));
+            connect(downloader, SIGNAL(downloadCanceled()),
+                    q, SLOT(slotDownloadDone()));
+            connect(downloader, SIGNAL(downloadAborted(QString)),
+                    q, SLOT(slotDownloadDone()));
+        }
+    }
+
+    downloadCompleteCount = 0;
+    for( QList< FileDownloader* >::const_iterator it = downloaders.begin(); it != downloaders.end(); ++it )
+        (*it)->download();
+
+    while( downloadCompleteCount != downloaders.count() )
+    {
+        QCoreApplication::processEvents();
+        if( cancel )
+            return false;
+    }
+
+    return true;
+}
+
+/*!
+   \internal
+
+   Parses the downloaded Updates.xml files in parallel and returns the valid ones, keyed by
+   the url of their update source. Update sources that could not be fetched or parsed are
+   noted in \ref failedSources.
+*/
+QHash<QUrl, UpdatesInfo> BatchUpdateFinder::Private::parseUpdateXMLFiles()
+{
+    QVector<Catalog> catalogs;
+    catalogs.reserve( downloaders.count() );
+    for( int i = 0; i < downloaders.count(); ++i )
+    {
+        const FileDownloader* const downloader = downloaders.at( i );
+        if( !downloader->isDownloaded() )
+        {
+            failedSources.append( sourceUrls.at( i ) );
+            continue;
+        }
+
+        Catalog catalog;
+        catalog.url = sourceUrls.at( i );
+        catalog.fileName = downloader->downloadedFileName();
+        catalogs.append( catalog );
+    }
+
+    QtConcurrent::blockingMap( catalogs, parseCatalog );
+
+    QHash<QUrl, UpdatesInfo> result;
+    for( QVector< Catalog >::const_iterator it = catalogs.begin(); it != catalogs.end(); ++it )
+    {
+        if( it->info.isValid() )
+        {
+            result.insert( it->url, it->info );
+        }
+        else
+        {
+            q->reportError( it->info.errorString() );
+            failedSources.append( it->url );
+        }
+    }
+
+    // This also removes the downloaded files
+    qDeleteAll( downloaders );
+    downloaders.clear();
+
+    return result;
+}
+
+/*!
+   \internal
+*/
+void BatchUpdateFinder::Private::slotDownloadDone()
+{
+    ++downloadCompleteCount;
+
+    const int pc = downloaders.isEmpty() ? 0 : downloadCompleteCount * 50 / downloaders.count();
+    q->reportProgress( pc, tr("Downloading Updates.xml from update sources") );
+}
+
+
+//
+// BatchUpdateFinder
+//
+
+/*!
+   Constructs a batch update finder with the given \a parent.
+*/
+BatchUpdateFinder::BatchUpdateFinder( QObject * parent )
+    : Task( QLatin1String( "BatchUpdateFinder" ), Stoppable ),
+      d( new Private( this ) )
+{
+    setParent( parent );
+}
+
+/*!
+   Destructor. Deletes the update finders of the last run and with them the updates found.
+*/
+BatchUpdateFinder::~BatchUpdateFinder()
+{
+}
+
+/*!
+   Adds \a target to the targets updates are searched for.
+*/
+void BatchUpdateFinder::addTarget( Target * target )
+{
+    if( target && !d->targets.contains( target ) )
+        d->targets.append( target );
+}
+
+/*!
+   Removes \a target from the targets updates are searched for.
+*/
+void BatchUpdateFinder::removeTarget( Target * target )
+{
+    d->targets.removeAll( target );
+}
+
+/*!
+   Returns the targets updates are searched for.
+*/
+QList<Target*> BatchUpdateFinder::targets() const
+{
+    return d->targets;
+}
+
+void BatchUpdateFinder::setUpdateType( UpdateTypes type )
+{
+    d->updateType = type;
+}
+
+/*!
+  \property KDUpdater::BatchUpdateFinder::updateType
+
+   Specifies the type of updates searched for all targets, see
+   \ref KDUpdater::UpdateFinder::updateType. Package updates by default.
+*/
+UpdateTypes BatchUpdateFinder::updateType() const
+{
+    return d->updateType;
+}
+
+void BatchUpdateFinder::setPlatformIdentifier( const QString & platformIdentifier )
+{
+    d->platformIdentifier = platformIdentifier;
+}
+
+/*!
+  \property KDUpdater::BatchUpdateFinder::platformIdentifier
+
+   Specifies the identifier for the platform updates are searched for, see
+   \ref KDUpdater::UpdateFinder::platformIdentifier. If empty, the default of
+   \ref KDUpdater::UpdateFinder is used.
+*/
+QString BatchUpdateFinder::platformIdentifier() const
+{
+    return d->platformIdentifier;
+}
+
+/*!
+   Returns the update finder holding the result of the last run for \a target, or 0 if
+   \a target was not part of the last run.
+*/
+UpdateFinder * BatchUpdateFinder::updateFinder( Target * target ) const
+{
+    return d->finders.value( target );
+}
+
+/*!
+   Returns the updates found for \a target by the last run. The updates are owned by the
+   \ref updateFinder() of the target.
+*/
+QList<Update*> BatchUpdateFinder::updates( Target * target ) const
+{
+    const UpdateFinder* const finder = d->finders.value( target );
+    return finder ? finder->updates() : QList<Update*>();
+}
+
+/*!
+   Returns the urls of the update sources whose Updates.xml could not be downloaded or
+   parsed during the last run.
+*/
+QList<QUrl> BatchUpdateFinder::failedUpdateSources() const
+{
+    return d->failedSources;
+}
+
+/*!
+   \internal
+
+   Implemented from \ref KDUpdater::Task::doRun().
+*/
+void BatchUpdateFinder::doRun()
+{
+    d->cancel = false;
+    d->clear();
+
+    // Step 1: Fetch the Updates.xml of every distinct update source once
+    reportProgress( 0, tr("Downloading Updates.xml from update sources") );
+    if( !d->downloadUpdateXMLFiles() )
+    {
+        d->clear();
+        return;
+    }
+
+    // Step 2: Parse them in parallel
+    reportProgress( 50, tr("Parsing Updates.xml files") );
+    const QHash<QUrl, UpdatesInfo> catalogs = d->parseUpdateXMLFiles();
+
+    // Step 3: Hand the parsed files to one finder per target
+    QList<UpdateFinder*> prepared;
+    for( QList< Target* >::const_iterator it = d->targets.begin(); it != d->targets.end(); ++it )
+    {
+        UpdateFinder* const finder = new UpdateFinder( *it );
+        finder->setUpdateType( d->updateType );
+        if( !d->platformIdentifier.isEmpty() )
+            finder->setPlatformIdentifier( d->platformIdentifier );
+        d->finders.insert( *it, finder );
+
+        if( prepareFinder( finder, catalogs ) )
+            prepared.append( finder );
+    }
+
+    // Step 4: Match the package updates of all targets in parallel. The chain of compat updates
+    // is planned by each finder itself.
+    reportProgress( 60, tr("Computing applicable updates") );
+    if( !( d->updateType & CompatUpdate ) )
+        QtConcurrent::blockingMap( prepared, matchPackageUpdates );
+
+    // Step 5: Create the update objects in this thread
+    int i = 0;
+    for( QList< UpdateFinder* >::const_iterator it = prepared.begin(); it != prepared.end(); ++it, ++i )
+    {
+        if( d->cancel )
+            return;
+
+        finishFinder( *it );
+        reportProgress( 60 + 40 * i / prepared.count(), tr("Computing applicable updates") );
+    }
+
+    reportDone();
+}
+
+/*!
+   \internal
+
+   Implemented from \ref KDUpdater::Task::doStop().
+*/
+bool BatchUpdateFinder::doStop()
+{
+    d->cancel = true;
+    return true;
+}
+
+/*!
+   \internal
+
+   Implemented from \ref KDUpdater::Task::doPause().
+*/
+bool BatchUpdateFinder::doPause()
+{
+    // Not a pausable task
+    return false;
+}
+
+/*!
+   \internal
+
+   Implemented from \ref KDUpdater::Task::doResume().
+*/
+bool BatchUpdateFinder::doResume()
+{
+    // Not a pausable task, hence it is not resumable as well
+    return false;
+}
+
+/*!
+   \internal
+
+   Hands the parsed \a catalogs to \a finder. Returns false if none of them is an update source
+   of the finder's target.
+*/
+bool BatchUpdateFinder::prepareFinder( UpdateFinder * finder, const QHash<QUrl, UpdatesInfo> & catalogs )
+{
+    return finder->d->prepareSharedRun( catalogs );
+}
+
+/*!
+   \internal
+
+   Creates the update objects of \a finder and finishes it.
+*/
+void BatchUpdateFinder::finishFinder( UpdateFinder * finder )
+{
+    finder->d->finishSharedRun();
+}
+
+/*!
+   \internal
+
+   Computes the package updates applicable to the target of \a finder. Called from worker threads.
+*/
+void BatchUpdateFinder::matchPackageUpdates( UpdateFinder * finder )
+{
+    finder->d->packageMatches = finder->d->matchPackageUpdates();
+}
+
+#include "moc_kdupdaterbatchupdatefinder.cpp"
@@ -0,0 +1,88 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#ifndef __KDTOOLS_KDUPDATERBATCHUPDATEFINDER_H__
+#define __KDTOOLS_KDUPDATERBATCHUPDATEFINDER_H__
+
+#include "kdupdater.h"
+#include "kdupdatertask.h"
+#include <pimpl_ptr.h>
+
+#include <QtCore/QList>
+#include <QtCore/QUrl>
+
+QT_BEGIN_NAMESPACE
+template< typename K, typename V >
+class QHash;
+QT_END_NAMESPACE
+
+namespace KDUpdater
+{
+    class Target;
+    class Update;
+    class UpdateFinder;
+    class UpdatesInfo;
+
+    class KDUPDATER_EXPORT BatchUpdateFinder : public Task
+    {
+        Q_OBJECT
+        Q_PROPERTY( UpdateTypes updateType READ updateType WRITE setUpdateType )
+        Q_PROPERTY( QString platformIdentifier READ platformIdentifier WRITE setPlatformIdentifier )
+
+    public:
+        explicit BatchUpdateFinder( QObject * parent=0 );
+        ~BatchUpdateFinder();
+
+        void addTarget( Target * target );
+        void removeTarget( Target * target );
+        QList<Target*> targets() const;
+
+        void setUpdateType( UpdateTypes type );
+        UpdateTypes updateType() const;
+
+        void setPlatformIdentifier( const QString & platformIdentifier );
+        QString platformIdentifier() const;
+
+        UpdateFinder * updateFinder( Target * target ) const;
+        QList<Update*> updates( Target * target ) const;
+
+        QList<QUrl> failedUpdateSources() const;
+
+    private:
+        void doRun();
+        bool doStop();
+        bool doPause();
+        bool doResume();
+
+        bool prepareFinder( UpdateFinder * finder, const QHash<QUrl, UpdatesInfo> & catalogs );
+        void finishFinder( UpdateFinder * finder );
+        static void matchPackageUpdates( UpdateFinder * finder );
+
+    private:
+        Q_PRIVATE_SLOT( d, void slotDownloadDone() )
+
+        class Private;
+        kdtools::pimpl_ptr< Private > d;
+    };
+}
+
+#endif
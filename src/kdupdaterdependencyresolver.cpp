@@ -0,0 +1,592 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#include "kdupdaterdependencyresolver.h"
+#include "kdupdaterpackagesinfo.h"
+#include "kdupdatertarget.h"
+#include "kdupdaterupdate.h"
+
+#include <QHash>
+#include <QVariant>
+#include <QVector>
+
+#include <algorithm>
+
+/*!
+   \ingroup kdupdater
+   \class KDUpdater::DependencyResolver kdupdaterdependencyresolver.h KDUpdaterDependencyResolver
+   \brief Computes the order in which a set of updates has to be installed
+
+   The resolver builds a dependency graph from the \c Dependencies of the candidate updates
+   passed via \ref setUpdates() and the packages already installed on the target (see
+   \ref KDUpdater::PackagesInfo). \ref resolve() checks that every dependency is satisfied
+   by either an installed package or another candidate update, detects version conflicts
+   and dependency cycles, and computes a topologically ordered installation plan.
+
+   A dependency is either a plain package name or a package name followed by a version
+   constraint, e.g. \c "Qt443" or \c "CorePlugin>=2.1". Supported operators are
+   \c =, \c ==, \c <, \c <=, \c > and \c >=.
+
+   The plan is available as a flat list via \ref orderedUpdates(), or grouped via
+   \ref batches(). Updates within one batch do not depend on each other and can be
+   installed concurrently; every batch only depends on the batches before it. The updates a
+   single update has to wait for are returned by \ref dependencies().
+   Compatibility updates always come first, each in a batch of its own, sorted by
+   compat level. They must form a chain without gaps, starting at the compat level
+   following the current compat level of the target.
+
+   \code
+   KDUpdater::DependencyResolver resolver( target );
+   resolver.setUpdates( updateFinder.updates() );
+   if( !resolver.resolve() )
+       qWarning() << resolver.errorString();
+   \endcode
+*/
+
+/*!
+   \enum KDUpdater::DependencyResolver::Error
+   Error codes reported by \ref resolve()
+*/
+
+/*!
+   \var KDUpdater::DependencyResolver::Error KDUpdater::DependencyResolver::NoError
+   The updates could be ordered.
+*/
+
+/*!
+   \var KDUpdater::DependencyResolver::Error KDUpdater::DependencyResolver::CyclicDependencyError
+   Two or more updates depend on each other.
+*/
+
+/*!
+   \var KDUpdater::DependencyResolver::Error KDUpdater::DependencyResolver::MissingDependencyError
+   An update depends on a package that is neither installed nor part of the updates.
+*/
+
+/*!
+   \var KDUpdater::DependencyResolver::Error KDUpdater::DependencyResolver::ConflictError
+   The same package is updated twice, or a version constraint cannot be satisfied.
+*/
+
+using namespace KDUpdater;
+
+namespace {
+
+    struct Requirement
+    {
+        QString name;
+        QString op;
+        QString version;
+    };
+
+    /*!
+     \internal
+     Splits \a spec of the form "Name", "Name>=1.0" into its parts.
+     */
+    Requirement parseRequirement( const QString& spec )
+    {
+        static const QString operatorChars = QLatin1String( "<>=" );
+
+        Requirement req;
+        int i = 0;
+        while( i < spec.length() && !operatorChars.contains( spec.at( i ) ) )
+            ++i;
+        req.name = spec.left( i ).trimmed();
+
+        const int opBegin = i;
+        while( i < spec.length() && operatorChars.contains( spec.at( i ) ) )
+            ++i;
+        req.op = spec.mid( opBegin, i - opBegin );
+        req.version = spec.mid( i ).trimmed();
+        return req;
+    }
+
+    bool satisfies( const QString& version, const Requirement& req )
+    {
+        if( req.op.isEmpty() || req.version.isEmpty() )
+            return true;
+
+        const int c = compareVersion( version, req.version );
+        if( req.op == QLatin1String( ">=" ) )
+            return c >= 0;
+        if( req.op == QLatin1String( "<=" ) )
+            return c <= 0;
+        if( req.op == QLatin1String( ">" ) )
+            return c > 0;
+        if( req.op == QLatin1String( "<" ) )
+            return c < 0;
+        return c == 0;
+    }
+
+    struct CompatLevelLessThan
+    {
+        bool operator()( const Update* lhs, const Update* rhs ) const
+        {
+            return lhs->compatLevel() < rhs->compatLevel();
+        }
+    };
+}
+
+class DependencyResolver::Private
+{
+public:
+    explicit Private( DependencyResolver* qq )
+        : q( qq ),
+          target( 0 ),
+          error( DependencyResolver::NoError )
+    {
+    }
+
+private:
+    DependencyResolver* const q;
+
+public:
+    Target* target;
+    QList<Update*> updates;
+    DependencyResolver::Error error;
+    QString errorString;
+    QList<Update*> ordered;
+    QList< QList<Update*> > batches;
+    QHash< Update*, QList<Update*> > dependencies;
+
+    bool setError( DependencyResolver::Error e, const QString& msg )
+    {
+        error = e;
+        errorString = msg;
+        ordered.clear();
+        batches.clear();
+        dependencies.clear();
+        return false;
+    }
+};
+
+/*!
+   Constructs a resolver for updates meant for \a target.
+*/
+DependencyResolver::DependencyResolver( Target* target )
+    : d( new Private( this ) )
+{
+    d->target = target;
+}
+
+/*!
+   Destructor
+*/
+DependencyResolver::~DependencyResolver()
+{
+}
+
+/*!
+   Returns the target whose installed packages are taken into account.
+*/
+Target* DependencyResolver::target() const
+{
+    return d->target;
+}
+
+/*!
+   Sets the candidate \a updates. Updates not meant for \ref target() are ignored.
+*/
+void DependencyResolver::setUpdates( const QList<Update*>& updates )
+{
+    d->updates = updates;
+    d->ordered.clear();
+    d->batches.clear();
+    d->dependencies.clear();
+}
+
+/*!
+   Returns the candidate updates set via \ref setUpdates().
+*/
+QList<Update*> DependencyResolver::updates() const
+{
+    return d->updates;
+}
+
+/*!
+   Returns the error of the last \ref resolve() call.
+*/
+DependencyResolver::Error DependencyResolver::error() const
+{
+    return d->error;
+}
+
+/*!
+   Returns a human-readable description of the last error.
+*/
+QString DependencyResolver::errorString() const
+{
+    return d->errorString;
+}
+
+/*!
+   Returns the updates in an order in which they can be installed one after another.
+   The list is empty unless \ref resolve() succeeded.
+*/
+QList<Update*> DependencyResolver::orderedUpdates() const
+{
+    return d->ordered;
+}
+
+/*!
+   Returns the installation plan grouped into batches of independent updates.
+   The list is empty unless \ref resolve() succeeded.
+*/
+QList< QList<Update*> > DependencyResolver::batches() const
+{
+    return d->batches;
+}
+
+/*!
+   Returns the updates that have to be installed before \a update, i.e. the updates of the
+   packages it depends on and the last compatibility update. Other updates may be installed
+   before, after or concurrently with \a update. The list is empty unless \ref resolve()
+   succeeded.
+*/
+QList<Update*> DependencyResolver::dependencies( Update* update ) const
+{
+    return d->dependencies.value( update );
+}
+
+/*!
+   Splits a comma separated list of \a dependencies, as used in Packages.xml, into
+   single dependency specifications.
+*/
+QStringList DependencyResolver::parseDependencies( const QString& dependencies )
+{
+    QStringList result;
+    const QStringList parts = dependencies.split( QLatin1Char( ',' ), QString::SkipEmptyParts );
+    for( QStringList::const_iterator it = parts.begin(); it != parts.end(); ++it )
+    {
+        const QString dep = it->trimmed();
+        if( !dep.isEmpty() )
+            result.append( dep );
+    }
+    return result;
+}
+
+/*!
+   Builds the dependency graph and computes the installation plan. Returns true on success.
+   On failure \ref error() and \ref errorString() describe the problem.
+*/
+bool DependencyResolver::resolve()
+{
+    d->error = NoError;
+    d->errorString.clear();
+    d->ordered.clear();
+    d->batches.clear();
+    d->dependencies.clear();
+
+    const PackagesInfo* const packages = d->target ? d->target->packagesInfo() : 0;
+
+    // Separate compat updates from package updates, detect duplicate package updates.
+    QList<Update*> compatUpdates;
+    QList<Update*> packageUpdates;
+    QHash<QString, Update*> updateByName;
+    for( QList<Update*>::const_iterator it = d->updates.begin(); it != d->updates.end(); ++it )
+    {
+        Update* const update = *it;
+        if( update->target() != d->target )
+            continue;
+
+        if( update->type() == CompatUpdate )
+        {
+            compatUpdates.append( update );
+            continue;
+        }
+
+        const QString name = update->packageName();
+        if( updateByName.contains( name ) )
+            return d->setError( ConflictError, tr( "Package %1 is updated twice (version %2 and %3)" )
+                                .arg( name, updateByName.value( name )->version(), update->version() ) );
+
+        updateByName.insert( name, update );
+        packageUpdates.append( update );
+    }
+
+    std::stable_sort( compatUpdates.begin(), compatUpdates.end(), CompatLevelLessThan() );
+
+    // Every compat update raises the compat level by one, so the chain must not have gaps.
+    int compatLevel = d->target ? d->target->compatLevel() : -1;
+    for( QList<Update*>::const_iterator it = compatUpdates.begin(); it != compatUpdates.end(); ++it )
+    {
+        const int level = (*it)->compatLevel();
+        if( compatLevel >= 0 && level <= compatLevel )
+            return d->setError( ConflictError, tr( "Compatibility level %1 update is not applicable at compatibility level %2" ).arg( level ).arg( compatLevel ) );
+        if( compatLevel >= 0 && level != compatLevel + 1 )
+            return d->setError( MissingDependencyError, tr( "Compatibility level %1 update is missing" ).arg( compatLevel + 1 ) );
+        compatLevel = level;
+    }
+
+    // The package versions after all updates have been installed
+    QHash<QString, QString> versions;
+    const QVector<PackageInfo> installed = packages ? packages->packageInfos() : QVector<PackageInfo>();
+    for( QVector<PackageInfo>::const_iterator it = installed.begin(); it != installed.end(); ++it )
+        versions.insert( it->name, it->version );
+    for( QList<Update*>::const_iterator it = packageUpdates.begin(); it != packageUpdates.end(); ++it )
+        versions.insert( (*it)->packageName(), (*it)->version() );
+
+    // Build the graph: an edge dep -> update means dep has to be installed before update.
+    QHash<Update*, QList<Update*> > dependents;
+    QHash<Update*, int> inDegree;
+    for( QList<Update*>::const_iterator it = packageUpdates.begin(); it != packageUpdates.end(); ++it )
+        inDegree.insert( *it, 0 );
+
+    for( QList<Update*>::const_iterator it = packageUpdates.begin(); it != packageUpdates.end(); ++it )
+    {
+        Update* const update = *it;
+        const QString name = update->packageName();
+        const QStringList deps = update->dependencies();
+        for( QStringList::const_iterator dit = deps.begin(); dit != deps.end(); ++dit )
+        {
+            const Requirement req = parseRequirement( *dit );
+            if( req.name.isEmpty() || req.name == name )
+                continue;
+
+            if( !versions.contains( req.name ) )
+                return d->setError( MissingDependencyError, tr( "Update %1 depends on %2, which is neither installed nor available" )
+                                    .arg( name, req.name ) );
+
+            if( !satisfies( versions.value( req.name ), req ) )
+                return d->setError( ConflictError, tr( "Update %1 requires %2, but version %3 would be installed" )
+                                    .arg( name, *dit, versions.value( req.name ) ) );
+
+            Update* const dependency = updateByName.value( req.name );
+            if( dependency != 0 )
+            {
+                dependents[ dependency ].append( update );
+                d->dependencies[ update ].append( dependency );
+                ++inDegree[ update ];
+            }
+        }
+    }
+
+    // Installed packages that are not updated must still be satisfied by the updated versions.
+    for( QVector<PackageInfo>::const_iterator it = installed.begin(); it != installed.end(); ++it )
+    {
+        if( updateByName.contains( it->name ) )
+            continue;
+
+        for( QStringList::const_iterator dit = it->dependencies.begin(); dit != it->dependencies.end(); ++dit )
+        {
+            const Requirement req = parseRequirement( *dit );
+            if( !updateByName.contains( req.name ) )
+                continue;
+            if( !satisfies( versions.value( req.name ), req ) )
+                return d->setError( ConflictError, tr( "Installed package %1 requires %2, which conflicts with the update to %3" )
+                                    .arg( it->name, *dit, versions.value( req.name ) ) );
+        }
+    }
+
+    // Kahn's algorithm, level by level. Each level forms one batch.
+    QList<Update*> ready;
+    for( QList<Update*>::const_iterator it = packageUpdates.begin(); it != packageUpdates.end(); ++it )
+        if( inDegree.value( *it ) == 0 )
+            ready.append( *it );
+
+    QList<Update*> orderedPackages;
+    QList< QList<Update*> > packageBatches;
+    while( !ready.isEmpty() )
+    {
+        const QList<Update*> batch = ready;
+        ready.clear();
+        for( QList<Update*>::const_iterator it = batch.begin(); it != batch.end(); ++it )
+        {
+            const QList<Update*> next = dependents.value( *it );
+            for( QList<Update*>::const_iterator nit = next.begin(); nit != next.end(); ++nit )
+                if( --inDegree[ *nit ] == 0 )
+                    ready.append( *nit );
+        }
+        packageBatches.append( batch );
+        orderedPackages += batch;
+    }
+
+    if( orderedPackages.count() != packageUpdates.count() )
+    {
+        QStringList cyclic;
+        for( QList<Update*>::const_iterator it = packageUpdates.begin(); it != packageUpdates.end(); ++it )
+            if( inDegree.value( *it ) > 0 )
+                cyclic.append( (*it)->packageName() );
+        return d->setError( CyclicDependencyError, tr( "Cyclic dependency between updates %1" )
+                            .arg( cyclic.join( QLatin1String( ", " ) ) ) );
+    }
+
+    // Each compatibility update depends on the one before, the package updates on the last one
+    for( QList<Update*>::const_iterator it = compatUpdates.begin(); it != compatUpdates.end(); ++it )
+    {
+        if( it != compatUpdates.begin() )
+            d->dependencies[ *it ].append( *( it - 1 ) );
+        d->batches.append( QList<Update*>() << *it );
+        d->ordered.append( *it );
+    }
+    if( !compatUpdates.isEmpty() )
+    {
+        for( QList<Update*>::const_iterator it = packageUpdates.begin(); it != packageUpdates.end(); ++it )
+            d->dependencies[ *it ].append( compatUpdates.last() );
+    }
+    d->batches += packageBatches;
+    d->ordered += orderedPackages;
+    return true;
+}
+
+#ifdef KDTOOLSCORE_UNITTESTS
+
+#include "kdupdaterupdatefinder.h"
+
+#include <KDUnitTest/Test>
+
+#include <QDir>
+#include <QFile>
+#include <QUrl>
+#include <QUuid>
+
+static bool writeTestFile( const QString& fileName, const QByteArray& contents )
+{
+    QFile file( fileName );
+    return file.open( QIODevice::WriteOnly ) && file.write( contents ) == contents.size();
+}
+
+/*!
+   \internal
+   Returns a package update of \a name to \a version depending on \a dependencies, in the
+   format of Updates.xml.
+ */
+static QByteArray packageUpdate( const char* name, const char* version, const char* dependencies = "" )
+{
+    return QByteArray( "<PackageUpdate><Name>" ) + name + "</Name><Version>" + version +
+           "</Version><ReleaseDate>2012-01-01</ReleaseDate><Dependencies>" + dependencies +
+           "</Dependencies><UpdateFile>" + name + ".kvz</UpdateFile></PackageUpdate>";
+}
+
+/*!
+   \internal
+   Publishes \a packageUpdates in the update source \a repository and resolves the updates
+   \a finder finds for its target with \a resolver.
+ */
+static bool resolveTestUpdates( UpdateFinder* finder, DependencyResolver* resolver, const QString& repository, const QByteArray& packageUpdates )
+{
+    writeTestFile( repository + QLatin1String( "/Updates.xml" ),
+                   "<Updates><TargetName>{AnyTarget}</TargetName><TargetVersion>1.0</TargetVersion>" + packageUpdates + "</Updates>" );
+    finder->run();
+    resolver->setUpdates( finder->updates() );
+    return resolver->resolve();
+}
+
+static QStringList packageNames( const QList<Update*>& updates )
+{
+    QStringList names;
+    for( QList<Update*>::const_iterator it = updates.begin(); it != updates.end(); ++it )
+        names.append( (*it)->packageName() );
+    return names;
+}
+
+static Update* findTestUpdate( const QList<Update*>& updates, const QString& name )
+{
+    for( QList<Update*>::const_iterator it = updates.begin(); it != updates.end(); ++it )
+    {
+        if( (*it)->packageName() == name )
+            return *it;
+    }
+    return 0;
+}
+
+KDAB_UNITTEST_SIMPLE( DependencyResolver, "kdupdater" ) {
+    const QDir dir( QDir::temp().filePath( QString::fromLatin1( "kdupdater-resolver-test%1" ).arg( QUuid::createUuid().toString() ) ) );
+    const QString repository = dir.filePath( QLatin1String( "repository" ) );
+    assertTrue( QDir().mkpath( repository ) );
+    assertTrue( writeTestFile( dir.filePath( QLatin1String( "Packages.xml" ) ),
+        "<Packages><TargetName>Test</TargetName><TargetVersion>1.0</TargetVersion>"
+        "<Package><Name>Core</Name><Version>1.0</Version><LastUpdateDate>2000-01-01</LastUpdateDate></Package>"
+        "<Package><Name>Gui</Name><Version>1.0</Version><Dependencies>Core</Dependencies><LastUpdateDate>2000-01-01</LastUpdateDate></Package>"
+        "<Package><Name>Plugin</Name><Version>1.0</Version><LastUpdateDate>2000-01-01</LastUpdateDate></Package>"
+        "<Package><Name>Tool</Name><Version>1.0</Version><LastUpdateDate>2000-01-01</LastUpdateDate></Package>"
+        "</Packages>" ) );
+    assertTrue( writeTestFile( dir.filePath( QLatin1String( "UpdateSources.xml" ) ),
+        "<UpdateSources><UpdateSource><Name>Test</Name><Url>" + QUrl::fromLocalFile( repository ).toEncoded() +
+        "</Url><Priority>1</Priority></UpdateSource></UpdateSources>" ) );
+
+    Target target;
+    target.setDirectory( dir.path() );
+
+    {
+        // dependencies first, independent updates in the same batch
+        UpdateFinder finder( &target );
+        DependencyResolver resolver( &target );
+        assertTrue( resolveTestUpdates( &finder, &resolver, repository,
+                                        packageUpdate( "Plugin", "2.0", "Gui>=2.0" ) + packageUpdate( "Gui", "2.0", "Core>=2.0" ) +
+                                        packageUpdate( "Core", "2.0" ) + packageUpdate( "Tool", "2.0" ) ) );
+        assertEqual( resolver.error(), DependencyResolver::NoError );
+
+        const QStringList ordered = packageNames( resolver.orderedUpdates() );
+        assertEqual( ordered.count(), 4 );
+        assertTrue( ordered.indexOf( QLatin1String( "Core" ) ) < ordered.indexOf( QLatin1String( "Gui" ) ) );
+        assertTrue( ordered.indexOf( QLatin1String( "Gui" ) ) < ordered.indexOf( QLatin1String( "Plugin" ) ) );
+
+        const QList< QList<Update*> > batches = resolver.batches();
+        assertEqual( batches.count(), 3 );
+        QStringList first = packageNames( batches.at( 0 ) );
+        first.sort();
+        assertEqual( first, QStringList() << QLatin1String( "Core" ) << QLatin1String( "Tool" ) );
+        assertEqual( packageNames( batches.at( 1 ) ), QStringList() << QLatin1String( "Gui" ) );
+        assertEqual( packageNames( batches.at( 2 ) ), QStringList() << QLatin1String( "Plugin" ) );
+
+        const QList<Update*> updates = resolver.orderedUpdates();
+        assertEqual( packageNames( resolver.dependencies( findTestUpdate( updates, QLatin1String( "Plugin" ) ) ) ), QStringList() << QLatin1String( "Gui" ) );
+        assertEqual( packageNames( resolver.dependencies( findTestUpdate( updates, QLatin1String( "Gui" ) ) ) ), QStringList() << QLatin1String( "Core" ) );
+        assertTrue( resolver.dependencies( findTestUpdate( updates, QLatin1String( "Tool" ) ) ).isEmpty() );
+    }
+    {
+        // Core and Gui updates depending on each other
+        UpdateFinder finder( &target );
+        DependencyResolver resolver( &target );
+        assertFalse( resolveTestUpdates( &finder, &resolver, repository,
+                                         packageUpdate( "Core", "2.0", "Gui" ) + packageUpdate( "Gui", "2.0", "Core" ) ) );
+        assertEqual( resolver.error(), DependencyResolver::CyclicDependencyError );
+        assertTrue( resolver.orderedUpdates().isEmpty() );
+    }
+    {
+        // a dependency neither installed nor updated
+        UpdateFinder finder( &target );
+        DependencyResolver resolver( &target );
+        assertFalse( resolveTestUpdates( &finder, &resolver, repository, packageUpdate( "Tool", "2.0", "Extra" ) ) );
+        assertEqual( resolver.error(), DependencyResolver::MissingDependencyError );
+    }
+    {
+        // the update of Core is not new enough for Plugin
+        UpdateFinder finder( &target );
+        DependencyResolver resolver( &target );
+        assertFalse( resolveTestUpdates( &finder, &resolver, repository,
+                                         packageUpdate( "Plugin", "2.0", "Core>=3.0" ) + packageUpdate( "Core", "2.0" ) ) );
+        assertEqual( resolver.error(), DependencyResolver::ConflictError );
+    }
+    {
+        // neither is the installed Gui, which is not updated
+        UpdateFinder finder( &target );
+        DependencyResolver resolver( &target );
+        assertFalse( resolveTestUpdates( &finder, &resolver, repository, packageUpdate( "Plugin", "2.0", "Gui>=2.0" ) ) );
+        assertEqual( resolver.error(), DependencyResolver::ConflictError );
+    }
+
+    assertTrue( QDir( dir.path() ).removeRecursively() );
+}
+
+#endif // KDTOOLSCORE_UNITTESTS
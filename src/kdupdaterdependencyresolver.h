@@ -0,0 +1,76 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#ifndef __KDTOOLS_KDUPDATERDEPENDENCYRESOLVER_H__
+#define __KDTOOLS_KDUPDATERDEPENDENCYRESOLVER_H__
+
+#include "kdupdater.h"
+#include <pimpl_ptr.h>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QList>
+#include <QtCore/QStringList>
+
+namespace KDUpdater
+{
+    class Target;
+    class Update;
+
+    class KDUPDATER_EXPORT DependencyResolver
+    {
+        Q_DECLARE_TR_FUNCTIONS(KDUpdater::DependencyResolver)
+
+    public:
+        enum Error
+        {
+            NoError=0,
+            CyclicDependencyError,
+            MissingDependencyError,
+            ConflictError
+        };
+
+        explicit DependencyResolver( Target * target );
+        ~DependencyResolver();
+
+        Target * target() const;
+
+        void setUpdates( const QList<Update*>& updates );
+        QList<Update*> updates() const;
+
+        bool resolve();
+
+        Error error() const;
+        QString errorString() const;
+
+        QList<Update*> orderedUpdates() const;
+        QList< QList<Update*> > batches() const;
+        QList<Update*> dependencies( Update* update ) const;
+
+        static QStringList parseDependencies( const QString& dependencies );
+
+    private:
+        class Private;
+        kdtools::pimpl_ptr< Private > d;
+    };
+}
+
+#endif
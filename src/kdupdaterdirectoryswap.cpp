@@ -0,0 +1,522 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#include "kdupdaterdirectoryswap_p.h"
+#include "kdupdaterfileutils_p.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include <QStringList>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace KDUpdater;
+
+/*!
+   \internal
+   \class KDUpdater::DirectorySwap kdupdaterdirectoryswap_p.h
+   \brief Replaces a directory tree by an updated copy in one atomic step
+
+   \ref KDUpdater::UpdateInstaller uses this to install updates in the
+   \ref KDUpdater::UpdateInstaller::SwapDirectory mode. \ref prepare() builds a copy of the
+   directory next to it, in which every file is a hard link to the file in the directory, or a
+   reflink clone or copy where the file system does not support hard links. The updates are
+   installed into that copy while the directory remains in use, and \ref commit() switches
+   to it:
+
+   \li If the directory is a symbolic link, the copy is renamed to a sibling named after the
+   link and the current time, and the link is atomically replaced by a link to it. The link
+   named like the directory with the suffix ".previous" points to the replaced tree.
+   \li Otherwise the two directories are exchanged atomically where the platform supports it
+   (renameat2() on Linux), or renamed one after the other. The replaced tree is kept in the
+   directory named like the directory with the suffix ".previous".
+
+   Until the next update, \ref rollback() switches back to the previous tree the same way.
+
+   As unchanged files are shared with the directory, files have to be detached before they are
+   modified in place, see \ref detach(): a detached file is replaced by a reflink clone or copy
+   of its own. Files replaced by renaming, as the built-in operations do, need not be detached,
+   but the files the operations touch are detached anyway, as long as they are known.
+
+   The hidden directory .kdupdater, which holds the state of the installer, is not copied. It
+   moves from the replaced tree to the new one on commit and back on rollback.
+*/
+
+static const char StateDirectory[] = ".kdupdater";
+
+static bool isInside( const QString& path, const QString& directory )
+{
+#ifdef Q_OS_WIN
+    const Qt::CaseSensitivity cs = Qt::CaseInsensitive;
+#else
+    const Qt::CaseSensitivity cs = Qt::CaseSensitive;
+#endif
+    return path.compare( directory, cs ) == 0 || path.startsWith( directory + QLatin1Char( '/' ), cs );
+}
+
+/*!
+ \internal
+ Returns the target of the symbolic link \a path as stored in the link, which unlike
+ QFileInfo::symLinkTarget() keeps relative targets relative.
+ */
+static QString readLink( const QString& path )
+{
+#ifdef Q_OS_UNIX
+    QByteArray buffer( 4096, '\0' );
+    const ssize_t length = ::readlink( QFile::encodeName( path ).constData(), buffer.data(), buffer.size() );
+    if( length < 0 || length >= buffer.size() )
+        return QString();
+    return QFile::decodeName( buffer.left( length ) );
+#else
+    return QFileInfo( path ).symLinkTarget();
+#endif
+}
+
+static bool createLink( const QString& target, const QString& link )
+{
+#ifdef Q_OS_UNIX
+    return ::symlink( QFile::encodeName( target ).constData(), QFile::encodeName( link ).constData() ) == 0;
+#else
+    return QFile::link( target, link );
+#endif
+}
+
+/*!
+ \internal
+ Atomically replaces the symbolic link \a link by one pointing to \a target, by renaming a new
+ link over it.
+ */
+static bool replaceLink( const QString& link, const QString& target, QString* errorString )
+{
+    const QString temporaryLink = link + QLatin1String( ".tmp" );
+    QFile::remove( temporaryLink );
+    if( !createLink( target, temporaryLink ) )
+    {
+        *errorString = QCoreApplication::translate( "KDUpdater::DirectorySwap", "Cannot create the symbolic link %1" ).arg( temporaryLink );
+        return false;
+    }
+    if( !moveFile( temporaryLink, link, errorString ) )
+    {
+        QFile::remove( temporaryLink );
+        return false;
+    }
+    return true;
+}
+
+/*!
+ \internal
+ Returns the absolute path the symbolic link \a link points to.
+ */
+static QString resolveLink( const QString& link )
+{
+    return QDir::cleanPath( QDir( QFileInfo( link ).absolutePath() ).absoluteFilePath( readLink( link ) ) );
+}
+
+/*!
+ \internal
+ Moves the state directory of the installer from the tree \a from to the tree \a to.
+ */
+static void moveStateDirectory( const QString& from, const QString& to )
+{
+    const QString source = QDir( from ).absoluteFilePath( QLatin1String( StateDirectory ) );
+    const QString target = QDir( to ).absoluteFilePath( QLatin1String( StateDirectory ) );
+    if( !QFileInfo( source ).isDir() )
+        return;
+
+    QDir( target ).removeRecursively();
+    if( !QDir().rename( source, target ) )
+        qDebug() << "Cannot move" << source << "to" << target;
+}
+
+class DirectorySwap::Private
+{
+public:
+    Private()
+        : symLinkMode( false )
+    {
+    }
+
+    QString directory;
+    QString newDirectory;
+    QString previousDirectory;
+    bool symLinkMode;
+    QSet<QString> detached;
+    QString errorString;
+
+    bool setError( const QString& msg )
+    {
+        errorString = msg;
+        return false;
+    }
+
+    bool copyTree( const QString& source, const QString& target );
+    bool detachFile( const QString& fileName );
+    bool commitSymLink();
+    bool commitDirectory();
+};
+
+/*!
+ \internal
+ Creates \a target as a copy of the directory \a source, sharing the files where possible.
+ The state directory of the installer is left out.
+ */
+bool DirectorySwap::Private::copyTree( const QString& source, const QString& target )
+{
+    if( !QDir().mkpath( target ) )
+        return setError( tr("Cannot create directory %1").arg( target ) );
+
+    const QDir sourceDir( source );
+    const QDir targetDir( target );
+    const QString stateDirectory = QLatin1String( StateDirectory );
+
+    // directory permissions are applied last, as read-only directories could not be filled
+    QStringList directories;
+    QDirIterator it( source, QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot, QDirIterator::Subdirectories );
+    while( it.hasNext() )
+    {
+        const QString sourcePath = it.next();
+        const QString relativePath = sourceDir.relativeFilePath( sourcePath );
+        if( relativePath == stateDirectory || relativePath.startsWith( stateDirectory + QLatin1Char( '/' ) ) )
+            continue;
+
+        const QString targetPath = targetDir.absoluteFilePath( relativePath );
+        const QFileInfo fi = it.fileInfo();
+        if( fi.isSymLink() )
+        {
+            if( !createLink( readLink( sourcePath ), targetPath ) )
+                return setError( tr("Cannot create the symbolic link %1").arg( targetPath ) );
+        }
+        else if( fi.isDir() )
+        {
+            if( !QDir().mkpath( targetPath ) )
+                return setError( tr("Cannot create directory %1").arg( targetPath ) );
+            directories.append( relativePath );
+        }
+        else
+        {
+            QString error;
+            if( !linkOrCloneFile( sourcePath, targetPath, &error ) )
+                return setError( tr("Cannot copy %1 to %2: %3").arg( sourcePath, targetPath, error ) );
+        }
+    }
+
+    for( QStringList::const_iterator dit = directories.constEnd(); dit != directories.constBegin(); )
+    {
+        --dit;
+        QFile::setPermissions( targetDir.absoluteFilePath( *dit ), QFileInfo( sourceDir.absoluteFilePath( *dit ) ).permissions() );
+    }
+    QFile::setPermissions( target, QFileInfo( source ).permissions() );
+    return true;
+}
+
+/*!
+ \internal
+ Replaces \a fileName, which may share its contents with the current tree, by a file of its own.
+ */
+bool DirectorySwap::Private::detachFile( const QString& fileName )
+{
+    if( detached.contains( fileName ) )
+        return true;
+
+    const QString temporaryName = fileName + QLatin1String( ".detached" );
+    QFile::remove( temporaryName );
+
+    QString error;
+    if( !cloneFile( fileName, temporaryName, &error ) || !moveFile( temporaryName, fileName, &error ) )
+    {
+        QFile::remove( temporaryName );
+        return setError( tr("Cannot detach %1: %2").arg( fileName, error ) );
+    }
+
+    detached.insert( fileName );
+    return true;
+}
+
+/*!
+   Creates a swap of \a directory. If \a directory is a symbolic link, the link is switched
+   to the new tree on commit, otherwise the directories are renamed.
+*/
+DirectorySwap::DirectorySwap( const QString& directory )
+    : d( new Private )
+{
+    d->directory = QDir::cleanPath( QFileInfo( directory ).absoluteFilePath() );
+    d->newDirectory = d->directory + QLatin1String( ".new" );
+    d->previousDirectory = d->directory + QLatin1String( ".previous" );
+#ifdef Q_OS_UNIX
+    d->symLinkMode = QFileInfo( d->directory ).isSymLink();
+#endif
+}
+
+/*!
+   Destructor. The new tree is kept, call \ref discard() to remove it.
+*/
+DirectorySwap::~DirectorySwap()
+{
+}
+
+/*!
+   Returns the directory that is replaced.
+*/
+QString DirectorySwap::directory() const
+{
+    return d->directory;
+}
+
+/*!
+   Returns the directory the new tree is built in before \ref commit().
+*/
+QString DirectorySwap::newDirectory() const
+{
+    return d->newDirectory;
+}
+
+/*!
+   Returns the path of the previous tree, kept for \ref rollback(). If the directory is a
+   symbolic link, this is a symbolic link to the previous tree.
+*/
+QString DirectorySwap::previousDirectory() const
+{
+    return d->previousDirectory;
+}
+
+/*!
+   Returns a human-readable description of the last error.
+*/
+QString DirectorySwap::errorString() const
+{
+    return d->errorString;
+}
+
+/*!
+   Builds the new tree as a copy of the directory, replacing a new tree left behind by an
+   earlier installation that did not complete. Returns false and sets \ref errorString() if
+   this fails.
+*/
+bool DirectorySwap::prepare()
+{
+    if( !QFileInfo( d->directory ).isDir() )
+        return d->setError( tr("%1 is not a directory").arg( d->directory ) );
+
+    discard();
+    if( QFileInfo( d->newDirectory ).exists() )
+        return d->setError( tr("Cannot remove %1").arg( d->newDirectory ) );
+
+    if( !d->copyTree( d->directory, d->newDirectory ) )
+    {
+        QDir( d->newDirectory ).removeRecursively();
+        return false;
+    }
+    return true;
+}
+
+/*!
+   Detaches the files \a paths of the new tree, and all files inside directories among them,
+   from the current tree, such that modifying them in place does not change the current tree.
+   Paths outside of the new tree and paths which do not exist are ignored.
+*/
+bool DirectorySwap::detach( const QStringList& paths )
+{
+    for( QStringList::const_iterator it = paths.begin(); it != paths.end(); ++it )
+    {
+        const QString path = QDir::cleanPath( QFileInfo( *it ).absoluteFilePath() );
+        if( !isInside( path, d->newDirectory ) )
+            continue;
+
+        const QFileInfo fi( path );
+        if( fi.isSymLink() )
+            continue;
+
+        if( fi.isFile() )
+        {
+            if( !d->detachFile( path ) )
+                return false;
+            continue;
+        }
+
+        if( !fi.isDir() )
+            continue;
+
+        QDirIterator dit( path, QDir::Files | QDir::Hidden | QDir::System, QDirIterator::Subdirectories );
+        while( dit.hasNext() )
+        {
+            const QString fileName = dit.next();
+            if( !dit.fileInfo().isSymLink() && !d->detachFile( fileName ) )
+                return false;
+        }
+    }
+    return true;
+}
+
+/*!
+   Detaches all files of the new tree from the current tree, see \ref detach(). This is needed
+   before running operations whose effects are unknown, like Execute.
+*/
+bool DirectorySwap::detachAll()
+{
+    return detach( QStringList( d->newDirectory ) );
+}
+
+/*!
+   Removes the new tree.
+*/
+void DirectorySwap::discard()
+{
+    QDir( d->newDirectory ).removeRecursively();
+    d->detached.clear();
+}
+
+/*!
+ \internal
+ */
+bool DirectorySwap::Private::commitSymLink()
+{
+    const QString current = readLink( directory );
+    const QString currentTree = resolveLink( directory );
+    const QString previousTree = QFileInfo( previousDirectory ).isSymLink() ? resolveLink( previousDirectory ) : QString();
+
+    // give the new tree a name of its own, the link refers to it by that name
+    const QString treeName = QString::fromLatin1( "%1.%2" ).arg( QFileInfo( directory ).fileName(),
+                                                                 QDateTime::currentDateTime().toString( QLatin1String( "yyyyMMddhhmmsszzz" ) ) );
+    const QString tree = QDir( QFileInfo( directory ).absolutePath() ).absoluteFilePath( treeName );
+    if( !QDir().rename( newDirectory, tree ) )
+        return setError( tr("Cannot rename %1 to %2").arg( newDirectory, tree ) );
+
+    QString error;
+    if( !replaceLink( directory, treeName, &error ) )
+    {
+        QDir().rename( tree, newDirectory );
+        return setError( tr("Cannot switch %1 to the new version: %2").arg( directory, error ) );
+    }
+
+    if( !replaceLink( previousDirectory, current, &error ) )
+        qDebug() << "Cannot keep the previous version:" << error;
+    else if( !previousTree.isEmpty() && previousTree != currentTree && previousTree != tree )
+        QDir( previousTree ).removeRecursively();
+
+    moveStateDirectory( currentTree, tree );
+    return true;
+}
+
+/*!
+ \internal
+ */
+bool DirectorySwap::Private::commitDirectory()
+{
+    if( QFileInfo( previousDirectory ).exists() )
+    {
+        QDir( previousDirectory ).removeRecursively();
+        if( QFileInfo( previousDirectory ).exists() )
+            return setError( tr("Cannot remove the previous version %1").arg( previousDirectory ) );
+    }
+
+    QString error;
+    if( exchangePaths( directory, newDirectory, &error ) )
+    {
+        if( !QDir().rename( newDirectory, previousDirectory ) )
+            qDebug() << "Cannot keep the previous version in" << previousDirectory;
+        else
+            moveStateDirectory( previousDirectory, directory );
+        return true;
+    }
+
+    // Not atomic: the directory is missing for a moment
+    if( !QDir().rename( directory, previousDirectory ) )
+        return setError( tr("Cannot rename %1 to %2").arg( directory, previousDirectory ) );
+    if( !QDir().rename( newDirectory, directory ) )
+    {
+        QDir().rename( previousDirectory, directory );
+        return setError( tr("Cannot rename %1 to %2").arg( newDirectory, directory ) );
+    }
+    moveStateDirectory( previousDirectory, directory );
+    return true;
+}
+
+/*!
+   Switches the directory to the new tree and keeps the current tree as the previous one,
+   replacing an older previous tree. Returns false and sets \ref errorString() if this fails,
+   in which case the directory is unchanged.
+*/
+bool DirectorySwap::commit()
+{
+    if( !QFileInfo( d->newDirectory ).isDir() )
+        return d->setError( tr("%1 is not a directory").arg( d->newDirectory ) );
+
+    const bool success = d->symLinkMode ? d->commitSymLink() : d->commitDirectory();
+    if( success )
+        d->detached.clear();
+    return success;
+}
+
+/*!
+   Switches the directory back to the previous tree, keeping the current tree as the previous
+   one, so that rolling back again restores it. Returns false and sets \ref errorString() if
+   there is no previous tree or switching fails.
+*/
+bool DirectorySwap::rollback()
+{
+    QString error;
+    if( d->symLinkMode )
+    {
+        if( !QFileInfo( d->previousDirectory ).isSymLink() )
+            return d->setError( tr("There is no previous version of %1").arg( d->directory ) );
+
+        const QString current = readLink( d->directory );
+        const QString currentTree = resolveLink( d->directory );
+        const QString previous = readLink( d->previousDirectory );
+        const QString previousTree = resolveLink( d->previousDirectory );
+        if( !replaceLink( d->directory, previous, &error ) )
+            return d->setError( tr("Cannot switch %1 to the previous version: %2").arg( d->directory, error ) );
+        if( !replaceLink( d->previousDirectory, current, &error ) )
+            qDebug() << "Cannot keep the replaced version:" << error;
+
+        moveStateDirectory( currentTree, previousTree );
+        return true;
+    }
+
+    if( !QFileInfo( d->previousDirectory ).isDir() )
+        return d->setError( tr("There is no previous version of %1").arg( d->directory ) );
+
+    if( !exchangePaths( d->directory, d->previousDirectory, &error ) )
+    {
+        // Not atomic: the directory is missing for a moment
+        QDir( d->newDirectory ).removeRecursively();
+        if( !QDir().rename( d->directory, d->newDirectory ) )
+            return d->setError( tr("Cannot rename %1 to %2").arg( d->directory, d->newDirectory ) );
+        if( !QDir().rename( d->previousDirectory, d->directory ) )
+        {
+            QDir().rename( d->newDirectory, d->directory );
+            return d->setError( tr("Cannot rename %1 to %2").arg( d->previousDirectory, d->directory ) );
+        }
+        QDir().rename( d->newDirectory, d->previousDirectory );
+    }
+
+    moveStateDirectory( d->previousDirectory, d->directory );
+    return true;
+}
@@ -35,6 +35,7 @@
 #include <QPointer>
 #include <QUrl>
 #include <QTemporaryFile>
+#include <QDir>
 #include <QFileInfo>
 #include <QCryptographicHash>
 #include <QThreadPool>
@@ -191,6 +192,7 @@ struct KDUpdater::FileDownloader::FileDownloaderData
     QString errorString;
     bool autoRemove;
     bool followRedirect;
+    QString downloadDirectory;
 };
 
 
@@ -299,6 +301,33 @@ bool KDUpdater::FileDownloader::isAutoRemoveDownloadedFile() const
     return d->autoRemove;
 }
 
+/*!
+   Sets the directory files are downloaded into to \a directory. By default, and if
+   \a directory is empty, files are downloaded into QDir::tempPath().
+*/
+void KDUpdater::FileDownloader::setDownloadDirectory( const QString& directory )
+{
+    d->downloadDirectory = directory;
+}
+
+QString KDUpdater::FileDownloader::downloadDirectory() const
+{
+    return d->downloadDirectory;
+}
+
+/*!
+   Returns a new, not yet opened temporary file in the \ref downloadDirectory(), owned by this
+   downloader. Subclasses download into such a file.
+*/
+QTemporaryFile* KDUpdater::FileDownloader::createDownloadFile()
+{
+    if( d->downloadDirectory.isEmpty() )
+        return new QTemporaryFile( this );
+
+    QDir().mkpath( d->downloadDirectory );
+    return new QTemporaryFile( QDir( d->downloadDirectory ).absoluteFilePath( QLatin1String( "download.XXXXXX" ) ), this );
+}
+
 void KDUpdater::FileDownloader::download() {
     QMetaObject::invokeMethod( this, "doDownload", Qt::QueuedConnection );
 }
@@ -379,7 +408,7 @@ void KDUpdater::LocalFileDownloader::doDownload()
     // Open source and destination files
     QString localFile = this->url().toLocalFile();
     d->source = new QFile(localFile, this);
-    d->destination = new QTemporaryFile(this);
+    d->destination = createDownloadFile();
 
     if( !d->source->open(QFile::ReadOnly) )
     {
@@ -408,7 +437,9 @@ QString KDUpdater::LocalFileDownloader::downloadedFileName() const
 
 KDUpdater::LocalFileDownloader* KDUpdater::LocalFileDownloader::clone( QObject* parent ) const
 {
-    return new LocalFileDownloader( parent );
+    LocalFileDownloader* const downloader = new LocalFileDownloader( parent );
+    downloader->setDownloadDirectory( downloadDirectory() );
+    return downloader;
 }
 
 void KDUpdater::LocalFileDownloader::cancelDownload()
@@ -545,7 +576,9 @@ QString KDUpdater::ResourceFileDownloader::downloadedFileName() const
 
 KDUpdater::ResourceFileDownloader* KDUpdater::ResourceFileDownloader::clone( QObject* parent ) const
 {
-    return new ResourceFileDownloader( parent );
+    ResourceFileDownloader* const downloader = new ResourceFileDownloader( parent );
+    downloader->setDownloadDirectory( downloadDirectory() );
+    return downloader;
 }
 
 void KDUpdater::ResourceFileDownloader::cancelDownload()
@@ -645,7 +678,9 @@ QString KDUpdater::FtpDownloader::downloadedFileName() const
 
 KDUpdater::FtpDownloader* KDUpdater::FtpDownloader::clone( QObject* parent ) const
 {
-    return new FtpDownloader( parent );
+    FtpDownloader* const downloader = new FtpDownloader( parent );
+    downloader->setDownloadDirectory( downloadDirectory() );
+    return downloader;
 }
 
 
@@ -729,7 +764,7 @@ void KDUpdater::FtpDownloader::ftpStateChanged(int state)
     {
     case QFtp::Connected:
         // begin the download
-        d->destination = new QTemporaryFile(this);
+        d->destination = createDownloadFile();
         d->destination->open(); //PENDING handle error
         d->ftpCmdId = d->ftp->get( url().path(), d->destination );
         break;
@@ -832,7 +867,7 @@ void KDUpdater::HttpDownloader::doDownload()
 
     // Begin the download
     d->redirectList.push_back( url().toString() );
-    d->destination = new QTemporaryFile(this);
+    d->destination = createDownloadFile();
     if ( !d->destination->open() ) {
         const QString err = d->destination->errorString();
         d->shutDown();
@@ -848,7 +883,9 @@ QString KDUpdater::HttpDownloader::downloadedFileName() const
 
 KDUpdater::HttpDownloader* KDUpdater::HttpDownloader::clone( QObject* parent ) const
 {
-    return new HttpDownloader( parent );
+    HttpDownloader* const downloader = new HttpDownloader( parent );
+    downloader->setDownloadDirectory( downloadDirectory() );
+    return downloader;
 }
 
 void KDUpdater::HttpDownloader::httpReadyRead()
@@ -973,7 +1010,7 @@ void KDUpdater::HttpDownloader::httpReqFinished()
             connect( d->http, SIGNAL(error(QNetworkReply::NetworkError)), this, SLOT(httpError(QNetworkReply::NetworkError)) );
 
             // Begin the download
-            d->destination = new QTemporaryFile(this);
+            d->destination = createDownloadFile();
             d->destination->open(); //PENDING handle error
         }
     }
@@ -30,6 +30,10 @@
 #include <QtCore/QUrl>
 #include <QtCore/QCryptographicHash>
 
+QT_BEGIN_NAMESPACE
+class QTemporaryFile;
+QT_END_NAMESPACE
+
 namespace KDUpdater
 {
     KDUPDATER_EXPORT QByteArray calculateHash( QIODevice* device, QCryptographicHash::Algorithm algo );
@@ -70,6 +74,9 @@ namespace KDUpdater
         void setFollowRedirects( bool val );
         bool followRedirects() const;
 
+        void setDownloadDirectory( const QString& directory );
+        QString downloadDirectory() const;
+
     public Q_SLOTS:
         virtual void cancelDownload();
         void sha1SumVerified( KDUpdater::HashVerificationJob* job );
@@ -92,6 +99,7 @@ namespace KDUpdater
     protected:
         void setDownloadCompleted( const QString& filepath );
         void setDownloadAborted( const QString& error );
+        QTemporaryFile* createDownloadFile();
 
     private Q_SLOTS:
         virtual void doDownload() = 0;
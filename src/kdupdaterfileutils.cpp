@@ -0,0 +1,927 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#include "kdupdaterfileutils_p.h"
+#include "kdsavefile.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QStorageInfo>
+#include <QTemporaryFile>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE ( 1 << 1 )
+#endif
+#if defined( __GLIBC__ ) && ( __GLIBC__ > 2 || ( __GLIBC__ == 2 && __GLIBC_MINOR__ >= 27 ) )
+#define KDUPDATER_HAVE_COPY_FILE_RANGE
+#endif
+#endif
+
+#include <cerrno>
+
+/*!
+   \internal
+   \file kdupdaterfileutils_p.h
+   Helpers creating and restoring backups of files with as little copying as possible.
+
+   Update operations back up a file before they replace or delete it, and restore the backup
+   when they are undone. The backups are created next to the files, so on the same file system:
+
+   \li A file that is about to be replaced or deleted, as by the Copy, Move, Delete and
+   PrependFile operations, is backed up by a hard link to it. Replacing the file unlinks it,
+   the backup keeps its contents.
+   \li A file that is about to be modified in place is backed up by a reflink clone (FICLONE on
+   Linux), which shares the data blocks with the original until either is written.
+   \li If the file system supports neither, the file is copied.
+
+   A backup is restored by renaming it over the file. AppendFile needs no backup, it records
+   the original size of the file and truncates it on undo.
+
+   Files are copied by cloning them where the file system supports it, as the staging directory
+   the update files are copied from is on the file system of the target by default.
+
+   Files are moved by renaming them. Only if source and destination are on different file
+   systems, the file is copied to a temporary file next to the destination, in kernel space
+   where possible, which is then renamed to the destination.
+
+   Operations on many files use \ref KDUpdater::DirectoryHandles and the functions taking
+   it, which work relative to open handles of the directories of the files.
+*/
+
+/*!
+   \internal
+   Creates \a target as a copy-on-write clone of \a source. Returns false if the platform or
+   the file system does not support this.
+ */
+static bool reflinkFile( const QString& source, const QString& target )
+{
+#if defined( Q_OS_LINUX ) && defined( FICLONE )
+    QFile sourceFile( source );
+    if( !sourceFile.open( QIODevice::ReadOnly ) )
+        return false;
+
+    QFile targetFile( target );
+    if( targetFile.exists() || !targetFile.open( QIODevice::WriteOnly ) )
+        return false;
+
+    if( ::ioctl( targetFile.handle(), FICLONE, sourceFile.handle() ) == 0 )
+    {
+        targetFile.setPermissions( sourceFile.permissions() );
+        return true;
+    }
+
+    targetFile.close();
+    targetFile.remove();
+    return false;
+#else
+    Q_UNUSED( source )
+    Q_UNUSED( target )
+    return false;
+#endif
+}
+
+/*!
+   \internal
+   Creates \a target as a hard link to \a source. Returns false if the file system does not
+   support this.
+ */
+static bool hardlinkFile( const QString& source, const QString& target )
+{
+#ifdef Q_OS_WIN
+    const QString nativeSource = QDir::toNativeSeparators( source );
+    const QString nativeTarget = QDir::toNativeSeparators( target );
+    return CreateHardLinkW( reinterpret_cast< LPCWSTR >( nativeTarget.utf16() ),
+                            reinterpret_cast< LPCWSTR >( nativeSource.utf16() ), 0 ) != 0;
+#else
+    return ::link( QFile::encodeName( source ).constData(), QFile::encodeName( target ).constData() ) == 0;
+#endif
+}
+
+/*!
+   \internal
+   Creates \a target with the contents of \a source, as a reflink clone if possible and a copy
+   otherwise. Use this for backups of files that are about to be modified in place.
+ */
+bool KDUpdater::cloneFile( const QString& source, const QString& target, QString* errorString )
+{
+    if( reflinkFile( source, target ) )
+        return true;
+
+    QFile sourceFile( source );
+    if( sourceFile.copy( target ) )
+        return true;
+
+    if( errorString )
+        *errorString = sourceFile.errorString();
+    return false;
+}
+
+/*!
+   \internal
+   Creates \a target with the contents of \a source, as a hard link if possible. Use this for
+   backups of files that are about to be replaced or deleted, but not modified in place, as the
+   hard link shares the modifications.
+ */
+bool KDUpdater::linkOrCloneFile( const QString& source, const QString& target, QString* errorString )
+{
+    if( hardlinkFile( source, target ) )
+        return true;
+
+    return cloneFile( source, target, errorString );
+}
+
+/*!
+   \internal
+   Renames \a source to \a target, replacing \a target if it exists. Sets \a crossDevice if
+   this failed because the two are on different file systems.
+ */
+static bool renameReplacing( const QString& source, const QString& target, bool* crossDevice, QString* errorString )
+{
+#ifdef Q_OS_WIN
+    const QString nativeSource = QDir::toNativeSeparators( source );
+    const QString nativeTarget = QDir::toNativeSeparators( target );
+    if( MoveFileExW( reinterpret_cast< LPCWSTR >( nativeSource.utf16() ),
+                     reinterpret_cast< LPCWSTR >( nativeTarget.utf16() ), MOVEFILE_REPLACE_EXISTING ) )
+        return true;
+    const int error = GetLastError();
+    *crossDevice = error == ERROR_NOT_SAME_DEVICE;
+#else
+    if( ::rename( QFile::encodeName( source ).constData(), QFile::encodeName( target ).constData() ) == 0 )
+        return true;
+    const int error = errno;
+    *crossDevice = error == EXDEV;
+#endif
+    if( errorString )
+        *errorString = qt_error_string( error );
+    return false;
+}
+
+/*!
+   \internal
+   Copies the contents of \a source from its current position to the end of \a target in the
+   kernel, without passing them through user space. Returns false and sets \a unsupported if
+   nothing was copied because the kernel or the file systems do not support this.
+ */
+template< typename File >
+static bool copyFileRange( QFile& source, File& target, bool* unsupported, QString* errorString )
+{
+    *unsupported = true;
+#ifdef KDUPDATER_HAVE_COPY_FILE_RANGE
+    loff_t sourceOffset = source.pos();
+    qint64 remaining = source.size() - sourceOffset;
+    while( remaining > 0 )
+    {
+        const ssize_t copied = ::copy_file_range( source.handle(), &sourceOffset, target.handle(), 0, static_cast< size_t >( remaining ), 0 );
+        if( copied == 0 )
+            break; // the source was truncated meanwhile
+        if( copied < 0 && errno == EINTR )
+            continue;
+        if( copied < 0 )
+        {
+            // kernels before 5.3 refuse to copy between file systems
+            const int error = errno;
+            *unsupported = *unsupported && ( error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP );
+            if( !*unsupported && errorString )
+                *errorString = qt_error_string( error );
+            return false;
+        }
+
+        *unsupported = false;
+        remaining -= copied;
+    }
+    *unsupported = false;
+    return true;
+#else
+    Q_UNUSED( source )
+    Q_UNUSED( target )
+    Q_UNUSED( errorString )
+    return false;
+#endif
+}
+
+/*!
+   \internal
+   Implements \ref appendFileContents() for both kinds of \a target.
+ */
+template< typename File >
+static bool appendContents( QFile& source, File& target, QString* errorString )
+{
+    // the kernel appends at the position of the file descriptor
+    if( !target.flush() )
+    {
+        if( errorString )
+            *errorString = target.errorString();
+        return false;
+    }
+
+    bool unsupported = false;
+    if( copyFileRange( source, target, &unsupported, errorString ) )
+        return true;
+    if( !unsupported )
+        return false;
+
+    QByteArray buffer( 1024 * 1024, Qt::Uninitialized );
+    while( !source.atEnd() )
+    {
+        const qint64 read = source.read( buffer.data(), buffer.size() );
+        if( read < 0 || target.write( buffer.constData(), read ) != read )
+        {
+            if( errorString )
+                *errorString = read < 0 ? source.errorString() : target.errorString();
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+   \internal
+   Appends the contents of \a source from its current position to \a target, in the kernel
+   where possible and block-wise through a buffer otherwise, so the memory used does not
+   depend on the size of \a source.
+ */
+bool KDUpdater::appendFileContents( QFile& source, KDSaveFile& target, QString* errorString )
+{
+    return appendContents( source, target, errorString );
+}
+
+/*!
+   \internal
+   \overload
+ */
+bool KDUpdater::appendFileContents( QFile& source, QFile& target, QString* errorString )
+{
+    return appendContents( source, target, errorString );
+}
+
+/*!
+   \internal
+   Makes the empty file \a target a copy-on-write clone of \a source. Returns false if the
+   platform or the file systems do not support this.
+ */
+static bool cloneFileContents( QFile& source, QFile& target )
+{
+#if defined( Q_OS_LINUX ) && defined( FICLONE )
+    return target.flush() && ::ioctl( target.handle(), FICLONE, source.handle() ) == 0;
+#else
+    Q_UNUSED( source )
+    Q_UNUSED( target )
+    return false;
+#endif
+}
+
+/*!
+   \internal
+   Replaces \a target by the complete temporary file \a temporary in one rename, so \a target
+   always exists with either its old or its new contents. \a temporary has to be in the
+   directory of \a target and is removed if this fails.
+ */
+bool KDUpdater::replaceFile( QTemporaryFile& temporary, const QString& target, QString* errorString )
+{
+    if( !temporary.flush() )
+    {
+        if( errorString )
+            *errorString = temporary.errorString();
+        return false;
+    }
+
+    // Windows cannot rename open files
+    temporary.close();
+    bool crossDevice = false;
+    if( !renameReplacing( temporary.fileName(), target, &crossDevice, errorString ) )
+        return false;
+    temporary.setAutoRemove( false );
+    return true;
+}
+
+/*!
+   \internal
+   Returns the QTemporaryFile template for a hidden file next to \a fileName, as needed by
+   \ref replaceFile().
+ */
+QString KDUpdater::temporaryFileTemplate( const QString& fileName )
+{
+    const QFileInfo fi( fileName );
+    return fi.absoluteDir().absoluteFilePath( QLatin1Char( '.' ) + fi.fileName() + QLatin1String( ".XXXXXX" ) );
+}
+
+/*!
+   \internal
+   Copies \a source to \a target, replacing \a target if it exists. The copy is written to a
+   temporary file in the directory of \a target first, which replaces \a target by a single
+   rename when complete, so \a target never has partial contents and never is missing. The
+   permissions are copied too. Where the file system supports it, the copy is a reflink clone
+   sharing the data blocks with \a source, as for files copied out of the staging directory on
+   the file system of the target.
+ */
+bool KDUpdater::copyFile( const QString& source, const QString& target, QString* errorString )
+{
+    QFile sourceFile( source );
+    if( !sourceFile.open( QIODevice::ReadOnly ) )
+    {
+        if( errorString )
+            *errorString = sourceFile.errorString();
+        return false;
+    }
+
+    QTemporaryFile targetFile( temporaryFileTemplate( target ) );
+    if( !targetFile.open() )
+    {
+        if( errorString )
+            *errorString = targetFile.errorString();
+        return false;
+    }
+
+    if( !cloneFileContents( sourceFile, targetFile ) && !KDUpdater::appendFileContents( sourceFile, targetFile, errorString ) )
+        return false;
+
+    targetFile.setPermissions( sourceFile.permissions() );
+    return replaceFile( targetFile, target, errorString );
+}
+
+/*!
+   \internal
+   Returns the permissions a new file gets when created with QFile, read and write access for
+   everyone minus the umask of the process. Files written to a temporary file first need them,
+   as temporary files are only accessible by the owner.
+ */
+QFile::Permissions KDUpdater::newFilePermissions()
+{
+    QFile::Permissions permissions = QFile::ReadOwner | QFile::WriteOwner | QFile::ReadUser | QFile::WriteUser;
+#ifdef Q_OS_WIN
+    permissions |= QFile::ReadGroup | QFile::WriteGroup | QFile::ReadOther | QFile::WriteOther;
+#else
+    // the umask can only be read by setting it
+    const mode_t mask = ::umask( 0 );
+    ::umask( mask );
+    if( ( mask & S_IRUSR ) != 0 )
+        permissions &= ~( QFile::ReadOwner | QFile::ReadUser );
+    if( ( mask & S_IWUSR ) != 0 )
+        permissions &= ~( QFile::WriteOwner | QFile::WriteUser );
+    if( ( mask & S_IRGRP ) == 0 )
+        permissions |= QFile::ReadGroup;
+    if( ( mask & S_IWGRP ) == 0 )
+        permissions |= QFile::WriteGroup;
+    if( ( mask & S_IROTH ) == 0 )
+        permissions |= QFile::ReadOther;
+    if( ( mask & S_IWOTH ) == 0 )
+        permissions |= QFile::WriteOther;
+#endif
+    return permissions;
+}
+
+/*!
+   \internal
+   Moves \a backup to \a target, replacing \a target if it exists. As the backup is on the same
+   file system, this is a single rename, so \a target always exists with either its current
+   contents or those of the backup.
+ */
+bool KDUpdater::restoreFile( const QString& backup, const QString& target, QString* errorString )
+{
+    return moveFile( backup, target, errorString );
+}
+
+/*!
+   \internal
+   Moves \a source to \a target, replacing \a target if it exists. Within one file system this
+   is an atomic rename. Across file systems, \a source is copied to \a target atomically and
+   then removed.
+ */
+bool KDUpdater::moveFile( const QString& source, const QString& target, QString* errorString )
+{
+    bool crossDevice = false;
+    if( renameReplacing( source, target, &crossDevice, errorString ) )
+        return true;
+    if( !crossDevice )
+        return false;
+
+    if( !copyFile( source, target, errorString ) )
+        return false;
+
+    QFile sourceFile( source );
+    const bool success = sourceFile.remove();
+    if( !success && errorString )
+        *errorString = sourceFile.errorString();
+    return success;
+}
+
+/*!
+   \internal
+   Atomically exchanges the files or directories \a path and \a other, which both have to exist
+   on the same file system. Returns false without changing anything if the platform or the file
+   system does not support this (renameat2() with RENAME_EXCHANGE, Linux 3.15 and later).
+ */
+bool KDUpdater::exchangePaths( const QString& path, const QString& other, QString* errorString )
+{
+#if defined( Q_OS_LINUX ) && defined( SYS_renameat2 )
+    if( ::syscall( SYS_renameat2, AT_FDCWD, QFile::encodeName( path ).constData(),
+                   AT_FDCWD, QFile::encodeName( other ).constData(), RENAME_EXCHANGE ) == 0 )
+        return true;
+    if( errorString )
+        *errorString = qt_error_string( errno );
+    return false;
+#else
+    Q_UNUSED( path )
+    Q_UNUSED( other )
+    if( errorString )
+        *errorString = QObject::tr( "Exchanging files atomically is not supported on this platform" );
+    return false;
+#endif
+}
+
+/*!
+   \internal
+   Returns the absolute path of \a path if it exists, otherwise of its closest existing ancestor.
+ */
+QString KDUpdater::existingPath( const QString& path )
+{
+    QFileInfo fi( path );
+    while( !fi.exists() && !fi.isRoot() )
+        fi = QFileInfo( fi.absolutePath() );
+    return fi.absoluteFilePath();
+}
+
+/*!
+   \internal
+   Returns true if \a path and \a other are on the same file system, so that one can be renamed
+   to or hard linked to the other. Paths that do not exist yet are looked up by their closest
+   existing ancestor.
+ */
+bool KDUpdater::isOnSameFileSystem( const QString& path, const QString& other )
+{
+    const QStorageInfo storage( existingPath( path ) );
+    const QStorageInfo otherStorage( existingPath( other ) );
+    return storage.isValid() && otherStorage.isValid() && storage.rootPath() == otherStorage.rootPath();
+}
+
+/*!
+   \internal
+   Returns the root path of the file system \a path is on, or an empty string if it cannot be
+   determined. Paths that do not exist yet are looked up by their closest existing ancestor.
+ */
+QString KDUpdater::fileSystemRoot( const QString& path )
+{
+    const QStorageInfo storage( existingPath( path ) );
+    return storage.isValid() ? storage.rootPath() : QString();
+}
+
+/*!
+   \internal
+   Returns the number of bytes available to this process on the file system \a path is on, or
+   -1 if it cannot be determined.
+ */
+qint64 KDUpdater::availableSpace( const QString& path )
+{
+    const QStorageInfo storage( existingPath( path ) );
+    return storage.isValid() && storage.isReady() ? storage.bytesAvailable() : -1;
+}
+
+/*!
+   \internal
+   \class KDUpdater::DirectoryHandles kdupdaterfileutils_p.h
+   \brief Keeps directories open, for file operations relative to them
+
+   Operations on many files in a directory tree open each directory once and address the files
+   relative to the directory handle by openat(), renameat(), unlinkat() and the like, so the
+   kernel resolves just the file name instead of the whole path for every operation. See
+   \ref removeFileAt(), \ref linkFileAt(), \ref renameFileAt() and \ref createDirectoryAt().
+
+   Directories are opened relative to the handles of their parent directories, which are opened
+   first and kept open as long as a child is, so walking down a tree resolves one path component
+   per directory. A directory is kept open while it is acquired. Once 256 directories are open,
+   those not acquired anymore are closed. A directory renamed or removed while it is open has to
+   be passed to \ref invalidate(), \ref renameFileAt() does that. The class is thread-safe. On
+   Windows no directories are opened, \ref acquire() returns -1 and the functions using it work
+   with the paths.
+*/
+
+// Number of open directories above which the unused ones are closed
+static const int MaxOpenDirectories = 256;
+
+class KDUpdater::DirectoryHandles::Private
+{
+public:
+    struct Handle
+    {
+        Handle()
+            : fd( -1 ),
+              users( 0 ),
+              stale( false )
+        {
+        }
+
+        int fd;
+        int users;
+        bool stale;
+        QString parent;
+    };
+
+    int open( const QString& directory );
+    void unpin( const QString& directory );
+    void closeUnused( bool staleOnly );
+
+    QMutex mutex;
+    QHash< QString, Handle > handles;
+};
+
+/*!
+   Returns the handle of \a directory, opened relative to the handle of its parent directory if
+   it is not open yet, and acquires it. Returns -1 if the directory cannot be opened or it or one
+   of its parent directories was invalidated but is still in use. Called with the mutex locked.
+*/
+int KDUpdater::DirectoryHandles::Private::open( const QString& directory )
+{
+#ifdef Q_OS_UNIX
+    QHash< QString, Handle >::iterator it = handles.find( directory );
+    if( it != handles.end() )
+    {
+        if( it->stale )
+            return -1;
+        ++it->users;
+        return it->fd;
+    }
+
+    if( handles.count() >= MaxOpenDirectories )
+        closeUnused( false );
+
+#ifdef O_PATH
+    const int flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+#else
+    const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+#endif
+    const int separator = directory.lastIndexOf( QLatin1Char( '/' ) );
+    const QString name = directory.mid( separator + 1 );
+    Handle handle;
+    if( separator < 0 || name.isEmpty() || name == QLatin1String( "." ) || name == QLatin1String( ".." ) )
+    {
+        handle.fd = ::open( QFile::encodeName( directory ).constData(), flags );
+    }
+    else
+    {
+        handle.parent = separator == 0 ? QString( QLatin1Char( '/' ) ) : directory.left( separator );
+        const int parentFd = open( handle.parent );
+        if( parentFd < 0 )
+            return -1;
+        handle.fd = ::openat( parentFd, QFile::encodeName( name ).constData(), flags );
+        if( handle.fd < 0 )
+            unpin( handle.parent );
+    }
+    if( handle.fd < 0 )
+        return -1;
+
+    handle.users = 1;
+    handles.insert( directory, handle );
+    return handle.fd;
+#else
+    Q_UNUSED( directory )
+    return -1;
+#endif
+}
+
+/*!
+   Releases \a directory, closing it if it was invalidated and is not used anymore.
+   Called with the mutex locked.
+*/
+void KDUpdater::DirectoryHandles::Private::unpin( const QString& directory )
+{
+    const QHash< QString, Handle >::iterator it = handles.find( directory );
+    if( it == handles.end() )
+        return;
+    --it->users;
+    if( it->stale && it->users <= 0 )
+        closeUnused( true );
+}
+
+/*!
+   Closes the directories not used anymore, or just the invalidated ones if \a staleOnly is
+   true. Closing a directory releases its parent directory, which may be closed then too.
+*/
+void KDUpdater::DirectoryHandles::Private::closeUnused( bool staleOnly )
+{
+    bool closed = true;
+    while( closed )
+    {
+        closed = false;
+        QHash< QString, Handle >::iterator it = handles.begin();
+        while( it != handles.end() )
+        {
+            if( it->users > 0 || ( staleOnly && !it->stale ) )
+            {
+                ++it;
+                continue;
+            }
+#ifdef Q_OS_UNIX
+            ::close( it->fd );
+#endif
+            const QString parent = it->parent;
+            it = handles.erase( it );
+            if( !parent.isEmpty() )
+            {
+                // the parent stays in the hash while it has children, so the iterator stays valid
+                const QHash< QString, Handle >::iterator parentIt = handles.find( parent );
+                if( parentIt != handles.end() )
+                    --parentIt->users;
+            }
+            closed = true;
+        }
+    }
+}
+
+KDUpdater::DirectoryHandles::DirectoryHandles()
+    : d( new Private )
+{
+}
+
+/*!
+   Destructor. Closes all directories, which must not be acquired anymore.
+*/
+KDUpdater::DirectoryHandles::~DirectoryHandles()
+{
+    d->closeUnused( false );
+}
+
+/*!
+   Returns an open handle of \a directory, which stays open until it is released by
+   \ref release(). Returns -1 if the directory cannot be opened.
+*/
+int KDUpdater::DirectoryHandles::acquire( const QString& directory )
+{
+    const QMutexLocker locker( &d->mutex );
+    return d->open( directory );
+}
+
+/*!
+   Releases \a directory acquired by \ref acquire().
+*/
+void KDUpdater::DirectoryHandles::release( const QString& directory )
+{
+    const QMutexLocker locker( &d->mutex );
+    d->unpin( directory );
+}
+
+/*!
+   Drops the handles of \a path and the directories inside it, because \a path was renamed,
+   replaced or removed. Handles still acquired are closed once they are released, until then
+   \ref acquire() returns -1 for them.
+*/
+void KDUpdater::DirectoryHandles::invalidate( const QString& path )
+{
+    const QMutexLocker locker( &d->mutex );
+    // the parents of open directories are open too, so nothing inside path is open if path is not
+    if( !d->handles.contains( path ) )
+        return;
+
+    const QString prefix = path.endsWith( QLatin1Char( '/' ) ) ? path : path + QLatin1Char( '/' );
+    for( QHash< QString, Private::Handle >::iterator it = d->handles.begin(); it != d->handles.end(); ++it )
+    {
+        if( it.key() == path || it.key().startsWith( prefix ) )
+            it->stale = true;
+    }
+    d->closeUnused( true );
+}
+
+/*!
+   \internal
+   Returns the directory of \a path and stores the name of the file in it in \a fileName. Cheaper
+   than QFileInfo for the absolute paths of tree operations, relative paths are made absolute.
+ */
+static QString splitPath( const QString& path, QString* fileName )
+{
+    const int separator = path.lastIndexOf( QLatin1Char( '/' ) );
+    if( separator < 0 || separator == path.length() - 1 || !QDir::isAbsolutePath( path ) )
+    {
+        const QFileInfo fi( path );
+        *fileName = fi.fileName();
+        return fi.absolutePath();
+    }
+    *fileName = path.mid( separator + 1 );
+    return separator == 0 ? QString( QLatin1Char( '/' ) ) : path.left( separator );
+}
+
+/*!
+   \internal
+   Removes the file \a fileName relative to the handle of its directory in \a handles.
+ */
+bool KDUpdater::removeFileAt( DirectoryHandles* handles, const QString& fileName, QString* errorString )
+{
+    QString name;
+    const QString directory = splitPath( fileName, &name );
+    const int handle = handles->acquire( directory );
+#ifdef Q_OS_UNIX
+    if( handle >= 0 )
+    {
+        const bool success = ::unlinkat( handle, QFile::encodeName( name ).constData(), 0 ) == 0;
+        const int error = errno;
+        handles->release( directory );
+        if( !success && errorString )
+            *errorString = qt_error_string( error );
+        return success;
+    }
+#else
+    Q_UNUSED( handle )
+#endif
+
+    QFile file( fileName );
+    const bool success = file.remove();
+    if( !success && errorString )
+        *errorString = file.errorString();
+    return success;
+}
+
+/*!
+   \internal
+   Creates \a target as a hard link to \a source relative to the handles of their directories
+   in \a handles, or as a clone like \ref linkOrCloneFile() if that fails.
+ */
+bool KDUpdater::linkFileAt( DirectoryHandles* handles, const QString& source, const QString& target, QString* errorString )
+{
+    QString sourceName;
+    QString targetName;
+    const QString sourceDirectory = splitPath( source, &sourceName );
+    const QString targetDirectory = splitPath( target, &targetName );
+    const int sourceHandle = handles->acquire( sourceDirectory );
+    const int targetHandle = handles->acquire( targetDirectory );
+
+    bool linked = false;
+#ifdef Q_OS_UNIX
+    if( sourceHandle >= 0 && targetHandle >= 0 )
+    {
+        linked = ::linkat( sourceHandle, QFile::encodeName( sourceName ).constData(),
+                           targetHandle, QFile::encodeName( targetName ).constData(), 0 ) == 0;
+    }
+#endif
+    if( sourceHandle >= 0 )
+        handles->release( sourceDirectory );
+    if( targetHandle >= 0 )
+        handles->release( targetDirectory );
+
+    return linked || linkOrCloneFile( source, target, errorString );
+}
+
+/*!
+   \internal
+   Renames \a source to \a target relative to the handles of their directories in \a handles,
+   replacing \a target if it exists. Falls back to \ref moveFile() if the two are on different
+   file systems or no handles are available. Handles of renamed directories are invalidated.
+ */
+bool KDUpdater::renameFileAt( DirectoryHandles* handles, const QString& source, const QString& target, QString* errorString )
+{
+    QString sourceName;
+    QString targetName;
+    const QString sourceDirectory = splitPath( source, &sourceName );
+    const QString targetDirectory = splitPath( target, &targetName );
+    const int sourceHandle = handles->acquire( sourceDirectory );
+    const int targetHandle = handles->acquire( targetDirectory );
+
+    int error = EXDEV;
+#ifdef Q_OS_UNIX
+    if( sourceHandle >= 0 && targetHandle >= 0 )
+    {
+        error = ::renameat( sourceHandle, QFile::encodeName( sourceName ).constData(),
+                            targetHandle, QFile::encodeName( targetName ).constData() ) == 0 ? 0 : errno;
+    }
+#endif
+    if( sourceHandle >= 0 )
+        handles->release( sourceDirectory );
+    if( targetHandle >= 0 )
+        handles->release( targetDirectory );
+
+    // handles of a renamed directory, or of one it replaced, refer to the wrong paths now
+    if( error == 0 || error == EXDEV )
+    {
+        handles->invalidate( source );
+        handles->invalidate( target );
+    }
+
+    if( error == EXDEV )
+        return moveFile( source, target, errorString );
+    if( error != 0 && errorString )
+        *errorString = qt_error_string( error );
+    return error == 0;
+}
+
+/*!
+   \internal
+   Creates the directory \a path relative to the handle of its parent directory in \a handles.
+   Missing parent directories are created too. Returns true if the directory exists already.
+ */
+bool KDUpdater::createDirectoryAt( DirectoryHandles* handles, const QString& path, QString* errorString )
+{
+    QString name;
+    const QString parent = splitPath( path, &name );
+    const int handle = handles->acquire( parent );
+#ifdef Q_OS_UNIX
+    if( handle >= 0 )
+    {
+        const bool created = ::mkdirat( handle, QFile::encodeName( name ).constData(), 0777 ) == 0;
+        const int error = errno;
+        handles->release( parent );
+        if( created || ( error == EEXIST && QFileInfo( path ).isDir() ) )
+            return true;
+        if( errorString )
+            *errorString = qt_error_string( error );
+        return false;
+    }
+#else
+    Q_UNUSED( handle )
+#endif
+
+    // the parent directory does not exist yet
+    const QFileInfo fi( path );
+    const bool success = QDir().mkpath( fi.absoluteFilePath() );
+    if( !success && errorString )
+        *errorString = QObject::tr( "Cannot create directory %1" ).arg( fi.absoluteFilePath() );
+    return success;
+}
+
+#ifdef KDTOOLSCORE_UNITTESTS
+
+#include <KDUnitTest/Test>
+
+#include <QUuid>
+
+static bool writeHandleTestFile( const QString& fileName )
+{
+    QFile file( fileName );
+    return file.open( QIODevice::WriteOnly ) && file.write( "data" ) == 4;
+}
+
+KDAB_UNITTEST_SIMPLE( DirectoryHandles, "kdupdater" ) {
+    const QString root = QDir::temp().absoluteFilePath( QLatin1String( "kdupdater-handles-" ) + QUuid::createUuid().toString().mid( 1, 36 ) );
+    const QString directory = root + QLatin1String( "/tree/dir" );
+    const QString moved = root + QLatin1String( "/moved" );
+    assertTrue( QDir().mkpath( directory ) );
+
+    {
+        DirectoryHandles handles;
+        QString errorString;
+
+        // files are addressed relative to the directory, which is opened relative to its parents
+        assertTrue( writeHandleTestFile( directory + QLatin1String( "/a" ) ) );
+        assertTrue( linkFileAt( &handles, directory + QLatin1String( "/a" ), directory + QLatin1String( "/b" ), &errorString ) );
+        assertTrue( QFile::exists( directory + QLatin1String( "/b" ) ) );
+        assertTrue( removeFileAt( &handles, directory + QLatin1String( "/a" ), &errorString ) );
+        assertFalse( QFile::exists( directory + QLatin1String( "/a" ) ) );
+        assertTrue( createDirectoryAt( &handles, directory + QLatin1String( "/sub" ), &errorString ) );
+        assertTrue( QFileInfo( directory + QLatin1String( "/sub" ) ).isDir() );
+
+        // renaming the parent of an open directory must not leave handles to the old paths
+        assertTrue( renameFileAt( &handles, root + QLatin1String( "/tree" ), moved, &errorString ) );
+        assertTrue( QDir().mkpath( directory ) );
+        assertTrue( writeHandleTestFile( directory + QLatin1String( "/c" ) ) );
+        assertTrue( renameFileAt( &handles, directory + QLatin1String( "/c" ), directory + QLatin1String( "/d" ), &errorString ) );
+        assertTrue( QFile::exists( directory + QLatin1String( "/d" ) ) );
+        assertFalse( QFile::exists( moved + QLatin1String( "/dir/d" ) ) );
+        assertTrue( QFile::exists( moved + QLatin1String( "/dir/b" ) ) );
+
+        // acquired handles stay valid until released, but are not handed out again
+        const int handle = handles.acquire( directory );
+        assertTrue( handle >= 0 );
+        handles.invalidate( root + QLatin1String( "/tree" ) );
+        assertEqual( handles.acquire( directory ), -1 );
+        handles.release( directory );
+        const int reopened = handles.acquire( directory );
+        assertTrue( reopened >= 0 );
+        handles.release( directory );
+    }
+
+    assertTrue( QDir( root ).removeRecursively() );
+}
+
+#endif // KDTOOLSCORE_UNITTESTS
@@ -0,0 +1,78 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#ifndef __KDTOOLS_KDUPDATERFILEUTILS_P_H__
+#define __KDTOOLS_KDUPDATERFILEUTILS_P_H__
+
+#include "kdupdater.h"
+#include <pimpl_ptr.h>
+
+#include <QFile>
+
+QT_BEGIN_NAMESPACE
+class QString;
+class QTemporaryFile;
+QT_END_NAMESPACE
+
+class KDSaveFile;
+
+namespace KDUpdater
+{
+    bool cloneFile( const QString& source, const QString& target, QString* errorString );
+    bool linkOrCloneFile( const QString& source, const QString& target, QString* errorString );
+    bool restoreFile( const QString& backup, const QString& target, QString* errorString );
+    bool copyFile( const QString& source, const QString& target, QString* errorString );
+    bool moveFile( const QString& source, const QString& target, QString* errorString );
+    bool appendFileContents( QFile& source, KDSaveFile& target, QString* errorString );
+    bool appendFileContents( QFile& source, QFile& target, QString* errorString );
+    QString temporaryFileTemplate( const QString& fileName );
+    bool replaceFile( QTemporaryFile& temporary, const QString& target, QString* errorString );
+    QFile::Permissions newFilePermissions();
+    bool exchangePaths( const QString& path, const QString& other, QString* errorString );
+    QString existingPath( const QString& path );
+    bool isOnSameFileSystem( const QString& path, const QString& other );
+    QString fileSystemRoot( const QString& path );
+    qint64 availableSpace( const QString& path );
+
+    class DirectoryHandles
+    {
+    public:
+        DirectoryHandles();
+        ~DirectoryHandles();
+
+        int acquire( const QString& directory );
+        void release( const QString& directory );
+        void invalidate( const QString& path );
+
+    private:
+        Q_DISABLE_COPY( DirectoryHandles )
+        class Private;
+        kdtools::pimpl_ptr< Private > d;
+    };
+
+    bool removeFileAt( DirectoryHandles* handles, const QString& fileName, QString* errorString );
+    bool linkFileAt( DirectoryHandles* handles, const QString& source, const QString& target, QString* errorString );
+    bool renameFileAt( DirectoryHandles* handles, const QString& source, const QString& target, QString* errorString );
+    bool createDirectoryAt( DirectoryHandles* handles, const QString& path, QString* errorString );
+}
+
+#endif
@@ -0,0 +1,861 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#include "kdupdaterfilewritebatch_p.h"
+#include "kdupdaterfileutils_p.h"
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QFileInfo>
+#include <QScopedPointer>
+#include <QString>
+#include <QTemporaryFile>
+#include <QVector>
+#include <QtConcurrentMap>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#ifdef __has_include
+#if __has_include( <linux/io_uring.h> )
+#include <linux/io_uring.h>
+#endif
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+// IORING_OP_RENAMEAT is an enumerator, so the headers are detected by IORING_FEAT_EXT_ARG, added
+// by Linux 5.11 along with it
+#if defined( IORING_FEAT_EXT_ARG ) && defined( __NR_io_uring_setup )
+#define KDUPDATER_HAVE_IO_URING
+#endif
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+using namespace KDUpdater;
+
+class IoUring;
+
+/*!
+   \internal
+   \class KDUpdater::FileWriteBatch kdupdaterfilewritebatch_p.h
+   \brief Writes many files at once, each one atomically
+
+   Files added by \ref addFile() are written when the batch is committed, see \ref commit().
+   Each file is written to a temporary file next to it, which is renamed to the file when
+   complete, so no file ever has partial contents.
+
+   On Linux with io_uring, the opens, writes, optional fsyncs, closes and renames of all files
+   are submitted to the kernel in batches, one batch per step, which saves a system call round
+   trip per step and file. This requires building against the headers of Linux 5.11 or later,
+   and a kernel supporting IORING_OP_RENAMEAT at run-time, which Linux 5.11 introduced.
+   Elsewhere, or if io_uring is not available at run-time, e.g. because it is disabled, the
+   files are written concurrently on the global thread pool.
+
+   \ref KDUpdater::UFUncompressor extracts update files through this.
+*/
+
+namespace
+{
+    /**
+     * \internal
+     * A file added to a batch, and the state of its write.
+     */
+    struct PendingFile
+    {
+        PendingFile()
+            : directoryHandle( -1 ),
+              handle( -1 ),
+              written( 0 )
+        {
+        }
+
+        QString fileName;
+        QByteArray data;
+        QFile::Permissions permissions;
+        QByteArray nativeFileName;
+        QByteArray nativeTemporaryName;
+        int directoryHandle;
+        int handle;
+        qint64 written;
+        QString error;
+    };
+
+    /**
+     * \internal
+     * Writes a file of a batch through a temporary file. Called for each file on the global thread pool
+     * by QtConcurrent::blockingMap(), failures are stored in the file.
+     */
+    struct FileWriter
+    {
+        explicit FileWriter( bool sync )
+            : syncToDisk( sync )
+        {
+        }
+
+        void operator()( PendingFile& file ) const;
+
+        bool syncToDisk;
+    };
+}
+
+/**
+ * \internal
+ * Flushes the file open as \a handle to the disk.
+ */
+static bool syncFile( int handle )
+{
+#ifdef Q_OS_WIN
+    return ::_commit( handle ) == 0;
+#else
+    return ::fsync( handle ) == 0;
+#endif
+}
+
+void FileWriter::operator()( PendingFile& file ) const
+{
+    QTemporaryFile temporaryFile( temporaryFileTemplate( file.fileName ) );
+    if( !temporaryFile.open() || temporaryFile.write( file.data ) != file.data.size() || !temporaryFile.flush() )
+    {
+        file.error = FileWriteBatch::tr("Cannot write %1: %2").arg( file.fileName, temporaryFile.errorString() );
+        return;
+    }
+
+    temporaryFile.setPermissions( file.permissions );
+    if( syncToDisk && !syncFile( temporaryFile.handle() ) )
+    {
+        file.error = FileWriteBatch::tr("Cannot write %1: %2").arg( file.fileName, qt_error_string( errno ) );
+        return;
+    }
+
+    QString errorString;
+    if( !replaceFile( temporaryFile, file.fileName, &errorString ) )
+        file.error = FileWriteBatch::tr("Cannot write %1: %2").arg( file.fileName, errorString );
+}
+
+#ifdef KDUPDATER_HAVE_IO_URING
+
+/**
+ * \internal
+ * A minimal io_uring submission and completion queue, see io_uring(7). There are no more
+ * requests in flight than the submission queue has entries, so the completion queue, which is
+ * twice as large, cannot overflow. The kernel uses the buffers, names and file handles of the
+ * requests until they complete, so they have to stay untouched while \ref isIdle() is false.
+ */
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+
+    bool setup( unsigned entries );
+    unsigned capacity() const;
+    io_uring_sqe* nextRequest();
+    bool submitAndWait( unsigned count, QVector< io_uring_cqe >* completions );
+    bool isIdle() const;
+
+private:
+    Q_DISABLE_COPY( IoUring )
+
+    int fd;
+    void* ring;
+    size_t ringSize;
+    io_uring_sqe* requests;
+    size_t requestsSize;
+    unsigned entries;
+    unsigned localTail;
+    unsigned inFlight;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+};
+
+IoUring::IoUring()
+    : fd( -1 ),
+      ring( MAP_FAILED ),
+      ringSize( 0 ),
+      requests( static_cast< io_uring_sqe* >( MAP_FAILED ) ),
+      requestsSize( 0 ),
+      entries( 0 ),
+      localTail( 0 ),
+      inFlight( 0 )
+{
+}
+
+IoUring::~IoUring()
+{
+    if( requests != MAP_FAILED )
+        ::munmap( requests, requestsSize );
+    if( ring != MAP_FAILED )
+        ::munmap( ring, ringSize );
+    if( fd >= 0 )
+        ::close( fd );
+}
+
+/*!
+   Sets up a queue of \a requestedEntries requests. Returns false if the kernel does not support
+   io_uring or any of the operations used by FileWriteBatch.
+*/
+bool IoUring::setup( unsigned requestedEntries )
+{
+    io_uring_params params;
+    std::memset( &params, 0, sizeof( params ) );
+    fd = static_cast< int >( ::syscall( __NR_io_uring_setup, requestedEntries, &params ) );
+    if( fd < 0 || !( params.features & IORING_FEAT_SINGLE_MMAP ) )
+        return false;
+
+    entries = params.sq_entries;
+    ringSize = qMax( params.sq_off.array + params.sq_entries * sizeof( unsigned ), params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe ) );
+    ring = ::mmap( 0, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    if( ring == MAP_FAILED )
+        return false;
+
+    requestsSize = params.sq_entries * sizeof( io_uring_sqe );
+    requests = static_cast< io_uring_sqe* >( ::mmap( 0, requestsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES ) );
+    if( requests == MAP_FAILED )
+        return false;
+
+    char* const base = static_cast< char* >( ring );
+    sqTail = reinterpret_cast< unsigned* >( base + params.sq_off.tail );
+    sqMask = reinterpret_cast< unsigned* >( base + params.sq_off.ring_mask );
+    sqArray = reinterpret_cast< unsigned* >( base + params.sq_off.array );
+    cqHead = reinterpret_cast< unsigned* >( base + params.cq_off.head );
+    cqTail = reinterpret_cast< unsigned* >( base + params.cq_off.tail );
+    cqMask = reinterpret_cast< unsigned* >( base + params.cq_off.ring_mask );
+    cqes = reinterpret_cast< io_uring_cqe* >( base + params.cq_off.cqes );
+    localTail = *sqTail;
+
+    QByteArray probeData( sizeof( io_uring_probe ) + 256 * sizeof( io_uring_probe_op ), '\0' );
+    io_uring_probe* const probe = reinterpret_cast< io_uring_probe* >( probeData.data() );
+    if( ::syscall( __NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256 ) < 0 )
+        return false;
+
+    static const int operations[] = { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_RENAMEAT };
+    for( size_t i = 0; i < sizeof( operations ) / sizeof( operations[ 0 ] ); ++i )
+    {
+        const int operation = operations[ i ];
+        if( operation >= probe->ops_len || !( probe->ops[ operation ].flags & IO_URING_OP_SUPPORTED ) )
+            return false;
+    }
+    return true;
+}
+
+unsigned IoUring::capacity() const
+{
+    return entries;
+}
+
+/*!
+   Returns a cleared request, which is submitted by the next call of \ref submitAndWait().
+   At most \ref capacity() requests can be queued.
+*/
+io_uring_sqe* IoUring::nextRequest()
+{
+    const unsigned index = localTail & *sqMask;
+    ++localTail;
+    sqArray[ index ] = index;
+    io_uring_sqe* const request = &requests[ index ];
+    std::memset( request, 0, sizeof( io_uring_sqe ) );
+    return request;
+}
+
+/*!
+   Submits the \a count queued requests and waits for their completions, which are stored in
+   \a completions. If submitting fails, the requests submitted before are still waited for,
+   their completions are stored too, and false is returned with errno set. If waiting fails as
+   well, requests stay in flight, see \ref isIdle().
+*/
+bool IoUring::submitAndWait( unsigned count, QVector< io_uring_cqe >* completions )
+{
+    completions->clear();
+    __atomic_store_n( sqTail, localTail, __ATOMIC_RELEASE );
+
+    unsigned unsubmitted = count;
+    int error = 0;
+    while( error == 0 ? static_cast< unsigned >( completions->count() ) < count : inFlight > 0 )
+    {
+        const unsigned toSubmit = error == 0 ? unsubmitted : 0;
+        const long submitted = ::syscall( __NR_io_uring_enter, fd, toSubmit, inFlight + toSubmit, IORING_ENTER_GETEVENTS, 0, 0 );
+        if( submitted < 0 && errno != EINTR )
+        {
+            if( error != 0 )
+                break;
+            error = errno;
+            continue;
+        }
+        if( submitted > 0 )
+        {
+            unsubmitted -= static_cast< unsigned >( submitted );
+            inFlight += static_cast< unsigned >( submitted );
+        }
+
+        unsigned head = *cqHead;
+        const unsigned tail = __atomic_load_n( cqTail, __ATOMIC_ACQUIRE );
+        for( ; head != tail; ++head, --inFlight )
+            completions->append( cqes[ head & *cqMask ] );
+        __atomic_store_n( cqHead, head, __ATOMIC_RELEASE );
+    }
+
+    if( error == 0 )
+        return true;
+    errno = error;
+    return false;
+}
+
+/*!
+   Returns true if no submitted request is still in flight.
+*/
+bool IoUring::isIdle() const
+{
+    return inFlight == 0;
+}
+
+/**
+ * \internal
+ * Returns \a permissions as a Unix file mode.
+ */
+static mode_t fileMode( QFile::Permissions permissions )
+{
+    mode_t mode = 0;
+    if( permissions & ( QFile::ReadOwner | QFile::ReadUser ) )
+        mode |= S_IRUSR;
+    if( permissions & ( QFile::WriteOwner | QFile::WriteUser ) )
+        mode |= S_IWUSR;
+    if( permissions & ( QFile::ExeOwner | QFile::ExeUser ) )
+        mode |= S_IXUSR;
+    if( permissions & QFile::ReadGroup )
+        mode |= S_IRGRP;
+    if( permissions & QFile::WriteGroup )
+        mode |= S_IWGRP;
+    if( permissions & QFile::ExeGroup )
+        mode |= S_IXGRP;
+    if( permissions & QFile::ReadOther )
+        mode |= S_IROTH;
+    if( permissions & QFile::WriteOther )
+        mode |= S_IWOTH;
+    if( permissions & QFile::ExeOther )
+        mode |= S_IXOTH;
+    return mode;
+}
+
+#endif // KDUPDATER_HAVE_IO_URING
+
+class FileWriteBatch::Private
+{
+public:
+    Private()
+        : syncToDisk( false ),
+          byteCount( 0 ),
+          ringChecked( false )
+    {
+    }
+
+    QVector< PendingFile > files;
+    bool syncToDisk;
+    qint64 byteCount;
+    QString errorString;
+
+    mutable bool ringChecked;
+#ifdef KDUPDATER_HAVE_IO_URING
+    enum Step
+    {
+        OpenStep,
+        WriteStep,
+        SyncStep,
+        CloseStep,
+        RenameStep
+    };
+
+    mutable QScopedPointer< IoUring > ring;
+    DirectoryHandles directoryHandles;
+
+    bool runStep( Step step );
+    bool prepareRequest( Step step, PendingFile& file, io_uring_sqe* request ) const;
+    void completeRequest( Step step, PendingFile& file, int result ) const;
+#endif
+    IoUring* ioUring() const;
+    bool commitWithIoUring();
+    void commitWithThreadPool();
+};
+
+#ifdef KDUPDATER_HAVE_IO_URING
+
+/*!
+   Returns the io_uring queue, set up on first use, or 0 if io_uring is not available.
+*/
+IoUring* FileWriteBatch::Private::ioUring() const
+{
+    if( !ringChecked )
+    {
+        ringChecked = true;
+        ring.reset( new IoUring );
+        if( !ring->setup( 256 ) )
+            ring.reset();
+    }
+    return ring.data();
+}
+
+/*!
+   Fills \a request with the \a step of writing \a file. Returns false if \a file does not take
+   part in \a step, because it failed before or is done with it.
+*/
+bool FileWriteBatch::Private::prepareRequest( Step step, PendingFile& file, io_uring_sqe* request ) const
+{
+    switch( step )
+    {
+    case OpenStep:
+        if( !file.error.isEmpty() )
+            return false;
+        request->opcode = IORING_OP_OPENAT;
+        request->fd = file.directoryHandle >= 0 ? file.directoryHandle : AT_FDCWD;
+        request->addr = reinterpret_cast< quintptr >( file.nativeTemporaryName.constData() );
+        request->len = S_IRUSR | S_IWUSR;
+        request->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+        return true;
+
+    case WriteStep:
+        if( !file.error.isEmpty() || file.handle < 0 || file.written == file.data.size() )
+            return false;
+        request->opcode = IORING_OP_WRITE;
+        request->fd = file.handle;
+        request->addr = reinterpret_cast< quintptr >( file.data.constData() + file.written );
+        request->len = static_cast< unsigned >( qMin< qint64 >( file.data.size() - file.written, 1 << 30 ) );
+        request->off = file.written;
+        return true;
+
+    case SyncStep:
+        if( !file.error.isEmpty() || file.handle < 0 )
+            return false;
+        request->opcode = IORING_OP_FSYNC;
+        request->fd = file.handle;
+        return true;
+
+    case CloseStep:
+        // also the files which failed are closed
+        if( file.handle < 0 )
+            return false;
+        request->opcode = IORING_OP_CLOSE;
+        request->fd = file.handle;
+        return true;
+
+    case RenameStep:
+        if( !file.error.isEmpty() )
+            return false;
+        request->opcode = IORING_OP_RENAMEAT;
+        request->fd = file.directoryHandle >= 0 ? file.directoryHandle : AT_FDCWD;
+        request->addr = reinterpret_cast< quintptr >( file.nativeTemporaryName.constData() );
+        request->len = static_cast< unsigned >( request->fd );
+        request->addr2 = reinterpret_cast< quintptr >( file.nativeFileName.constData() );
+        return true;
+    }
+    return false;
+}
+
+/*!
+   Records the \a result of the \a step of writing \a file.
+*/
+void FileWriteBatch::Private::completeRequest( Step step, PendingFile& file, int result ) const
+{
+    if( step == CloseStep )
+        file.handle = -1;
+
+    if( result < 0 )
+    {
+        if( file.error.isEmpty() )
+            file.error = FileWriteBatch::tr("Cannot write %1: %2").arg( file.fileName, qt_error_string( -result ) );
+        return;
+    }
+
+    if( step == OpenStep )
+    {
+        file.handle = result;
+        // the mode passed to open is subject to the umask
+        if( ::fchmod( file.handle, fileMode( file.permissions ) ) != 0 )
+            file.error = FileWriteBatch::tr("Cannot write %1: %2").arg( file.fileName, qt_error_string( errno ) );
+    }
+    else if( step == WriteStep )
+    {
+        file.written += result;
+        if( result == 0 )
+            file.error = FileWriteBatch::tr("Cannot write %1: no data was written").arg( file.fileName );
+    }
+}
+
+/*!
+   Submits the \a step of all files taking part in it, as many at once as the queue holds.
+   Returns false if the requests could not be submitted.
+*/
+bool FileWriteBatch::Private::runStep( Step step )
+{
+    QVector< io_uring_cqe > completions;
+    int index = 0;
+    while( index < files.count() )
+    {
+        unsigned queued = 0;
+        for( ; index < files.count() && queued < ring->capacity(); ++index )
+        {
+            io_uring_sqe request;
+            std::memset( &request, 0, sizeof( request ) );
+            if( !prepareRequest( step, files[ index ], &request ) )
+                continue;
+            request.user_data = static_cast< quint64 >( index );
+            *ring->nextRequest() = request;
+            ++queued;
+        }
+
+        if( queued == 0 )
+            break;
+        const bool submitted = ring->submitAndWait( queued, &completions );
+        const int error = errno;
+
+        // also after a failure, as the files opened or closed meanwhile have to be known
+        for( QVector< io_uring_cqe >::const_iterator it = completions.constBegin(); it != completions.constEnd(); ++it )
+            completeRequest( step, files[ static_cast< int >( it->user_data ) ], it->res );
+
+        if( !submitted )
+        {
+            errorString = FileWriteBatch::tr("Cannot submit file operations: %1").arg( qt_error_string( error ) );
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+   Writes the files through io_uring, one step of all files after the other. Writes cut
+   short are continued in further rounds. The files are opened and renamed relative to the
+   handles of their directories, which stay open for the following batches.
+*/
+bool FileWriteBatch::Private::commitWithIoUring()
+{
+    static QAtomicInt sequence;
+    const QByteArray suffix = ".tmp." + QByteArray::number( QCoreApplication::applicationPid() ) + '-';
+    for( QVector< PendingFile >::iterator it = files.begin(); it != files.end(); ++it )
+    {
+        const QFileInfo fi( it->fileName );
+        const QString directory = fi.absolutePath();
+        it->directoryHandle = directoryHandles.acquire( directory );
+        const QString prefix = it->directoryHandle >= 0 ? QString() : directory + QLatin1Char( '/' );
+        it->nativeFileName = QFile::encodeName( prefix + fi.fileName() );
+        it->nativeTemporaryName = QFile::encodeName( prefix + QLatin1Char( '.' ) + fi.fileName() ) + suffix + QByteArray::number( sequence.fetchAndAddRelaxed( 1 ) );
+    }
+
+    bool submitted = runStep( OpenStep );
+    while( submitted )
+    {
+        bool pending = false;
+        for( QVector< PendingFile >::const_iterator it = files.constBegin(); it != files.constEnd() && !pending; ++it )
+            pending = it->error.isEmpty() && it->handle >= 0 && it->written < it->data.size();
+        if( !pending )
+            break;
+        submitted = runStep( WriteStep );
+    }
+    if( submitted && syncToDisk )
+        submitted = runStep( SyncStep );
+    // the files which failed are closed too
+    if( submitted )
+        submitted = runStep( CloseStep );
+    if( submitted )
+        submitted = runStep( RenameStep );
+
+    if( !submitted && !ring->isIdle() )
+    {
+        // The kernel may still read the data and names of the files and use their handles and
+        // those of their directories, so all of them are left alone for good, as is the queue.
+        // The following batches are written by the thread pool.
+        new QVector< PendingFile >( files );
+        ring.take();
+        return false;
+    }
+
+    // the queue is left in an unknown state, the following batches are written by the thread pool
+    if( !submitted )
+        ring.reset();
+
+    bool success = submitted;
+    for( QVector< PendingFile >::iterator it = files.begin(); it != files.end(); ++it )
+    {
+        if( it->handle >= 0 )
+            ::close( it->handle );
+        if( !it->error.isEmpty() || !submitted )
+            ::unlinkat( it->directoryHandle >= 0 ? it->directoryHandle : AT_FDCWD, it->nativeTemporaryName.constData(), 0 );
+        if( it->directoryHandle >= 0 )
+            directoryHandles.release( QFileInfo( it->fileName ).absolutePath() );
+        if( !it->error.isEmpty() && success )
+        {
+            errorString = it->error;
+            success = false;
+        }
+    }
+    return success;
+}
+
+#else
+
+IoUring* FileWriteBatch::Private::ioUring() const
+{
+    return 0;
+}
+
+bool FileWriteBatch::Private::commitWithIoUring()
+{
+    return false;
+}
+
+#endif // KDUPDATER_HAVE_IO_URING
+
+/*!
+   Writes the files through temporary files, concurrently on the global thread pool.
+*/
+void FileWriteBatch::Private::commitWithThreadPool()
+{
+    QtConcurrent::blockingMap( files, FileWriter( syncToDisk ) );
+    for( QVector< PendingFile >::const_iterator it = files.constBegin(); it != files.constEnd(); ++it )
+    {
+        if( !it->error.isEmpty() )
+        {
+            errorString = it->error;
+            return;
+        }
+    }
+}
+
+/*!
+   Creates an empty batch.
+*/
+FileWriteBatch::FileWriteBatch()
+    : d( new Private )
+{
+}
+
+/*!
+   Destructor. Files not committed are not written.
+*/
+FileWriteBatch::~FileWriteBatch()
+{
+}
+
+/*!
+   Returns the backend writing the files, io_uring if the platform and the kernel support it.
+*/
+FileWriteBatch::Backend FileWriteBatch::backend() const
+{
+    return d->ioUring() ? IoUringBackend : ThreadPoolBackend;
+}
+
+/*!
+   Sets the \a backend writing the files. io_uring is only used if the platform and the kernel
+   support it, see \ref backend().
+*/
+void FileWriteBatch::setBackend( Backend backend )
+{
+    if( backend == ThreadPoolBackend )
+    {
+        d->ringChecked = true;
+#ifdef KDUPDATER_HAVE_IO_URING
+        d->ring.reset();
+#endif
+    }
+    else if( !d->ioUring() )
+    {
+        // check again, io_uring may have been disabled by a failure
+        d->ringChecked = false;
+    }
+}
+
+/*!
+   Sets whether the contents of each file are flushed to the disk before it is renamed, so
+   the file has either its previous or its new contents after a system crash. Off by default.
+*/
+void FileWriteBatch::setSyncToDisk( bool sync )
+{
+    d->syncToDisk = sync;
+}
+
+bool FileWriteBatch::syncToDisk() const
+{
+    return d->syncToDisk;
+}
+
+/*!
+   Adds the file \a fileName with the contents \a data and \a permissions to the batch. The
+   directory of the file has to exist when the batch is committed. An existing file is replaced.
+*/
+void FileWriteBatch::addFile( const QString& fileName, const QByteArray& data, QFile::Permissions permissions )
+{
+    PendingFile file;
+    file.fileName = fileName;
+    file.data = data;
+    file.permissions = permissions;
+    d->files.append( file );
+    d->byteCount += data.size();
+}
+
+/*!
+   Returns the number of files added since the last commit.
+*/
+int FileWriteBatch::fileCount() const
+{
+    return d->files.count();
+}
+
+/*!
+   Returns the total size of the files added since the last commit.
+*/
+qint64 FileWriteBatch::byteCount() const
+{
+    return d->byteCount;
+}
+
+/*!
+   Writes all files added since the last commit and empties the batch. Returns false if any
+   file could not be written, see \ref errorString(). The other files are written anyway.
+*/
+bool FileWriteBatch::commit()
+{
+    d->errorString.clear();
+    bool success = false;
+    if( d->ioUring() )
+    {
+        success = d->commitWithIoUring();
+    }
+    else
+    {
+        d->commitWithThreadPool();
+        success = d->errorString.isEmpty();
+    }
+    d->files.clear();
+    d->byteCount = 0;
+    return success;
+}
+
+/*!
+   Returns a description of the first error of the last commit.
+*/
+QString FileWriteBatch::errorString() const
+{
+    return d->errorString;
+}
+
+#ifdef KDTOOLSCORE_UNITTESTS
+
+#include <KDUnitTest/Test>
+
+#include <QDir>
+#include <QUuid>
+
+static QByteArray readTestFile( const QString& fileName )
+{
+    QFile file( fileName );
+    return file.open( QIODevice::ReadOnly ) ? file.readAll() : QByteArray();
+}
+
+static QFile::Permissions testPermissions( const QString& fileName )
+{
+    const QFile::Permissions mask = QFile::ReadOwner | QFile::WriteOwner | QFile::ExeOwner |
+                                    QFile::ReadGroup | QFile::WriteGroup | QFile::ExeGroup |
+                                    QFile::ReadOther | QFile::WriteOther | QFile::ExeOther;
+    return QFile::permissions( fileName ) & mask;
+}
+
+KDAB_UNITTEST_SIMPLE( FileWriteBatch, "kdupdater" ) {
+    const QDir dir( QDir::temp().filePath( QString::fromLatin1( "kdupdater-writebatch-test%1" ).arg( QUuid::createUuid().toString() ) ) );
+    assertTrue( QDir().mkpath( dir.filePath( QLatin1String( "sub" ) ) ) );
+
+    const FileWriteBatch::Backend backends[] = { FileWriteBatch::ThreadPoolBackend, FileWriteBatch::IoUringBackend };
+    for( size_t i = 0; i < sizeof( backends ) / sizeof( backends[ 0 ] ); ++i )
+    {
+        FileWriteBatch batch;
+        batch.setBackend( backends[ i ] );
+        // io_uring is not available everywhere
+        if( batch.backend() != backends[ i ] )
+            continue;
+
+        const QString existing = dir.filePath( QLatin1String( "existing" ) );
+        {
+            QFile file( existing );
+            assertTrue( file.open( QIODevice::WriteOnly ) );
+            assertEqual( file.write( "previous contents, longer than the new ones" ), qint64( 43 ) );
+        }
+
+        const QString script = dir.filePath( QLatin1String( "sub/script" ) );
+        const QFile::Permissions executable = QFile::ReadOwner | QFile::WriteOwner | QFile::ExeOwner | QFile::ReadGroup | QFile::ExeGroup;
+        const QFile::Permissions readOnly = QFile::ReadOwner | QFile::ReadGroup | QFile::ReadOther;
+        const QByteArray large( 3 * 1024 * 1024 + 17, 'x' );
+
+        batch.setSyncToDisk( i == 1 );
+        batch.addFile( existing, "replaced", QFile::ReadOwner | QFile::WriteOwner );
+        batch.addFile( script, "#!/bin/sh\n", executable );
+        batch.addFile( dir.filePath( QLatin1String( "large" ) ), large, readOnly );
+        batch.addFile( dir.filePath( QLatin1String( "empty" ) ), QByteArray(), QFile::ReadOwner | QFile::WriteOwner );
+        assertEqual( batch.fileCount(), 4 );
+        assertEqual( batch.byteCount(), qint64( 8 + 10 + large.size() ) );
+
+        assertTrue( batch.commit() );
+        assertTrue( batch.errorString().isEmpty() );
+        assertEqual( batch.fileCount(), 0 );
+        assertEqual( batch.byteCount(), qint64( 0 ) );
+
+        assertEqual( readTestFile( existing ), QByteArray( "replaced" ) );
+        assertEqual( readTestFile( script ), QByteArray( "#!/bin/sh\n" ) );
+        assertEqual( readTestFile( dir.filePath( QLatin1String( "large" ) ) ), large );
+        assertTrue( QFileInfo( dir.filePath( QLatin1String( "empty" ) ) ).exists() );
+        assertEqual( QFileInfo( dir.filePath( QLatin1String( "empty" ) ) ).size(), qint64( 0 ) );
+#ifdef Q_OS_UNIX
+        assertEqual( testPermissions( existing ), QFile::ReadOwner | QFile::WriteOwner );
+        assertEqual( testPermissions( script ), executable );
+        assertEqual( testPermissions( dir.filePath( QLatin1String( "large" ) ) ), readOnly );
+#endif
+
+        // a missing directory fails its file, the others are written anyway
+        batch.addFile( dir.filePath( QLatin1String( "missing/file" ) ), "lost", QFile::ReadOwner | QFile::WriteOwner );
+        batch.addFile( existing, "again", QFile::ReadOwner | QFile::WriteOwner );
+        assertFalse( batch.commit() );
+        assertTrue( batch.errorString().contains( dir.filePath( QLatin1String( "missing/file" ) ) ) );
+        assertFalse( QFileInfo( dir.filePath( QLatin1String( "missing" ) ) ).exists() );
+        assertEqual( readTestFile( existing ), QByteArray( "again" ) );
+        assertEqual( batch.fileCount(), 0 );
+
+        // no temporary files are left behind
+        assertEqual( QDir( dir.path() ).entryList( QDir::Files | QDir::Hidden ).count(), 3 );
+        assertEqual( QDir( dir.filePath( QLatin1String( "sub" ) ) ).entryList( QDir::Files | QDir::Hidden ).count(), 1 );
+
+        assertTrue( QFile::setPermissions( dir.filePath( QLatin1String( "large" ) ), QFile::ReadOwner | QFile::WriteOwner ) );
+        assertTrue( QDir( dir.path() ).removeRecursively() );
+        assertTrue( QDir().mkpath( dir.filePath( QLatin1String( "sub" ) ) ) );
+    }
+
+    assertTrue( QDir( dir.path() ).removeRecursively() );
+}
+
+#endif // KDTOOLSCORE_UNITTESTS
@@ -0,0 +1,72 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#ifndef __KDTOOLS_KDUPDATERFILEWRITEBATCH_P_H__
+#define __KDTOOLS_KDUPDATERFILEWRITEBATCH_P_H__
+
+#include "kdupdater.h"
+#include <pimpl_ptr.h>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QFile>
+
+QT_BEGIN_NAMESPACE
+class QByteArray;
+class QString;
+QT_END_NAMESPACE
+
+namespace KDUpdater
+{
+    class FileWriteBatch
+    {
+        Q_DECLARE_TR_FUNCTIONS(KDUpdater::FileWriteBatch)
+
+    public:
+        enum Backend
+        {
+            ThreadPoolBackend,
+            IoUringBackend
+        };
+
+        FileWriteBatch();
+        ~FileWriteBatch();
+
+        Backend backend() const;
+        void setBackend( Backend backend );
+
+        void setSyncToDisk( bool sync );
+        bool syncToDisk() const;
+
+        void addFile( const QString& fileName, const QByteArray& data, QFile::Permissions permissions );
+        int fileCount() const;
+        qint64 byteCount() const;
+
+        bool commit();
+        QString errorString() const;
+
+    private:
+        class Private;
+        kdtools::pimpl_ptr< Private > d;
+    };
+}
+
+#endif
@@ -0,0 +1,1085 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#include "kdupdaterinstallplan.h"
+#include "kdupdaterfileutils_p.h"
+#include "kdupdatertarget.h"
+#include "kdupdaterupdate.h"
+#include "kdupdaterupdateinstructions_p.h"
+#include "kdupdaterupdateoperationfactory.h"
+#include "kdupdaterupdateoperations_p.h"
+#include "kdupdaterufuncompressor_p.h"
+
+#include <QAtomicInt>
+#include <QDebug>
+#include <QDir>
+#include <QDomDocument>
+#include <QDomElement>
+#include <QFile>
+#include <QFileInfo>
+#include <QMap>
+#include <QVector>
+
+#include <kdsavefile.h>
+
+/*!
+   \ingroup kdupdater
+   \class KDUpdater::InstallPlan kdupdaterinstallplan.h KDUpdaterInstallPlan
+   \brief The operations installing a list of updates, with their estimated cost
+
+   An install plan unpacks downloaded updates and compiles their UpdateInstructions.xml into
+   a list of steps, each consisting of a \ref KDUpdater::UpdateOperation and the action to take
+   if it fails. \ref KDUpdater::UpdateInstaller executes such plans.
+
+   Before installing, a plan can be dry run with \ref dryRun(). This changes nothing on disk,
+   but asks every operation for its cost (see \ref KDUpdater::UpdateOperation::estimateCost())
+   and tests whether it would succeed (see \ref KDUpdater::UpdateOperation::testOperation()).
+   The files created and removed by earlier steps are taken into account, so a Copy into a
+   directory created by a Mkdir before does not fail.
+
+   The expected duration of each step is derived from the throughput measured while installing
+   earlier updates of the same target. Until an installation was measured, a throughput of
+   50 MB/s is assumed; \ref setThroughput() overrides it.
+
+   \code
+   KDUpdater::InstallPlan plan( target );
+   Q_FOREACH( KDUpdater::Update* update, resolver.orderedUpdates() )
+       plan.addUpdate( update );
+   if( !plan.dryRun() )
+   {
+       for( int i = 0; i < plan.stepCount(); ++i )
+       {
+           if( plan.step( i ).willFail )
+               qWarning() << plan.step( i ).operation->operationCommand() << plan.step( i ).errorString;
+       }
+   }
+   qDebug() << "Writes" << plan.bytesToWrite() << "bytes in about" << plan.expectedDuration() << "ms";
+   \endcode
+
+   Generated UpdateInstructions.xml files often contain redundant operations, like a file
+   copied twice to the same destination. \ref optimize() removes and merges them.
+
+   \note The updates added to a plan have to be downloaded, see \ref KDUpdater::Update::download().
+   The directories they are unpacked to are removed when the plan is cleared or destroyed.
+*/
+
+/*!
+   \class KDUpdater::InstallPlan::Step
+   \brief An operation of an \ref KDUpdater::InstallPlan
+
+   \li \c update: the update the operation belongs to, 0 for instructions added without an update
+   \li \c operation: the operation, owned by the plan unless it is one of the operations of
+   \c update itself
+   \li \c onError: the action to take if the operation fails: "Abort", "Continue" or "AskUser"
+   \li \c cost, \c expectedDuration: the estimated cost of the operation and the time it takes
+   in milliseconds, set by \ref estimateCosts() and \ref dryRun()
+   \li \c willFail, \c errorString: whether and why the operation is expected to fail, set
+   by \ref dryRun()
+*/
+
+using namespace KDUpdater;
+
+// Throughput assumed until an installation was measured, in bytes per second
+static const qint64 DefaultThroughput = 50 * 1024 * 1024;
+// Creating, renaming or removing a file takes about as long as transferring this many bytes
+static const qint64 FileOverhead = 64 * 1024;
+// Installations taking less milliseconds are too short to measure the throughput
+static const qint64 MinimumMeasuredDuration = 500;
+
+enum PathState
+{
+    PathCreated,
+    PathRemoved
+};
+
+InstallPlan::Step::Step()
+    : update( 0 ),
+      operation( 0 ),
+      expectedDuration( 0 ),
+      willFail( false )
+{
+}
+
+static QString normalizedPath( const QString& path )
+{
+    const QString cleanPath = QDir::cleanPath( QFileInfo( path ).absoluteFilePath() );
+#ifdef Q_OS_WIN
+    return cleanPath.toLower();
+#else
+    return cleanPath;
+#endif
+}
+
+/*!
+ \internal
+ Returns the amount of data transferred for \a cost, with changes of the file system metadata
+ converted to bytes.
+ */
+static qint64 weightedBytes( const UpdateOperation::Cost& cost )
+{
+    return cost.bytesRead + cost.bytesWritten + cost.backupBytes + cost.filesTouched * FileOverhead;
+}
+
+/*!
+ \internal
+ Returns the state of the closest of \a path and its ancestors in \a states, or -1 if none of
+ them is created or removed.
+ */
+static int closestPathState( const QMap< QString, int >& states, QString path )
+{
+    while( true )
+    {
+        const QMap< QString, int >::const_iterator it = states.constFind( path );
+        if( it != states.constEnd() )
+            return it.value();
+
+        const int slash = path.lastIndexOf( QLatin1Char( '/' ) );
+        if( slash < 0 || path.length() == 1 )
+            return -1;
+        path = slash == 0 ? QString( QLatin1Char( '/' ) ) : path.left( slash );
+    }
+}
+
+/*!
+ \internal
+ Returns true if a file or directory inside the directory \a path is created or removed.
+ */
+static bool hasChangedDescendants( const QMap< QString, int >& states, const QString& path )
+{
+    const QString prefix = path.endsWith( QLatin1Char( '/' ) ) ? path : path + QLatin1Char( '/' );
+    const QMap< QString, int >::const_iterator it = states.lowerBound( prefix );
+    return it != states.constEnd() && it.key().startsWith( prefix );
+}
+
+/*!
+ \internal
+ Returns true if the paths of \a cost are affected by the changes in \a states.
+ */
+static bool dependsOnChanges( const QMap< QString, int >& states, const UpdateOperation::Cost& cost )
+{
+    const QStringList paths = cost.requiredPaths + cost.createdPaths + cost.removedPaths;
+    for( QStringList::const_iterator it = paths.begin(); it != paths.end(); ++it )
+    {
+        const QString path = normalizedPath( *it );
+        if( closestPathState( states, path ) != -1 || hasChangedDescendants( states, path ) )
+            return true;
+    }
+    return false;
+}
+
+static bool isInsideOrEqual( const QString& path, const QString& directory )
+{
+    return path == directory || path.startsWith( directory + QLatin1Char( '/' ) );
+}
+
+/*!
+ \internal
+ Returns true if \a step reads, creates, modifies or removes \a path, or something inside it.
+ Steps with an unknown cost touch everything.
+ */
+static bool touches( const InstallPlan::Step& step, const QString& path )
+{
+    const UpdateOperation::Cost& cost = step.cost;
+    if( !cost.known )
+        return true;
+
+    // requiring an ancestor to exist does not conflict with changes of path
+    for( QStringList::const_iterator it = cost.requiredPaths.begin(); it != cost.requiredPaths.end(); ++it )
+    {
+        if( isInsideOrEqual( normalizedPath( *it ), path ) )
+            return true;
+    }
+
+    QStringList changed = cost.createdPaths + cost.removedPaths;
+    const QString name = step.operation->name();
+    if( name == QLatin1String( "AppendFile" ) || name == QLatin1String( "PrependFile" ) )
+        changed << QDir( step.operation->workingDirectory() ).absoluteFilePath( step.operation->arguments().value( 0 ) );
+    for( QStringList::const_iterator it = changed.begin(); it != changed.end(); ++it )
+    {
+        const QString changedPath = normalizedPath( *it );
+        if( isInsideOrEqual( changedPath, path ) || isInsideOrEqual( path, changedPath ) )
+            return true;
+    }
+    return false;
+}
+
+static qint64 transferredBytes( const UpdateOperation::Cost& cost )
+{
+    return cost.known ? cost.bytesRead + cost.bytesWritten + cost.backupBytes : 0;
+}
+
+static QString statisticsFileName( const Target* target )
+{
+    return QDir( target->directory() ).absoluteFilePath( QLatin1String( ".kdupdater/InstallStatistics.xml" ) );
+}
+
+/*!
+ \internal
+ Returns the throughput measured while installing earlier updates of \a target, or 0 if none
+ was measured yet.
+ */
+static qint64 readThroughput( const Target* target )
+{
+    QFile file( statisticsFileName( target ) );
+    if( !file.open( QIODevice::ReadOnly ) )
+        return 0;
+
+    QDomDocument doc;
+    if( !doc.setContent( &file ) || doc.documentElement().tagName() != QLatin1String( "InstallStatistics" ) )
+        return 0;
+
+    return doc.documentElement().firstChildElement( QLatin1String( "Throughput" ) ).text().toLongLong();
+}
+
+static void writeThroughput( const Target* target, qint64 bytesPerSecond )
+{
+    const QString fileName = statisticsFileName( target );
+    QDir().mkpath( QFileInfo( fileName ).absolutePath() );
+
+    QDomDocument doc;
+    QDomElement root = doc.createElement( QLatin1String( "InstallStatistics" ) );
+    doc.appendChild( root );
+    QDomElement throughputE = doc.createElement( QLatin1String( "Throughput" ) );
+    throughputE.appendChild( doc.createTextNode( QString::number( bytesPerSecond ) ) );
+    root.appendChild( throughputE );
+
+    KDSaveFile file( fileName );
+    if( !file.open( QFile::WriteOnly ) )
+    {
+        qDebug() << "Cannot write install statistics to" << fileName;
+        return;
+    }
+
+    file.write( doc.toByteArray( 4 ) );
+    file.commit( KDSaveFile::OverwriteExistingFile );
+}
+
+class InstallPlan::Private
+{
+public:
+    explicit Private( InstallPlan* qq )
+        : q( qq ),
+          target( 0 ),
+          throughput( 0 ),
+          measuredThroughput( 0 ),
+          removedSteps( 0 ),
+          savedBytes( 0 )
+    {
+    }
+
+private:
+    InstallPlan* const q;
+
+public:
+    Target* target;
+    QVector<Step> steps;
+    QList<Update*> updates;
+    QList<UpdateOperation*> ownedOperations;
+    QStringList directories;
+    QString targetDirectory;
+    QString unpackDirectory;
+    QString errorString;
+    QStringList warnings;
+    qint64 throughput;
+    qint64 measuredThroughput;
+    int removedSteps;
+    qint64 savedBytes;
+
+    bool setError( const QString& msg )
+    {
+        errorString = msg;
+        return false;
+    }
+
+    QStringList placeholderValues( const QString& workingDirectory ) const;
+
+    bool isOptimizable( int index, const char* name ) const;
+    int nextStepTouching( int index, const QString& path ) const;
+    bool earlierStepTouches( int index, const QString& path ) const;
+    void replaceStep( int index, const QString& name, const QStringList& arguments );
+    void removeStep( int index );
+    bool optimizeStep( int index );
+};
+
+/*!
+ \internal
+ Returns the values of the placeholders in UpdateInstructions.xml, like {TARGETDIR}.
+ */
+QStringList InstallPlan::Private::placeholderValues( const QString& workingDirectory ) const
+{
+    QStringList values;
+    for( int i = 0; i < UpdateInstructions::PlaceholderCount; ++i )
+        values.append( QString() );
+
+    values[ UpdateInstructions::AppDir ] = QDir::toNativeSeparators( q->targetDirectory() ); // backwards compat
+    values[ UpdateInstructions::TargetDir ] = QDir::toNativeSeparators( q->targetDirectory() );
+    values[ UpdateInstructions::Home ] = QDir::toNativeSeparators( QDir::homePath() );
+    values[ UpdateInstructions::AppName ] = target->name(); // backwards compat
+    values[ UpdateInstructions::TargetName ] = target->name();
+    values[ UpdateInstructions::AppVersion ] = target->version(); // backwards compat
+    values[ UpdateInstructions::TargetVersion ] = target->version();
+    values[ UpdateInstructions::CurPath ] = QDir::toNativeSeparators( workingDirectory );
+    values[ UpdateInstructions::Root ] = QDir::toNativeSeparators( QDir::rootPath() );
+    values[ UpdateInstructions::Temp ] = QDir::toNativeSeparators( QDir::tempPath() );
+    return values;
+}
+
+/*!
+ \internal
+ Returns true if the step at \a index is a built-in operation \a name created by the plan.
+ The operations of the updates themselves are never changed.
+ */
+bool InstallPlan::Private::isOptimizable( int index, const char* name ) const
+{
+    const Step& step = steps.at( index );
+    return step.cost.known && step.operation->name() == QLatin1String( name ) && ownedOperations.contains( step.operation );
+}
+
+/*!
+ \internal
+ Returns the index of the first step after \a index touching \a path, or -1 if there is none.
+ */
+int InstallPlan::Private::nextStepTouching( int index, const QString& path ) const
+{
+    for( int next = index + 1; next < steps.count(); ++next )
+    {
+        if( touches( steps.at( next ), path ) )
+            return next;
+    }
+    return -1;
+}
+
+/*!
+ \internal
+ Returns true if a step before \a index touches \a path, which therefore may not be in the
+ state it is in now when the step at \a index is performed.
+ */
+bool InstallPlan::Private::earlierStepTouches( int index, const QString& path ) const
+{
+    for( int previous = 0; previous < index; ++previous )
+    {
+        if( touches( steps.at( previous ), path ) )
+            return true;
+    }
+    return false;
+}
+
+/*!
+ \internal
+ Replaces the operation of the step at \a index by a new operation \a name with \a arguments.
+ */
+void InstallPlan::Private::replaceStep( int index, const QString& name, const QStringList& arguments )
+{
+    Step& step = steps[ index ];
+    UpdateOperation* const operation = UpdateOperationFactory::instance().create( name, arguments, target );
+    if( !operation )
+        return;
+
+    operation->setWorkingDirectory( step.operation->workingDirectory() );
+    ownedOperations.removeAll( step.operation );
+    delete step.operation;
+    ownedOperations.append( operation );
+
+    step.operation = operation;
+    step.cost = operation->estimateCost();
+    step.expectedDuration = step.cost.known ? weightedBytes( step.cost ) * 1000 / q->throughput() : 0;
+}
+
+void InstallPlan::Private::removeStep( int index )
+{
+    ownedOperations.removeAll( steps.at( index ).operation );
+    delete steps.at( index ).operation;
+    steps.remove( index );
+    ++removedSteps;
+}
+
+/*!
+ \internal
+ Applies the first rule of \ref InstallPlan::optimize() matching the step at \a index. Returns
+ true if the step was changed or removed, such that the rules should be applied again.
+ */
+bool InstallPlan::Private::optimizeStep( int index )
+{
+    const Step& step = steps.at( index );
+    const QStringList args = step.operation->arguments();
+    const QString workingDirectory = step.operation->workingDirectory();
+
+    if( isOptimizable( index, "Mkdir" ) && args.count() == 1 )
+    {
+        // creating a directory that exists does nothing
+        const QString dirName = normalizedPath( MkdirOperation::directoryPath( workingDirectory, args.first() ) );
+        if( QFileInfo( dirName ).isDir() && !earlierStepTouches( index, dirName ) )
+        {
+            removeStep( index );
+            return true;
+        }
+        return false;
+    }
+
+    if( isOptimizable( index, "AppendFile" ) && ( args.count() == 2 || args.count() == 3 ) )
+    {
+        const QString fileName = normalizedPath( QDir( workingDirectory ).absoluteFilePath( args.first() ) );
+        const int next = nextStepTouching( index, fileName );
+        if( next < 0 || !isOptimizable( next, "AppendFile" ) || steps.at( next ).onError != step.onError )
+            return false;
+
+        // append both texts at once, if they are appended the same way
+        const QStringList nextArgs = steps.at( next ).operation->arguments();
+        const QString nextFileName = normalizedPath( QDir( steps.at( next ).operation->workingDirectory() ).absoluteFilePath( nextArgs.value( 0 ) ) );
+        if( nextFileName != fileName || nextArgs.count() != args.count() || nextArgs.value( 2 ) != args.value( 2 ) )
+            return false;
+
+        QStringList merged = args;
+        merged[ 1 ] += nextArgs.at( 1 );
+        removeStep( next );
+        replaceStep( index, QLatin1String( "AppendFile" ), merged );
+        return true;
+    }
+
+    if( !isOptimizable( index, "Copy" ) || args.count() != 2 )
+        return false;
+
+    const QString source = normalizedPath( QDir( workingDirectory ).absoluteFilePath( args.first() ) );
+    const QString dest = normalizedPath( QDir( workingDirectory ).absoluteFilePath( args.last() ) );
+    if( !QFileInfo( source ).isFile() || source == dest || earlierStepTouches( index, source ) || earlierStepTouches( index, dest ) )
+        return false;
+
+    // a copy that would fail must not be removed, nor turned into a move that succeeds
+    if( !step.operation->testOperation() )
+        return false;
+
+    const int next = nextStepTouching( index, dest );
+    if( next >= 0 && steps.at( next ).onError == QLatin1String( "Abort" ) )
+    {
+        const Step& nextStep = steps.at( next );
+        const QStringList nextArgs = nextStep.operation->arguments();
+        const QString nextWorkingDirectory = nextStep.operation->workingDirectory();
+
+        // a copy overwritten by the next copy to the same destination is not needed
+        if( isOptimizable( next, "Copy" ) && nextArgs.count() == 2 &&
+            normalizedPath( QDir( nextWorkingDirectory ).absoluteFilePath( nextArgs.last() ) ) == dest &&
+            normalizedPath( QDir( nextWorkingDirectory ).absoluteFilePath( nextArgs.first() ) ) != dest )
+        {
+            removeStep( index );
+            return true;
+        }
+
+        // neither is a copy deleted right away, only the file it replaced has to be deleted
+        if( isOptimizable( next, "Delete" ) && nextArgs.count() == 1 &&
+            normalizedPath( QDir( nextWorkingDirectory ).absoluteFilePath( nextArgs.first() ) ) == dest )
+        {
+            if( !QFileInfo( dest ).exists() )
+                removeStep( next );
+            removeStep( index );
+            return true;
+        }
+    }
+
+    // a copy whose source is deleted afterwards is a move, which renames the file
+    const int sourceNext = nextStepTouching( index, source );
+    if( sourceNext < 0 || !isOptimizable( sourceNext, "Delete" ) || steps.at( sourceNext ).onError != step.onError ||
+        ( next >= 0 && next < sourceNext ) )
+        return false;
+
+    const Step& deleteStep = steps.at( sourceNext );
+    if( normalizedPath( QDir( deleteStep.operation->workingDirectory() ).absoluteFilePath( deleteStep.operation->arguments().value( 0 ) ) ) != source )
+        return false;
+
+    removeStep( sourceNext );
+    replaceStep( index, QLatin1String( "Move" ), args );
+    return true;
+}
+
+/*!
+   Constructs an empty plan for installing updates of \a target.
+*/
+InstallPlan::InstallPlan( Target* target )
+    : d( new Private( this ) )
+{
+    d->target = target;
+    d->measuredThroughput = readThroughput( target );
+}
+
+/*!
+   Destructor. Deletes the operations of the plan and the directories the updates were
+   unpacked to.
+*/
+InstallPlan::~InstallPlan()
+{
+    clear();
+}
+
+/*!
+   Returns the target the updates are installed into.
+*/
+Target* InstallPlan::target() const
+{
+    return d->target;
+}
+
+/*!
+   Sets the directory the operations install into, the value of the {TARGETDIR} placeholder in
+   UpdateInstructions.xml, to \a directory. Pass an empty string to install into the directory
+   of the target again, which is the default. This only affects updates added afterwards.
+
+   \sa KDUpdater::UpdateInstaller::SwapDirectory
+*/
+void InstallPlan::setTargetDirectory( const QString& directory )
+{
+    d->targetDirectory = directory;
+}
+
+/*!
+   Returns the directory the operations install into.
+*/
+QString InstallPlan::targetDirectory() const
+{
+    return d->targetDirectory.isEmpty() ? d->target->directory() : d->targetDirectory;
+}
+
+/*!
+   Sets the directory updates are unpacked into to \a directory. The directory is created if it
+   does not exist. Pass an empty string to unpack updates next to their downloaded files again,
+   which is the default.
+
+   Copy and Move operations whose source is on another file system than their destination
+   have to copy the data, so an unpack directory on the file system of the target is faster,
+   and it does not need space on the file system of the temporary directory.
+*/
+void InstallPlan::setUnpackDirectory( const QString& directory )
+{
+    d->unpackDirectory = directory;
+}
+
+/*!
+   Returns the directory updates are unpacked into, or an empty string if they are unpacked
+   next to their downloaded files.
+*/
+QString InstallPlan::unpackDirectory() const
+{
+    return d->unpackDirectory;
+}
+
+/*!
+   Unpacks the downloaded \a update into the \ref unpackDirectory() and adds the operations of
+   its UpdateInstructions.xml, followed by the operations of \a update itself, see
+   \ref addInstructions(). Returns false and sets \ref errorString() if this fails.
+*/
+bool InstallPlan::addUpdate( Update* update )
+{
+    if( !update->isDownloaded() )
+        return d->setError( tr("Could not download update '%1'").arg( update->packageName() ) );
+
+    // Prepare a directory into which the UpdateFile will be unpacked.
+    // If update file is C:/Users/PRASHA~1/AppData/Local/Temp/qt_temp.Hp1204 and
+    // the target name "MyApplication"
+    // Then the directory would be %USERDIR%/AppData/Local/Temp/MyApplication_Update1
+    static QAtomicInt count;
+    const QString dirName = QString::fromLatin1("%1_Update%2").arg( d->target->name(), QString::number( count.fetchAndAddRelaxed( 1 ) ) );
+    const QString updateFile = update->downloadedFileName();
+    QDir dir( d->unpackDirectory.isEmpty() ? QFileInfo( updateFile ).absolutePath() : d->unpackDirectory );
+    if( !dir.mkpath( dirName ) )
+        return d->setError( tr("Could not create directory %1").arg( dir.absoluteFilePath( dirName ) ) );
+    dir.cd( dirName );
+    d->directories.append( dir.absolutePath() );
+
+    // Unpack the update file into the update directory
+    UFUncompressor uncompressor;
+    uncompressor.setFileName( updateFile );
+    uncompressor.setDestination( dir.absolutePath() );
+    if( !uncompressor.uncompress() )
+        return d->setError( tr("Couldn't uncompress update: %1").arg( uncompressor.errorString() ) );
+
+    // Find out the directory in which UpdateInstructions.xml can be found
+    QDir updateDir = dir;
+    while( !updateDir.exists(QLatin1String( "UpdateInstructions.xml" )) )
+    {
+        const QFileInfoList fiList = updateDir.entryInfoList( QDir::Dirs |QDir::NoDotAndDotDot );
+        if( fiList.isEmpty() )
+            return d->setError( tr("Could not find UpdateInstructions.xml for %1").arg( update->name() ) );
+
+        updateDir.cd(fiList.first().fileName());
+    }
+
+    return addInstructions( updateDir.absoluteFilePath( QLatin1String( "UpdateInstructions.xml" ) ), update );
+}
+
+/*!
+   Adds the operations listed in the UpdateInstructions.xml file \a fileName of \a update to the
+   plan, followed by the operations of \a update itself. Relative paths in the arguments of the
+   operations are resolved against the directory of \a fileName.
+
+   Operations which are not supported by \ref KDUpdater::UpdateOperationFactory are skipped and
+   added to \ref warnings() if their action on error is to continue. Otherwise this returns
+   false and sets \ref errorString(). The operations added before are kept in that case.
+*/
+bool InstallPlan::addInstructions( const QString& fileName, Update* update )
+{
+    const QString workingDirectory = QFileInfo( fileName ).absolutePath();
+    const QString updateName = update ? update->name() : fileName;
+
+    // Uses the compiled instructions embedded by ufcreator if available
+    UpdateInstructions instructions;
+    if( !instructions.load( fileName ) )
+        return d->setError( tr("Could not read UpdateInstructions.xml of %1").arg( updateName ) );
+
+    if( update && !d->updates.contains( update ) )
+        d->updates.append( update );
+
+    const QStringList values = d->placeholderValues( workingDirectory );
+    d->steps.reserve( d->steps.count() + instructions.count() + ( update ? update->operations().count() : 0 ) );
+
+    // Create the update operations
+    for( int index = 0; index < instructions.count(); ++index )
+    {
+        const QString operName = instructions.name( index );
+        const QString onError = instructions.onError( index );
+        const QStringList args = instructions.arguments( index, values );
+
+        // Fetch update operation
+        UpdateOperation* const updateOperation = UpdateOperationFactory::instance().create( operName, args, d->target );
+        if( !updateOperation )
+        {
+            const QString msg = tr( "Update operation %1 not supported" ).arg( operName );
+
+            // TODO: AskUser
+            if( onError == QLatin1String( "Continue" ) || onError == QLatin1String( "AskUser" ) )
+            {
+                d->warnings.append( msg );
+                continue;
+            }
+            return d->setError( msg );
+        }
+
+        updateOperation->setWorkingDirectory( workingDirectory );
+        d->ownedOperations.append( updateOperation );
+
+        Step step;
+        step.update = update;
+        step.operation = updateOperation;
+        step.onError = onError;
+        d->steps.append( step );
+    }
+
+    if( !update )
+        return true;
+
+    // The operations of the update itself, like changing the package version, come last
+    const QList<UpdateOperation*> operations = update->operations();
+    for( QList< UpdateOperation* >::const_iterator it = operations.begin(); it != operations.end(); ++it )
+    {
+        Step step;
+        step.update = update;
+        step.operation = *it;
+        step.onError = QLatin1String( "Abort" );
+        d->steps.append( step );
+    }
+
+    return true;
+}
+
+/*!
+   Removes all steps from the plan, deletes the operations it created and the directories
+   updates were unpacked to.
+*/
+void InstallPlan::clear()
+{
+    // deleting the operations removes their backups
+    qDeleteAll( d->ownedOperations );
+    d->ownedOperations.clear();
+    d->steps.clear();
+    d->updates.clear();
+    d->warnings.clear();
+    d->errorString.clear();
+    d->removedSteps = 0;
+    d->savedBytes = 0;
+
+    for( QStringList::const_iterator it = d->directories.begin(); it != d->directories.end(); ++it )
+        QDir( *it ).removeRecursively();
+    d->directories.clear();
+}
+
+/*!
+   Returns a human-readable description of the last error.
+*/
+QString InstallPlan::errorString() const
+{
+    return d->errorString;
+}
+
+/*!
+   Returns the messages about operations skipped while adding updates.
+*/
+QStringList InstallPlan::warnings() const
+{
+    return d->warnings;
+}
+
+/*!
+   Returns the updates added to the plan.
+*/
+QList<Update*> InstallPlan::updates() const
+{
+    return d->updates;
+}
+
+/*!
+   Returns the number of steps in the plan.
+*/
+int InstallPlan::stepCount() const
+{
+    return d->steps.count();
+}
+
+/*!
+   Returns the step at \a index, which must be in the range [0, \ref stepCount()).
+*/
+const InstallPlan::Step& InstallPlan::step( int index ) const
+{
+    return d->steps.at( index );
+}
+
+/*!
+   Sets the throughput used to compute the expected durations to \a bytesPerSecond. Pass 0 to
+   use the throughput measured while installing earlier updates again.
+*/
+void InstallPlan::setThroughput( qint64 bytesPerSecond )
+{
+    d->throughput = bytesPerSecond;
+}
+
+/*!
+   Returns the throughput used to compute the expected durations, in bytes per second.
+*/
+qint64 InstallPlan::throughput() const
+{
+    if( d->throughput > 0 )
+        return d->throughput;
+    return d->measuredThroughput > 0 ? d->measuredThroughput : DefaultThroughput;
+}
+
+/*!
+   Asks every operation for its cost in the current state of the file system and computes
+   the expected duration of the steps.
+*/
+void InstallPlan::estimateCosts()
+{
+    const qint64 bytesPerSecond = throughput();
+    for( QVector< Step >::iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+    {
+        it->cost = it->operation->estimateCost();
+        it->expectedDuration = it->cost.known ? weightedBytes( it->cost ) * 1000 / bytesPerSecond : 0;
+    }
+}
+
+/*!
+   Estimates the cost of all steps, see \ref estimateCosts(), and tests whether they will
+   succeed. Nothing is changed on disk. Returns true if no step is expected to fail.
+
+   A step is expected to fail if its operation requires a file which an earlier step removes,
+   or if \ref KDUpdater::UpdateOperation::testOperation() fails for reasons not explained by
+   files earlier steps create or remove. After an operation whose cost is unknown, like
+   Execute, which may change anything, failing tests are not reported.
+*/
+bool InstallPlan::dryRun()
+{
+    estimateCosts();
+
+    QMap< QString, int > states;
+    bool unknownChanges = false;
+    bool success = true;
+    for( QVector< Step >::iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+    {
+        Step& step = *it;
+        step.willFail = false;
+        step.errorString.clear();
+
+        for( QStringList::const_iterator pit = step.cost.requiredPaths.begin(); pit != step.cost.requiredPaths.end(); ++pit )
+        {
+            if( closestPathState( states, normalizedPath( *pit ) ) == PathRemoved )
+            {
+                step.willFail = true;
+                step.errorString = tr("%1 is removed by an earlier operation").arg( *pit );
+                break;
+            }
+        }
+
+        if( !step.willFail && !step.operation->testOperation() && !unknownChanges && !dependsOnChanges( states, step.cost ) )
+        {
+            step.willFail = true;
+            step.errorString = step.operation->errorString();
+        }
+        success = success && !step.willFail;
+
+        for( QStringList::const_iterator pit = step.cost.createdPaths.begin(); pit != step.cost.createdPaths.end(); ++pit )
+            states.insert( normalizedPath( *pit ), PathCreated );
+        for( QStringList::const_iterator pit = step.cost.removedPaths.begin(); pit != step.cost.removedPaths.end(); ++pit )
+            states.insert( normalizedPath( *pit ), PathRemoved );
+        unknownChanges = unknownChanges || !step.cost.known;
+    }
+    return success;
+}
+
+/*!
+   Removes and merges redundant steps, keeping the effect of the plan and the ability to undo
+   it. The costs have to be estimated before, see \ref estimateCosts(). As the rules depend on
+   which files exist, call this right before executing the plan.
+
+   \li A Mkdir of a directory that exists is removed.
+   \li A Copy of a file to a destination which the next step touching it copies another file
+   to is removed.
+   \li A Copy of a file to a destination which the next step touching it deletes is removed,
+   and so is the Delete, unless it deletes a file that existed before.
+   \li A Copy of a file followed by a Delete of its source is replaced by a Move, which renames
+   the file if possible.
+   \li Consecutive AppendFile operations on the same file, with nothing else touching it in
+   between, are merged into one.
+
+   Only operations created from UpdateInstructions.xml are changed, and only if no step with
+   an unknown cost, like Execute, comes in between, as it might use the files. Steps whose
+   failure would not abort the update are not removed in favor of them.
+
+   \sa removedSteps(), savedBytes()
+*/
+void InstallPlan::optimize()
+{
+    qint64 bytes = 0;
+    for( QVector< Step >::const_iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+        bytes += transferredBytes( it->cost );
+
+    for( int index = 0; index < d->steps.count(); )
+    {
+        if( !d->optimizeStep( index ) )
+            ++index;
+    }
+
+    for( QVector< Step >::const_iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+        bytes -= transferredBytes( it->cost );
+    d->savedBytes += bytes;
+}
+
+/*!
+   Returns the number of steps removed by \ref optimize().
+*/
+int InstallPlan::removedSteps() const
+{
+    return d->removedSteps;
+}
+
+/*!
+   Returns the number of bytes less to read, write and back up thanks to \ref optimize().
+*/
+qint64 InstallPlan::savedBytes() const
+{
+    return d->savedBytes;
+}
+
+/*!
+   Returns the number of bytes all steps read, see \ref estimateCosts().
+*/
+qint64 InstallPlan::bytesToRead() const
+{
+    qint64 bytes = 0;
+    for( QVector< Step >::const_iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+        bytes += it->cost.bytesRead;
+    return bytes;
+}
+
+/*!
+   Returns the number of bytes all steps write, not counting backups, see \ref estimateCosts().
+*/
+qint64 InstallPlan::bytesToWrite() const
+{
+    qint64 bytes = 0;
+    for( QVector< Step >::const_iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+        bytes += it->cost.bytesWritten;
+    return bytes;
+}
+
+/*!
+   Returns the disk space taken by the backups of all steps, see \ref estimateCosts().
+*/
+qint64 InstallPlan::backupSize() const
+{
+    qint64 bytes = 0;
+    for( QVector< Step >::const_iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+        bytes += it->cost.backupBytes;
+    return bytes;
+}
+
+/*!
+   Returns the number of files and directories all steps create, change or remove, see
+   \ref estimateCosts().
+*/
+int InstallPlan::filesTouched() const
+{
+    int files = 0;
+    for( QVector< Step >::const_iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+        files += it->cost.filesTouched;
+    return files;
+}
+
+/*!
+   Returns the expected duration of all steps in milliseconds, see \ref estimateCosts(). Steps
+   with an unknown cost are not included.
+*/
+qint64 InstallPlan::expectedDuration() const
+{
+    qint64 duration = 0;
+    for( QVector< Step >::const_iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+        duration += it->expectedDuration;
+    return duration;
+}
+
+/*!
+   Returns the number of steps expected to fail, see \ref dryRun().
+*/
+int InstallPlan::failingSteps() const
+{
+    int count = 0;
+    for( QVector< Step >::const_iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+    {
+        if( it->willFail )
+            ++count;
+    }
+    return count;
+}
+
+/*!
+   Returns the disk space the steps need on each file system, keyed by the root path of the file
+   system, see \ref estimateCosts(). The space needed for a step is the data it writes and its
+   backups, which are kept next to the files they belong to until the plan is destroyed. The
+   space freed by files the steps replace or remove is not taken into account, as it is only
+   freed once the backups are removed.
+
+   Steps with an unknown cost are not included.
+*/
+QMap<QString, qint64> InstallPlan::requiredSpace() const
+{
+    QMap<QString, qint64> space;
+    for( QVector< Step >::const_iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+    {
+        const UpdateOperation::Cost& cost = it->cost;
+        const qint64 bytes = cost.bytesWritten + cost.backupBytes;
+        if( !cost.known || bytes <= 0 )
+            continue;
+
+        // the data is written to the created file, or to the file changed in place
+        const QString path = !cost.createdPaths.isEmpty() ? cost.createdPaths.first() : cost.requiredPaths.value( 0 );
+        if( path.isEmpty() )
+            continue;
+        space[ fileSystemRoot( path ) ] += bytes;
+    }
+    return space;
+}
+
+/*!
+   Records that executing the plan took \a msecs milliseconds. The throughput computed from
+   this and the costs estimated before execution updates the throughput history of the target,
+   which later plans use for their expected durations.
+*/
+void InstallPlan::recordDuration( qint64 msecs )
+{
+    qint64 bytes = 0;
+    for( QVector< Step >::const_iterator it = d->steps.begin(); it != d->steps.end(); ++it )
+    {
+        if( it->cost.known )
+            bytes += weightedBytes( it->cost );
+    }
+    if( msecs < MinimumMeasuredDuration || bytes <= 0 )
+        return;
+
+    // average with the earlier measurements, such that a single slow install has little effect
+    const qint64 measured = bytes * 1000 / msecs;
+    const qint64 previous = readThroughput( d->target );
+    d->measuredThroughput = previous > 0 ? ( 3 * previous + measured ) / 4 : measured;
+    writeThroughput( d->target, d->measuredThroughput );
+}
+
+#ifdef KDTOOLSCORE_UNITTESTS
+
+#include <KDUnitTest/Test>
+
+#include <QUuid>
+
+static bool writeTestFile( const QString& fileName, const QByteArray& contents )
+{
+    QFile file( fileName );
+    return file.open( QIODevice::WriteOnly ) && file.write( contents ) == contents.size();
+}
+
+KDAB_UNITTEST_SIMPLE( InstallPlanOptimize, "kdupdater" ) {
+    const QDir dir( QDir::temp().filePath( QString::fromLatin1( "kdupdater-plan-test%1" ).arg( QUuid::createUuid().toString() ) ) );
+    assertTrue( QDir().mkpath( dir.filePath( QLatin1String( "existing" ) ) ) );
+    assertTrue( writeTestFile( dir.filePath( QLatin1String( "a" ) ), "a" ) );
+    assertTrue( writeTestFile( dir.filePath( QLatin1String( "c" ) ), "c" ) );
+    assertTrue( writeTestFile( dir.filePath( QLatin1String( "e" ) ), "e" ) );
+
+    // Mkdir resolves relative paths without working directory against the root, so does the rule
+    assertEqual( MkdirOperation::directoryPath( QString(), QLatin1String( "relative" ) ), QDir::root().absoluteFilePath( QLatin1String( "relative" ) ) );
+    assertEqual( MkdirOperation::directoryPath( dir.path(), QLatin1String( "existing" ) ), dir.filePath( QLatin1String( "existing" ) ) );
+
+    const QString instructions = dir.filePath( QLatin1String( "UpdateInstructions.xml" ) );
+    assertTrue( writeTestFile( instructions,
+        "<UpdateInstructions>"
+        "<UpdateOperation><Name>Mkdir</Name><Arg>existing</Arg></UpdateOperation>"
+        "<UpdateOperation><Name>Mkdir</Name><Arg>new</Arg></UpdateOperation>"
+        "<UpdateOperation><Name>Copy</Name><Arg>a</Arg><Arg>b</Arg></UpdateOperation>"
+        "<UpdateOperation><Name>Delete</Name><Arg>a</Arg></UpdateOperation>"
+        "<UpdateOperation><Name>Copy</Name><Arg>c</Arg><Arg>d</Arg></UpdateOperation>"
+        "<UpdateOperation><Name>Copy</Name><Arg>e</Arg><Arg>d</Arg></UpdateOperation>"
+        "<UpdateOperation><Name>AppendFile</Name><Arg>f</Arg><Arg>x</Arg></UpdateOperation>"
+        "<UpdateOperation><Name>AppendFile</Name><Arg>f</Arg><Arg>y</Arg></UpdateOperation>"
+        "</UpdateInstructions>" ) );
+
+    {
+        Target target;
+        target.setDirectory( dir.path() );
+        InstallPlan plan( &target );
+        assertTrue( plan.addInstructions( instructions ) );
+        assertEqual( plan.stepCount(), 8 );
+        plan.estimateCosts();
+        plan.optimize();
+
+        // the existing directory is not created, the copy and delete of a become a move, the
+        // copy overwritten right away is dropped and the appends are merged
+        assertEqual( plan.stepCount(), 4 );
+        assertEqual( plan.removedSteps(), 4 );
+        assertEqual( plan.step( 0 ).operation->name(), QString::fromLatin1( "Mkdir" ) );
+        assertEqual( plan.step( 0 ).operation->arguments(), QStringList() << QLatin1String( "new" ) );
+        assertEqual( plan.step( 1 ).operation->name(), QString::fromLatin1( "Move" ) );
+        assertEqual( plan.step( 1 ).operation->arguments(), QStringList() << QLatin1String( "a" ) << QLatin1String( "b" ) );
+        assertEqual( plan.step( 2 ).operation->name(), QString::fromLatin1( "Copy" ) );
+        assertEqual( plan.step( 2 ).operation->arguments(), QStringList() << QLatin1String( "e" ) << QLatin1String( "d" ) );
+        assertEqual( plan.step( 3 ).operation->name(), QString::fromLatin1( "AppendFile" ) );
+        assertEqual( plan.step( 3 ).operation->arguments(), QStringList() << QLatin1String( "f" ) << QLatin1String( "xy" ) );
+
+        // nothing is changed on disk
+        assertTrue( QFile::exists( dir.filePath( QLatin1String( "a" ) ) ) );
+        assertFalse( QFile::exists( dir.filePath( QLatin1String( "b" ) ) ) );
+        assertFalse( QFile::exists( dir.filePath( QLatin1String( "new" ) ) ) );
+    }
+
+    assertTrue( QDir( dir.path() ).removeRecursively() );
+}
+
+#endif // KDTOOLSCORE_UNITTESTS
@@ -0,0 +1,106 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#ifndef __KDTOOLS_KDUPDATERINSTALLPLAN_H__
+#define __KDTOOLS_KDUPDATERINSTALLPLAN_H__
+
+#include "kdupdater.h"
+#include "kdupdaterupdateoperation.h"
+#include <pimpl_ptr.h>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QList>
+#include <QtCore/QMap>
+#include <QtCore/QStringList>
+
+namespace KDUpdater
+{
+    class Target;
+    class Update;
+
+    class KDUPDATER_EXPORT InstallPlan
+    {
+        Q_DECLARE_TR_FUNCTIONS(KDUpdater::InstallPlan)
+
+    public:
+        struct KDUPDATER_EXPORT Step
+        {
+            Step();
+
+            Update* update;
+            UpdateOperation* operation;
+            QString onError;
+
+            UpdateOperation::Cost cost;
+            qint64 expectedDuration;
+            bool willFail;
+            QString errorString;
+        };
+
+        explicit InstallPlan( Target * target );
+        ~InstallPlan();
+
+        Target * target() const;
+
+        void setTargetDirectory( const QString& directory );
+        QString targetDirectory() const;
+
+        void setUnpackDirectory( const QString& directory );
+        QString unpackDirectory() const;
+
+        bool addUpdate( Update * update );
+        bool addInstructions( const QString& fileName, Update * update=0 );
+        void clear();
+
+        QString errorString() const;
+        QStringList warnings() const;
+
+        QList<Update*> updates() const;
+        int stepCount() const;
+        const Step& step( int index ) const;
+
+        void setThroughput( qint64 bytesPerSecond );
+        qint64 throughput() const;
+
+        void estimateCosts();
+        bool dryRun();
+        void optimize();
+
+        qint64 bytesToRead() const;
+        qint64 bytesToWrite() const;
+        qint64 backupSize() const;
+        int filesTouched() const;
+        qint64 expectedDuration() const;
+        int failingSteps() const;
+        int removedSteps() const;
+        qint64 savedBytes() const;
+        QMap<QString, qint64> requiredSpace() const;
+
+        void recordDuration( qint64 msecs );
+
+    private:
+        class Private;
+        kdtools::pimpl_ptr< Private > d;
+    };
+}
+
+#endif
@@ -0,0 +1,670 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#include "kdupdateroperationjournal_p.h"
+#include "kdupdaterpackagesinfo.h"
+#include "kdupdatertarget.h"
+#include "kdupdaterupdateoperation.h"
+#include "kdupdaterupdateoperationfactory.h"
+#include "kdupdaterupdateoperations_p.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QDomDocument>
+#include <QFile>
+#include <QFileInfo>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QStringList>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace KDUpdater;
+
+/*!
+   \internal
+   \class KDUpdater::OperationJournal kdupdateroperationjournal_p.h
+   \brief Persistent log of the update operations performed by \ref KDUpdater::UpdateInstaller
+
+   The journal is an append-only file with one record per step: an update begins, an operation
+   was backed up and is about to be performed, was performed, was undone, and an update was
+   committed or rolled back. Operations are stored via \ref KDUpdater::UpdateOperation::toXml(),
+   including the names of their backup files.
+
+   If the installing process dies, \ref recover() uses the journal on the next run: updates that
+   were committed are rolled forward, which redoes their changes to the packages info as these
+   may not have been written yet. Updates that were interrupted are rolled back by undoing
+   their operations, last one first. An operation interrupted before it was recorded as
+   performed may have run completely, partially or not at all, so it is not undone; instead,
+   the state from before it is restored from its backup. Afterwards the backups are removed
+   with the operations.
+
+   Each record is written to the operating system right away, which makes the journal survive
+   the process being killed. Only the records ending an update are flushed to disk with fsync,
+   so the journal costs one disk flush per update rather than per operation.
+
+   Records are framed by their size and a checksum, a record torn by a crash while it was being
+   written is ignored.
+*/
+
+static const char JournalMagic[] = "KDUJ";
+static const quint32 JournalVersion = 1;
+
+enum RecordType
+{
+    BeginUpdateRecord = 1,
+    OperationStartedRecord,
+    OperationPerformedRecord,
+    OperationUndoneRecord,
+    UpdateCommittedRecord,
+    UpdateAbortedRecord
+};
+
+/*!
+   \internal A record of the journal.
+ */
+struct JournalRecord
+{
+    JournalRecord() : type( 0 ), update( -1 ), index( -1 ) {}
+
+    quint8 type;
+    qint32 update;
+    qint32 index;
+    QString name;
+    QString workingDirectory;
+    QString xml;
+};
+
+/*!
+   \internal The last known state of an operation of an update in the journal.
+ */
+struct JournaledOperation
+{
+    JournaledOperation() : performed( false ), undone( false ) {}
+
+    QString name;
+    QString workingDirectory;
+    QString xml;
+    bool performed;
+    bool undone;
+};
+
+/*!
+   \internal An update in the journal, with its operations by index.
+ */
+struct JournaledUpdate
+{
+    JournaledUpdate() : type( BeginUpdateRecord ) {}
+
+    QString name;
+    int type;
+    QMap<int, JournaledOperation> operations;
+};
+
+static JournalRecord operationRecord( RecordType type, int update, int index, const UpdateOperation* operation )
+{
+    JournalRecord record;
+    record.type = type;
+    record.update = update;
+    record.index = index;
+    record.name = operation->name();
+    record.workingDirectory = operation->workingDirectory();
+    record.xml = operation->toXml().toString( -1 );
+    return record;
+}
+
+/*!
+   \internal Flushes \a file to disk.
+ */
+static void syncFile( QFile& file )
+{
+    file.flush();
+#ifdef Q_OS_WIN
+    FlushFileBuffers( reinterpret_cast< HANDLE >( _get_osfhandle( file.handle() ) ) );
+#else
+    ::fsync( file.handle() );
+#endif
+}
+
+/*!
+   \internal Reads all complete records of the journal \a fileName into \a records.
+ */
+static bool readRecords( const QString& fileName, QList<JournalRecord>* records, QString* errorString )
+{
+    QFile file( fileName );
+    if( !file.open( QIODevice::ReadOnly ) )
+    {
+        *errorString = OperationJournal::tr( "Cannot read the installation journal %1: %2" ).arg( fileName, file.errorString() );
+        return false;
+    }
+
+    QDataStream stream( &file );
+    char magic[ 4 ];
+    quint32 version = 0;
+    if( stream.readRawData( magic, 4 ) == 4 && qstrncmp( magic, JournalMagic, 4 ) == 0 )
+        stream >> version;
+    if( version != JournalVersion )
+    {
+        *errorString = OperationJournal::tr( "%1 is no installation journal" ).arg( fileName );
+        return false;
+    }
+
+    while( !stream.atEnd() )
+    {
+        quint32 size = 0;
+        stream >> size;
+        if( stream.status() != QDataStream::Ok || size > quint32( file.bytesAvailable() ) )
+            break; // torn by a crash
+
+        QByteArray payload( int( size ), Qt::Uninitialized );
+        quint16 checksum = 0;
+        if( stream.readRawData( payload.data(), payload.size() ) != payload.size() )
+            break;
+        stream >> checksum;
+        if( stream.status() != QDataStream::Ok || checksum != qChecksum( payload.constData(), payload.size() ) )
+            break;
+
+        JournalRecord record;
+        QDataStream recordStream( payload );
+        recordStream >> record.type >> record.update >> record.index >> record.name >> record.workingDirectory >> record.xml;
+        records->append( record );
+    }
+
+    return true;
+}
+
+/*!
+   \internal Recreates the journaled operation \a journaled, or returns 0 if that is not possible.
+ */
+static UpdateOperation* restoreOperation( const JournaledOperation& journaled, Target* target )
+{
+    UpdateOperation* const operation = UpdateOperationFactory::instance().create( journaled.name, QStringList(), target );
+    if( !operation )
+        return 0;
+
+    if( !operation->fromXml( journaled.xml ) )
+    {
+        delete operation;
+        return 0;
+    }
+
+    operation->setWorkingDirectory( journaled.workingDirectory );
+    return operation;
+}
+
+//
+// OperationJournal::Private
+//
+class OperationJournal::Private
+{
+public:
+    explicit Private( const QString& fn )
+        : fileName( fn ),
+          nextUpdate( 0 )
+    {
+    }
+
+    QString fileName;
+    QString errorString;
+    QFile file;
+    QMutex mutex;
+    int nextUpdate;
+
+    void append( const JournalRecord& record, bool sync );
+};
+
+/*!
+   \internal Appends \a record to the journal, and flushes it to disk if \a sync is true.
+   The caller holds the mutex.
+ */
+void OperationJournal::Private::append( const JournalRecord& record, bool sync )
+{
+    if( !file.isOpen() )
+        return;
+
+    QByteArray payload;
+    {
+        QDataStream stream( &payload, QIODevice::WriteOnly );
+        stream << record.type << record.update << record.index << record.name << record.workingDirectory << record.xml;
+    }
+
+    QByteArray data;
+    QDataStream stream( &data, QIODevice::WriteOnly );
+    stream << quint32( payload.size() );
+    stream.writeRawData( payload.constData(), payload.size() );
+    stream << qChecksum( payload.constData(), payload.size() );
+
+    if( file.write( data ) != data.size() || !file.flush() )
+        errorString = tr( "Cannot write the installation journal %1: %2" ).arg( fileName, file.errorString() );
+    else if( sync )
+        syncFile( file );
+}
+
+/*!
+   Creates a journal in the file \a fileName. The file is not touched before \ref open().
+*/
+OperationJournal::OperationJournal( const QString& fileName )
+    : d( new Private( fileName ) )
+{
+}
+
+/*!
+   Destructor. The journal file is kept unless \ref remove() was called.
+*/
+OperationJournal::~OperationJournal()
+{
+}
+
+/*!
+   Returns the file name of the journal of installations into \a target.
+*/
+QString OperationJournal::defaultFileName( const Target* target )
+{
+    return QDir( target->directory() ).absoluteFilePath( QLatin1String( ".kdupdater/journal" ) );
+}
+
+/*!
+   Returns the file name of the journal.
+*/
+QString OperationJournal::fileName() const
+{
+    return d->fileName;
+}
+
+/*!
+   Returns a description of the last error.
+*/
+QString OperationJournal::errorString() const
+{
+    return d->errorString;
+}
+
+/*!
+   Creates an empty journal file, replacing an existing one. Returns false if the file
+   cannot be written; all records are then dropped.
+*/
+bool OperationJournal::open()
+{
+    const QMutexLocker locker( &d->mutex );
+
+    const QString path = QFileInfo( d->fileName ).absolutePath();
+    if( !QDir().mkpath( path ) )
+    {
+        d->errorString = tr( "Cannot create directory %1" ).arg( path );
+        return false;
+    }
+
+    d->file.setFileName( d->fileName );
+    if( !d->file.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+    {
+        d->errorString = tr( "Cannot write the installation journal %1: %2" ).arg( d->fileName, d->file.errorString() );
+        return false;
+    }
+
+    QDataStream stream( &d->file );
+    stream.writeRawData( JournalMagic, 4 );
+    stream << JournalVersion;
+    syncFile( d->file );
+    return true;
+}
+
+/*!
+   Returns true if records are written to the journal file.
+*/
+bool OperationJournal::isOpen() const
+{
+    return d->file.isOpen();
+}
+
+/*!
+   Closes and deletes the journal file. Called once all updates are either committed or rolled
+   back and the packages info was written.
+*/
+void OperationJournal::remove()
+{
+    const QMutexLocker locker( &d->mutex );
+    if( d->file.isOpen() )
+        d->file.close();
+    QFile::remove( d->fileName );
+}
+
+/*!
+   Records that the installation of the update \a updateName begins. Returns the id of the
+   update for the following records.
+*/
+int OperationJournal::beginUpdate( const QString& updateName )
+{
+    const QMutexLocker locker( &d->mutex );
+    JournalRecord record;
+    record.type = BeginUpdateRecord;
+    record.update = d->nextUpdate++;
+    record.name = updateName;
+    d->append( record, false );
+    return record.update;
+}
+
+/*!
+   Records that \a operation, the operation at \a index of \a update, was backed up and is about
+   to be performed.
+*/
+void OperationJournal::operationStarted( int update, int index, const UpdateOperation* operation )
+{
+    const JournalRecord record = operationRecord( OperationStartedRecord, update, index, operation );
+    const QMutexLocker locker( &d->mutex );
+    d->append( record, false );
+}
+
+/*!
+   Records that \a operation, the operation at \a index of \a update, was performed.
+*/
+void OperationJournal::operationPerformed( int update, int index, const UpdateOperation* operation )
+{
+    const JournalRecord record = operationRecord( OperationPerformedRecord, update, index, operation );
+    const QMutexLocker locker( &d->mutex );
+    d->append( record, false );
+}
+
+/*!
+   Records that the operation at \a index of \a update was undone.
+*/
+void OperationJournal::operationUndone( int update, int index )
+{
+    const QMutexLocker locker( &d->mutex );
+    JournalRecord record;
+    record.type = OperationUndoneRecord;
+    record.update = update;
+    record.index = index;
+    d->append( record, false );
+}
+
+/*!
+   Records that the installation of \a update ended, either \a committed or rolled back, and
+   flushes the journal to disk.
+*/
+void OperationJournal::endUpdate( int update, bool committed )
+{
+    const QMutexLocker locker( &d->mutex );
+    JournalRecord record;
+    record.type = committed ? UpdateCommittedRecord : UpdateAbortedRecord;
+    record.update = update;
+    d->append( record, true );
+}
+
+/*!
+   \enum KDUpdater::OperationJournal::RecoveryMode
+   How \ref recover() treats the updates that were committed
+*/
+
+/*!
+   \var KDUpdater::OperationJournal::RecoveryMode KDUpdater::OperationJournal::RollForwardCommitted
+   Committed updates are completed, interrupted ones are rolled back. This is for
+   installations in place.
+*/
+
+/*!
+   \var KDUpdater::OperationJournal::RecoveryMode KDUpdater::OperationJournal::RollBackAll
+   All updates are rolled back. This is for installations into a copy of the target directory
+   that did not replace the target directory yet.
+*/
+
+/*!
+   Completes an installation into \a target that was interrupted, as recorded in the journal
+   \a fileName, and deletes the journal. Does nothing if there is no journal. The packages info
+   of \a target is changed in memory only; the caller writes it to disk. \a mode tells whether
+   committed updates are rolled forward or back.
+
+   Returns false if the journal could not be read or an operation could not be rolled forward
+   or back. The problems are added to \a errors.
+*/
+bool OperationJournal::recover( const QString& fileName, Target* target, QStringList* errors, RecoveryMode mode )
+{
+    if( !QFile::exists( fileName ) )
+        return true;
+
+    QList<JournalRecord> records;
+    QString errorString;
+    if( !readRecords( fileName, &records, &errorString ) )
+    {
+        errors->append( errorString );
+        QFile::remove( fileName );
+        return false;
+    }
+
+    // Collect the last known state of every update and its operations
+    QMap<int, JournaledUpdate> updates;
+    for( QList< JournalRecord >::const_iterator it = records.begin(); it != records.end(); ++it )
+    {
+        JournaledUpdate& update = updates[ it->update ];
+        switch( it->type )
+        {
+        case BeginUpdateRecord:
+            update.name = it->name;
+            break;
+        case OperationStartedRecord:
+        case OperationPerformedRecord:
+        {
+            JournaledOperation& operation = update.operations[ it->index ];
+            operation.name = it->name;
+            operation.workingDirectory = it->workingDirectory;
+            operation.xml = it->xml;
+            operation.performed = it->type == OperationPerformedRecord;
+            break;
+        }
+        case OperationUndoneRecord:
+            update.operations[ it->index ].undone = true;
+            break;
+        case UpdateCommittedRecord:
+        case UpdateAbortedRecord:
+            update.type = it->type;
+            break;
+        }
+    }
+
+    bool success = true;
+
+    // Roll forward the committed updates. Their files are in place, but their changes to
+    // the packages info may not have been written.
+    for( QMap< int, JournaledUpdate >::const_iterator it = updates.begin(); it != updates.end(); ++it )
+    {
+        if( it->type != UpdateCommittedRecord || mode == RollBackAll )
+            continue;
+
+        for( QMap< int, JournaledOperation >::const_iterator oit = it->operations.begin(); oit != it->operations.end(); ++oit )
+        {
+            if( oit->undone )
+                continue;
+
+            UpdateOperation* const operation = restoreOperation( *oit, target );
+            if( !operation )
+            {
+                errors->append( tr( "Cannot restore operation %1 of %2" ).arg( oit->name, it->name ) );
+                success = false;
+                continue;
+            }
+
+            if( oit->name == QLatin1String( "UpdatePackage" ) || oit->name == QLatin1String( "UpdateCompatLevel" ) )
+            {
+                if( !operation->performOperation() )
+                {
+                    errors->append( tr( "Cannot redo '%1' of %2: %3" ).arg( operation->operationCommand(), it->name, operation->errorString() ) );
+                    success = false;
+                }
+            }
+
+            // this removes the backups
+            delete operation;
+        }
+    }
+
+    // Roll back the interrupted updates, or all of them, last one first
+    for( QMap< int, JournaledUpdate >::const_iterator it = updates.end(); it != updates.begin(); )
+    {
+        --it;
+        if( it->type == UpdateCommittedRecord && mode == RollForwardCommitted )
+            continue;
+
+        QMap< int, JournaledOperation >::const_iterator oit = it->operations.end();
+        while( oit != it->operations.begin() )
+        {
+            --oit;
+            UpdateOperation* const operation = restoreOperation( *oit, target );
+            if( !operation )
+            {
+                errors->append( tr( "Cannot restore operation %1 of %2" ).arg( oit->name, it->name ) );
+                success = false;
+                continue;
+            }
+
+            // Aborted updates were rolled back already, only their backups are left
+            if( it->type != UpdateAbortedRecord && !oit->undone )
+            {
+                if( oit->performed && !operation->undoOperation() )
+                {
+                    errors->append( tr( "Cannot undo '%1' of %2: %3" ).arg( operation->operationCommand(), it->name, operation->errorString() ) );
+                    success = false;
+                }
+
+                InterruptibleOperation* const interrupted = dynamic_cast< InterruptibleOperation* >( operation );
+                if( !oit->performed && interrupted && !interrupted->restoreBackup() )
+                {
+                    errors->append( tr( "Cannot restore the backup of '%1' of %2: %3" ).arg( operation->operationCommand(), it->name, operation->errorString() ) );
+                    success = false;
+                }
+            }
+
+            delete operation;
+        }
+    }
+
+    QFile::remove( fileName );
+    return success;
+}
+
+#ifdef KDTOOLSCORE_UNITTESTS
+
+#include <KDUnitTest/Test>
+
+#include <QUuid>
+
+static bool writeTestFile( const QString& fileName, const QByteArray& contents )
+{
+    QFile file( fileName );
+    return file.open( QIODevice::WriteOnly ) && file.write( contents ) == contents.size();
+}
+
+static QByteArray readTestFile( const QString& fileName )
+{
+    QFile file( fileName );
+    return file.open( QIODevice::ReadOnly ) ? file.readAll() : QByteArray();
+}
+
+/*!
+   \internal
+   Journals \a operation as started, and as performed if \a performed is true, then drops the
+   journal without ending the update, like a killed installer does.
+ */
+static void journalInterruptedOperation( const QString& journalFile, UpdateOperation* operation, bool performed )
+{
+    OperationJournal journal( journalFile );
+    journal.open();
+    const int update = journal.beginUpdate( QLatin1String( "test" ) );
+    operation->backup();
+    journal.operationStarted( update, 0, operation );
+    if( performed )
+    {
+        operation->performOperation();
+        journal.operationPerformed( update, 0, operation );
+    }
+}
+
+KDAB_UNITTEST_SIMPLE( OperationJournal, "kdupdater" ) {
+    const QDir dir( QDir::temp().filePath( QString::fromLatin1( "kdupdater-journal-test%1" ).arg( QUuid::createUuid().toString() ) ) );
+    assertTrue( QDir().mkpath( dir.path() ) );
+    const QString journalFile = dir.filePath( QLatin1String( "journal" ) );
+    const QString source = dir.filePath( QLatin1String( "source" ) );
+    const QString dest = dir.filePath( QLatin1String( "dest" ) );
+    QStringList errors;
+
+    {
+        // killed between backing up and performing a Move: the untouched destination
+        // must not be moved over the source
+        assertTrue( writeTestFile( source, "new" ) );
+        assertTrue( writeTestFile( dest, "old" ) );
+        UpdateOperation* const move = UpdateOperationFactory::instance().create( QLatin1String( "Move" ), QStringList() << source << dest, 0 );
+        journalInterruptedOperation( journalFile, move, false );
+        assertTrue( OperationJournal::recover( journalFile, 0, &errors ) );
+        assertTrue( errors.isEmpty() );
+        assertEqual( readTestFile( source ), QByteArray( "new" ) );
+        assertEqual( readTestFile( dest ), QByteArray( "old" ) );
+        assertFalse( QFile::exists( journalFile ) );
+        delete move;
+    }
+    {
+        // killed after performing the Move, before it was recorded as performed
+        UpdateOperation* const move = UpdateOperationFactory::instance().create( QLatin1String( "Move" ), QStringList() << source << dest, 0 );
+        move->backup();
+        {
+            OperationJournal journal( journalFile );
+            assertTrue( journal.open() );
+            const int update = journal.beginUpdate( QLatin1String( "test" ) );
+            journal.operationStarted( update, 0, move );
+            assertTrue( move->performOperation() );
+        }
+        assertEqual( readTestFile( dest ), QByteArray( "new" ) );
+        assertTrue( OperationJournal::recover( journalFile, 0, &errors ) );
+        assertTrue( errors.isEmpty() );
+        assertEqual( readTestFile( source ), QByteArray( "new" ) );
+        assertEqual( readTestFile( dest ), QByteArray( "old" ) );
+        delete move;
+    }
+    {
+        // killed after the Move was recorded as performed: it is undone
+        UpdateOperation* const move = UpdateOperationFactory::instance().create( QLatin1String( "Move" ), QStringList() << source << dest, 0 );
+        journalInterruptedOperation( journalFile, move, true );
+        assertTrue( OperationJournal::recover( journalFile, 0, &errors ) );
+        assertTrue( errors.isEmpty() );
+        assertEqual( readTestFile( source ), QByteArray( "new" ) );
+        assertEqual( readTestFile( dest ), QByteArray( "old" ) );
+        delete move;
+    }
+    {
+        // killed before a Copy to a new file: there is nothing to undo
+        const QString copy = dir.filePath( QLatin1String( "copy" ) );
+        UpdateOperation* const operation = UpdateOperationFactory::instance().create( QLatin1String( "Copy" ), QStringList() << source << copy, 0 );
+        journalInterruptedOperation( journalFile, operation, false );
+        assertTrue( OperationJournal::recover( journalFile, 0, &errors ) );
+        assertTrue( errors.isEmpty() );
+        assertFalse( QFile::exists( copy ) );
+        assertEqual( readTestFile( source ), QByteArray( "new" ) );
+        delete operation;
+    }
+
+    assertTrue( QDir( dir.path() ).removeRecursively() );
+}
+
+#endif // KDTOOLSCORE_UNITTESTS
@@ -0,0 +1,78 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#ifndef __KDTOOLS_KDUPDATEROPERATIONJOURNAL_P_H__
+#define __KDTOOLS_KDUPDATEROPERATIONJOURNAL_P_H__
+
+#include "kdupdater.h"
+#include <pimpl_ptr.h>
+
+#include <QtCore/QCoreApplication>
+
+QT_BEGIN_NAMESPACE
+class QString;
+class QStringList;
+QT_END_NAMESPACE
+
+namespace KDUpdater
+{
+    class Target;
+    class UpdateOperation;
+
+    class OperationJournal
+    {
+        Q_DECLARE_TR_FUNCTIONS(KDUpdater::OperationJournal)
+
+    public:
+        enum RecoveryMode
+        {
+            RollForwardCommitted,
+            RollBackAll
+        };
+
+        explicit OperationJournal( const QString& fileName );
+        ~OperationJournal();
+
+        static QString defaultFileName( const Target* target );
+
+        QString fileName() const;
+        QString errorString() const;
+
+        bool open();
+        bool isOpen() const;
+        void remove();
+
+        int beginUpdate( const QString& updateName );
+        void operationStarted( int update, int index, const UpdateOperation* operation );
+        void operationPerformed( int update, int index, const UpdateOperation* operation );
+        void operationUndone( int update, int index );
+        void endUpdate( int update, bool committed );
+
+        static bool recover( const QString& fileName, Target* target, QStringList* errors, RecoveryMode mode = RollForwardCommitted );
+
+    private:
+        class Private;
+        kdtools::pimpl_ptr< Private > d;
+    };
+}
+
+#endif
@@ -22,6 +22,7 @@
 
 #include "kdupdaterpackagesinfo.h"
 #include "kdupdatertarget.h"
+#include "kdupdaterupdatesinfo_p.h"
 
 #include <QFileInfo>
 #include <QDomDocument>
@@ -505,7 +506,7 @@ void PackagesInfo::Private::addPackageFrom(const QDomElement& packageE)
             continue;
 
         if( childNodeE.tagName() == QLatin1String( "Name" ) )
-            info.name = childNodeE.text();
+            info.name = internString( childNodeE.text() );
         else if( childNodeE.tagName() == QLatin1String( "Pixmap" ) )
             info.pixmap = childNodeE.text();
         else if( childNodeE.tagName() == QLatin1String( "Title" ) )
@@ -513,11 +514,15 @@ void PackagesInfo::Private::addPackageFrom(const QDomElement& packageE)
         else if( childNodeE.tagName() == QLatin1String( "Description" ) )
             info.description = childNodeE.text();
         else if( childNodeE.tagName() == QLatin1String( "Version" ) )
-            info.version = childNodeE.text();
+            info.version = internString( childNodeE.text() );
         else if( childNodeE.tagName() == QLatin1String( "Size" ) )
             info.uncompressedSize = childNodeE.text().toULongLong();
         else if( childNodeE.tagName() == QLatin1String( "Dependencies" ) )
+        {
             info.dependencies = childNodeE.text().split( QLatin1String( "," ), QString::SkipEmptyParts );
+            for( QStringList::iterator it = info.dependencies.begin(); it != info.dependencies.end(); ++it )
+                *it = internString( *it );
+        }
         else if( childNodeE.tagName() == QLatin1String( "LastUpdateDate" ) )
             info.lastUpdateDate = QDate::fromString(childNodeE.text(), Qt::ISODate);
         else if( childNodeE.tagName() == QLatin1String( "InstallDate" ) )
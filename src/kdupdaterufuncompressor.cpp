@@ -22,6 +22,8 @@
 
 #include "kdupdaterufuncompressor_p.h"
 #include "kdupdaterufcompresscommon_p.h"
+#include "kdupdaterfilewritebatch_p.h"
+#include "kdupdaterfileutils_p.h"
 
 #include <QCryptographicHash>
 #include <QDir>
@@ -31,10 +33,12 @@
 #include <QDebug>
 #include <QDataStream>
 
-#include <kdsavefile.h>
-
 using namespace KDUpdater;
 
+// Limits of the files written at once, see KDUpdater::FileWriteBatch
+static const qint64 MaxBatchSize = 32 * 1024 * 1024;
+static const int MaxBatchFiles = 1024;
+
 class UFUncompressor::Private
 {
 public:
@@ -118,7 +122,8 @@ bool UFUncompressor::uncompress()
     const QDir dir(d->destination);
 //    QFSFileEngine fileEngine;
 
-    // Lets create the required directory structure
+    // Lets create the required directory structure, relative to the parent directories
+    DirectoryHandles directoryHandles;
     int numExpectedFiles = 0;
     for(int i=0; i<header.fileList.count(); i++)
     {
@@ -126,9 +131,10 @@ bool UFUncompressor::uncompress()
         // qDebug("ToUncompress %s", qPrintable(fileName));
         if( header.isDirList[i] )
         {
-            if ( !dir.mkpath( fileName ) )
+            QString errorString;
+            if ( !createDirectoryAt( &directoryHandles, dir.filePath( fileName ), &errorString ) )
             {
-                d->setError(tr("Could not create folder: %1/%2").arg( d->destination, fileName ));
+                d->setError(tr("Could not create folder: %1/%2: %3").arg( d->destination, fileName, errorString ));
                 return false;
             }
 //            fileEngine.setFileName( QString(QLatin1String( "%1/%2" )).arg(d->destination, fileName) );
@@ -138,7 +144,8 @@ bool UFUncompressor::uncompress()
         }
     }
 
-    // Lets now create files within these directories
+    // Lets now create files within these directories, many at once
+    FileWriteBatch batch;
     int numActualFiles = 0;
     while( !ufDS.atEnd() && numActualFiles < numExpectedFiles )
     {
@@ -167,44 +174,26 @@ bool UFUncompressor::uncompress()
         }
     
 
-        KDSaveFile ufeFile( completeFileName );
-        if ( !ufeFile.open( QFile::WriteOnly ) )
-        {
-            d->setError(tr("Could not open file %1 for writing: %2").arg( completeFileName, ufeFile.errorString() ));
-            return false;
-        }
-        
-        
-        const char* const data = ba.constData();
-        const qint64 total = ba.size();
-        qint64 written = 0;
-        
-        while ( written < total )
+        const QFile::Permissions perm = static_cast< QFile::Permissions >( static_cast< QFile::Permissions::Int > ( ufEntry.permissions ) );
+        batch.addFile( completeFileName, ba, perm );
+        ++numActualFiles;
+
+        if( batch.byteCount() >= MaxBatchSize || batch.fileCount() >= MaxBatchFiles )
         {
-            const qint64 num = ufeFile.write( data+written, total-written );
-            if ( num == -1 )
+            if( !batch.commit() )
             {
-                d->setError( tr("Failed writing uncompressed data to %1: %2").arg( completeFileName, ufeFile.errorString() ) );
+                d->setError( batch.errorString() );
                 return false;
             }
-            written += num;
-        }
-
-        const QFile::Permissions perm = static_cast< QFile::Permissions >( static_cast< QFile::Permissions::Int > ( ufEntry.permissions ) );
-        ufeFile.setPermissions( perm );
-
-        ufeFile.commit( KDSaveFile::OverwriteExistingFile );        
-
-        
-        if ( ufeFile.error() != QFile::NoError )
-        {
-            d->setError( tr("Failed writing uncompressed data to %1: %2").arg( completeFileName, ufeFile.errorString() ) );
-            return false;
         }
+    }
 
-        qDebug("Uncompressed %s", qPrintable(completeFileName));
-        ++numActualFiles;
+    if( !batch.commit() )
+    {
+        d->setError( batch.errorString() );
+        return false;
     }
+    qDebug("Uncompressed %d files into %s", numActualFiles, qPrintable(d->destination));
 
     if( numExpectedFiles != numActualFiles ) {
         d->errorMessage = tr("Corrupt file (wrong number of files)");
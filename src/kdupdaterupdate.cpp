@@ -27,10 +27,11 @@
 #include "kdupdaterfiledownloaderfactory.h"
 #include "kdupdaterupdateoperations_p.h"
 #include "kdupdaterupdateoperationfactory.h"
+#include "kdupdaterupdatesinfo_p.h"
 
 #include <QtCore/QDate>
 #include <QtCore/QFile>
-#include <QtCore/QMap>
+#include <QtCore/QStringList>
 #include <QtCore/QVariant>
 
 /*!
@@ -53,7 +54,8 @@
    \property KDUpdater::Update::canDownload
 
    This property contains whether the update can be downloaded or not. If the property is false, the URL scheme
-   might not be supported.
+   might not be supported. The file downloader of an update is created on first use, reading this property
+   creates it if the URL scheme is supported.
 
    Get this property's value using %canDownload().
 */
@@ -126,10 +128,13 @@ public:
         : q( qq ),
           target( 0 ),
         compressedSize( 0 ),
-        uncompressedSize( 0 )
+        uncompressedSize( 0 ),
+        fileDownloader( 0 )
     {
     }
 
+    FileDownloader* ensureDownloader() const;
+
     void downloadProgress( int );
     void downloadAborted( const QString& msg );
     void downloadCompleted();
@@ -140,7 +145,7 @@ private:
 public:
     Target * target;
     UpdateSourceInfo sourceInfo;
-    QMap<QString, QVariant> data;
+    UpdateInfo info;
     QUrl updateUrl;
     UpdateType type;
     QList<UpdateOperation*> operations;
@@ -149,7 +154,8 @@ public:
     quint64 compressedSize;
     quint64 uncompressedSize;
 
-    FileDownloader* fileDownloader;
+    QString downloadDirectory;
+    mutable FileDownloader* fileDownloader;
 };
 
 
@@ -157,39 +163,31 @@ public:
    \internal
 */
 Update::Update( Target* target, const UpdateSourceInfo& sourceInfo,
-                          UpdateType type, const QUrl& updateUrl, const QMap<QString, QVariant>& data, quint64 compressedSize, quint64 uncompressedSize, const QByteArray& sha1sum )
+                          UpdateType type, const QUrl& updateUrl, const UpdateInfo& info, const UpdateFileInfo& fileInfo )
     : Task(QLatin1String( "Update" ), Stoppable, target),
       d( new Private( this ) )
 {
     d->target = target;
     d->sourceInfo = sourceInfo;
-    d->data = data;
+    d->info = info;
     d->updateUrl = updateUrl;
     d->type = type;
 
-    d->compressedSize = compressedSize;
-    d->uncompressedSize = uncompressedSize;
-    d->sha1sum = sha1sum;
+    // The file alternatives are not needed anymore once one was picked
+    d->info.updateFiles.clear();
 
-    d->fileDownloader = FileDownloaderFactory::instance().create( updateUrl.scheme(), this );
-    if(d->fileDownloader)
-    {
-        d->fileDownloader->setUrl(d->updateUrl);
-        d->fileDownloader->setSha1Sum( d->sha1sum );
-        connect(d->fileDownloader, SIGNAL(downloadProgress(int)), this, SLOT(downloadProgress(int)));
-        connect(d->fileDownloader, SIGNAL(downloadAborted(QString)), this, SLOT(downloadAborted(QString)) );
-        connect(d->fileDownloader, SIGNAL(downloadCanceled()), this, SIGNAL(stopped()));
-        connect(d->fileDownloader, SIGNAL(downloadCompleted()), this, SIGNAL(finished()));
-    }
+    d->compressedSize = fileInfo.compressedSize;
+    d->uncompressedSize = fileInfo.uncompressedSize;
+    d->sha1sum = fileInfo.sha1sum;
 
     switch( type ) {
     case NewPackage:
     case PackageUpdate:
     {
         QStringList args;
-        args << data.value( QLatin1String( "Name" ) ).toString()
-             << data.value( QLatin1String( "Version" ) ).toString()
-             << data.value( QLatin1String( "ReleaseDate" ) ).toString();
+        args << info.name
+             << info.version
+             << info.releaseDate.toString( Qt::ISODate );
         UpdateOperation * const packageOperation = UpdateOperationFactory::instance().create( QLatin1String( "UpdatePackage" ), args, target );
         d->operations.append( packageOperation );
         break;
@@ -197,7 +195,7 @@ Update::Update( Target* target, const UpdateSourceInfo& sourceInfo,
     case CompatUpdate:
     {
         QStringList args;
-        args << data.value( QLatin1String( "CompatLevel" ) ).toString();
+        args << QString::number( info.compatLevel );
         UpdateOperation * const compatOperation = UpdateOperationFactory::instance().create( QLatin1String( "UpdateCompatLevel" ), args, target );
         d->operations.append( compatOperation );
         break;
@@ -232,17 +230,73 @@ Target* Update::target() const
 */
 QDate Update::releaseDate() const
 {
-    return d->data.value( QLatin1String( "ReleaseDate" ) ).toDate();
+    return d->info.releaseDate;
+}
+
+/*!
+   Returns the name of the package updated by this update. Empty for compat updates.
+*/
+QString Update::packageName() const
+{
+    return d->info.name;
+}
+
+/*!
+   Returns the version of the package after installing this update.
+*/
+QString Update::version() const
+{
+    return d->info.version;
+}
+
+/*!
+   Returns the human readable title of this update.
+*/
+QString Update::title() const
+{
+    return d->info.title;
+}
+
+/*!
+   Returns the description of this update.
+*/
+QString Update::description() const
+{
+    return d->info.description;
+}
+
+/*!
+   Returns the compat level reached by installing this compat update, or -1 for other updates.
+*/
+int Update::compatLevel() const
+{
+    return d->info.compatLevel;
+}
+
+/*!
+   Returns the url of the release notes of this update, if any.
+*/
+QUrl Update::releaseNotes() const
+{
+    return d->info.releaseNotes;
+}
+
+/*!
+   Returns the dependencies of this update, see \ref KDUpdater::DependencyResolver.
+*/
+QStringList Update::dependencies() const
+{
+    return d->info.dependencies;
 }
 
 /*!
    Returns data for a given key @p name, or an invalid QVariant if the data doesn't exist.
+   \a name is the tag name of the element in Updates.xml. Prefer the typed accessors like
+   \ref packageName() and \ref version() for the standard elements.
 */
 QVariant Update::data( const QString& name ) const
 {
-    if ( d->data.contains( name ) )
-        return d->data.value( name );
-    return QVariant();
+    return d->info.value( name );
 }
 
 QUrl Update::updateUrl() const
@@ -263,9 +317,39 @@ UpdateType Update::type() const
     return d->type;
 }
 
+/*!
+   \internal
+
+   Creates the file downloader on first use. A finder run can create thousands of updates of
+   which only a few are ever downloaded, so the downloaders (an HTTP downloader owns its own
+   QNetworkAccessManager) are not created up front.
+*/
+FileDownloader* Update::Private::ensureDownloader() const
+{
+    if( fileDownloader )
+        return fileDownloader;
+
+    fileDownloader = FileDownloaderFactory::instance().create( updateUrl.scheme(), q );
+    if( !fileDownloader )
+        return 0;
+
+    fileDownloader->setUrl( updateUrl );
+    fileDownloader->setSha1Sum( sha1sum );
+    fileDownloader->setDownloadDirectory( downloadDirectory );
+    QObject::connect( fileDownloader, SIGNAL(downloadProgress(int)), q, SLOT(downloadProgress(int)) );
+    QObject::connect( fileDownloader, SIGNAL(downloadAborted(QString)), q, SLOT(downloadAborted(QString)) );
+    QObject::connect( fileDownloader, SIGNAL(downloadCanceled()), q, SIGNAL(stopped()) );
+    QObject::connect( fileDownloader, SIGNAL(downloadCompleted()), q, SIGNAL(finished()) );
+    return fileDownloader;
+}
+
 bool Update::canDownload() const
 {
-    return d->fileDownloader && d->fileDownloader->canDownload();
+    if( !d->fileDownloader && !FileDownloaderFactory::instance().supportedSchemes().contains( d->updateUrl.scheme() ) )
+        return false;
+
+    const FileDownloader* const downloader = d->ensureDownloader();
+    return downloader && downloader->canDownload();
 }
 
 bool Update::isDownloaded() const
@@ -281,6 +365,27 @@ QString Update::downloadedFileName() const
     return QString();
 }
 
+/*!
+   Sets the directory the update file is downloaded into to \a directory. By default, and if
+   \a directory is empty, it is downloaded into QDir::tempPath(). This has no effect on a
+   download that is already running or done.
+*/
+void Update::setDownloadDirectory( const QString& directory )
+{
+    d->downloadDirectory = directory;
+    if( d->fileDownloader )
+        d->fileDownloader->setDownloadDirectory( directory );
+}
+
+/*!
+   Returns the directory the update file is downloaded into, or an empty string for the
+   temporary directory.
+*/
+QString Update::downloadDirectory() const
+{
+    return d->downloadDirectory;
+}
+
 /*!
    \internal
 */
@@ -311,8 +416,10 @@ void Update::Private::downloadAborted( const QString& msg )
 */
 void Update::doRun()
 {
-    if(d->fileDownloader)
-        d->fileDownloader->download();
+    if( FileDownloader* const downloader = d->ensureDownloader() )
+        downloader->download();
+    else
+        reportError( tr( "No downloader available for %1" ).arg( d->updateUrl.toString() ) );
 }
 
 /*!
@@ -32,13 +32,11 @@
 #endif
 
 QT_BEGIN_NAMESPACE
-template< typename K, typename V >
-class QMap;
-
 template< typename T >
 class QList;
 
 class QDate;
+class QStringList;
 class QUrl;
 QT_END_NAMESPACE
 
@@ -46,6 +44,8 @@ namespace KDUpdater
 {
     class Target;
     struct UpdateSourceInfo;
+    struct UpdateInfo;
+    struct UpdateFileInfo;
     class UpdateFinder;
     class UpdateOperation;
 
@@ -69,6 +69,13 @@ namespace KDUpdater
         UpdateType type() const;
         QUrl updateUrl() const;
         QDate releaseDate() const;
+        QString packageName() const;
+        QString version() const;
+        QString title() const;
+        QString description() const;
+        int compatLevel() const;
+        QUrl releaseNotes() const;
+        QStringList dependencies() const;
         QVariant data( const QString& name ) const;
         UpdateSourceInfo sourceInfo() const;
 
@@ -77,6 +84,9 @@ namespace KDUpdater
         void download() { run(); }
         QString downloadedFileName() const;
 
+        void setDownloadDirectory( const QString& directory );
+        QString downloadDirectory() const;
+
         QList<UpdateOperation*> operations() const;
 
         quint64 compressedSize() const;
@@ -101,7 +111,7 @@ namespace KDUpdater
         bool doResume();
 
         Update( Target* target, const UpdateSourceInfo& sourceInfo,
-               UpdateType type, const QUrl& updateUrl, const QMap<QString, QVariant>& data, quint64 compressedSize, quint64 uncompressedSize, const QByteArray& sha1sum );
+               UpdateType type, const QUrl& updateUrl, const UpdateInfo& info, const UpdateFileInfo& fileInfo );
     };
 }
 
@@ -21,6 +21,7 @@
 **********************************************************************/
 
 #include "kdupdaterupdatefinder.h"
+#include "kdupdaterdependencyresolver.h"
 #include "kdupdatertarget.h"
 #include "kdupdaterupdatesourcesinfo.h"
 #include "kdupdaterpackagesinfo.h"
@@ -30,7 +31,18 @@
 #include "kdupdaterupdatesinfo_p.h"
 
 #include <QCoreApplication>
+#include <QCryptographicHash>
 #include <QDebug>
+#include <QDomDocument>
+#include <QDomElement>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <kdsavefile.h>
 
 /*!
    \ingroup kdupdater
@@ -92,6 +104,43 @@ static QString suggest_platform_identifier() {
 
 using namespace KDUpdater;
 
+/*!
+   \struct KDUpdater::UpdateSourceStatistics kdupdaterupdatefinder.h KDUpdaterUpdateFinder
+   \brief Instrumentation of fetching the updates from a single update source
+
+   Times are in milliseconds and measured from the moment the Updates.xml downloads were
+   triggered. \c timeToFirstByte and \c transferTime are -1 if the download did not end.
+*/
+
+UpdateSourceStatistics::UpdateSourceStatistics()
+    : succeeded( false ),
+      timeToFirstByte( -1 ),
+      transferTime( -1 ),
+      bytes( 0 ),
+      parseTime( 0 ),
+      updateCount( 0 )
+{
+}
+
+/*!
+   \struct KDUpdater::UpdateFinderStatistics kdupdaterupdatefinder.h KDUpdaterUpdateFinder
+   \brief Instrumentation of an update finder run
+
+   \c downloadTime is the wall clock time spent until all Updates.xml downloads finished,
+   \c parseTime the sum of the parse times of all sources and \c matchingTime the time spent
+   computing the applicable updates. All times are in milliseconds.
+*/
+
+UpdateFinderStatistics::UpdateFinderStatistics()
+    : succeeded( false ),
+      totalTime( 0 ),
+      downloadTime( 0 ),
+      parseTime( 0 ),
+      matchingTime( 0 ),
+      updateCount( 0 )
+{
+}
+
 //
 // Private
 //
@@ -102,7 +151,9 @@ public:
         q( qq ),
         target( 0 ),
         updateType(PackageUpdate),
-        platformIdentifier( suggest_platform_identifier() )
+        platformIdentifier( suggest_platform_identifier() ),
+        stampCheck( false ),
+        unchanged( false )
     {}
 
     ~Private()
@@ -117,6 +168,23 @@ public:
     QList<Update*> updates;
     UpdateTypes updateType;
     QString platformIdentifier;
+    QList<QUrl> ignoredSources;
+    QList<QUrl> failedSources;
+
+    // Version stamps of the update sources at the last successful run
+    bool stampCheck;
+    bool unchanged;
+    QMap<QUrl, QByteArray> stamps;
+    QMap<QUrl, QByteArray> fetchedStamps;
+    QByteArray localStamp;
+    int stampDownloadCompleteCount;
+
+    // Instrumentation of the last run
+    UpdateFinderStatistics statistics;
+    QString statisticsFileName;
+    QElapsedTimer downloadTimer;
+    QHash<const QObject*, int> downloaderStatistics;
+    QHash<const QObject*, int> downloaderProgressReports;
 
     // Temporary structure that notes down information about updates.
     bool cancel;
@@ -124,20 +192,35 @@ public:
     QVector<UpdateSourceInfo> updateSourceInfoList;
     QList<UpdatesInfo*> updatesInfoList;
     QList<FileDownloader*> updateXmlFDList;
+    QVector< QVector<UpdateInfo> > packageMatches;
 
     void clear();
+    bool checkTarget();
     void computeUpdates();
+    bool prepareSharedRun( const QHash<QUrl, UpdatesInfo>& catalogs );
+    void finishSharedRun();
     void cancelComputeUpdates();
     bool downloadUpdateXMLFiles();
+    bool checkVersionStamps();
+    QByteArray computeLocalStamp() const;
+    QByteArray combinedStamp( const QByteArray& updatesSha1 ) const;
+    QByteArray sourceStamp( const QByteArray& updatesSha1, const QDate& latestReleaseDate ) const;
     bool computeApplicableUpdates();
+    QVector< QVector<UpdateInfo> > matchPackageUpdates() const;
+    bool createPackageUpdates( const QVector< QVector<UpdateInfo> >& matches );
 
-    QVector<UpdateInfo> applicableUpdates( const UpdatesInfo* updatesInfo, bool addNewPackages=false );
+    QVector<UpdateInfo> applicableUpdates( const UpdatesInfo* updatesInfo, bool addNewPackages=false ) const;
     void createUpdateObjects(const UpdateSourceInfo& sourceInfo,
                              const QVector<UpdateInfo>& updateInfoList);
     bool checkForUpdatePriority(const UpdateSourceInfo& sourceInfo,
                                 const UpdateInfo& updateInfo);
     int pickUpdateFileInfo(const QVector<UpdateFileInfo>& updateFiles);
+    UpdateSourceStatistics* sourceStatistics(const QUrl& url);
+    void writeStatistics() const;
+    void slotDownloadStarted();
+    void slotDownloadProgress(int percent);
     void slotDownloadDone();
+    void slotStampDownloadDone();
 };
 
 
@@ -165,10 +248,42 @@ void UpdateFinder::Private::clear()
     qDeleteAll( updateXmlFDList );
     updateXmlFDList.clear();
     updateSourceInfoList.clear();
+    packageMatches.clear();
 
     downloadCompleteCount = 0;
 }
 
+/*!
+   \internal
+
+   Checks that the package and update source information of the target can be used,
+   reports an error otherwise.
+*/
+bool UpdateFinder::Private::checkTarget()
+{
+    PackagesInfo * packages = target->packagesInfo();
+    if( !packages ) {
+        q->reportError(tr("Could not access the package information of this target"));
+        return false;
+    }
+    if( !packages->isValid() ) {
+        q->reportError(packages->errorString());
+        return false;
+    }
+
+    UpdateSourcesInfo * sources = target->updateSourcesInfo();
+    if( !sources ) {
+        q->reportError(tr("Could not access the update sources information of this target"));
+        return false;
+    }
+    if( !sources->isValid() ) {
+        q->reportError(sources->errorString());
+        return false;
+    }
+
+    return true;
+}
+
 /*!
    \internal
 
@@ -196,32 +311,32 @@ void UpdateFinder::Private::computeUpdates()
     // 2. Matching updates with Package XML and figuring out available updates
 
     cancel = false;
+    unchanged = false;
     clear();
+    failedSources.clear();
+    fetchedStamps.clear();
 
-    // First do some quick sanity checks on the packages info
-    PackagesInfo * packages = target->packagesInfo();
-    if( !packages ) {
-        q->reportError(tr("Could not access the package information of this target"));
-        return;
-    }
-    if( !packages->isValid() ) {
-        q->reportError(packages->errorString());
-        return;
-    }
-
-    // Now do some quick sanity checks on the update sources info
-    UpdateSourcesInfo * sources = target->updateSourcesInfo();
-    if( !sources ) {
-        q->reportError(tr("Could not access the update sources information of this target"));
+    // First do some quick sanity checks on the packages and update sources info
+    if( !checkTarget() )
         return;
-    }
-    if( !sources->isValid() ) {
-        q->reportError(sources->errorString());
-        return;
-    }
 
     // Now we can start...
 
+    // Step 0: Skip everything if no update source changed since the last run
+    localStamp = computeLocalStamp();
+    if( stampCheck && !stamps.isEmpty() )
+    {
+        if( checkVersionStamps() )
+        {
+            unchanged = true;
+            q->reportProgress( 100, tr("Update sources unchanged since the last check") );
+            q->reportDone();
+            return;
+        }
+        if( cancel )
+            return;
+    }
+
     // Step 1: 0 - 49 percent
     if(!downloadUpdateXMLFiles() || cancel)
     {
@@ -230,17 +345,107 @@ void UpdateFinder::Private::computeUpdates()
     }
 
     // Step 2: 50 - 100 percent
-    if(!computeApplicableUpdates() || cancel)
+    QElapsedTimer matchingTimer;
+    matchingTimer.start();
+    const bool computed = computeApplicableUpdates();
+    statistics.matchingTime = matchingTimer.elapsed();
+    if(!computed || cancel)
     {
         clear();
         return;
     }
+    statistics.updateCount = updates.count();
+    stamps = fetchedStamps;
 
     // All done
     q->reportProgress( 100, tr("%1 updates found").arg(updates.count()) );
     q->reportDone();
 }
 
+/*!
+   \internal
+
+   Prepares a run of \ref KDUpdater::BatchUpdateFinder, which fetches and parses the Updates.xml
+   of each update source only once for all its targets. Instead of downloading, the parsed
+   \a catalogs are taken, keyed by the url of the update source. Update sources without catalog
+   could not be fetched.
+
+   Returns false if no update source of the target can be used.
+
+   \sa finishSharedRun()
+*/
+bool UpdateFinder::Private::prepareSharedRun( const QHash<QUrl, UpdatesInfo>& catalogs )
+{
+    cancel = false;
+    unchanged = false;
+    clear();
+    failedSources.clear();
+    fetchedStamps.clear();
+    statistics = UpdateFinderStatistics();
+    statistics.startTime = QDateTime::currentDateTimeUtc();
+
+    if( !checkTarget() )
+        return false;
+
+    const UpdateSourcesInfo * const updateSources = target->updateSourcesInfo();
+    for(int i=0; i<updateSources->updateSourceInfoCount(); i++)
+    {
+        const UpdateSourceInfo info = updateSources->updateSourceInfo(i);
+        if( ignoredSources.contains( info.url ) )
+            continue;
+
+        UpdateSourceStatistics sourceStats;
+        sourceStats.url = info.url;
+        sourceStats.name = info.name;
+
+        const QHash<QUrl, UpdatesInfo>::const_iterator it = catalogs.constFind( info.url );
+        if( it == catalogs.constEnd() )
+        {
+            q->reportError(tr("Could not download updates from %1 ('%2')").arg(info.name, info.url.toString()));
+            failedSources.append(info.url);
+            statistics.sources.append(sourceStats);
+            continue;
+        }
+
+        sourceStats.succeeded = true;
+        statistics.sources.append(sourceStats);
+        updateSourceInfoList.append(info);
+        updatesInfoList.append(new UpdatesInfo(*it));
+    }
+
+    return !updatesInfoList.isEmpty();
+}
+
+/*!
+   \internal
+
+   Creates the updates of a run prepared by prepareSharedRun(). For package updates, the
+   package matches have to be computed before, usually in a worker thread.
+*/
+void UpdateFinder::Private::finishSharedRun()
+{
+    QElapsedTimer matchingTimer;
+    matchingTimer.start();
+    const bool computed = ( updateType & CompatUpdate ) ? computeApplicableUpdates()
+                                                        : createPackageUpdates( packageMatches );
+    packageMatches.clear();
+    statistics.matchingTime = matchingTimer.elapsed();
+
+    if( computed && !cancel )
+    {
+        statistics.updateCount = updates.count();
+        q->reportProgress( 100, tr("%1 updates found").arg(updates.count()) );
+        q->reportDone();
+    }
+    else
+    {
+        clear();
+    }
+
+    statistics.succeeded = q->isFinished();
+    writeStatistics();
+}
+
 /*!
    \internal
 
@@ -282,6 +487,9 @@ bool UpdateFinder::Private::downloadUpdateXMLFiles()
     for(int i=0; i<updateSources->updateSourceInfoCount(); i++)
     {
         const UpdateSourceInfo info = updateSources->updateSourceInfo(i);
+        if( ignoredSources.contains( info.url ) )
+            continue;
+
         const QUrl updateXmlUrl = QString::fromLatin1("%1/Updates.xml").arg(info.url.toString());
         KDUpdater::FileDownloader* downloader = FileDownloaderFactory::instance().create(updateXmlUrl.scheme(),  q);
         if( !downloader )
@@ -295,6 +503,16 @@ bool UpdateFinder::Private::downloadUpdateXMLFiles()
         updateXmlFDList.append(downloader);
         updatesInfoList.append(updatesInfo);
 
+        UpdateSourceStatistics sourceStats;
+        sourceStats.url = info.url;
+        sourceStats.name = info.name;
+        downloaderStatistics.insert(downloader, statistics.sources.count());
+        statistics.sources.append(sourceStats);
+
+        connect(downloader, SIGNAL(downloadStarted()),
+                q, SLOT(slotDownloadStarted()));
+        connect(downloader, SIGNAL(downloadProgress(int)),
+                q, SLOT(slotDownloadProgress(int)));
         connect(downloader, SIGNAL(downloadCompleted()),
                 q, SLOT(slotDownloadDone()));
         connect(downloader, SIGNAL(downloadCanceled()),
@@ -305,6 +523,7 @@ bool UpdateFinder::Private::downloadUpdateXMLFiles()
 
     // Trigger download of Updates.xml file
     downloadCompleteCount = 0;
+    downloadTimer.start();
     for( QList< FileDownloader* >::const_iterator it = updateXmlFDList.begin(); it != updateXmlFDList.end(); ++it )
         (*it)->download();
 
@@ -320,6 +539,9 @@ bool UpdateFinder::Private::downloadUpdateXMLFiles()
         const int pc = computePercent(downloadCompleteCount, updateXmlFDList.count());
         q->reportProgress(pc, tr("Downloading Updates.xml from update-sources"));
     }
+    statistics.downloadTime = downloadTimer.elapsed();
+    downloaderStatistics.clear();
+    downloaderProgressReports.clear();
 
     // All the downloaders have now either downloaded or aborted the
     // donwload of update XML files.
@@ -334,6 +556,7 @@ bool UpdateFinder::Private::downloadUpdateXMLFiles()
         const UpdateSourceInfo& info = updateSourceInfoList[i];
         const QString msg = tr("Could not download updates from %1 ('%2')").arg(info.name, info.url.toString());
         q->reportError(msg);
+        failedSources.append(info.url);
 
         delete updatesInfoList[i];
         delete downloader;
@@ -352,17 +575,39 @@ bool UpdateFinder::Private::downloadUpdateXMLFiles()
     {
         const FileDownloader* const downloader = updateXmlFDList[i];
         UpdatesInfo* const updatesInfo = updatesInfoList[i];
+        UpdateSourceStatistics* const sourceStats = sourceStatistics(updateSourceInfoList[i].url);
 
+        QElapsedTimer parseTimer;
+        parseTimer.start();
         updatesInfo->setFileName( downloader->downloadedFileName() );
+        if (updatesInfo->isValid()) {
+            const QByteArray sha1 = calculateHash( downloader->downloadedFileName(), QCryptographicHash::Sha1 );
+            const QVector<UpdateInfo> infos = updatesInfo->updatesInfo();
+            QDate latestReleaseDate;
+            for( QVector<UpdateInfo>::const_iterator it = infos.begin(); it != infos.end(); ++it )
+            {
+                if( !latestReleaseDate.isValid() || it->releaseDate > latestReleaseDate )
+                    latestReleaseDate = it->releaseDate;
+            }
+            fetchedStamps.insert( updateSourceInfoList[i].url, sourceStamp( sha1, latestReleaseDate ) );
+        }
+        if (sourceStats) {
+            sourceStats->bytes = QFileInfo( downloader->downloadedFileName() ).size();
+            sourceStats->parseTime = parseTimer.elapsed();
+            sourceStats->succeeded = updatesInfo->isValid();
+            statistics.parseTime += sourceStats->parseTime;
+        }
 
         if (!updatesInfo->isValid()) {
             QString msg = updatesInfo->errorString();
             q->reportError(msg);
+            failedSources.append(updateSourceInfoList[i].url);
 
             delete updatesInfoList[i];
             delete downloader;
             updateXmlFDList.removeAt(i);
             updatesInfoList.removeAt(i);
+            updateSourceInfoList.remove( i );
             --i;
         }
     }
@@ -377,6 +622,162 @@ bool UpdateFinder::Private::downloadUpdateXMLFiles()
     return true;
 }
 
+/*!
+   \internal
+
+   Downloads the Updates.stamp file of every update source and compares it with the
+   version stamps of the last run. Returns true if no update source changed, false if any
+   update source changed or its stamp could not be fetched.
+
+   The Updates.stamp file is optional. Its \c Sha1 element contains the SHA-1 checksum of
+   Updates.xml in hexadecimal notation, its \c ReleaseDate element the latest release date of
+   the updates in Updates.xml in ISO 8601 format. An update source is unchanged if the checksum
+   did not change. Without checksum, it is unchanged if the latest release date did not change,
+   which misses updates replaced without a new release date.
+*/
+bool UpdateFinder::Private::checkVersionStamps()
+{
+    const UpdateSourcesInfo * const updateSources = target->updateSourcesInfo();
+    if( !updateSources )
+        return false;
+
+    QList<FileDownloader*> downloaders;
+    QList<QUrl> urls;
+    for(int i=0; i<updateSources->updateSourceInfoCount(); i++)
+    {
+        const UpdateSourceInfo info = updateSources->updateSourceInfo(i);
+        if( ignoredSources.contains( info.url ) )
+            continue;
+
+        // Without a stamp of the last run, there is nothing to compare with
+        if( !stamps.contains( info.url ) )
+        {
+            qDeleteAll( downloaders );
+            return false;
+        }
+
+        const QUrl stampUrl = QString::fromLatin1("%1/Updates.stamp").arg(info.url.toString());
+        FileDownloader* const downloader = FileDownloaderFactory::instance().create(stampUrl.scheme(), q);
+        if( !downloader )
+        {
+            qDeleteAll( downloaders );
+            return false;
+        }
+
+        downloader->setUrl(stampUrl);
+        downloader->setAutoRemoveDownloadedFile(true);
+        downloaders.append(downloader);
+        urls.append(info.url);
+
+        connect(downloader, SIGNAL(downloadCompleted()),
+                q, SLOT(slotStampDownloadDone()));
+        connect(downloader, SIGNAL(downloadCanceled()),
+                q, SLOT(slotStampDownloadDone()));
+        connect(downloader, SIGNAL(downloadAborted(QString)),
+                q, SLOT(slotStampDownloadDone()));
+    }
+
+    if( downloaders.isEmpty() )
+        return false;
+
+    q->reportProgress( 0, tr("Checking update sources for changes") );
+
+    stampDownloadCompleteCount = 0;
+    for( QList< FileDownloader* >::const_iterator it = downloaders.begin(); it != downloaders.end(); ++it )
+        (*it)->download();
+
+    while( stampDownloadCompleteCount != downloaders.count() )
+    {
+        QCoreApplication::processEvents();
+        if( cancel )
+        {
+            qDeleteAll( downloaders );
+            return false;
+        }
+    }
+
+    bool result = true;
+    for( int i = 0; i < downloaders.count(); ++i )
+    {
+        const FileDownloader* const downloader = downloaders.at( i );
+        if( !downloader->isDownloaded() )
+        {
+            result = false;
+            break;
+        }
+
+        QFile file( downloader->downloadedFileName() );
+        QDomDocument doc;
+        if( !file.open( QIODevice::ReadOnly ) || !doc.setContent( &file ) )
+        {
+            result = false;
+            break;
+        }
+
+        const QByteArray sha1 = QByteArray::fromHex( doc.documentElement().firstChildElement( QLatin1String( "Sha1" ) ).text().trimmed().toLatin1() );
+        const QDate releaseDate = QDate::fromString( doc.documentElement().firstChildElement( QLatin1String( "ReleaseDate" ) ).text().trimmed(), Qt::ISODate );
+        const QList<QByteArray> stamp = stamps.value( urls.at( i ) ).split( ':' );
+        const bool unchanged = !sha1.isEmpty() ? combinedStamp( sha1 ) == stamp.first()
+                                               : releaseDate.isValid() && stamp.count() == 2 && sourceStamp( QByteArray(), releaseDate ) == stamp.last();
+        if( !unchanged )
+        {
+            result = false;
+            break;
+        }
+    }
+
+    qDeleteAll( downloaders );
+    return result;
+}
+
+/*!
+   \internal
+
+   Returns a checksum of the local state the applicable updates depend on: the installed
+   packages, the platform identifier and the types of updates searched.
+*/
+QByteArray UpdateFinder::Private::computeLocalStamp() const
+{
+    QCryptographicHash hash( QCryptographicHash::Sha1 );
+    const PackagesInfo* const packages = target->packagesInfo();
+    if( packages )
+        hash.addData( calculateHash( packages->fileName(), QCryptographicHash::Sha1 ) );
+    hash.addData( platformIdentifier.toUtf8() );
+    hash.addData( QByteArray::number( int( updateType ) ) );
+    return hash.result();
+}
+
+/*!
+   \internal
+
+   Returns the version stamp for an update source whose Updates.xml has the checksum
+   \a updatesSha1, given the current local state.
+*/
+QByteArray UpdateFinder::Private::combinedStamp( const QByteArray& updatesSha1 ) const
+{
+    QCryptographicHash hash( QCryptographicHash::Sha1 );
+    hash.addData( updatesSha1 );
+    hash.addData( localStamp );
+    return hash.result().toHex();
+}
+
+/*!
+   \internal
+
+   Returns the version stamp recorded for an update source whose Updates.xml has the checksum
+   \a updatesSha1 and \a latestReleaseDate as latest release date: the combined stamps of both,
+   separated by a colon, so Updates.stamp files with either of them can be checked. Returns
+   just the stamp of the release date if \a updatesSha1 is empty, and just the stamp of the
+   checksum if \a latestReleaseDate is invalid.
+*/
+QByteArray UpdateFinder::Private::sourceStamp( const QByteArray& updatesSha1, const QDate& latestReleaseDate ) const
+{
+    const QByteArray dateStamp = latestReleaseDate.isValid() ? combinedStamp( latestReleaseDate.toString( Qt::ISODate ).toLatin1() ) : QByteArray();
+    if( updatesSha1.isEmpty() )
+        return dateStamp;
+    return dateStamp.isEmpty() ? combinedStamp( updatesSha1 ) : combinedStamp( updatesSha1 ) + ':' + dateStamp;
+}
+
 /*!
    \internal
 
@@ -389,48 +790,50 @@ bool UpdateFinder::Private::computeApplicableUpdates()
 {
     if( updateType & CompatUpdate )
     {
-        UpdateInfo compatUpdateInfo;
-        UpdateSourceInfo compatUpdateSourceInfo;
-
-        // Required compat level
-        const int reqCompatLevel = target->compatLevel() + 1 ;
-
         q->reportProgress(60, tr("Looking for compatibility update..."));
 
-        // We are only interested in compat updates.
-        for(int i=0; i<updatesInfoList.count(); i++)
+        // Plan the whole chain of compat updates at once: each compat update raises the
+        // compat level by one, so look for the next level until no source provides it.
+        int reqCompatLevel = target->compatLevel() + 1;
+        while( true )
         {
-            const UpdatesInfo* const info = updatesInfoList[i];
-            UpdateSourceInfo updateSource = updateSourceInfoList[i];
+            UpdateInfo compatUpdateInfo;
+            UpdateSourceInfo compatUpdateSourceInfo;
 
-            // If we already have a compat update, just check if the source currently being
-            // considered has a higher priority or not.
-            if(compatUpdateInfo.data.contains( QLatin1String( "CompatLevel" ) ) && updateSource.priority < compatUpdateSourceInfo.priority)
-                continue;
+            for(int i=0; i<updatesInfoList.count(); i++)
+            {
+                const UpdatesInfo* const info = updatesInfoList[i];
+                const UpdateSourceInfo& updateSource = updateSourceInfoList[i];
 
-            // Lets look for comapt updates that provide compat level one-higher than
-            // the target's current compat level.
-            const QVector<UpdateInfo> updatesInfo = info->updatesInfo( CompatUpdate, reqCompatLevel );
+                // If we already have a compat update, just check if the source currently being
+                // considered has a higher priority or not.
+                if(compatUpdateInfo.compatLevel >= 0 && updateSource.priority < compatUpdateSourceInfo.priority)
+                    continue;
 
-            if( updatesInfo.count() == 0 )
-                continue;
+                // Lets look for compat updates that provide the required compat level
+                const QVector<UpdateInfo> updatesInfo = info->updatesInfo( CompatUpdate, reqCompatLevel );
 
-            compatUpdateInfo = updatesInfo.at( 0 );
-            compatUpdateSourceInfo = updateSource;
-        }
+                if( updatesInfo.count() == 0 )
+                    continue;
 
-        const bool found = (compatUpdateInfo.data.contains( QLatin1String( "CompatLevel" ) ));
-        if(found)
-        {
-            q->reportProgress(80, tr("Found compatibility update.."));
+                compatUpdateInfo = updatesInfo.at( 0 );
+                compatUpdateSourceInfo = updateSource;
+
+                if( UpdateSourceStatistics* const sourceStats = sourceStatistics( updateSource.url ) )
+                    sourceStats->updateCount += updatesInfo.count();
+            }
 
-            // Lets create an update for this compat update.
-            const QString updateName = tr("Compatibility level %1 update").arg(reqCompatLevel);
+            if( compatUpdateInfo.compatLevel < 0 )
+                break;
 
             // Pick a update file based on arch and OS.
             const int pickUpdateFileIndex = pickUpdateFileInfo(compatUpdateInfo.updateFiles);
             if(pickUpdateFileIndex < 0)
             {
+                // The chain ends at the last level that can be installed here
+                if( !updates.isEmpty() )
+                    break;
+
                 q->reportError(tr("Compatibility update for the required architecture and hardware configuration was not found"));
                 q->reportProgress(100, tr("Compatibility update not found"));
                 return false;
@@ -443,51 +846,95 @@ bool UpdateFinder::Private::computeApplicableUpdates()
             Update * const  update = q->constructUpdate(target,
                                                               compatUpdateSourceInfo,
                                                               CompatUpdate, url,
-                                                              compatUpdateInfo.data, fileInfo.compressedSize, fileInfo.uncompressedSize, fileInfo.sha1sum );
+                                                              compatUpdateInfo, fileInfo );
 
             // Register the update
             updates.append(update);
 
-            // Done
-            q->reportProgress(100, tr("Compatibility update found"));
+            q->reportProgress(80, tr("Found compatibility level %1 update..").arg(reqCompatLevel));
+            ++reqCompatLevel;
+
+            if( cancel )
+                return false;
         }
-        else
+
+        // Done
+        if( updates.isEmpty() )
             q->reportProgress(100, tr("No compatibility updates found"));
+        else
+            q->reportProgress(100, tr("%n compatibility update(s) found", 0, updates.count()));
     }
     else if ( updateType & PackageUpdate )
     {
         // We are not looking for normal updates, not compat ones.
-        int i = 0;
-        for( QList< UpdatesInfo* >::const_iterator it = updatesInfoList.begin(); it != updatesInfoList.end(); ++it, ++i )
-        {
-            // Fetch updates applicable to this target.
-            const UpdatesInfo* const info = *it;
-            const QVector<UpdateInfo> updates = applicableUpdates(info, updateType & NewPackage);
-            if( updates.isEmpty() )
-                continue;
+        if( !createPackageUpdates( matchPackageUpdates() ) )
+            return false;
+    }
 
-            if( cancel )
-                return false;
-            const UpdateSourceInfo& updateSource = updateSourceInfoList[i];
+    q->reportProgress( 99, tr("Application updates computed") );
+    return true;
+}
 
-            // Create KDUpdater::Update objects for updates that have a valid
-            // UpdateFile
-            createUpdateObjects(updateSource, updates);
-            if( cancel )
-                return false;
+/*!
+   \internal
 
-            // Report progress
-            int pc = computePercent(i, updatesInfoList.count());
-            pc = computeProgressPercentage( ComputeUpdatesPercentageBegin, ComputeUpdatesPercentageEnd, pc );  // percentage from 50% to 100% is for the calculate updates stuff
-            q->reportProgress( pc, tr("Computing applicable updates") );
-        }
+   Returns the package updates applicable to the target, one list per update source.
+   Only reads the target's packages and the parsed Updates.xml files, hence it can be run
+   outside of the thread of the finder.
+*/
+QVector< QVector<UpdateInfo> > UpdateFinder::Private::matchPackageUpdates() const
+{
+    QVector< QVector<UpdateInfo> > matches;
+    matches.reserve( updatesInfoList.count() );
+    for( QList< UpdatesInfo* >::const_iterator it = updatesInfoList.begin(); it != updatesInfoList.end(); ++it )
+        matches.append( applicableUpdates( *it, updateType & NewPackage ) );
+    return matches;
+}
+
+/*!
+   \internal
+
+   Creates KDUpdater::Update objects for the applicable package updates \a matches, as returned
+   by matchPackageUpdates(), and orders them by their dependencies.
+*/
+bool UpdateFinder::Private::createPackageUpdates( const QVector< QVector<UpdateInfo> >& matches )
+{
+    for( int i = 0; i < matches.count() && i < updateSourceInfoList.count(); ++i )
+    {
+        const QVector<UpdateInfo>& updates = matches.at( i );
+        if( UpdateSourceStatistics* const sourceStats = sourceStatistics( updateSourceInfoList[i].url ) )
+            sourceStats->updateCount = updates.count();
+        if( updates.isEmpty() )
+            continue;
+
+        if( cancel )
+            return false;
+        const UpdateSourceInfo& updateSource = updateSourceInfoList[i];
+
+        // Create KDUpdater::Update objects for updates that have a valid
+        // UpdateFile
+        createUpdateObjects(updateSource, updates);
+        if( cancel )
+            return false;
+
+        // Report progress
+        int pc = computePercent(i, updatesInfoList.count());
+        pc = computeProgressPercentage( ComputeUpdatesPercentageBegin, ComputeUpdatesPercentageEnd, pc );  // percentage from 50% to 100% is for the calculate updates stuff
+        q->reportProgress( pc, tr("Computing applicable updates") );
     }
 
-    q->reportProgress( 99, tr("Application updates computed") );
+    // Report the updates in installation order, dependencies first
+    DependencyResolver resolver( target );
+    resolver.setUpdates( updates );
+    if( resolver.resolve() )
+        updates = resolver.orderedUpdates();
+    else
+        qDebug() << "Cannot order updates by their dependencies:" << resolver.errorString();
+
     return true;
 }
 
-QVector<UpdateInfo> UpdateFinder::Private::applicableUpdates( const UpdatesInfo* updatesInfo, bool addNewPackages)
+QVector<UpdateInfo> UpdateFinder::Private::applicableUpdates( const UpdatesInfo* updatesInfo, bool addNewPackages) const
 {
     QVector<UpdateInfo> retList;
 
@@ -549,13 +996,13 @@ QVector<UpdateInfo> UpdateFinder::Private::applicableUpdates( const UpdatesInfo*
         const UpdateInfo& updateInfo = *it;
         if( !addNewPackages )
         {
-            int pkgInfoIdx = packages->findPackageInfo( updateInfo.data.value( QLatin1String( "Name" ) ).toString() );
+            int pkgInfoIdx = packages->findPackageInfo( updateInfo.name );
             if( pkgInfoIdx < 0 )
                 continue;
 
             const PackageInfo pkgInfo = packages->packageInfo( pkgInfoIdx );
             // First check to see if the update version is more than package version
-            const QString updateVersion = updateInfo.data.value( QLatin1String( "Version" ) ).toString();
+            const QString& updateVersion = updateInfo.version;
             const QString& pkgVersion = pkgInfo.version;
             if( KDUpdater::compareVersion(updateVersion, pkgVersion) <= 0 )
                 continue;
@@ -565,7 +1012,7 @@ QVector<UpdateInfo> UpdateFinder::Private::applicableUpdates( const UpdatesInfo*
             // of the update. This way we can compare and figure out if the update
             // has been installed or not.
             const QDate& pkgDate = pkgInfo.lastUpdateDate;
-            const QDate updateDate = updateInfo.data.value( QLatin1String( "ReleaseDate" ) ).toDate();
+            const QDate& updateDate = updateInfo.releaseDate;
             if( pkgDate > updateDate )
                 continue;
         }
@@ -582,10 +1029,10 @@ void UpdateFinder::Private::createUpdateObjects(const UpdateSourceInfo& sourceIn
     {
         const UpdateInfo& info = *it;
         // Compat level checks
-        if( info.data.contains( QLatin1String( "RequiredCompatLevel" ) ) &&
-            info.data.value( QLatin1String( "RequiredCompatLevel" ) ).toInt() != target->compatLevel() )
+        if( info.requiredCompatLevel >= 0 &&
+            info.requiredCompatLevel != target->compatLevel() )
         {
-            qDebug() << "Update \"" << info.data.value( QLatin1String( "Name" ) ).toString() << "\" at \""
+            qDebug() << "Update \"" << info.name << "\" at \""
                      << sourceInfo.name << "\"(\"" << sourceInfo.url.toString() << "\") requires a different compat level";
             continue; // Compatibility level mismatch
         }
@@ -595,7 +1042,7 @@ void UpdateFinder::Private::createUpdateObjects(const UpdateSourceInfo& sourceIn
         if( !checkForUpdatePriority(sourceInfo, info) )
         {
             qDebug() << "Skipping Update \""
-                     << info.data.value( QLatin1String( "Name" ) ).toString()
+                     << info.name
                      << "\" from \""
                      << sourceInfo.name
                      << "\"(\""
@@ -614,7 +1061,7 @@ void UpdateFinder::Private::createUpdateObjects(const UpdateSourceInfo& sourceIn
 
         // Create an update for this entry
         const QUrl url( QString::fromLatin1("%1/%2").arg( sourceInfo.url.toString(), fileInfo.fileName ) );
-        Update * const update = q->constructUpdate( target, sourceInfo, PackageUpdate, url, info.data, fileInfo.compressedSize, fileInfo.uncompressedSize, fileInfo.sha1sum );
+        Update * const update = q->constructUpdate( target, sourceInfo, PackageUpdate, url, info, fileInfo );
 
         // Register the update
         this->updates.append(update);
@@ -626,7 +1073,7 @@ bool UpdateFinder::Private::checkForUpdatePriority(const UpdateSourceInfo& sourc
     for( QList< Update* >::iterator it = updates.begin(); it != updates.end(); ++it )
     {
         Update* const update = *it;
-        if( update->data( QLatin1String( "Name" ) ).toString() != updateInfo.data.value( QLatin1String( "Name" ) ).toString() )
+        if( update->packageName() != updateInfo.name )
             continue;
 
         // Bingo, update was previously found elsewhere.
@@ -636,8 +1083,7 @@ bool UpdateFinder::Private::checkForUpdatePriority(const UpdateSourceInfo& sourc
             return false;
 
         // If the existing update has a higher version number, keep it
-        if ( compareVersion(update->data( QLatin1String( "Version" ) ).toString(),
-                                       updateInfo.data.value( QLatin1String( "Version" ) ).toString()) > 0)
+        if ( compareVersion(update->version(), updateInfo.version) > 0)
             return false;
 
         // Otherwise the old update must be deleted.
@@ -753,6 +1199,114 @@ QString UpdateFinder::platformIdentifier() const
     return d->platformIdentifier;
 }
 
+/*!
+   Sets the \a urls of update sources that are skipped while computing updates. This
+   can be used to avoid repeatedly contacting update sources that are known to be down.
+
+   \sa failedUpdateSources()
+*/
+void UpdateFinder::setIgnoredUpdateSources( const QList<QUrl> & urls )
+{
+    d->ignoredSources = urls;
+}
+
+/*!
+   Returns the urls of update sources that are skipped while computing updates.
+*/
+QList<QUrl> UpdateFinder::ignoredUpdateSources() const
+{
+    return d->ignoredSources;
+}
+
+/*!
+   Returns the urls of the update sources whose Updates.xml could not be downloaded
+   or parsed during the last run.
+*/
+QList<QUrl> UpdateFinder::failedUpdateSources() const
+{
+    return d->failedSources;
+}
+
+/*!
+   Enables or disables checking the version stamps of the update sources before fetching
+   their Updates.xml. Disabled by default.
+
+   If enabled and \ref versionStamps() contains a stamp for every update source, the finder
+   first downloads the small Updates.stamp file of every update source. If none of them
+   changed since the run that recorded the stamps, and the installed packages did not
+   change either, the finder finishes without fetching Updates.xml and computing updates.
+   In that case \ref isUnchanged() returns true and \ref updates() is empty; the updates
+   found by the previous run are still valid.
+*/
+void UpdateFinder::setVersionStampCheckEnabled( bool enabled )
+{
+    d->stampCheck = enabled;
+}
+
+/*!
+   Returns whether the version stamps are checked before fetching Updates.xml.
+*/
+bool UpdateFinder::isVersionStampCheckEnabled() const
+{
+    return d->stampCheck;
+}
+
+/*!
+   Sets the version \a stamps of the update sources, usually those returned by
+   \ref versionStamps() after the last successful run. The stamps are opaque values.
+*/
+void UpdateFinder::setVersionStamps( const QMap<QUrl, QByteArray> & stamps )
+{
+    d->stamps = stamps;
+}
+
+/*!
+   Returns the version stamps of the update sources, keyed by the url of the update source.
+   After a successful run, these are the stamps of the fetched Updates.xml files.
+*/
+QMap<QUrl, QByteArray> UpdateFinder::versionStamps() const
+{
+    return d->stamps;
+}
+
+/*!
+   Returns true if the last run was skipped because no update source changed.
+
+   \sa setVersionStampCheckEnabled()
+*/
+bool UpdateFinder::isUnchanged() const
+{
+    return d->unchanged;
+}
+
+/*!
+   Returns timing and size information about the last run, split up by update source.
+   All times are in milliseconds.
+
+   \sa setStatisticsFileName()
+*/
+UpdateFinderStatistics UpdateFinder::statistics() const
+{
+    return d->statistics;
+}
+
+/*!
+   Sets the \a fileName the \ref statistics() are written to as a JSON document after
+   each run. An empty file name, the default, disables writing the statistics.
+*/
+void UpdateFinder::setStatisticsFileName( const QString & fileName )
+{
+    d->statisticsFileName = fileName;
+}
+
+/*!
+   Returns the file name the statistics are written to.
+*/
+QString UpdateFinder::statisticsFileName() const
+{
+    return d->statisticsFileName;
+}
+
 /*!
    \internal
 
@@ -760,7 +1314,16 @@ QString UpdateFinder::platformIdentifier() const
 */
 void UpdateFinder::doRun()
 {
+    d->statistics = UpdateFinderStatistics();
+    d->statistics.startTime = QDateTime::currentDateTimeUtc();
+
+    QElapsedTimer timer;
+    timer.start();
     d->computeUpdates();
+
+    d->statistics.totalTime = timer.elapsed();
+    d->statistics.succeeded = isFinished();
+    d->writeStatistics();
 }
 
 /*!
@@ -800,11 +1363,117 @@ bool UpdateFinder::doResume()
     return false;
 }
 
+/*!
+   \internal
+
+   Returns the statistics entry of the update source with \a url, or 0 if there is none.
+*/
+UpdateSourceStatistics* UpdateFinder::Private::sourceStatistics(const QUrl& url)
+{
+    for( QVector<UpdateSourceStatistics>::iterator it = statistics.sources.begin(); it != statistics.sources.end(); ++it )
+    {
+        if( it->url == url )
+            return &*it;
+    }
+    return 0;
+}
+
+/*!
+   \internal
+
+   Writes the statistics of the last run as JSON to the statistics file, if one was set.
+*/
+void UpdateFinder::Private::writeStatistics() const
+{
+    if( statisticsFileName.isEmpty() )
+        return;
+
+    QJsonArray sources;
+    for( QVector<UpdateSourceStatistics>::const_iterator it = statistics.sources.begin(); it != statistics.sources.end(); ++it )
+    {
+        QJsonObject source;
+        source.insert( QLatin1String( "url" ), it->url.toString() );
+        source.insert( QLatin1String( "name" ), it->name );
+        source.insert( QLatin1String( "succeeded" ), it->succeeded );
+        source.insert( QLatin1String( "timeToFirstByte" ), double( it->timeToFirstByte ) );
+        source.insert( QLatin1String( "transferTime" ), double( it->transferTime ) );
+        source.insert( QLatin1String( "bytes" ), double( it->bytes ) );
+        source.insert( QLatin1String( "parseTime" ), double( it->parseTime ) );
+        source.insert( QLatin1String( "updateCount" ), it->updateCount );
+        sources.append( source );
+    }
+
+    QJsonObject root;
+    root.insert( QLatin1String( "target" ), target ? target->name() : QString() );
+    root.insert( QLatin1String( "startTime" ), statistics.startTime.toString( Qt::ISODate ) );
+    root.insert( QLatin1String( "succeeded" ), statistics.succeeded );
+    root.insert( QLatin1String( "totalTime" ), double( statistics.totalTime ) );
+    root.insert( QLatin1String( "downloadTime" ), double( statistics.downloadTime ) );
+    root.insert( QLatin1String( "parseTime" ), double( statistics.parseTime ) );
+    root.insert( QLatin1String( "matchingTime" ), double( statistics.matchingTime ) );
+    root.insert( QLatin1String( "updateCount" ), statistics.updateCount );
+    root.insert( QLatin1String( "sources" ), sources );
+
+    KDSaveFile file( statisticsFileName );
+    if( !file.open( QFile::WriteOnly ) )
+    {
+        qDebug() << "Cannot write update finder statistics to" << statisticsFileName;
+        return;
+    }
+
+    file.write( QJsonDocument( root ).toJson() );
+    file.commit( KDSaveFile::OverwriteExistingFile );
+}
+
+/*!
+   \internal
+*/
+void UpdateFinder::Private::slotStampDownloadDone()
+{
+    ++stampDownloadCompleteCount;
+}
+
+/*!
+   \internal
+*/
+void UpdateFinder::Private::slotDownloadStarted()
+{
+    downloaderProgressReports.insert( q->sender(), 0 );
+}
+
+/*!
+   \internal
+
+   Every downloader reports 0% right after it started. The next progress report is the first
+   one caused by received data and is taken as time-to-first-byte.
+*/
+void UpdateFinder::Private::slotDownloadProgress(int percent)
+{
+    Q_UNUSED( percent );
+
+    const QObject* const downloader = q->sender();
+    const int reports = ++downloaderProgressReports[ downloader ];
+    if( reports != 2 || !downloaderStatistics.contains( downloader ) )
+        return;
+
+    statistics.sources[ downloaderStatistics.value( downloader ) ].timeToFirstByte = downloadTimer.elapsed();
+}
+
 /*!
    \internal
 */
 void UpdateFinder::Private::slotDownloadDone()
 {
+    const QObject* const downloader = q->sender();
+    if( downloaderStatistics.contains( downloader ) )
+    {
+        UpdateSourceStatistics& sourceStats = statistics.sources[ downloaderStatistics.value( downloader ) ];
+        const qint64 elapsed = downloadTimer.elapsed();
+        if( sourceStats.timeToFirstByte < 0 )
+            sourceStats.timeToFirstByte = elapsed;
+        sourceStats.transferTime = elapsed - sourceStats.timeToFirstByte;
+    }
+
     ++downloadCompleteCount;
 
     int pc = computePercent(downloadCompleteCount, updateXmlFDList.count());
@@ -816,9 +1485,9 @@ void UpdateFinder::Private::slotDownloadDone()
    \internal
  */
 Update* UpdateFinder::constructUpdate( Target* target, const UpdateSourceInfo& sourceInfo,
-                                                             UpdateType type, const QUrl& updateUrl, const QMap< QString, QVariant >& data, quint64 compressedSize, quint64 uncompressedSize, const QByteArray& sha1sum )
+                                                             UpdateType type, const QUrl& updateUrl, const UpdateInfo& info, const UpdateFileInfo& fileInfo )
 {
-    return new Update( target, sourceInfo, type, updateUrl, data, compressedSize, uncompressedSize, sha1sum );
+    return new Update( target, sourceInfo, type, updateUrl, info, fileInfo );
 }
 
 
@@ -31,18 +31,51 @@
 # include "kdupdaterapplication.h"
 #endif // KDUPDATER_NO_COMPAT
 
-QT_BEGIN_NAMESPACE
-class QUrl;
+#include <QtCore/QDateTime>
+#include <QtCore/QUrl>
+#include <QtCore/QVector>
 
+QT_BEGIN_NAMESPACE
 template< typename K, typename V >
 class QMap;
 QT_END_NAMESPACE
 
 namespace KDUpdater
 {
+    class BatchUpdateFinder;
     class Target;
     class Update;
     struct UpdateSourceInfo;
+    struct UpdateInfo;
+    struct UpdateFileInfo;
+
+    struct KDUPDATER_EXPORT UpdateSourceStatistics
+    {
+        UpdateSourceStatistics();
+
+        QUrl url;
+        QString name;
+        bool succeeded;
+        qint64 timeToFirstByte;
+        qint64 transferTime;
+        qint64 bytes;
+        qint64 parseTime;
+        int updateCount;
+    };
+
+    struct KDUPDATER_EXPORT UpdateFinderStatistics
+    {
+        UpdateFinderStatistics();
+
+        QDateTime startTime;
+        bool succeeded;
+        qint64 totalTime;
+        qint64 downloadTime;
+        qint64 parseTime;
+        qint64 matchingTime;
+        int updateCount;
+        QVector<UpdateSourceStatistics> sources;
+    };
 
     class KDUPDATER_EXPORT UpdateFinder : public Task
     {
@@ -63,6 +96,24 @@ namespace KDUpdater
         void setPlatformIdentifier( const QString & platformIdentifier );
         QString platformIdentifier() const;
 
+        void setIgnoredUpdateSources( const QList<QUrl> & urls );
+        QList<QUrl> ignoredUpdateSources() const;
+
+        QList<QUrl> failedUpdateSources() const;
+
+        void setVersionStampCheckEnabled( bool enabled );
+        bool isVersionStampCheckEnabled() const;
+
+        void setVersionStamps( const QMap<QUrl, QByteArray> & stamps );
+        QMap<QUrl, QByteArray> versionStamps() const;
+
+        bool isUnchanged() const;
+
+        UpdateFinderStatistics statistics() const;
+
+        void setStatisticsFileName( const QString & fileName );
+        QString statisticsFileName() const;
+
 #ifndef KDUPDATER_NO_COMPAT
         Application * application() const { return dynamic_cast<Application*>( target() ); }
 #endif // KDUPDATER_NO_COMPAT
@@ -74,11 +125,15 @@ namespace KDUpdater
         bool doResume();
 
         Update* constructUpdate( Target * target, const UpdateSourceInfo & sourceInfo,
-                                 UpdateType type, const QUrl& updateUrl, const QMap< QString, QVariant >& data, quint64 compressedSize, quint64 uncompressedSize, const QByteArray& sha1sum );
+                                 UpdateType type, const QUrl& updateUrl, const UpdateInfo& info, const UpdateFileInfo& fileInfo );
 
 
     private:
+        friend class ::KDUpdater::BatchUpdateFinder;
+        Q_PRIVATE_SLOT( d, void slotDownloadStarted() )
+        Q_PRIVATE_SLOT( d, void slotDownloadProgress( int ) )
         Q_PRIVATE_SLOT( d, void slotDownloadDone() )
+        Q_PRIVATE_SLOT( d, void slotStampDownloadDone() )
         
         class Private;
         kdtools::pimpl_ptr< Private > d;
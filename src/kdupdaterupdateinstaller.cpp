@@ -21,109 +21,230 @@
 **********************************************************************/
 
 #include "kdupdaterupdateinstaller.h"
+#include "kdupdaterdependencyresolver.h"
+#include "kdupdaterdirectoryswap_p.h"
+#include "kdupdaterfileutils_p.h"
+#include "kdupdaterinstallplan.h"
 #include "kdupdaterpackagesinfo.h"
 #include "kdupdatertarget.h"
 #include "kdupdaterupdate.h"
-#include "kdupdaterupdateoperationfactory.h"
 #include "kdupdaterupdateoperation.h"
-#include "kdupdaterufuncompressor_p.h"
+#include "kdupdateroperationjournal_p.h"
 
 #include <QCoreApplication>
 #include <QFileInfo>
 #include <QDir>
-#include <QDirIterator>
-#include <QDomDocument>
-#include <QDomElement>
-#include <QDate>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFuture>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QMap>
+#include <QSet>
 #include <QStack>
 #include <QVariant>
+#include <QtConcurrentRun>
 
 #include <memory>
 
 using namespace KDUpdater;
 
-static void removeDirectory(const QDir & dir)
+/*!
+ \internal
+ An unpacked update with its operations, ready to be installed.
+ */
+struct PreparedUpdate
+{
+    PreparedUpdate( Update* update_, Target* target ) : update( update_ ), plan( target ), journal( 0 ), journalUpdate( -1 ), unpacked( false ), exclusive( false ), success( false ), duration( 0 ) {}
+
+    Update* update;
+    InstallPlan plan;
+    OperationJournal* journal;
+    int journalUpdate;
+    QFutureWatcher<void> watcher;
+    QStack< int > performedSteps;
+    QStringList paths;
+    bool unpacked;
+    bool exclusive;
+    bool success;
+    qint64 duration;
+    QStringList errors;
+
+private:
+    Q_DISABLE_COPY( PreparedUpdate )
+};
+
+static QString normalizedPath( const QString& path )
 {
-    QDirIterator dirIt( dir.path(), QDir::Dirs| QDir::Files| QDir::NoDotAndDotDot );
-    while( dirIt.hasNext() )
+#ifdef Q_OS_WIN
+    return QDir::cleanPath( path ).toLower();
+#else
+    return QDir::cleanPath( path );
+#endif
+}
+
+/*!
+ \internal
+ Returns true if any of \a paths is equal to or inside any of \a others, or vice versa.
+ */
+static bool pathsOverlap( const QStringList& paths, const QStringList& others )
+{
+    for( QStringList::const_iterator it = paths.begin(); it != paths.end(); ++it )
     {
-        dirIt.next();
-        const QFileInfo fi = dirIt.fileInfo();
-        if( fi.isDir() )
+        for( QStringList::const_iterator oit = others.begin(); oit != others.end(); ++oit )
         {
-            const QDir childDir = fi.absoluteFilePath();
-            removeDirectory( childDir );
-            dir.rmdir( childDir.dirName() );
+            if( *it == *oit || it->startsWith( *oit + QLatin1Char( '/' ) ) || oit->startsWith( *it + QLatin1Char( '/' ) ) )
+                return true;
         }
-        else if( fi.isFile() )
-            QFile::remove( fi.absoluteFilePath() );
     }
+    return false;
 }
 
+/*!
+ \internal
+ Returns true if each file system in \a space, keyed by its root path, has the number of bytes
+ available it maps to. Otherwise \a errorString, if not null, describes the first file system
+ that is too small. File systems whose free space cannot be determined are assumed to suffice.
+ */
+static bool hasEnoughSpace( const QMap<QString, qint64>& space, QString* errorString )
+{
+    for( QMap< QString, qint64 >::const_iterator it = space.begin(); it != space.end(); ++it )
+    {
+        const qint64 available = availableSpace( it.key() );
+        if( available < 0 || it.value() <= available )
+            continue;
+
+        if( errorString )
+            *errorString = UpdateInstaller::tr("Not enough disk space on %1: %2 MB needed, %3 MB available")
+                           .arg( QDir::toNativeSeparators( it.key() ),
+                                 QString::number( ( it.value() + 1024 * 1024 - 1 ) / ( 1024 * 1024 ) ),
+                                 QString::number( available / ( 1024 * 1024 ) ) );
+        return false;
+    }
+    return true;
+}
 
 /*!
  \internal
+ Adds the files and directories changed by \a operation to \a prepared. Returns false if they
+ are not known, like for Execute and custom operations; such updates are installed on their own.
  */
-class TempDirDeleter
+static bool addTouchedPaths( PreparedUpdate* prepared, const UpdateOperation* operation, const QString& workingDirectory )
 {
-public:
-    explicit TempDirDeleter( const QString& path );
-    explicit TempDirDeleter( const QStringList& paths = QStringList() );
-    ~TempDirDeleter();
-    void releaseAll();
-    void release( const QString& path );
+    const QString name = operation->name();
+    const QStringList args = operation->arguments();
 
-    void add( const QString& path );
-    void add( const QDir& path );
-    void add( const QStringList& paths );
+    // These change the packages info only, which the operations serialize themselves
+    if( name == QLatin1String( "UpdatePackage" ) || name == QLatin1String( "UpdateCompatLevel" ) )
+        return true;
 
-private:
     QStringList paths;
-};
+    if( name == QLatin1String( "Copy" ) || name == QLatin1String( "Move" ) ||
+        name == QLatin1String( "CopyTree" ) || name == QLatin1String( "SyncTree" ) )
+        paths = args;
+    else if( name == QLatin1String( "Delete" ) || name == QLatin1String( "Mkdir" ) || name == QLatin1String( "Rmdir" ) ||
+             name == QLatin1String( "AppendFile" ) || name == QLatin1String( "PrependFile" ) || name == QLatin1String( "DeleteTree" ) )
+        paths = args.mid( 0, 1 );
+    else
+        return false;
 
-TempDirDeleter::TempDirDeleter( const QString& path )
-    : paths( QStringList() << path )
-{
-}
+    const QDir dir( workingDirectory );
+    for( QStringList::const_iterator it = paths.begin(); it != paths.end(); ++it )
+    {
+        QFileInfo fi( dir.absoluteFilePath( *it ) );
 
-TempDirDeleter::TempDirDeleter( const QStringList& paths_ )
-    : paths( paths_ )
-{
+        // Mkdir creates, and its undo removes, all missing parent directories
+        if( name == QLatin1String( "Mkdir" ) )
+        {
+            while( !fi.dir().exists() )
+                fi = QFileInfo( fi.absolutePath() );
+        }
+        prepared->paths.append( normalizedPath( fi.absoluteFilePath() ) );
+    }
+    return true;
 }
 
-TempDirDeleter::~TempDirDeleter()
+/*!
+ \internal
+ Undoes the operations of \a prepared that were performed, last one first, and records the
+ update as rolled back in its journal. Returns false if an operation could not be undone.
+ */
+static bool undoUpdate( PreparedUpdate* prepared )
 {
-    for( QStringList::const_iterator it = paths.constBegin(); it != paths.constEnd(); ++it )
+    bool success = true;
+    while( !prepared->performedSteps.isEmpty() )
     {
-        const QString& path = *it;
-        if( !path.isEmpty() )
-            removeDirectory( QDir( path ) );
+        const int performed = prepared->performedSteps.pop();
+        success = prepared->plan.step( performed ).operation->undoOperation() && success;
+        prepared->journal->operationUndone( prepared->journalUpdate, performed );
     }
+    prepared->journal->endUpdate( prepared->journalUpdate, false );
+    return success;
 }
 
-void TempDirDeleter::releaseAll() {
-    paths.clear();
-}
+/*!
+ \internal
+ Performs the operations of \a prepared. A failed operation is undone; unless its action on
+ error is to continue, so are all operations performed before, and the installation of the
+ update ends. Errors are collected in \a prepared, as this runs in worker threads for updates
+ installed concurrently. Every step is recorded in the journal of \a prepared.
+ */
+static void executeUpdate( PreparedUpdate* prepared )
+{
+    OperationJournal* const journal = prepared->journal;
+    const int journalUpdate = prepared->journalUpdate;
 
-void TempDirDeleter::release( const QString& path ) {
-    paths.removeAll( path );
-}
+    QElapsedTimer timer;
+    timer.start();
 
-void TempDirDeleter::add( const QString& path )
-{
-    if( !paths.contains( path ) )
-        paths.push_back( path );
-}
+    // Redundant operations are removed once the files they depend on are in their final state
+    prepared->plan.optimize();
+    const InstallPlan& plan = prepared->plan;
 
-void TempDirDeleter::add( const QDir& path )
-{
-    add( path.absolutePath() );
+    prepared->performedSteps.reserve( plan.stepCount() );
+
+    for( int index = 0; index < plan.stepCount(); ++index )
+    {
+        const InstallPlan::Step& step = plan.step( index );
+        UpdateOperation* const updateOperation = step.operation;
+        updateOperation->backup();
+        journal->operationStarted( journalUpdate, index, updateOperation );
+        if( updateOperation->performOperation() )
+        {
+            journal->operationPerformed( journalUpdate, index, updateOperation );
+            prepared->performedSteps.push( index );
+
+            // Keep the downloads going while installing in the thread of the installer
+            if( prepared->exclusive )
+                QCoreApplication::processEvents();
+            continue;
+        }
+
+        prepared->errors.append( UpdateInstaller::tr("Cannot execute '%1'").arg( updateOperation->operationCommand() ) );
+        updateOperation->undoOperation();
+        journal->operationUndone( journalUpdate, index );
+
+        // TODO: AskUser
+        if( step.onError == QLatin1String( "Continue" ) || step.onError == QLatin1String( "AskUser" ) )
+            continue;
+
+        undoUpdate( prepared );
+        return;
+    }
+
+    journal->endUpdate( journalUpdate, true );
+    prepared->duration = timer.elapsed();
+    prepared->success = true;
 }
 
-void TempDirDeleter::add( const QStringList& paths )
+/*!
+ \internal
+ Returns the file name of the journal of installations into a copy of the directory of
+ \a target. Unlike the copy, it is kept until the next run in case the installer dies.
+ */
+static QString swapJournalFileNameOf( const Target* target )
 {
-    for( QStringList::const_iterator it = paths.begin(); it != paths.end(); ++it )
-        add( *it );
+    return QDir( target->directory() ).absoluteFilePath( QLatin1String( ".kdupdater/swapjournal" ) );
 }
 
 /*!
@@ -135,10 +256,56 @@ void TempDirDeleter::add( const QStringList& paths )
    \ref setUpdatesToInstall() method and call \ref run(). To install the updates this class 
    performs the following for each update
 
-   \li Downloads the update files from its source
-   \li Unpacks update files into a temporary directory
-   \li Parses and executes UpdateInstructions.xml by making use of \ref KDUpdater::UpdateOperation
-   objects sourced via \ref KDUpdater::UpdateOperationFactory
+   \li Orders the updates such that dependencies are installed first, see
+   \ref KDUpdater::DependencyResolver
+   \li Downloads the update files from its source. Each update is installed as soon as its
+   own download is done and the updates it depends on are installed, while the other
+   updates are still being downloaded
+   \li Unpacks update files into the staging directory, see \ref setStagingDirectory()
+   \li Parses UpdateInstructions.xml into a \ref KDUpdater::InstallPlan of
+   \ref KDUpdater::UpdateOperation objects sourced via \ref KDUpdater::UpdateOperationFactory,
+   removes redundant operations from it, see \ref KDUpdater::InstallPlan::optimize(), and
+   executes it
+
+   Updates that do not depend on each other are installed concurrently on the global
+   QThreadPool, as long as their operations touch disjoint files and directories. Updates
+   containing Execute or custom operations are always installed on their own, in the thread
+   of the installer. The operations resolve relative paths against the directory the update
+   was unpacked to, see \ref KDUpdater::UpdateOperation::workingDirectory(); the current
+   directory of the process is not changed.
+
+   All operations are recorded in a journal in the target directory, see
+   \ref KDUpdater::OperationJournal. If the installing process dies, the next run of an
+   installer for the same target first completes the updates that were installed and rolls
+   back the ones that were not.
+
+   Before downloading anything, the installer checks that the file systems involved have
+   enough free space for the downloads, the unpacked updates and the installed files, using
+   the sizes declared in Updates.xml. If only the staging directory is too small, the updates
+   are unpacked into the default staging directory on the file system of the target instead.
+   Once an update is unpacked, the space needed for the files its operations write and for
+   the backups is checked again, before it is installed.
+
+   Update files are downloaded and unpacked into a staging directory, by default the hidden
+   directory .kdupdater/staging of the target. Being on the file system of the target, Move
+   operations out of the unpacked update rename the files instead of copying them, and Copy
+   operations can clone them where the file system supports it.
+
+   In the \ref SwapDirectory mode, see \ref setInstallMode(), the target directory itself is
+   not changed while installing. The updates are installed into a copy next to it, which
+   shares the unchanged files with it by hard links or reflinks, and which replaces the target
+   directory in one atomic step once all updates are installed. If the target directory is a
+   symbolic link, the link is switched to the new tree instead. The replaced tree is kept
+   until the next installation, see \ref restorePreviousVersion(). Operations outside of the
+   target directory, like those using {HOME}, still change the files in place. Therefore the
+   installed updates and their backups are kept until the new tree replaced the target
+   directory; if an update fails or the replacement does, they are all undone. If the
+   installing process dies in this mode, the next run rolls back all updates of the
+   interrupted installation, including those outside of the target directory, before it
+   discards the copy.
+
+   The time taken by each update is recorded together with its estimated cost, so that the
+   expected durations reported by dry runs of later install plans match this system.
 
    \note All temporary files created during the installation of the update will be destroyed
    immediately after the installation is complete.
@@ -149,14 +316,11 @@ public:
     explicit Private( UpdateInstaller* qq )
         : q( qq ),
           target( 0 ),
-          updateDownloadDoneCount( 0 ),
-          updateDownloadFailCount( 0 ),
-          updateDownloadProgress( 0 ),
           totalUpdates( 0 ),
-          tempDirDeleter( 0 ),
-          canceled( false ),
-          totalProgressPc( 0 ),
-          currentProgressPc( 0 )
+          journal( 0 ),
+          installMode( InPlace ),
+          swap( 0 ),
+          canceled( false )
     {
     }
 
@@ -165,23 +329,33 @@ private:
 
 public:
     Target* target;
-    int updateDownloadDoneCount;
-    int updateDownloadFailCount;
-    int updateDownloadProgress;
     int totalUpdates;
-    TempDirDeleter* tempDirDeleter;
+    OperationJournal* journal;
+    InstallMode installMode;
+    DirectorySwap* swap;
+    QString installDirectory;
 
     bool canceled;
 
-    int totalProgressPc;
-    int currentProgressPc;
     QList<Update*> updates;
+    QHash< Update*, QList<Update*> > dependencies;
+    QSet<const QObject*> downloadsDone;
+    QSet<const Update*> installedUpdates;
+    QString stagingDirectory;
+    QString unpackDirectory;
+
+    int progressOf( int done ) const;
+    QString packagesFileNameIn( const DirectorySwap& swap ) const;
+    bool checkDiskSpace( const QList< QList<Update*> >& batches );
+    bool install( const QList<Update*>& updates, const QString& journalFileName );
+    bool isReady( Update* update ) const;
+    bool prepareUpdate( PreparedUpdate* prepared );
+    bool startUpdate( PreparedUpdate* prepared, const QList<PreparedUpdate*>& running );
+    bool finishUpdate( PreparedUpdate* prepared );
+
+    void stopDownloads(const QList<Update*>& updates);
 
-    void resolveArguments(QStringList& args);
-
-    void slotUpdateDownloadProgress();
     void slotUpdateDownloadDone();
-    void slotUpdateDownloadFailed();
 };
 
 // next two are duplicated from kdupdaterupdatefinder.cpp:
@@ -240,99 +414,181 @@ QList<Update*> UpdateInstaller::updatesToInstall() const
 }
 
 /*!
-   \internal
+   Sets the directory update files are downloaded and unpacked into to \a directory. Pass an
+   empty string to use the default, the hidden directory .kdupdater/staging of the target.
+
+   The staging directory should be on the same file system as the target directory, so that
+   the installed files can be moved there by renaming them. Use QDir::tempPath() to download
+   and unpack the updates into the temporary directory like older versions did.
 */
-void UpdateInstaller::doRun()
+void UpdateInstaller::setStagingDirectory( const QString& directory )
 {
-    d->tempDirDeleter = new TempDirDeleter;
-    std::auto_ptr< TempDirDeleter > tempDirDeleter( d->tempDirDeleter );
-    
-    QList<Update*>& updates = d->updates;
+    d->stagingDirectory = directory;
+}
 
-    // First download all the updates
-    d->updateDownloadDoneCount = 0;
-    d->updateDownloadFailCount = 0;
-    d->totalUpdates = updates.count();
+/*!
+   Returns the directory update files are downloaded and unpacked into.
+*/
+QString UpdateInstaller::stagingDirectory() const
+{
+    if( !d->stagingDirectory.isEmpty() )
+        return d->stagingDirectory;
+    return QDir( d->target->directory() ).absoluteFilePath( QLatin1String( ".kdupdater/staging" ) );
+}
 
-    for( QList< Update* >::const_iterator it = updates.begin(); it != updates.end(); ++it )
-    {
-        if( d->canceled )
-            return;
+/*!
+   Sets how updates are installed to \a mode:
+
+   \li \c InPlace: the operations change the target directory one by one. If an update
+   fails, its operations are undone. This is the default.
+   \li \c SwapDirectory: the operations change a copy of the target directory, which replaces
+   the target directory once all updates are installed. The target directory remains
+   consistent and usable during the installation, and the previous version is kept for
+   \ref restorePreviousVersion(). Both trees need to be on one file system, and the parent
+   directory of the target directory has to be writable.
+*/
+void UpdateInstaller::setInstallMode( InstallMode mode )
+{
+    d->installMode = mode;
+}
 
-        Update* const update = *it;
-        if( update->target() != d->target )
-            continue;
+/*!
+   Returns how updates are installed.
+*/
+UpdateInstaller::InstallMode UpdateInstaller::installMode() const
+{
+    return d->installMode;
+}
 
-        connect(update, SIGNAL(progressValue(int)), this, SLOT(slotUpdateDownloadProgress()));
-        connect(update, SIGNAL(finished()), this, SLOT(slotUpdateDownloadDone()));
-        connect(update, SIGNAL(error(int,QString)), this, SLOT(slotUpdateDownloadFailed()) );
-        connect(update, SIGNAL(stopped()), this, SLOT(slotUpdateDownloadDone()));
-        update->download();
+/*!
+   Switches the target directory back to the version it had before the last installation in
+   the \ref SwapDirectory mode, and keeps the current version such that calling this again
+   switches back to it. Returns false and reports an error if there is no previous version or
+   switching fails.
+*/
+bool UpdateInstaller::restorePreviousVersion()
+{
+    DirectorySwap swap( d->target->directory() );
+    if( !swap.rollback() )
+    {
+        reportError( swap.errorString() );
+        return false;
     }
 
-    d->totalProgressPc = updates.count() * 100;
-    d->currentProgressPc = 0;
+    d->target->packagesInfo()->refresh();
+    return true;
+}
 
-    // Wait until all updates have been downloaded
-    while(d->updateDownloadDoneCount + d->updateDownloadFailCount != updates.count() && !d->canceled )
+/*!
+   \internal
+*/
+void UpdateInstaller::doRun()
+{
+    // Complete an installation that was interrupted before starting a new one
+    const QString journalFileName = OperationJournal::defaultFileName( d->target );
+    if( QFile::exists( journalFileName ) )
     {
-        QCoreApplication::processEvents();
-
-        // Normalized progress
-        int progressPc = computePercent(d->currentProgressPc, d->totalProgressPc);
-
-        // Bring the progress to within 50 percent
-        progressPc = (progressPc>>1);
-
-        // Report the progress
-        reportProgress(progressPc, tr("Downloading updates..."));
+        QStringList recoveryErrors;
+        const bool recovered = OperationJournal::recover( journalFileName, d->target, &recoveryErrors );
+        d->target->packagesInfo()->writeToDisk();
+        if( !recovered )
+        {
+            reportError( recoveryErrors.join( QLatin1String( "\n" ) ) );
+            return;
+        }
     }
-    
-    // Global progress
-    reportProgress(50, tr("Updates downloaded..."));
 
-    // Save the current working directory of the application
-    const QDir oldCWD = QDir::current();
-
-    int pcDiff = computePercent(1, updates.count());
-    pcDiff = computeProgressPercentage(50, 95, pcDiff) - 50;
-
-    // Now install one update after another.
-    int i = 0;
-    for( QList< Update* >::const_iterator it = updates.begin(); it != updates.end(); ++it, ++i )
+    // Roll back an interrupted installation into a copy of the target directory, before the
+    // copy is discarded. Its changes outside of the copy would remain otherwise.
+    const QString swapJournalFileName = swapJournalFileNameOf( d->target );
+    if( QFile::exists( swapJournalFileName ) )
     {
-        if( d->canceled )
+        DirectorySwap swap( d->target->directory() );
+        const QString packagesFileName = d->target->packagesXMLFileName();
+        const QString newPackagesFileName = d->packagesFileNameIn( swap );
+        if( !newPackagesFileName.isEmpty() )
+            d->target->setPackagesXMLFileName( newPackagesFileName );
+
+        QStringList recoveryErrors;
+        const bool recovered = OperationJournal::recover( swapJournalFileName, d->target, &recoveryErrors, OperationJournal::RollBackAll );
+        d->target->setPackagesXMLFileName( packagesFileName );
+        swap.discard();
+        if( !recovered )
+        {
+            reportError( recoveryErrors.join( QLatin1String( "\n" ) ) );
             return;
+        }
+    }
 
-        Update* const update = *it;
-
-        // Global progress
-        const QString msg = tr("Installing %1..").arg(update->name());
-        const int minPc = pcDiff*i + 50;
-        const int maxPc = minPc + pcDiff;
-        reportProgress(minPc, msg);
+    // Order the updates such that dependencies are installed first
+    DependencyResolver resolver( d->target );
+    resolver.setUpdates( d->updates );
+    if( !resolver.resolve() )
+    {
+        reportError( resolver.errorString() );
+        return;
+    }
+    const QList<Update*> updates = resolver.orderedUpdates();
+    const QList< QList<Update*> > batches = resolver.batches();
+    d->dependencies.clear();
+    for( QList< Update* >::const_iterator it = updates.begin(); it != updates.end(); ++it )
+        d->dependencies.insert( *it, resolver.dependencies( *it ) );
 
-        if( update->target() != d->target )
-            continue;
+    // Abort before downloading anything if the updates do not fit on disk
+    const QString stagingDirectory = this->stagingDirectory();
+    if( !QDir().mkpath( stagingDirectory ) )
+    {
+        reportError( tr("Could not create the staging directory %1").arg( QDir::toNativeSeparators( stagingDirectory ) ) );
+        return;
+    }
+    d->unpackDirectory = stagingDirectory;
+    if( !d->checkDiskSpace( batches ) )
+        return;
 
-        QDir::setCurrent(oldCWD.absolutePath());
-        if (!installUpdate(update, minPc, maxPc)) {
-            d->target->packagesInfo()->writeToDisk();
+    if( d->installMode == InPlace )
+    {
+        d->installDirectory.clear();
+        if( !d->install( updates, journalFileName ) )
             return;
-        }
     }
+    else
+    {
+        // Install into a copy of the target directory, together with its packages info
+        DirectorySwap swap( d->target->directory() );
+        reportProgress( 0, tr("Copying %1..").arg( QDir::toNativeSeparators( swap.directory() ) ) );
+        if( !swap.prepare() )
+        {
+            reportError( swap.errorString() );
+            return;
+        }
 
-    d->target->packagesInfo()->writeToDisk();
+        d->swap = &swap;
+        d->installDirectory = swap.newDirectory();
+        const QString packagesFileName = d->target->packagesXMLFileName();
+        const QString newPackagesFileName = d->packagesFileNameIn( swap );
+        const bool packagesInTree = !newPackagesFileName.isEmpty();
+        if( packagesInTree )
+            d->target->setPackagesXMLFileName( newPackagesFileName );
+
+        // The journal stays in the target directory, so it survives prepare() of the next run.
+        // install() commits the swap.
+        const bool success = d->install( updates, swapJournalFileName );
+        if( !success )
+            swap.discard();
+
+        // reads the packages info of whichever tree is current now
+        d->swap = 0;
+        d->installDirectory.clear();
+        if( packagesInTree )
+            d->target->setPackagesXMLFileName( packagesFileName );
+        if( !success )
+            return;
+    }
 
     // Global progress
     reportProgress(95, tr("Finished installing updates. Now removing temporary files and directories.."));
 
-    d->tempDirDeleter = 0;
-
-    // Restore the current working directory of the application
-    QDir::setCurrent(oldCWD.absolutePath());
-
-    // Global progress
+    // The unpacked updates were removed together with their install plans
     reportProgress(100, tr("Removed temporary files and directories"));
     reportDone();
 }
@@ -364,242 +620,453 @@ bool UpdateInstaller::doResume()
     return false;
 }
 
-bool UpdateInstaller::installUpdate(Update* update, int minPc, int maxPc)
-{
-    const QString updateName( update->name() );
+/*!
+   \internal
 
-    // Sanity checks
-    if( !update->isDownloaded() )
-    {
-        QString msg = tr("Could not download update '%1'").arg( update->data( QString::fromLatin1( "Name" ) ).toString() );
-        reportError(msg);
-        return false;
-    }
+   Downloads the \a updates and installs each one as soon as its own download is done and the
+   updates it depends on are installed, recording the operations in the journal
+   \a journalFileName. Returns false if an update fails or the installation is canceled, after
+   writing the changes to the packages info made so far.
+
+   When installing into the copy of \ref swap, the installed updates are kept until the copy
+   replaced the target directory, which is done here once all updates are installed. If
+   anything fails before, they are undone, last one first, as their changes outside of the
+   copy are not discarded with it. The journal is only removed after the copy replaced the
+   target directory, so the next run can roll them back if this process dies before.
+
+   Updates touching disjoint files are installed concurrently on the global thread pool, while
+   this thread waits for events, so that the downloads continue. Updates touching the same
+   files are installed one after another, in the order of the dependency resolver once they
+   are unpacked.
+*/
+bool UpdateInstaller::Private::install( const QList<Update*>& updates, const QString& journalFileName )
+{
+    journal = new OperationJournal( journalFileName );
+    std::auto_ptr< OperationJournal > journalDeleter( journal );
+    if( !journal->open() )
+        qDebug( "Installing without journal: %s", qPrintable( journal->errorString() ) );
 
-    // Step 1: Prepare a directory into which the UpdateFile will be unpacked.
-    // If update file is C:/Users/PRASHA~1/AppData/Local/Temp/qt_temp.Hp1204 and
-    // the target name "MyApplication"
-    // Then the directory would be %USERDIR%/AppData/Local/Temp/MyApplication_Update1
-    static int count = 0;
-    const QString dirName = QString::fromLatin1("%1_Update%2").arg( d->target->name(), QString::number(count++) );
-    const QString updateFile = update->downloadedFileName();
-    const QFileInfo fi(updateFile);
-    QDir dir( fi.absolutePath() );
-    dir.mkdir( dirName );
-    dir.cd( dirName );
-    d->tempDirDeleter->add( dir );
-
-    // Step 2: Unpack the update file into the update directory
-    UFUncompressor uncompressor;
-    uncompressor.setFileName( updateFile );
-    uncompressor.setDestination( dir.absolutePath() );
-
-    if (!uncompressor.uncompress()) {
-        reportError(tr("Couldn't uncompress update: %1")
-                    .arg(uncompressor.errorString()));
-        return false;
-    }
+    // Start all downloads
+    downloadsDone.clear();
+    installedUpdates.clear();
+    totalUpdates = updates.count();
 
-    // Step 3: Find out the directory in which UpdateInstructions.xml can be found
-    QDir updateDir = dir;
-    while( !updateDir.exists(QLatin1String( "UpdateInstructions.xml" )) )
+    QList<PreparedUpdate*> waiting;
+    for( QList< Update* >::const_iterator it = updates.begin(); it != updates.end(); ++it )
     {
-        const QString path = updateDir.absolutePath();
-        const QFileInfoList fiList = updateDir.entryInfoList( QDir::Dirs |QDir::NoDotAndDotDot );
-        if( fiList.isEmpty() )
+        if( canceled )
         {
-            QString msg = tr("Could not find UpdateInstructions.xml for %1").arg(update->name());
-            reportError(msg);
+            qDeleteAll( waiting );
+            journal->remove();
             return false;
         }
 
-        updateDir.cd(fiList.first().fileName());
-    }
-
-    // Set the application's current working directory as updateDir
-    QDir::setCurrent(updateDir.absolutePath());
+        Update* const update = *it;
+        if( update->target() != target )
+        {
+            // nothing to wait for
+            installedUpdates.insert( update );
+            continue;
+        }
 
-    // Step 4: Now load the UpdateInstructions.xml file
-    QDomDocument doc;
-    QFile file(updateDir.absoluteFilePath(QLatin1String( "UpdateInstructions.xml" )));
-    if( !file.open(QFile::ReadOnly) )
-    {
-        const QString msg = tr("Could not read UpdateInstructions.xml of %1").arg(update->name());
-        reportError(msg);
-        return false;
-    }
-    if( !doc.setContent(&file) )
-    {
-        const QString msg = tr("Could not read UpdateInstructions.xml of %1").arg(update->name());
-        reportError(msg);
-        return false;
+        QObject::connect(update, SIGNAL(finished()), q, SLOT(slotUpdateDownloadDone()));
+        QObject::connect(update, SIGNAL(error(int,QString)), q, SLOT(slotUpdateDownloadDone()) );
+        QObject::connect(update, SIGNAL(stopped()), q, SLOT(slotUpdateDownloadDone()));
+        update->setDownloadDirectory( q->stagingDirectory() );
+        update->download();
+        waiting.append( new PreparedUpdate( update, target ) );
     }
 
-    // Now parse and execute update operations
-    const int operEListCount = doc.elementsByTagName( QLatin1String( "UpdateOperation" ) ).count();
-    QString msg = tr("Installing %1").arg(updateName);
-
-    QStack< UpdateOperation* > performedOperations;
-    QStack< UpdateOperation* > updatesToDelete;
-    performedOperations.reserve( operEListCount );
-    updatesToDelete.reserve( operEListCount );
-
-    const QDomElement firstOperation = doc.firstChildElement( QLatin1String( "UpdateInstructions" ) ).firstChildElement( QLatin1String( "UpdateOperation" ) );
-
-    int i = 0;
-    for( QDomElement operE = firstOperation; !operE.isNull(); operE = operE.nextSiblingElement( QLatin1String( "UpdateOperation" ) ), ++i )
+    QList<PreparedUpdate*> running;
+    QList<PreparedUpdate*> installed;
+    bool success = true;
+    int reportedPc = -1;
+    QString reportedText;
+    while( !running.isEmpty() || ( success && !waiting.isEmpty() ) )
     {
-        int pc = computePercent( i + 1, operEListCount );
-        pc = computeProgressPercentage(minPc, maxPc, pc);
-        reportProgress(pc, msg);
-
-        // Fetch the important XML elements in UpdateOperation
-        const QDomElement nameE = operE.firstChildElement(QLatin1String( "Name" ));
-        const QDomElement errorE = operE.firstChildElement(QLatin1String( "OnError" ));
-        QDomElement argE = operE.firstChildElement(QLatin1String( "Arg" ));
-
-        // Figure out information about the update operation to perform
-        const QString operName = nameE.text();
-        const QString onError = errorE.attribute(QLatin1String( "Action" ), QLatin1String( "Abort" ) );
-        QStringList args;
-        while( !argE.isNull() )
+        bool changed = false;
+
+        // Collect the updates installed concurrently in the meantime. Deleting them removes
+        // their backups and the unpacked updates, which is delayed while installing into a copy.
+        for( QList< PreparedUpdate* >::iterator it = running.begin(); it != running.end(); )
         {
-            args << argE.text();
-            argE = argE.nextSiblingElement(QLatin1String( "Arg" ));
-        }
+            PreparedUpdate* const prepared = *it;
+            if( !prepared->watcher.isFinished() )
+            {
+                ++it;
+                continue;
+            }
 
-        //QString operSignature = QString::fromLatin1("%1(%2)").arg(operName, args.join( QLatin1String( ", ") ) );
+            it = running.erase( it );
+            success = finishUpdate( prepared ) && success;
+            if( swap && prepared->success )
+                installed.append( prepared );
+            else
+                delete prepared;
+            changed = true;
+        }
+        if( canceled )
+            success = false;
 
-        // Now resolve special fields in arguments
-        d->resolveArguments(args);
+        // Start the updates that are ready, unless they touch files of a running update or of
+        // an earlier unpacked one. Updates with unknown effects are installed on their own.
+        QStringList blockedPaths;
+        for( QList< PreparedUpdate* >::const_iterator it = running.begin(); it != running.end(); ++it )
+            blockedPaths += (*it)->paths;
+        bool blockedAll = false;
 
-        // Fetch update operation
-        UpdateOperation* const updateOperation = UpdateOperationFactory::instance().create( operName, args, d->target );
-        if( !updateOperation )
+        for( QList< PreparedUpdate* >::iterator it = waiting.begin(); success && it != waiting.end(); )
         {
-            reportError( tr( "Update operation %1 not supported" ).arg( operName ) );
+            PreparedUpdate* const prepared = *it;
+            if( !prepared->unpacked )
+            {
+                if( !isReady( prepared->update ) )
+                {
+                    ++it;
+                    continue;
+                }
+
+                q->reportProgress( progressOf( installedUpdates.count() ), tr("Unpacking %1..").arg( prepared->update->name() ) );
+                prepared->unpacked = true;
+                changed = true;
+                if( !prepareUpdate( prepared ) )
+                {
+                    success = false;
+                    break;
+                }
+            }
 
-            if( onError == QLatin1String( "Continue" ) )
+            const bool blocked = blockedAll || ( prepared->exclusive ? !blockedPaths.isEmpty() || !running.isEmpty() : pathsOverlap( prepared->paths, blockedPaths ) );
+            blockedAll = blockedAll || prepared->exclusive;
+            blockedPaths += prepared->paths;
+            if( blocked )
+            {
+                ++it;
                 continue;
+            }
 
-            else if( onError == QLatin1String( "Abort" ) )
+            it = waiting.erase( it );
+            changed = true;
+            if( !startUpdate( prepared, running ) )
             {
-                qDeleteAll( updatesToDelete );
-                return false;
+                success = false;
+                delete prepared;
+                break;
             }
 
-            else if( onError == QLatin1String( "AskUser" ) )
+            if( !prepared->exclusive )
             {
-                // TODO:
+                running.append( prepared );
                 continue;
             }
+
+            // installed in this thread already
+            success = finishUpdate( prepared );
+            if( swap && prepared->success )
+                installed.append( prepared );
+            else
+                delete prepared;
+            break;
         }
 
-        // Now execute the update operation
-        updateOperation->backup();
-        updatesToDelete.push( updateOperation );
-        if( !updateOperation->performOperation() )
+        if( changed )
+            continue;
+
+        // Nothing to do until a download or an update is done
+        int pc = progressOf( installedUpdates.count() );
+        QString text;
+        if( running.count() == 1 )
+            text = tr("Installing %1..").arg( running.first()->update->name() );
+        else if( !running.isEmpty() )
+            text = tr("Installing %n updates..", 0, running.count());
+        else if( !waiting.isEmpty() )
+        {
+            const Update* const update = waiting.first()->update;
+            pc = computeProgressPercentage( pc, progressOf( installedUpdates.count() + 1 ), update->progressPercent() );
+            text = tr("Downloading %1..").arg( update->name() );
+        }
+        if( pc != reportedPc || text != reportedText )
         {
-            reportError( tr("Cannot execute '%1'").arg( updateOperation->operationCommand() ) );
-            
-            updateOperation->undoOperation();
+            q->reportProgress( pc, text );
+            reportedPc = pc;
+            reportedText = text;
+        }
 
-            if( onError == QLatin1String( "Continue" ) )
-                continue;
+        if( !running.isEmpty() || ( success && !waiting.isEmpty() ) )
+            QCoreApplication::processEvents( QEventLoop::WaitForMoreEvents );
+    }
 
-            else if( onError == QLatin1String( "Abort" ) )
-            {
-                while( !performedOperations.isEmpty() )
-                    performedOperations.pop()->undoOperation();
-                qDeleteAll( updatesToDelete );
-                return false;
-            }
+    qDeleteAll( waiting );
 
-            else if( onError == QLatin1String( "AskUser" ) )
-            {
-                // TODO:
-                continue;
-            }
-        }
-        else
+    // The packages info in the copy has to be written before the copy replaces the target directory
+    if( success && swap )
+    {
+        target->packagesInfo()->writeToDisk();
+        if( !swap->commit() )
         {
-            performedOperations.push( updateOperation );
+            q->reportError( swap->errorString() );
+            success = false;
         }
     }
 
-    Q_FOREACH( UpdateOperation* updateOperation, update->operations() )
+    if( !success )
     {
-        updateOperation->backup();
-        if( !updateOperation->performOperation() )
+        for( QList< PreparedUpdate* >::const_iterator it = installed.constEnd(); it != installed.constBegin(); )
         {
-            reportError( tr("Cannot execute '%1'").arg( updateOperation->operationCommand() ) );
-            
-            updateOperation->undoOperation();
-            
-            while( !performedOperations.isEmpty() )
-                performedOperations.pop()->undoOperation();
+            --it;
+            if( !undoUpdate( *it ) )
+                q->reportError( tr("Cannot undo the installation of %1").arg( (*it)->update->name() ) );
+        }
+        qDeleteAll( installed );
+
+        // the downloads were stopped when canceling
+        if( !canceled )
+            stopDownloads( updates );
+        target->packagesInfo()->writeToDisk();
+        journal->remove();
+        QDir().rmdir( unpackDirectory );
+        return false;
+    }
+
+    if( !swap )
+        target->packagesInfo()->writeToDisk();
+    journal->remove();
+    // the backups are needed until the journal is gone
+    qDeleteAll( installed );
+
+    // The downloaded files remain until the updates are destroyed
+    QDir().rmdir( unpackDirectory );
+    return true;
+}
+
+/*!
+   \internal
+
+   Returns true if the download of \a update is done and the updates it depends on are installed.
+*/
+bool UpdateInstaller::Private::isReady( Update* update ) const
+{
+    if( !downloadsDone.contains( update ) )
+        return false;
+
+    const QList<Update*> required = dependencies.value( update );
+    for( QList< Update* >::const_iterator it = required.begin(); it != required.end(); ++it )
+    {
+        if( !installedUpdates.contains( *it ) )
             return false;
+    }
+    return true;
+}
+
+/*!
+   \internal
+
+   Returns the file name of the packages info of the target in the new tree of \a swap, or an
+   empty string if the packages info is not inside the target directory.
+*/
+QString UpdateInstaller::Private::packagesFileNameIn( const DirectorySwap& swap ) const
+{
+    const QString relativePackagesFileName = QDir( swap.directory() ).relativeFilePath( target->packagesXMLFileName() );
+    if( QDir::isAbsolutePath( relativePackagesFileName ) || relativePackagesFileName.startsWith( QLatin1String( "../" ) ) )
+        return QString();
+    return QDir( swap.newDirectory() ).absoluteFilePath( relativePackagesFileName );
+}
+
+/*!
+   \internal
+
+   Returns the progress percentage once \a done updates are installed.
+*/
+int UpdateInstaller::Private::progressOf( int done ) const
+{
+    return computeProgressPercentage( 0, 95, computePercent( done, totalUpdates ) );
+}
+
+/*!
+   \internal
+
+   Checks that the file systems involved have enough space for installing the updates of
+   \a batches, from the sizes declared in Updates.xml. Updates whose uncompressed size is not
+   declared are not accounted for.
+
+   All downloads run at the same time, while each update is unpacked only until it is
+   installed. The largest batch of independent updates is taken as an estimate of the updates
+   unpacked at the same time. The installed files take at most the uncompressed size of the updates on the file
+   system of the target. If only the staging directory lacks space, \ref unpackDirectory is
+   set to the default staging directory on the file system of the target. Returns false and reports an error if
+   this does not help either.
+*/
+bool UpdateInstaller::Private::checkDiskSpace( const QList< QList<Update*> >& batches )
+{
+    qint64 downloads = 0;
+    qint64 largestBatch = 0;
+    qint64 installed = 0;
+    for( QList< QList<Update*> >::const_iterator it = batches.begin(); it != batches.end(); ++it )
+    {
+        qint64 unpacked = 0;
+        for( QList< Update* >::const_iterator uit = it->begin(); uit != it->end(); ++uit )
+        {
+            if( (*uit)->target() != target )
+                continue;
+            downloads += (*uit)->compressedSize();
+            unpacked += (*uit)->uncompressedSize();
         }
-        else
+        largestBatch = qMax( largestBatch, unpacked );
+        installed += unpacked;
+    }
+
+    const QString stagingRoot = fileSystemRoot( unpackDirectory );
+    const QString targetRoot = fileSystemRoot( target->directory() );
+
+    QMap<QString, qint64> space;
+    space[ stagingRoot ] += downloads + largestBatch;
+    space[ targetRoot ] += installed;
+
+    QString error;
+    if( hasEnoughSpace( space, &error ) )
+        return true;
+
+    // Unpack on the file system of the target if only the staging directory is too small
+    if( stagingRoot != targetRoot )
+    {
+        QMap<QString, qint64> alternative;
+        alternative[ stagingRoot ] += downloads;
+        alternative[ targetRoot ] += largestBatch + installed;
+        if( hasEnoughSpace( alternative, 0 ) )
         {
-            performedOperations.push( updateOperation );
+            unpackDirectory = QDir( target->directory() ).absoluteFilePath( QLatin1String( ".kdupdater/staging" ) );
+            qDebug( "Unpacking updates into %s: %s", qPrintable( unpackDirectory ), qPrintable( error ) );
+            return true;
         }
     }
 
-    // now delete all operations, this will remove the backups as well
-    qDeleteAll( updatesToDelete );
+    q->reportError( error );
+    return false;
+}
+
+/*!
+   \internal
+
+   Unpacks the update of \a prepared into \ref unpackDirectory and compiles its
+   UpdateInstructions.xml into the install plan of \a prepared, installing into
+   \ref installDirectory if set. Relative paths in the arguments of the operations are
+   resolved against the directory UpdateInstructions.xml was found in.
+*/
+bool UpdateInstaller::Private::prepareUpdate( PreparedUpdate* prepared )
+{
+    InstallPlan& plan = prepared->plan;
+    plan.setTargetDirectory( installDirectory );
+    plan.setUnpackDirectory( unpackDirectory );
+    const bool success = plan.addUpdate( prepared->update );
+
+    const QStringList warnings = plan.warnings();
+    for( QStringList::const_iterator it = warnings.begin(); it != warnings.end(); ++it )
+        q->reportError( *it );
+    if( !success )
+    {
+        q->reportError( plan.errorString() );
+        return false;
+    }
+
+    for( int index = 0; index < plan.stepCount(); ++index )
+    {
+        const UpdateOperation* const operation = plan.step( index ).operation;
+        if( !addTouchedPaths( prepared, operation, operation->workingDirectory() ) )
+            prepared->exclusive = true;
+    }
 
-    msg = tr("Finished installing update %1").arg(update->name());
-    reportProgress(maxPc, msg);
+    // The costs are needed to measure the throughput once the update is installed
+    plan.estimateCosts();
     return true;
 }
 
 /*!
    \internal
+
+   Checks the space needed by the operations of \a prepared together with the updates still
+   \a running, detaches the files it changes from the target directory, and starts installing
+   it. Updates with unknown effects are installed in this thread before this returns, all
+   others on the global thread pool.
 */
-void UpdateInstaller::Private::slotUpdateDownloadProgress()
+bool UpdateInstaller::Private::startUpdate( PreparedUpdate* prepared, const QList<PreparedUpdate*>& running )
 {
-    // calculate the global download progress
-    currentProgressPc = 0;
-    
-    for( QList< Update* >::const_iterator it = updates.begin(); it != updates.end(); ++it )
-        currentProgressPc += (*it)->progressPercent();
+    QMap<QString, qint64> space = prepared->plan.requiredSpace();
+    for( QList< PreparedUpdate* >::const_iterator it = running.begin(); it != running.end(); ++it )
+    {
+        const QMap<QString, qint64> required = (*it)->plan.requiredSpace();
+        for( QMap< QString, qint64 >::const_iterator sit = required.begin(); sit != required.end(); ++sit )
+            space[ sit.key() ] += sit.value();
+    }
+    QString spaceError;
+    if( !hasEnoughSpace( space, &spaceError ) )
+    {
+        q->reportError( spaceError );
+        return false;
+    }
+
+    // Files shared with the target directory must not be modified in place
+    if( swap && !( prepared->exclusive ? swap->detachAll() : swap->detach( prepared->paths ) ) )
+    {
+        q->reportError( swap->errorString() );
+        return false;
+    }
+
+    prepared->journal = journal;
+    prepared->journalUpdate = journal->beginUpdate( prepared->update->name() );
+    if( !prepared->exclusive )
+    {
+        prepared->watcher.setFuture( QtConcurrent::run( executeUpdate, prepared ) );
+        return true;
+    }
+
+    q->reportProgress( progressOf( installedUpdates.count() ), tr("Installing %1..").arg( prepared->update->name() ) );
+    executeUpdate( prepared );
+    return true;
 }
 
 /*!
    \internal
+
+   Reports the errors and the progress of the installed update \a prepared. Returns true if it
+   was installed successfully.
 */
-void UpdateInstaller::Private::slotUpdateDownloadDone()
+bool UpdateInstaller::Private::finishUpdate( PreparedUpdate* prepared )
 {
-    ++updateDownloadDoneCount;
+    for( QStringList::const_iterator it = prepared->errors.begin(); it != prepared->errors.end(); ++it )
+        q->reportError( *it );
+    if( prepared->plan.removedSteps() > 0 )
+        qDebug( "Optimized %s: %d operations and %lld bytes saved", qPrintable( prepared->update->name() ),
+                prepared->plan.removedSteps(), prepared->plan.savedBytes() );
+    if( !prepared->success )
+        return false;
+
+    prepared->plan.recordDuration( prepared->duration );
+    installedUpdates.insert( prepared->update );
+    q->reportProgress( progressOf( installedUpdates.count() ), tr("Finished installing update %1").arg( prepared->update->name() ) );
+    return true;
 }
 
 /*!
- * \internal
- */
-void UpdateInstaller::Private::slotUpdateDownloadFailed()
+   \internal
+
+   Called when the download of an update completed, failed or was stopped.
+*/
+void UpdateInstaller::Private::slotUpdateDownloadDone()
 {
-    ++updateDownloadFailCount;
+    downloadsDone.insert( q->sender() );
 }
 
-void UpdateInstaller::Private::resolveArguments(QStringList& args)
+/*!
+   \internal
+
+   Stops the downloads of \a updates that are still running, after the installation failed.
+*/
+void UpdateInstaller::Private::stopDownloads(const QList<Update*>& updates)
 {
-    for( QStringList::iterator it = args.begin(); it != args.end(); ++it )
+    for( QList< Update* >::const_iterator it = updates.begin(); it != updates.end(); ++it )
     {
-        QString arg = *it;
-
-        arg = arg.replace(QLatin1String( "{APPDIR}" ), QDir::toNativeSeparators( target->directory() ) ); // backwards compat
-        arg = arg.replace(QLatin1String( "{TARGETDIR}" ), QDir::toNativeSeparators( target->directory() ) );
-        arg = arg.replace(QLatin1String( "{HOME}" ), QDir::toNativeSeparators( QDir::homePath() ) );
-        arg = arg.replace(QLatin1String( "{APPNAME}" ), target->name());  // backwards compat
-        arg = arg.replace(QLatin1String( "{TARGETNAME}" ), target->name());
-        arg = arg.replace(QLatin1String( "{APPVERSION}" ), target->version());  // backwards compat
-        arg = arg.replace(QLatin1String( "{TARGETVERSION}" ), target->version());
-        arg = arg.replace(QLatin1String( "{CURPATH}" ), QDir::toNativeSeparators( QDir::currentPath() ) );
-        arg = arg.replace(QLatin1String( "{ROOT}" ), QDir::toNativeSeparators( QDir::rootPath() ) );
-        arg = arg.replace(QLatin1String( "{TEMP}" ), QDir::toNativeSeparators( QDir::tempPath() ) );
-
-        *it = arg;
+        if( (*it)->isRunning() && !downloadsDone.contains( *it ) )
+            (*it)->stop();
     }
 }
 
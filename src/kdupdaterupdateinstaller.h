@@ -34,6 +34,7 @@
 QT_BEGIN_NAMESPACE
 template< typename T >
 class QList;
+class QString;
 QT_END_NAMESPACE
 
 namespace KDUpdater
@@ -46,6 +47,12 @@ namespace KDUpdater
         Q_OBJECT
 
     public:
+        enum InstallMode
+        {
+            InPlace,
+            SwapDirectory
+        };
+
         explicit UpdateInstaller( Target * target );
         ~UpdateInstaller();
 
@@ -54,6 +61,14 @@ namespace KDUpdater
         void setUpdatesToInstall(const QList<Update*>& updates);
         QList<Update*> updatesToInstall() const;
 
+        void setStagingDirectory( const QString& directory );
+        QString stagingDirectory() const;
+
+        void setInstallMode( InstallMode mode );
+        InstallMode installMode() const;
+
+        bool restorePreviousVersion();
+
 #ifndef KDUPDATER_NO_COMPAT
         Application * application() const { return dynamic_cast<Application*>( target() ); }
 #endif // KDUPDATER_NO_COMPAT
@@ -64,14 +79,10 @@ namespace KDUpdater
         bool doPause();
         bool doResume();
 
-        bool installUpdate(Update* update, int minPc, int maxPc);
-
         class Private;
         kdtools::pimpl_ptr<Private> d;
 
-        Q_PRIVATE_SLOT( d, void slotUpdateDownloadProgress() )
         Q_PRIVATE_SLOT( d, void slotUpdateDownloadDone() )
-        Q_PRIVATE_SLOT( d, void slotUpdateDownloadFailed() )
     };
 
 }
@@ -0,0 +1,562 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#include "kdupdaterupdateinstructions_p.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+#include <QHash>
+#include <QStringList>
+#include <QVector>
+#include <QXmlStreamReader>
+
+/*!
+   \internal
+   \class KDUpdater::UpdateInstructions kdupdaterupdateinstructions_p.h
+   \brief UpdateInstructions.xml compiled into a compact list of operations
+
+   The operations are stored in a single array of integers. Every operation consists of the
+   index of its name, the index of its action on error, the number of arguments, and for every
+   argument the number of its segments followed by the segments. A segment is either the index
+   of a literal string, or a negative number referring to a placeholder like {TARGETDIR}. All
+   strings are stored once in a string table.
+
+   Arguments are split into literals and placeholders once while compiling, so resolving the
+   placeholders is a concatenation. An argument without placeholders is a shared copy of its
+   literal.
+
+   ufcreator compiles every UpdateInstructions.xml into UpdateInstructions.kdc next to it in
+   the update file, see \ref compiledFileName(). \ref load() reads the compiled form if it exists
+   and was compiled from the same XML, and parses the XML in a single streaming pass otherwise.
+*/
+
+using namespace KDUpdater;
+
+// "KDUI"
+static const quint32 CompiledMagic = 0x4B445549;
+static const quint32 CompiledVersion = 1;
+
+static const char* const placeholderNames[] = {
+    "APPDIR", "TARGETDIR", "HOME", "APPNAME", "TARGETNAME", "APPVERSION", "TARGETVERSION", "CURPATH", "ROOT", "TEMP"
+};
+
+class UpdateInstructions::Private
+{
+public:
+    QStringList strings;
+    QVector< qint32 > code;
+    QVector< int > offsets;
+    QString errorString;
+
+    QHash< QString, int > stringIndexes;
+
+    void clear();
+    int intern( const QString& string );
+    void compileArgument( const QString& arg );
+    void compileOperation( QXmlStreamReader& reader );
+    bool buildOffsets();
+};
+
+void UpdateInstructions::Private::clear()
+{
+    strings.clear();
+    code.clear();
+    offsets.clear();
+    stringIndexes.clear();
+    errorString.clear();
+}
+
+int UpdateInstructions::Private::intern( const QString& string )
+{
+    const QHash< QString, int >::const_iterator it = stringIndexes.constFind( string );
+    if( it != stringIndexes.constEnd() )
+        return it.value();
+
+    const int index = strings.count();
+    strings.append( string );
+    stringIndexes.insert( string, index );
+    return index;
+}
+
+/*!
+   \internal
+   Appends \a arg split into literals and placeholders to the code.
+*/
+void UpdateInstructions::Private::compileArgument( const QString& arg )
+{
+    QVector< qint32 > segments;
+    int literalStart = 0;
+    int pos = 0;
+    while( true )
+    {
+        const int open = arg.indexOf( QLatin1Char( '{' ), pos );
+        const int close = open == -1 ? -1 : arg.indexOf( QLatin1Char( '}' ), open + 1 );
+        if( close == -1 )
+            break;
+
+        const QStringRef name = arg.midRef( open + 1, close - open - 1 );
+        int placeholder = 0;
+        while( placeholder < PlaceholderCount && name != QLatin1String( placeholderNames[ placeholder ] ) )
+            ++placeholder;
+        if( placeholder == PlaceholderCount )
+        {
+            pos = open + 1;
+            continue;
+        }
+
+        if( open > literalStart )
+            segments.append( intern( arg.mid( literalStart, open - literalStart ) ) );
+        segments.append( -placeholder - 1 );
+        literalStart = pos = close + 1;
+    }
+
+    if( literalStart < arg.length() || segments.isEmpty() )
+        segments.append( intern( arg.mid( literalStart ) ) );
+
+    code.append( segments.count() );
+    code += segments;
+}
+
+/*!
+   \internal
+   Compiles the UpdateOperation element \a reader is positioned at.
+*/
+void UpdateInstructions::Private::compileOperation( QXmlStreamReader& reader )
+{
+    QString name;
+    QString onError = QLatin1String( "Abort" );
+    bool hasName = false;
+    bool hasOnError = false;
+    QStringList args;
+
+    while( reader.readNextStartElement() )
+    {
+        if( reader.name() == QLatin1String( "Name" ) && !hasName )
+        {
+            name = reader.readElementText( QXmlStreamReader::IncludeChildElements );
+            hasName = true;
+        }
+        else if( reader.name() == QLatin1String( "OnError" ) && !hasOnError )
+        {
+            if( reader.attributes().hasAttribute( QLatin1String( "Action" ) ) )
+                onError = reader.attributes().value( QLatin1String( "Action" ) ).toString();
+            hasOnError = true;
+            reader.skipCurrentElement();
+        }
+        else if( reader.name() == QLatin1String( "Arg" ) )
+        {
+            args.append( reader.readElementText( QXmlStreamReader::IncludeChildElements ) );
+        }
+        else
+        {
+            reader.skipCurrentElement();
+        }
+    }
+
+    code.append( intern( name ) );
+    code.append( intern( onError ) );
+    code.append( args.count() );
+    for( QStringList::const_iterator it = args.begin(); it != args.end(); ++it )
+        compileArgument( *it );
+}
+
+/*!
+   \internal
+   Finds the start of every operation in the code. Returns false if the code is corrupt.
+*/
+bool UpdateInstructions::Private::buildOffsets()
+{
+    offsets.clear();
+    const int size = code.count();
+    const int stringCount = strings.count();
+    int pos = 0;
+    while( pos < size )
+    {
+        offsets.append( pos );
+        if( pos + 3 > size || code.at( pos ) < 0 || code.at( pos ) >= stringCount ||
+            code.at( pos + 1 ) < 0 || code.at( pos + 1 ) >= stringCount || code.at( pos + 2 ) < 0 )
+            return false;
+
+        const int argCount = code.at( pos + 2 );
+        pos += 3;
+        for( int arg = 0; arg < argCount; ++arg )
+        {
+            if( pos >= size || code.at( pos ) < 0 || pos + 1 + code.at( pos ) > size )
+                return false;
+
+            const int segmentCount = code.at( pos++ );
+            for( int segment = 0; segment < segmentCount; ++segment, ++pos )
+            {
+                if( code.at( pos ) >= stringCount || code.at( pos ) < -PlaceholderCount )
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+UpdateInstructions::UpdateInstructions()
+    : d( new Private )
+{
+}
+
+UpdateInstructions::~UpdateInstructions()
+{
+}
+
+/*!
+   Returns a human-readable description of the last error.
+*/
+QString UpdateInstructions::errorString() const
+{
+    return d->errorString;
+}
+
+/*!
+   Loads the UpdateInstructions.xml file \a fileName. If the file returned by
+   \ref compiledFileName() exists and was compiled from the same XML, it is read instead of
+   parsing the XML.
+*/
+bool UpdateInstructions::load( const QString& fileName )
+{
+    QFile file( fileName );
+    if( !file.open( QIODevice::ReadOnly ) )
+    {
+        d->clear();
+        d->errorString = tr( "Could not open %1: %2" ).arg( fileName, file.errorString() );
+        return false;
+    }
+    const QByteArray xml = file.readAll();
+
+    QFile compiledFile( compiledFileName( fileName ) );
+    if( compiledFile.open( QIODevice::ReadOnly ) && fromBinary( compiledFile.readAll(), hash( xml ) ) )
+        return true;
+
+    return parse( xml );
+}
+
+/*!
+   Compiles the UpdateInstructions.xml contents \a xml. Returns false and sets
+   \ref errorString() if \a xml is not well-formed.
+*/
+bool UpdateInstructions::parse( const QByteArray& xml )
+{
+    d->clear();
+
+    QXmlStreamReader reader( xml );
+    if( reader.readNextStartElement() && reader.name() == QLatin1String( "UpdateInstructions" ) )
+    {
+        while( reader.readNextStartElement() )
+        {
+            if( reader.name() == QLatin1String( "UpdateOperation" ) )
+                d->compileOperation( reader );
+            else
+                reader.skipCurrentElement();
+        }
+    }
+
+    // the remainder has to be well-formed as well
+    while( !reader.atEnd() )
+        reader.readNext();
+
+    if( reader.hasError() )
+    {
+        const QString msg = tr( "Parse error in line %1, column %2: %3" )
+                            .arg( reader.lineNumber() ).arg( reader.columnNumber() ).arg( reader.errorString() );
+        d->clear();
+        d->errorString = msg;
+        return false;
+    }
+
+    d->stringIndexes.clear();
+    return d->buildOffsets();
+}
+
+/*!
+   Reads instructions written by \ref toBinary(). Returns false if \a data is corrupt or was not
+   compiled from XML with the hash \a xmlHash.
+*/
+bool UpdateInstructions::fromBinary( const QByteArray& data, const QByteArray& xmlHash )
+{
+    d->clear();
+
+    QDataStream stream( data );
+    stream.setVersion( QDataStream::Qt_5_0 );
+
+    quint32 magic = 0;
+    quint32 version = 0;
+    QByteArray compiledHash;
+    stream >> magic >> version;
+    if( magic != CompiledMagic || version != CompiledVersion )
+        return false;
+
+    stream >> compiledHash;
+    if( compiledHash != xmlHash )
+        return false;
+
+    stream >> d->strings >> d->code;
+    if( stream.status() != QDataStream::Ok || !d->buildOffsets() )
+    {
+        d->clear();
+        return false;
+    }
+    return true;
+}
+
+/*!
+   Returns the compiled instructions, to be read by \ref fromBinary(). \a xmlHash is the hash
+   of the XML they were compiled from, see \ref hash().
+*/
+QByteArray UpdateInstructions::toBinary( const QByteArray& xmlHash ) const
+{
+    QByteArray data;
+    QDataStream stream( &data, QIODevice::WriteOnly );
+    stream.setVersion( QDataStream::Qt_5_0 );
+    stream << CompiledMagic << CompiledVersion << xmlHash << d->strings << d->code;
+    return data;
+}
+
+/*!
+   Returns the number of operations.
+*/
+int UpdateInstructions::count() const
+{
+    return d->offsets.count();
+}
+
+/*!
+   Returns the name of the operation at \a index.
+*/
+QString UpdateInstructions::name( int index ) const
+{
+    return d->strings.at( d->code.at( d->offsets.at( index ) ) );
+}
+
+/*!
+   Returns the action to take if the operation at \a index fails: "Abort", "Continue" or "AskUser".
+*/
+QString UpdateInstructions::onError( int index ) const
+{
+    return d->strings.at( d->code.at( d->offsets.at( index ) + 1 ) );
+}
+
+/*!
+   Returns the arguments of the operation at \a index, with placeholders replaced by \a values.
+   \a values has one entry per \ref Placeholder.
+*/
+QStringList UpdateInstructions::arguments( int index, const QStringList& values ) const
+{
+    Q_ASSERT( values.count() == PlaceholderCount );
+
+    const qint32* code = d->code.constData() + d->offsets.at( index ) + 2;
+    const int argCount = *code++;
+
+    QStringList args;
+    args.reserve( argCount );
+    for( int arg = 0; arg < argCount; ++arg )
+    {
+        const int segmentCount = *code++;
+        if( segmentCount == 1 && *code >= 0 )
+        {
+            args.append( d->strings.at( *code++ ) );
+            continue;
+        }
+
+        QString resolved;
+        for( int segment = 0; segment < segmentCount; ++segment, ++code )
+            resolved += *code >= 0 ? d->strings.at( *code ) : values.at( -*code - 1 );
+        args.append( resolved );
+    }
+    return args;
+}
+
+/*!
+   Returns the hash identifying the UpdateInstructions.xml contents \a xml.
+*/
+QByteArray UpdateInstructions::hash( const QByteArray& xml )
+{
+    return QCryptographicHash::hash( xml, QCryptographicHash::Md5 );
+}
+
+/*!
+   Returns the name of the compiled form of the UpdateInstructions.xml file \a fileName.
+*/
+QString UpdateInstructions::compiledFileName( const QString& fileName )
+{
+    if( fileName.endsWith( QLatin1String( ".xml" ) ) )
+        return fileName.left( fileName.length() - 4 ) + QLatin1String( ".kdc" );
+    return fileName + QLatin1String( ".kdc" );
+}
+
+/*!
+   Compiles the UpdateInstructions.xml contents \a xml and returns the compiled form. Returns
+   an empty byte array and sets \a errorString if \a xml is not well-formed.
+*/
+QByteArray UpdateInstructions::compile( const QByteArray& xml, QString* errorString )
+{
+    UpdateInstructions instructions;
+    if( !instructions.parse( xml ) )
+    {
+        if( errorString )
+            *errorString = instructions.errorString();
+        return QByteArray();
+    }
+    return instructions.toBinary( hash( xml ) );
+}
+
+#ifdef KDTOOLSCORE_UNITTESTS
+
+#include <KDUnitTest/Test>
+
+#include <QDir>
+#include <QUuid>
+
+/*!
+   \internal
+   Returns compiled instructions with the \a strings and \a code given, as if written by
+   \ref UpdateInstructions::toBinary() for \a xmlHash.
+ */
+static QByteArray compiledTestData( const QByteArray& xmlHash, const QStringList& strings, const QVector< qint32 >& code )
+{
+    QByteArray data;
+    QDataStream stream( &data, QIODevice::WriteOnly );
+    stream.setVersion( QDataStream::Qt_5_0 );
+    stream << CompiledMagic << CompiledVersion << xmlHash << strings << code;
+    return data;
+}
+
+KDAB_UNITTEST_SIMPLE( UpdateInstructions, "kdupdater" ) {
+    const QByteArray xml =
+        "<UpdateInstructions>"
+        "<UpdateOperation><Name>Copy</Name><OnError Action=\"Continue\"/>"
+        "<Arg>{TARGETDIR}/bin/{APPNAME}.exe</Arg><Arg>{HOME}</Arg><Arg>plain</Arg><Arg/></UpdateOperation>"
+        "<Unknown><UpdateOperation><Name>Ignored</Name></UpdateOperation></Unknown>"
+        "<UpdateOperation><Name>Execute</Name><Arg>{FOO}{TEMP}{</Arg><Arg>{TARGETDIR}{TARGETDIR}</Arg></UpdateOperation>"
+        "</UpdateInstructions>";
+
+    QStringList values;
+    for( int i = 0; i < UpdateInstructions::PlaceholderCount; ++i )
+        values.append( QLatin1Char( '<' ) + QString::fromLatin1( placeholderNames[ i ] ).toLower() + QLatin1Char( '>' ) );
+
+    UpdateInstructions instructions;
+    assertTrue( instructions.parse( xml ) );
+    assertTrue( instructions.errorString().isEmpty() );
+    assertEqual( instructions.count(), 2 );
+
+    assertEqual( instructions.name( 0 ), QLatin1String( "Copy" ) );
+    assertEqual( instructions.onError( 0 ), QLatin1String( "Continue" ) );
+    assertEqual( instructions.arguments( 0, values ), QStringList() << QLatin1String( "<targetdir>/bin/<appname>.exe" )
+                                                                   << QLatin1String( "<home>" )
+                                                                   << QLatin1String( "plain" )
+                                                                   << QString() );
+
+    // unknown tokens stay as they are, a missing OnError aborts
+    assertEqual( instructions.name( 1 ), QLatin1String( "Execute" ) );
+    assertEqual( instructions.onError( 1 ), QLatin1String( "Abort" ) );
+    assertEqual( instructions.arguments( 1, values ), QStringList() << QLatin1String( "{FOO}<temp>{" )
+                                                                   << QLatin1String( "<targetdir><targetdir>" ) );
+
+    // round trip through the compiled form
+    const QByteArray xmlHash = UpdateInstructions::hash( xml );
+    const QByteArray binary = instructions.toBinary( xmlHash );
+    assertEqual( UpdateInstructions::compile( xml, 0 ), binary );
+    {
+        UpdateInstructions compiled;
+        assertTrue( compiled.fromBinary( binary, xmlHash ) );
+        assertEqual( compiled.count(), 2 );
+        for( int i = 0; i < compiled.count(); ++i )
+        {
+            assertEqual( compiled.name( i ), instructions.name( i ) );
+            assertEqual( compiled.onError( i ), instructions.onError( i ) );
+            assertEqual( compiled.arguments( i, values ), instructions.arguments( i, values ) );
+        }
+
+        // compiled from other XML
+        assertFalse( compiled.fromBinary( binary, UpdateInstructions::hash( xml + ' ' ) ) );
+        assertEqual( compiled.count(), 0 );
+        assertFalse( compiled.fromBinary( binary.left( binary.size() - 3 ), xmlHash ) );
+        assertFalse( compiled.fromBinary( QByteArray(), xmlHash ) );
+    }
+
+    // corrupt code is rejected by buildOffsets()
+    {
+        const QStringList strings = QStringList() << QLatin1String( "Copy" ) << QLatin1String( "Abort" ) << QLatin1String( "a" );
+        UpdateInstructions compiled;
+        assertTrue( compiled.fromBinary( compiledTestData( xmlHash, strings, QVector< qint32 >() << 0 << 1 << 1 << 2 << 2 << -1 ), xmlHash ) );
+        assertEqual( compiled.arguments( 0, values ), QStringList() << QLatin1String( "a<appdir>" ) );
+
+        // a string index out of range
+        assertFalse( compiled.fromBinary( compiledTestData( xmlHash, strings, QVector< qint32 >() << 0 << 3 << 0 ), xmlHash ) );
+        // a segment out of range
+        assertFalse( compiled.fromBinary( compiledTestData( xmlHash, strings, QVector< qint32 >() << 0 << 1 << 1 << 1 << 3 ), xmlHash ) );
+        // an unknown placeholder
+        assertFalse( compiled.fromBinary( compiledTestData( xmlHash, strings, QVector< qint32 >() << 0 << 1 << 1 << 1 << -UpdateInstructions::PlaceholderCount - 1 ), xmlHash ) );
+        // more arguments than code
+        assertFalse( compiled.fromBinary( compiledTestData( xmlHash, strings, QVector< qint32 >() << 0 << 1 << 2 << 1 << 2 ), xmlHash ) );
+        // more segments than code
+        assertFalse( compiled.fromBinary( compiledTestData( xmlHash, strings, QVector< qint32 >() << 0 << 1 << 1 << 3 << 2 ), xmlHash ) );
+        // a truncated operation
+        assertFalse( compiled.fromBinary( compiledTestData( xmlHash, strings, QVector< qint32 >() << 0 << 1 ), xmlHash ) );
+        assertEqual( compiled.count(), 0 );
+    }
+
+    // XML which is not well-formed
+    assertFalse( instructions.parse( "<UpdateInstructions><UpdateOperation><Name>Copy</Name></UpdateInstructions>" ) );
+    assertFalse( instructions.errorString().isEmpty() );
+    assertEqual( instructions.count(), 0 );
+    QString errorString;
+    assertTrue( UpdateInstructions::compile( "<UpdateInstructions>", &errorString ).isEmpty() );
+    assertFalse( errorString.isEmpty() );
+
+    // load() prefers the compiled form if it belongs to the XML
+    const QDir dir( QDir::temp().filePath( QString::fromLatin1( "kdupdater-instructions-test%1" ).arg( QUuid::createUuid().toString() ) ) );
+    assertTrue( QDir().mkpath( dir.path() ) );
+    const QString fileName = dir.filePath( QLatin1String( "UpdateInstructions.xml" ) );
+    assertEqual( UpdateInstructions::compiledFileName( fileName ), dir.filePath( QLatin1String( "UpdateInstructions.kdc" ) ) );
+    {
+        QFile file( fileName );
+        assertTrue( file.open( QIODevice::WriteOnly ) );
+        assertEqual( file.write( xml ), qint64( xml.size() ) );
+        QFile compiledFile( UpdateInstructions::compiledFileName( fileName ) );
+        assertTrue( compiledFile.open( QIODevice::WriteOnly ) );
+        const QByteArray data = compiledTestData( xmlHash, QStringList() << QLatin1String( "Compiled" ) << QLatin1String( "Abort" ), QVector< qint32 >() << 0 << 1 << 0 );
+        assertEqual( compiledFile.write( data ), qint64( data.size() ) );
+    }
+    assertTrue( instructions.load( fileName ) );
+    assertEqual( instructions.count(), 1 );
+    assertEqual( instructions.name( 0 ), QLatin1String( "Compiled" ) );
+
+    // and parses the XML if it does not
+    {
+        QFile file( fileName );
+        assertTrue( file.open( QIODevice::Append ) );
+        assertEqual( file.write( "\n" ), qint64( 1 ) );
+    }
+    assertTrue( instructions.load( fileName ) );
+    assertEqual( instructions.count(), 2 );
+    assertEqual( instructions.name( 0 ), QLatin1String( "Copy" ) );
+
+    assertTrue( QDir( dir.path() ).removeRecursively() );
+}
+
+#endif // KDTOOLSCORE_UNITTESTS
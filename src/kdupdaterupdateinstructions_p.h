@@ -0,0 +1,84 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#ifndef __KDTOOLS_KDUPDATERUPDATEINSTRUCTIONS_P_H__
+#define __KDTOOLS_KDUPDATERUPDATEINSTRUCTIONS_P_H__
+
+#include "kdupdater.h"
+#include <pimpl_ptr.h>
+
+#include <QtCore/QCoreApplication>
+
+QT_BEGIN_NAMESPACE
+class QByteArray;
+class QString;
+class QStringList;
+QT_END_NAMESPACE
+
+namespace KDUpdater
+{
+    class KDUPDATER_EXPORT UpdateInstructions
+    {
+        Q_DECLARE_TR_FUNCTIONS(KDUpdater::UpdateInstructions)
+
+    public:
+        enum Placeholder
+        {
+            AppDir=0,
+            TargetDir,
+            Home,
+            AppName,
+            TargetName,
+            AppVersion,
+            TargetVersion,
+            CurPath,
+            Root,
+            Temp,
+            PlaceholderCount
+        };
+
+        UpdateInstructions();
+        ~UpdateInstructions();
+
+        QString errorString() const;
+
+        bool load( const QString& fileName );
+        bool parse( const QByteArray& xml );
+        bool fromBinary( const QByteArray& data, const QByteArray& xmlHash );
+        QByteArray toBinary( const QByteArray& xmlHash ) const;
+
+        int count() const;
+        QString name( int index ) const;
+        QString onError( int index ) const;
+        QStringList arguments( int index, const QStringList& values ) const;
+
+        static QByteArray hash( const QByteArray& xml );
+        static QString compiledFileName( const QString& fileName );
+        static QByteArray compile( const QByteArray& xml, QString* errorString );
+
+    private:
+        class Private;
+        kdtools::pimpl_ptr< Private > d;
+    };
+}
+
+#endif
@@ -23,6 +23,7 @@
 #include "kdupdaterupdateoperation.h"
 
 #include <QDebug>
+#include <QDir>
 #include <QMap>
 #include <QVariant>
 
@@ -43,8 +44,35 @@
    at the same time.
 */
 
+/*!
+   \class KDUpdater::UpdateOperation::Cost
+   \brief The estimated cost of performing an update operation, see \ref estimateCost()
+
+   \li \c bytesRead, \c bytesWritten: the amount of data the operation reads and writes
+   \li \c backupBytes: the data written for the backup made before the operation, which is also
+   the disk space the backup takes. Backups made by hard link take none.
+   \li \c filesTouched: the number of files and directories created, changed or removed
+   \li \c requiredPaths: absolute paths which have to exist for the operation to succeed
+   \li \c createdPaths, \c removedPaths: absolute paths the operation creates or removes
+
+   \c known is false if the operation cannot tell what it does, like Execute; all other
+   members are zero or empty then.
+*/
+
 using namespace KDUpdater;
 
+/*!
+   Constructs an unknown cost.
+*/
+UpdateOperation::Cost::Cost()
+    : known( false ),
+      bytesRead( 0 ),
+      bytesWritten( 0 ),
+      backupBytes( 0 ),
+      filesTouched( 0 )
+{
+}
+
 class UpdateOperation::Private
 {
 public:
@@ -59,6 +87,7 @@ public:
     QStringList args;
     int error;
     Target * target;
+    QString workingDirectory;
     QString errorMessage;
     QVariantMap values;
 };
@@ -189,6 +218,38 @@ void UpdateOperation::setTarget( Target * target )
     d->target = target;
 }
 
+/*!
+   Sets the directory relative paths in the arguments of this operation are resolved against
+   to \a path. This is the directory the update was unpacked to. If no working directory is
+   set, relative paths are resolved against the current directory of the process.
+
+   \sa absolutePath()
+*/
+void UpdateOperation::setWorkingDirectory( const QString& path )
+{
+    d->workingDirectory = path;
+}
+
+/*!
+   Returns the directory relative paths in the arguments of this operation are resolved against.
+*/
+QString UpdateOperation::workingDirectory() const
+{
+    return d->workingDirectory;
+}
+
+/*!
+   Returns \a path resolved against the \ref workingDirectory(). Subclasses use this for all
+   arguments naming files or directories, so that operations do not depend on the current
+   directory of the process and can run concurrently.
+*/
+QString UpdateOperation::absolutePath( const QString& path ) const
+{
+    if( d->workingDirectory.isEmpty() || path.isEmpty() )
+        return path;
+    return QDir( d->workingDirectory ).absoluteFilePath( path );
+}
+
 /*!
    Returns the last set function arguments.
 */
@@ -268,7 +329,9 @@ Target * UpdateOperation::target() const
 /*!
    \fn virtual bool KDUpdater::UpdateOperation::testOperation() = 0;
 
-   Subclasses must implement this function to perform the test operation.
+   Subclasses must implement this function to check whether \ref performOperation() would
+   succeed in the current state of the file system, without changing anything. If not, it
+   returns false and sets an error describing the problem.
 */
 
 /*!
@@ -277,6 +340,18 @@ Target * UpdateOperation::target() const
    Subclasses must implement this function to clone the current operation.
 */
 
+/*!
+   Returns the estimated cost of performing this operation in the current state of the file
+   system, without changing anything. Used by \ref KDUpdater::InstallPlan for dry runs.
+
+   The default implementation returns an unknown cost. Subclasses should reimplement it if
+   they can tell which files they access.
+*/
+UpdateOperation::Cost UpdateOperation::estimateCost() const
+{
+    return Cost();
+}
+
 /*!
   Saves this UpdateOperation in XML. You can override this method to store your own extra-data.
   The default implementation is taking care of arguments and values set via setValue.
@@ -57,6 +57,21 @@ namespace KDUpdater
             UserDefinedError=128
         };
 
+        struct KDUPDATER_EXPORT Cost
+        {
+            Cost();
+
+            bool known;
+            qint64 bytesRead;
+            qint64 bytesWritten;
+            qint64 backupBytes;
+            int filesTouched;
+
+            QStringList requiredPaths;
+            QStringList createdPaths;
+            QStringList removedPaths;
+        };
+
         UpdateOperation();
         virtual ~UpdateOperation();
 
@@ -65,6 +80,9 @@ namespace KDUpdater
 
         QStringList arguments() const;
         QString errorString() const;
+
+        void setWorkingDirectory( const QString& path );
+        QString workingDirectory() const;
         int error() const;
 
         virtual void backup() = 0;
@@ -73,6 +91,8 @@ namespace KDUpdater
         virtual bool testOperation() = 0;
         virtual UpdateOperation* clone() const = 0;
 
+        virtual Cost estimateCost() const;
+
         QString lastError() const;
 
         virtual QDomDocument toXml() const;
@@ -86,6 +106,7 @@ namespace KDUpdater
             T* const cloned = new T;
             cloned->setValues( values() );
             cloned->setArguments( arguments() );
+            cloned->setWorkingDirectory( workingDirectory() );
             return cloned;
         }
 
@@ -96,6 +117,7 @@ namespace KDUpdater
 
         void setArguments(const QStringList& args);
         void setTarget( Target * target );
+        QString absolutePath( const QString& path ) const;
   
         void setName(const QString& name);
         Target * target() const;
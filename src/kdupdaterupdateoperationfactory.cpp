@@ -73,6 +73,9 @@ UpdateOperationFactory::UpdateOperationFactory()
     registerUpdateOperation< RmdirOperation >( QLatin1String( "Rmdir" ) );
     registerUpdateOperation< AppendFileOperation >( QLatin1String( "AppendFile" ) );
     registerUpdateOperation< PrependFileOperation >( QLatin1String( "PrependFile" ) );
+    registerUpdateOperation< CopyTreeOperation >( QLatin1String( "CopyTree" ) );
+    registerUpdateOperation< SyncTreeOperation >( QLatin1String( "SyncTree" ) );
+    registerUpdateOperation< DeleteTreeOperation >( QLatin1String( "DeleteTree" ) );
     registerUpdateOperation< ExecuteOperation >( QLatin1String( "Execute" ) );
     registerUpdateOperation< UpdatePackageOperation >( QLatin1String( "UpdatePackage" ) );
     registerUpdateOperation< UpdateCompatOperation >( QLatin1String( "UpdateCompat" ) );
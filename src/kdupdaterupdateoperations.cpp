@@ -21,19 +21,27 @@
 **********************************************************************/
 
 #include "kdupdaterupdateoperations_p.h"
+#include "kdupdaterfileutils_p.h"
 #include "kdupdatertarget.h"
 #include "kdupdaterpackagesinfo.h"
+#include "kdsavefile.h"
 
 #include <QFile>
 #include <QDir>
 #include <QDomDocument>
 #include <QDirIterator>
+#include <QCryptographicHash>
+#include <QMutex>
+#include <QMutexLocker>
 #include <QProcess>
+#include <QSet>
 #include <QTemporaryFile>
 #include <QTextCodec>
 #include <QTextStream>
 #include <QVariant>
 #include <QString>
+#include <QVector>
+#include <QtConcurrentMap>
 #include <cerrno>
 
 #ifdef SUPPORT_DETACHED_PROCESS_EXECUTION
@@ -71,6 +79,17 @@ static bool removeDirectory( const QString& path, QString* errorString = NULL )
         *errorString = path + QLatin1String(": ") + QLatin1String( strerror(errno) );
     return success;
 }
+/**
+ * \internal
+ * Returns the mutex serializing changes to the packages info of targets. Updates of one
+ * target may be installed concurrently, see KDUpdater::UpdateInstaller.
+ */
+static QMutex* packagesInfoMutex()
+{
+    static QMutex mutex;
+    return &mutex;
+}
+
 /**
  * \internal
  * Returns a filename for a temporary file based on \a templateName
@@ -85,6 +104,70 @@ static QString backupFileName( const QString& templateName = QString() )
     return name;
 }
 
+/**
+ * \internal
+ * Returns the size of the file at \a path, or the total size of the files in the directory tree
+ * at \a path. Adds the number of files and directories to \a files.
+ */
+static qint64 treeSize( const QString& path, int* files )
+{
+    const QFileInfo fi( path );
+    ++*files;
+    if( fi.isSymLink() )
+        return 0;
+    if( !fi.isDir() )
+        return fi.size();
+
+    qint64 size = 0;
+    QDirIterator it( path, QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden | QDir::System, QDirIterator::Subdirectories );
+    while( it.hasNext() )
+    {
+        it.next();
+        const QFileInfo info = it.fileInfo();
+        ++*files;
+        if( info.isFile() && !info.isSymLink() )
+            size += info.size();
+    }
+    return size;
+}
+
+/**
+ * \internal
+ * Returns the length of the Unicode byte order mark at the start of \a head, or 0 if there is none.
+ */
+static int byteOrderMarkLength( const QByteArray& head )
+{
+    if( head.startsWith( QByteArray( "\xEF\xBB\xBF" ) ) )
+        return 3;
+    if( head.startsWith( QByteArray( "\xFF\xFE\x00\x00", 4 ) ) || head.startsWith( QByteArray( "\x00\x00\xFE\xFF", 4 ) ) )
+        return 4;
+    if( head.startsWith( QByteArray( "\xFF\xFE" ) ) || head.startsWith( QByteArray( "\xFE\xFF" ) ) )
+        return 2;
+    return 0;
+}
+
+/**
+ * \internal
+ * Returns true if \a path is an existing directory in which files can be created.
+ */
+static bool isWritableDirectory( const QString& path )
+{
+    const QFileInfo fi( path );
+    return fi.isDir() && fi.isWritable();
+}
+
+/**
+ * \internal
+ * Returns the number of bytes \a text takes when written by a QTextStream using \a codec,
+ * or the locale codec if \a codec is 0.
+ */
+static qint64 encodedSize( const QString& text, QTextCodec* codec )
+{
+    if( codec == 0 )
+        codec = QTextCodec::codecForLocale();
+    return codec->fromUnicode( text ).size();
+}
+
 ////////////////////////////////////////////////////////////////////////////
 // KDUpdater::CopyOperation
 ////////////////////////////////////////////////////////////////////////////
@@ -101,7 +184,7 @@ CopyOperation::~CopyOperation()
 
 void CopyOperation::backup()
 {
-    const QString dest = arguments().last();
+    const QString dest = absolutePath( arguments().last() );
     if( !QFile::exists( dest ) )
     {
         clearValue( QLatin1String( "backupOfExistingDestination" ) );
@@ -114,9 +197,11 @@ void CopyOperation::backup()
     // race condition: The backup file could get created 
     // by another process right now. But this is the same 
     // in QFile::copy...
-    const bool success = QFile::copy( dest, value( QLatin1String( "backupOfExistingDestination" ) ).toString() );
+    // The destination is replaced, not written to, so a hard link is a sufficient backup
+    QString errorString;
+    const bool success = linkOrCloneFile( dest, value( QLatin1String( "backupOfExistingDestination" ) ).toString(), &errorString );
     if(!success)
-        setError( UserDefinedError, tr("Could not backup file %1").arg(dest) );
+        setError( UserDefinedError, tr("Could not backup file %1: %2").arg(dest, errorString) );
 }
 // only a very basic implementation
 void copyDirectory( const QString &src, const QString &dst )
@@ -147,10 +232,7 @@ void copyDirectory( const QString &src, const QString &dst )
                 }
                 else if ( entry.isFile() )
                 {
-                    if ( QFile::exists( destDir.absoluteFilePath( entry.fileName() ) ) )
-                        QFile::remove( destDir.absoluteFilePath( entry.fileName() ) );
-                    QFile srcFile( entry.absoluteFilePath() );
-                    srcFile.copy( destDir.absoluteFilePath( entry.fileName() ) );
+                    copyFile( entry.absoluteFilePath(), destDir.absoluteFilePath( entry.fileName() ), 0 );
                 }
             }
             else
@@ -175,30 +257,18 @@ bool CopyOperation::performOperation()
         return false;
     }
 
-    const QString& source = args.first();
-    const QString& dest = args.last();
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
     const QFileInfo fi( source );
 
     if( !fi.isDir() )
     {
-        // If destination file exists, then we cannot use QFile::copy()
-        // because it does not overwrite an existing file. So we remove
-        // the destination file.
-        if( QFile::exists(dest) )
-        {
-            QFile destF( dest );
-            if( !destF.remove() )
-            {
-                setError( UserDefinedError, tr("File %1 could not be deleted before copy: %2").arg(dest, destF.errorString()) );
-                return false;
-            }
-        }
-
-        // Perform the copy operation
-        QFile sourceF( source );
-        const bool success = sourceF.copy(dest);
+        // The copy replaces an existing destination atomically, cloning the source where the
+        // file system supports it. The backup of the destination is a hard link to it.
+        QString errorString;
+        const bool success = copyFile( source, dest, &errorString );
         if(!success)
-            setError( UserDefinedError, tr("Cannot copy file from %1 to %2: %3").arg(source, dest, sourceF.errorString()) );
+            setError( UserDefinedError, tr("Cannot copy file from %1 to %2: %3").arg(source, dest, errorString) );
         return success;
     }
     else
@@ -214,7 +284,7 @@ bool CopyOperation::performOperation()
 
 bool CopyOperation::undoOperation()
 {
-   const QString dest = arguments().last();
+    const QString dest = absolutePath( arguments().last() );
 
     QFile destF( dest );
     // first remove the dest
@@ -229,21 +299,101 @@ bool CopyOperation::undoOperation()
     if( !hasValue( QLatin1String( "backupOfExistingDestination" ) ) )
         return true;
 
-    QFile backupF( value( QLatin1String( "backupOfExistingDestination" ) ).toString() );
-    // otherwise we have to copy the backup back:
-    const bool success = backupF.copy( dest ) && backupF.remove();
+    // otherwise we have to move the backup back:
+    QString errorString;
+    const bool success = restoreFile( value( QLatin1String( "backupOfExistingDestination" ) ).toString(), dest, &errorString );
     if(!success) {
-        setError( UserDefinedError, tr("Could not restore backup file into %1: %2").arg(dest, backupF.errorString()) );
+        setError( UserDefinedError, tr("Could not restore backup file into %1: %2").arg(dest, errorString) );
+    }
+    return success;
+}
+
+/*!
+   Restores the destination from its backup, or removes it if it did not exist before. The file
+   is either in its new or old state, as it is copied atomically.
+*/
+bool CopyOperation::restoreBackup()
+{
+    const QString dest = absolutePath( arguments().last() );
+    QString errorString;
+    if( hasValue( QLatin1String( "backupOfExistingDestination" ) ) )
+    {
+        const bool success = restoreFile( value( QLatin1String( "backupOfExistingDestination" ) ).toString(), dest, &errorString );
+        if(!success)
+            setError( UserDefinedError, tr("Could not restore backup file into %1: %2").arg(dest, errorString) );
+        return success;
     }
+
+    // copied directories are not undone either
+    if( QFileInfo( absolutePath( arguments().first() ) ).isDir() || !QFile::exists( dest ) )
+        return true;
+
+    QFile destF( dest );
+    const bool success = destF.remove();
+    if(!success)
+        setError( UserDefinedError, tr("Could not delete file %1: %2").arg(dest, destF.errorString()) );
     return success;
 }
 
 bool CopyOperation::testOperation()
 {
-    // TODO
+    const QStringList args = arguments();
+    if( args.count() != 2 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 2 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
+    const QFileInfo sourceInfo( source );
+    if( !sourceInfo.exists() )
+    {
+        setError( UserDefinedError, tr("Cannot copy %1: the file does not exist").arg( source ) );
+        return false;
+    }
+
+    // directories are created as needed when copying a directory
+    const QString destDir = sourceInfo.isDir() ? existingPath( dest ) : QFileInfo( dest ).absolutePath();
+    if( !isWritableDirectory( destDir ) )
+    {
+        setError( UserDefinedError, tr("Cannot copy %1 to %2: directory %3 is not writable").arg( source, dest, destDir ) );
+        return false;
+    }
+
+    if( !sourceInfo.isDir() && QFileInfo( dest ).isDir() )
+    {
+        setError( UserDefinedError, tr("Cannot copy %1 to %2: the destination is a directory").arg( source, dest ) );
+        return false;
+    }
     return true;
 }
 
+UpdateOperation::Cost CopyOperation::estimateCost() const
+{
+    Cost cost;
+    const QStringList args = arguments();
+    if( args.count() != 2 )
+        return cost;
+
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
+
+    cost.known = true;
+    const qint64 size = treeSize( source, &cost.filesTouched );
+    cost.bytesRead = size;
+    cost.bytesWritten = size;
+    // the backup of an existing destination is a hard link
+    if( QFile::exists( dest ) )
+        ++cost.filesTouched;
+
+    cost.requiredPaths << source;
+    if( !QFileInfo( source ).isDir() )
+        cost.requiredPaths << QFileInfo( dest ).absolutePath();
+    cost.createdPaths << dest;
+    return cost;
+}
+
 CopyOperation* CopyOperation::clone() const
 {
     return UpdateOperation::clone< CopyOperation >();
@@ -266,7 +416,7 @@ MoveOperation::~MoveOperation()
 
 void MoveOperation::backup()
 {
-    const QString dest = arguments().last();
+    const QString dest = absolutePath( arguments().last() );
     if( !QFile::exists( dest ) )
     {
         clearValue( QLatin1String( "backupOfExistingDestination" ) );
@@ -279,9 +429,11 @@ void MoveOperation::backup()
     // race condition: The backup file could get created 
     // by another process right now. But this is the same 
     // in QFile::copy...
-    const bool success = QFile::copy( dest, value( QLatin1String( "backupOfExistingDestination" ) ).toString() );
+    // The destination is replaced, not written to, so a hard link is a sufficient backup
+    QString errorString;
+    const bool success = linkOrCloneFile( dest, value( QLatin1String( "backupOfExistingDestination" ) ).toString(), &errorString );
     if(!success)
-        setError( UserDefinedError, tr("Could not backup file %1").arg(dest) );
+        setError( UserDefinedError, tr("Could not backup file %1: %2").arg(dest, errorString) );
 }
 
 bool MoveOperation::performOperation()
@@ -296,27 +448,15 @@ bool MoveOperation::performOperation()
         return false;
     }
 
-    const QString& source = args.first();
-    const QString& dest = args.last();
-
-    // If destination file exists, then we cannot use QFile::copy()
-    // because it does not overwrite an existing file. So we remove
-    // the destination file.
-    if( QFile::exists(dest) )
-    {
-        QFile destF( dest );
-        if( !destF.remove(dest) )
-        {
-            setError( UserDefinedError, tr("Cannot remove file %1: %2").arg(dest, destF.errorString()) );
-            return false;
-        }
-    }
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
 
-    // Copy source to destination.
-    QFile sourceF( source );
-    const bool success = sourceF.copy( dest ) && sourceF.remove();
+    // Rename source to destination, replacing an existing destination file.
+    // Only across file systems this copies the file.
+    QString errorString;
+    const bool success = moveFile( source, dest, &errorString );
     if(!success)
-        setError( UserDefinedError, tr("Cannot move file from %1 to %2: %3").arg( source, dest, sourceF.errorString() ) );
+        setError( UserDefinedError, tr("Cannot move file from %1 to %2: %3").arg( source, dest, errorString ) );
 
     return success;
 }
@@ -324,14 +464,14 @@ bool MoveOperation::performOperation()
 bool MoveOperation::undoOperation()
 {
     const QStringList args = arguments();
-    const QString& source = args.first();
-    const QString& dest = args.last();
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
 
-    // first: copy back the destination to source
-    QFile destF( dest );
-    if( !destF.copy( source ) )
+    // first: move back the destination to source
+    QString errorString;
+    if( !moveFile( dest, source, &errorString ) )
     {
-        setError( UserDefinedError, tr("Cannot copy %1 to %2: %3").arg( dest, source, destF.errorString() ) );
+        setError( UserDefinedError, tr("Cannot move %1 to %2: %3").arg( dest, source, errorString ) );
         return false;
     }
 
@@ -340,21 +480,101 @@ bool MoveOperation::undoOperation()
     if( !hasValue( QLatin1String( "backupOfExistingDestination" ) ) )
         return true;
 
-    // otherwise we have to copy the backup back:
-    QFile backupF( value( QLatin1String( "backupOfExistingDestination" ) ).toString() );
-    const  bool success = backupF.copy( dest ) && backupF.remove();
+    // otherwise we have to move the backup back:
+    const bool success = restoreFile( value( QLatin1String( "backupOfExistingDestination" ) ).toString(), dest, &errorString );
     if(!success)
-        setError( UserDefinedError, tr("Cannot restore backup file for %1: %2").arg(dest, backupF.errorString()) );
+        setError( UserDefinedError, tr("Cannot restore backup file for %1: %2").arg(dest, errorString) );
+
+    return success;
+}
+
+/*!
+   Moves the destination back only if the source is gone, so an untouched destination is never
+   moved over the source, then restores the destination from its backup.
+*/
+bool MoveOperation::restoreBackup()
+{
+    const QStringList args = arguments();
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
+
+    QString errorString;
+    const QFileInfo sourceInfo( source );
+    if( !sourceInfo.exists() && !sourceInfo.isSymLink() && QFileInfo( dest ).exists() && !moveFile( dest, source, &errorString ) )
+    {
+        setError( UserDefinedError, tr("Cannot move %1 to %2: %3").arg( dest, source, errorString ) );
+        return false;
+    }
+
+    if( !hasValue( QLatin1String( "backupOfExistingDestination" ) ) )
+        return true;
 
+    const bool success = restoreFile( value( QLatin1String( "backupOfExistingDestination" ) ).toString(), dest, &errorString );
+    if(!success)
+        setError( UserDefinedError, tr("Cannot restore backup file for %1: %2").arg(dest, errorString) );
     return success;
 }
 
 bool MoveOperation::testOperation()
 {
-    // TODO
+    const QStringList args = arguments();
+    if( args.count() != 2 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 2 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
+    const QFileInfo sourceInfo( source );
+    if( !sourceInfo.exists() )
+    {
+        setError( UserDefinedError, tr("Cannot move %1: the file does not exist").arg( source ) );
+        return false;
+    }
+
+    if( !isWritableDirectory( sourceInfo.absolutePath() ) )
+    {
+        setError( UserDefinedError, tr("Cannot move %1: directory %2 is not writable").arg( source, sourceInfo.absolutePath() ) );
+        return false;
+    }
+
+    const QString destDir = QFileInfo( dest ).absolutePath();
+    if( !isWritableDirectory( destDir ) )
+    {
+        setError( UserDefinedError, tr("Cannot move %1 to %2: directory %3 is not writable").arg( source, dest, destDir ) );
+        return false;
+    }
     return true;
 }
 
+UpdateOperation::Cost MoveOperation::estimateCost() const
+{
+    Cost cost;
+    const QStringList args = arguments();
+    if( args.count() != 2 )
+        return cost;
+
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
+
+    cost.known = true;
+    cost.filesTouched = 1;
+    // only moves across file systems copy the data
+    if( !isOnSameFileSystem( source, dest ) )
+    {
+        cost.bytesRead = QFileInfo( source ).size();
+        cost.bytesWritten = cost.bytesRead;
+    }
+    if( QFile::exists( dest ) )
+        ++cost.filesTouched;
+
+    cost.requiredPaths << source << QFileInfo( dest ).absolutePath();
+    cost.createdPaths << dest;
+    cost.removedPaths << source;
+    return cost;
+}
+
 MoveOperation* MoveOperation::clone() const
 {
     return UpdateOperation::clone< MoveOperation >();
@@ -377,12 +597,13 @@ DeleteOperation::~DeleteOperation()
 
 void DeleteOperation::backup()
 {
-    const QString fileName = arguments().first();
+    const QString fileName = absolutePath( arguments().first() );
     setValue( QLatin1String( "backupOfExistingFile" ), backupFileName( fileName ) );
-    QFile file( fileName );
-    const bool success = file.copy( value( QLatin1String( "backupOfExistingFile" ) ).toString() );
+    // The file is deleted, not written to, so a hard link is a sufficient backup
+    QString errorString;
+    const bool success = linkOrCloneFile( fileName, value( QLatin1String( "backupOfExistingFile" ) ).toString(), &errorString );
     if(!success)
-        setError( UserDefinedError, tr("Cannot create backup of %1: %2").arg(fileName, file.errorString()) );
+        setError( UserDefinedError, tr("Cannot create backup of %1: %2").arg(fileName, errorString) );
 }
 
 bool DeleteOperation::performOperation()
@@ -396,7 +617,7 @@ bool DeleteOperation::performOperation()
         return false;
     }
 
-    const QString& fName = args.first();
+    const QString fName = absolutePath( args.first() );
     QFile file( fName );
     const bool success = file.remove();
     if(!success)
@@ -413,21 +634,70 @@ bool DeleteOperation::undoOperation()
         return false;
     }
 
-    const QString fileName = arguments().first();
-    QFile backupF( value( QLatin1String( "backupOfExistingFile" ) ).toString() );
-    const bool success = backupF.copy( fileName ) && backupF.remove();
+    const QString fileName = absolutePath( arguments().first() );
+    QString errorString;
+    const bool success = restoreFile( value( QLatin1String( "backupOfExistingFile" ) ).toString(), fileName, &errorString );
     if(!success)
-        setError( UserDefinedError, tr("Cannot restore backup file for %1: %2").arg(fileName, backupF.errorString()) );
+        setError( UserDefinedError, tr("Cannot restore backup file for %1: %2").arg(fileName, errorString) );
 
     return success;
 }
 
+/*!
+   Restores the file from its backup, which is a link to the same file if it was not deleted.
+*/
+bool DeleteOperation::restoreBackup()
+{
+    return undoOperation();
+}
+
 bool DeleteOperation::testOperation()
 {
-    // TODO
+    const QStringList args = arguments();
+    if( args.count() != 1 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 1 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    const QFileInfo fi( absolutePath( args.first() ) );
+    if( !fi.exists() && !fi.isSymLink() )
+    {
+        setError( UserDefinedError, tr("Cannot delete file %1: the file does not exist").arg( fi.absoluteFilePath() ) );
+        return false;
+    }
+
+    if( fi.isDir() && !fi.isSymLink() )
+    {
+        setError( UserDefinedError, tr("Cannot delete file %1: it is a directory").arg( fi.absoluteFilePath() ) );
+        return false;
+    }
+
+    if( !isWritableDirectory( fi.absolutePath() ) )
+    {
+        setError( UserDefinedError, tr("Cannot delete file %1: directory %2 is not writable").arg( fi.absoluteFilePath(), fi.absolutePath() ) );
+        return false;
+    }
     return true;
 }
 
+UpdateOperation::Cost DeleteOperation::estimateCost() const
+{
+    Cost cost;
+    const QStringList args = arguments();
+    if( args.count() != 1 )
+        return cost;
+
+    const QString fileName = absolutePath( args.first() );
+
+    // the file and its backup, a hard link
+    cost.known = true;
+    cost.filesTouched = 2;
+    cost.requiredPaths << fileName;
+    cost.removedPaths << fileName;
+    return cost;
+}
+
 DeleteOperation* DeleteOperation::clone() const
 {
     return UpdateOperation::clone< DeleteOperation >();
@@ -453,7 +723,7 @@ void MkdirOperation::backup()
     static const QRegExp re( QLatin1String( "\\\\|/" ) );
     static const QLatin1String sep( "/" );
 
-    QString path = arguments().first();
+    QString path = directoryPath( workingDirectory(), arguments().first() );
     path.replace( re, sep );
 
     QDir createdDir = QDir::root();
@@ -488,7 +758,7 @@ bool MkdirOperation::performOperation()
         return false;
     }
 
-    const QString& dirName = args.first();
+    const QString dirName = directoryPath( workingDirectory(), args.first() );
     const bool success = QDir::root().mkpath(dirName);
     if(!success)
         setError( UserDefinedError, tr("Could not create directory %1").arg(dirName) );
@@ -511,17 +781,76 @@ bool MkdirOperation::undoOperation()
     return success;
 }
 
+/*!
+   Removes the first created directory if it exists.
+*/
+bool MkdirOperation::restoreBackup()
+{
+    const QDir createdDir = QDir( value( QLatin1String( "createddir" ) ).toString() );
+    if( createdDir == QDir::root() || !createdDir.exists() )
+        return true;
+
+    return undoOperation();
+}
+
 bool MkdirOperation::testOperation()
 {
-    // TODO
+    const QStringList args = arguments();
+    if( args.count() != 1 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 1 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    const QString dirName = directoryPath( workingDirectory(), args.first() );
+    const QString existing = existingPath( dirName );
+    if( QDir::cleanPath( existing ) == QDir::cleanPath( dirName ) && QFileInfo( existing ).isDir() )
+        return true;
+
+    if( !isWritableDirectory( existing ) )
+    {
+        setError( UserDefinedError, tr("Cannot create directory %1: %2 is not a writable directory").arg( dirName, existing ) );
+        return false;
+    }
     return true;
 }
 
+UpdateOperation::Cost MkdirOperation::estimateCost() const
+{
+    Cost cost;
+    const QStringList args = arguments();
+    if( args.count() != 1 )
+        return cost;
+
+    const QString dirName = QDir::cleanPath( directoryPath( workingDirectory(), args.first() ) );
+
+    cost.known = true;
+    const QString existing = QDir::cleanPath( existingPath( dirName ) );
+    if( existing != dirName )
+    {
+        // one for every directory to create
+        cost.filesTouched = dirName.mid( existing.length() ).split( QLatin1Char( '/' ), QString::SkipEmptyParts ).count();
+        cost.createdPaths << dirName;
+    }
+    return cost;
+}
+
 MkdirOperation* MkdirOperation::clone() const
 {
     return UpdateOperation::clone< MkdirOperation >();
 }
 
+/*!
+   Returns the absolute path of the directory \a dirName created by a Mkdir operation with the
+   working directory \a workingDirectory. Relative paths are resolved against the working
+   directory, or against the root directory if there is none, like QDir::root().mkpath() does.
+*/
+QString MkdirOperation::directoryPath( const QString& workingDirectory, const QString& dirName )
+{
+    const QString path = workingDirectory.isEmpty() || dirName.isEmpty() ? dirName : QDir( workingDirectory ).absoluteFilePath( dirName );
+    return QDir::root().absoluteFilePath( path );
+}
+
 ////////////////////////////////////////////////////////////////////////////
 // KDUpdater::RmdirOperation
 ////////////////////////////////////////////////////////////////////////////
@@ -553,7 +882,7 @@ bool RmdirOperation::performOperation()
         return false;
     }
 
-    const QString dirName = args.first();
+    const QString dirName = absolutePath( args.first() );
     const QDir dir( dirName );
     if( !dir.exists() )
     {
@@ -576,7 +905,7 @@ bool RmdirOperation::undoOperation()
    if( !value( QLatin1String( "removed" ) ).toBool() )
         return true;
 
-    const QFileInfo fi( arguments().first() );
+    const QFileInfo fi( absolutePath( arguments().first() ) );
     const bool success = fi.dir().mkdir( fi.fileName() );
     if(!success)
         setError( UserDefinedError, tr("Cannot recreate directory %1: %2").arg( fi.fileName(), QLatin1String(strerror(errno)) ) );
@@ -584,12 +913,67 @@ bool RmdirOperation::undoOperation()
     return success;
 }
 
+/*!
+   Recreates the directory if it is gone. It existed when the operation was started.
+*/
+bool RmdirOperation::restoreBackup()
+{
+    const QFileInfo fi( absolutePath( arguments().first() ) );
+    if( fi.isDir() )
+        return true;
+
+    setValue( QLatin1String( "removed" ), true );
+    return undoOperation();
+}
+
 bool RmdirOperation::testOperation()
 {
-    // TODO
+    const QStringList args = arguments();
+    if( args.count() != 1 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 1 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    const QString dirName = absolutePath( args.first() );
+    const QDir dir( dirName );
+    if( !dir.exists() )
+    {
+        setError( UserDefinedError, tr("Cannot delete non-existing directory %1").arg( dirName ) );
+        return false;
+    }
+
+    if( !dir.entryList( QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden | QDir::System ).isEmpty() )
+    {
+        setError( UserDefinedError, tr("Cannot delete directory %1: it is not empty").arg( dirName ) );
+        return false;
+    }
+
+    const QString parent = QFileInfo( dirName ).absolutePath();
+    if( !isWritableDirectory( parent ) )
+    {
+        setError( UserDefinedError, tr("Cannot delete directory %1: directory %2 is not writable").arg( dirName, parent ) );
+        return false;
+    }
     return true;
 }
 
+UpdateOperation::Cost RmdirOperation::estimateCost() const
+{
+    Cost cost;
+    const QStringList args = arguments();
+    if( args.count() != 1 )
+        return cost;
+
+    const QString dirName = absolutePath( args.first() );
+
+    cost.known = true;
+    cost.filesTouched = 1;
+    cost.requiredPaths << dirName;
+    cost.removedPaths << dirName;
+    return cost;
+}
+
 RmdirOperation* RmdirOperation::clone() const
 {
     return UpdateOperation::clone< RmdirOperation >();
@@ -610,20 +994,45 @@ AppendFileOperation::~AppendFileOperation()
 
 }
 
+/**
+ * \internal
+ * Returns the hex encoded hash of the last bytes of the first \a size bytes of \a fileName, or
+ * an empty string if the file cannot be read.
+ */
+static QString tailHash( const QString& fileName, qint64 size )
+{
+    static const qint64 TailSize = 4096;
+
+    QFile file( fileName );
+    const qint64 length = qMin( size, TailSize );
+    if( !file.open( QIODevice::ReadOnly ) || !file.seek( size - length ) )
+        return QString();
+
+    const QByteArray tail = file.read( length );
+    if( tail.size() != length )
+        return QString();
+    return QString::fromLatin1( QCryptographicHash::hash( tail, QCryptographicHash::Sha1 ).toHex() );
+}
+
 void AppendFileOperation::backup()
 {
-    const QString filename = arguments().first();
+    const QString filename = absolutePath( arguments().first() );
 
     QFile file( filename );
     if( !file.exists() )
         return; // nothing to backup
 
-    setValue( QLatin1String( "backupOfFile" ), backupFileName( filename ) );
-    if( !file.copy( value( QLatin1String( "backupOfFile" ) ).toString() ) )
+    // Appending leaves the existing contents alone, so undoing it only needs to truncate the
+    // file to its original size. The hash of its last bytes verifies that they are unchanged.
+    const qint64 size = file.size();
+    const QString hash = tailHash( filename, size );
+    if( hash.isEmpty() )
     {
         setError( UserDefinedError, tr("Cannot backup file %1: %2").arg(filename, file.errorString()) );
-        clearValue( QLatin1String( "backupOfFile" ) );
+        return;
     }
+    setValue( QLatin1String( "originalSize" ), size );
+    setValue( QLatin1String( "originalTailHash" ), hash );
 }
 
 bool AppendFileOperation::performOperation()
@@ -639,7 +1048,7 @@ bool AppendFileOperation::performOperation()
         return false;
     }
 
-    const QString& fName = args.first();
+    const QString fName = absolutePath( args.first() );
     const QString& text = args.at(1);
     QTextCodec* const codec = args.count() == 2 ? 0 : QTextCodec::codecForName( args.at(2).toLatin1() );
 
@@ -672,8 +1081,25 @@ bool AppendFileOperation::performOperation()
 
 bool AppendFileOperation::undoOperation()
 {
-   // backupOfFile being empty -> file didn't exist before -> no error
-    const QString filename = arguments().first();
+    const QString filename = absolutePath( arguments().first() );
+    if( hasValue( QLatin1String( "originalSize" ) ) )
+    {
+        const qint64 originalSize = value( QLatin1String( "originalSize" ) ).toLongLong();
+        QFile file( filename );
+        if( file.size() < originalSize || tailHash( filename, originalSize ) != value( QLatin1String( "originalTailHash" ) ).toString() )
+        {
+            setError( UserDefinedError, tr("Could not restore %1: it was changed by someone else").arg(filename) );
+            return false;
+        }
+
+        const bool success = file.resize( originalSize );
+        if ( !success )
+            setError( UserDefinedError, tr("Could not restore %1: %2").arg(filename, file.errorString()) );
+        return success;
+    }
+
+    // Operations journaled by earlier versions have a full backup of the file.
+    // backupOfFile being empty -> file didn't exist before -> no error
     const QString backupOfFile = value( QLatin1String( "backupOfFile" ) ).toString();
     if( !backupOfFile.isEmpty() && !QFile::exists( backupOfFile ) )
     {
@@ -699,158 +1125,1082 @@ bool AppendFileOperation::undoOperation()
     return success;
 }
 
-bool AppendFileOperation::testOperation()
+/*!
+   Truncates the file to its original size if the text was appended, or restores it from the
+   full backup of earlier versions.
+*/
+bool AppendFileOperation::restoreBackup()
 {
-    // TODO
-    return true;
-}
+    const QString filename = absolutePath( arguments().first() );
+    if( hasValue( QLatin1String( "originalSize" ) ) )
+    {
+        if( QFileInfo( filename ).size() == value( QLatin1String( "originalSize" ) ).toLongLong() )
+            return true;
+        return undoOperation();
+    }
 
-AppendFileOperation* AppendFileOperation::clone() const
-{
+    if( QFile::exists( filename ) )
+        return undoOperation();
+
+    const QString backupOfFile = value( QLatin1String( "backupOfFile" ) ).toString();
+    if( backupOfFile.isEmpty() )
+        return true;
+
+    QString errorString;
+    const bool success = restoreFile( backupOfFile, filename, &errorString );
+    if ( !success )
+        setError( UserDefinedError, tr("Could not restore backup file for %1: %2").arg(filename, errorString) );
+    return success;
+}
+
+bool AppendFileOperation::testOperation()
+{
+    const QStringList args = arguments();
+    if( args.count() != 2 && args.count() != 3 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 2 or 3 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    if( args.count() == 3 && QTextCodec::codecForName( args.at(2).toLatin1() ) == 0 )
+    {
+        setError( UserDefinedError, tr( "Unknown text codec: %1" ).arg( args.at(2) ) );
+        return false;
+    }
+
+    const QFileInfo fi( absolutePath( args.first() ) );
+    if( fi.exists() ? !fi.isFile() || !fi.isWritable() : !isWritableDirectory( fi.absolutePath() ) )
+    {
+        setError( UserDefinedError, tr("Cannot write to file %1").arg( fi.absoluteFilePath() ) );
+        return false;
+    }
+    return true;
+}
+
+UpdateOperation::Cost AppendFileOperation::estimateCost() const
+{
+    Cost cost;
+    const QStringList args = arguments();
+    if( args.count() != 2 && args.count() != 3 )
+        return cost;
+
+    const QFileInfo fi( absolutePath( args.first() ) );
+    QTextCodec* const codec = args.count() == 2 ? 0 : QTextCodec::codecForName( args.at(2).toLatin1() );
+
+    // the backup is the size of the file and a hash of its last bytes
+    cost.known = true;
+    cost.filesTouched = 1;
+    cost.bytesRead = qMin( fi.size(), Q_INT64_C( 4096 ) );
+    cost.bytesWritten = encodedSize( args.at(1), codec );
+    cost.requiredPaths << fi.absolutePath();
+    if( !fi.exists() )
+        cost.createdPaths << fi.absoluteFilePath();
+    return cost;
+}
+
+AppendFileOperation* AppendFileOperation::clone() const
+{
     return UpdateOperation::clone< AppendFileOperation >();
 }
 
 
-////////////////////////////////////////////////////////////////////////////
-// KDUpdater::PrependFileOperation
-////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+// KDUpdater::PrependFileOperation
+////////////////////////////////////////////////////////////////////////////
+
+PrependFileOperation::PrependFileOperation()
+{
+    setName(QLatin1String( "PrependFile" ));
+}
+
+PrependFileOperation::~PrependFileOperation()
+{
+
+}
+
+void PrependFileOperation::backup()
+{
+    const QString filename = absolutePath( arguments().first() );
+
+    QFile file( filename );
+    if( !file.exists() )
+        return; // nothing to backup
+
+    setValue( QLatin1String( "backupOfFile" ), backupFileName( filename ) );
+    // The file is replaced by a new one rather than modified in place
+    QString errorString;
+    if( !linkOrCloneFile( filename, value( QLatin1String( "backupOfFile" ) ).toString(), &errorString ) )
+    {
+        setError( UserDefinedError, tr("Cannot backup file %1: %2").arg(filename, errorString) );
+        clearValue( QLatin1String( "backupOfFile" ) );
+    }
+}
+
+bool PrependFileOperation::performOperation()
+{
+    // This operation takes two arguments. First argument is the name
+    // of the file into which a text has to be appended. Second argument
+    // is the text to preend.
+    // Optionally, a third parameter defines the text codec to be used
+    const QStringList args = this->arguments();
+    if( args.count() != 2 && args.count() != 3 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 2 or 3 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    const QString fName = absolutePath( args.first() );
+    const QString& text = args.at(1);
+    QTextCodec* const codec = args.count() == 2 ? 0 : QTextCodec::codecForName( args.at(2).toLatin1() );
+
+    if( codec == 0 && args.count() == 3 )
+    {
+        setError( UserDefinedError, tr( "Unknown text codec:").arg( args.at(2) ) );
+        return false;
+    }
+
+    /*
+    If Append can append text into an empty file, Prepend should be
+    able to prepend text into an empty file as well. 
+    */
+    QFile file( fName );
+    const bool exists = file.exists(); // the file not existing is no problem
+    if( exists && !file.open( codec ? QFile::ReadOnly | QFile::Text : QFile::ReadOnly ) )
+    {
+        setError( UserDefinedError, tr( "Cannot open file %1 for reading: %2" ).arg( fName, file.errorString() ) );
+        return false;
+    }
+
+    // The new contents are written next to the file and replace it once complete, so they
+    // never have to be held in memory and the file is never left half written
+    QTemporaryFile saveFile( temporaryFileTemplate( fName ) );
+    if( !saveFile.open() )
+    {
+        setError( UserDefinedError, tr("Cannot open file %1 for writing: %2").arg(fName, saveFile.errorString() ) );
+        return false;
+    }
+    saveFile.setTextModeEnabled( codec != 0 );
+
+    QString errorString;
+    if( codec )
+    {
+        // Recode the existing contents block by block
+        QTextStream out( &saveFile );
+        out.setCodec( codec );
+        out << text;
+
+        if( exists )
+        {
+            QTextStream in( &file );
+            in.setCodec( codec );
+            in.setAutoDetectUnicode( true );
+            while( !in.atEnd() && out.status() == QTextStream::Ok )
+                out << in.read( 64 * 1024 );
+        }
+        out.flush();
+        if( out.status() != QTextStream::Ok )
+            errorString = saveFile.errorString();
+    }
+    else
+    {
+        // Without a codec, the existing contents are copied byte by byte, in the kernel where
+        // possible. The text is encoded like the existing contents, as told by a byte order mark.
+        const QByteArray head = exists ? file.peek( 4 ) : QByteArray();
+        const int bomLength = byteOrderMarkLength( head );
+        QTextCodec* const textCodec = bomLength > 0 ? QTextCodec::codecForUtfText( head ) : QTextCodec::codecForLocale();
+        QTextEncoder* const encoder = textCodec->makeEncoder( QTextCodec::IgnoreHeader );
+#ifdef Q_OS_WIN
+        const QByteArray prefix = encoder->fromUnicode( QString( text ).replace( QLatin1String( "\n" ), QLatin1String( "\r\n" ) ) );
+#else
+        const QByteArray prefix = encoder->fromUnicode( text );
+#endif
+        delete encoder;
+
+        if( saveFile.write( head.left( bomLength ) ) != bomLength || saveFile.write( prefix ) != prefix.size() )
+            errorString = saveFile.errorString();
+        else if( exists && !file.seek( bomLength ) )
+            errorString = file.errorString();
+        else if( exists && !appendFileContents( file, saveFile, &errorString ) && errorString.isEmpty() )
+            errorString = tr( "Cannot copy the contents of %1" ).arg( fName );
+    }
+
+    // the file cannot be replaced while it is open on Windows
+    saveFile.setPermissions( exists ? file.permissions() : newFilePermissions() );
+    file.close();
+    if( errorString.isEmpty() )
+        replaceFile( saveFile, fName, &errorString );
+    if( !errorString.isEmpty() )
+    {
+        setError( UserDefinedError, tr( "Error while writing data to %1: %2" ).arg( fName, errorString ) );
+        return false;
+    }
+
+    return true;
+}
+
+bool PrependFileOperation::undoOperation()
+{
+    // bockupOfFile being empty -> file didn't exist before -> no error
+    const QString filename = absolutePath( arguments().first() );
+    const QString backupOfFile = value( QLatin1String( "backupOfFile" ) ).toString();
+    if( !backupOfFile.isEmpty() && !QFile::exists( backupOfFile ) )
+    {
+        setError( UserDefinedError, tr("Cannot find backup file for %1").arg(filename) );
+        return false;
+    }
+
+    QFile file( filename );
+    if ( !file.remove() ) {
+        setError( UserDefinedError, tr("Cannot restore backup file for %1: %2").arg(filename, file.errorString()) );
+        return false;
+    }
+
+    // got deleted? We might be done, if it didn't exist before
+    if( backupOfFile.isEmpty() )
+        return true;
+
+    QFile backupF( backupOfFile );
+    const bool success = backupF.rename( filename );
+    if(!success)
+        setError( UserDefinedError, tr("Cannot restore backup file for %1: %2").arg(filename, backupF.errorString()) );
+
+    return success;
+}
+
+/*!
+   Restores the file from its backup, or removes it if it did not exist before. The file is
+   either in its new or old state, as it is replaced atomically.
+*/
+bool PrependFileOperation::restoreBackup()
+{
+    const QString filename = absolutePath( arguments().first() );
+    if( QFile::exists( filename ) )
+        return undoOperation();
+
+    const QString backupOfFile = value( QLatin1String( "backupOfFile" ) ).toString();
+    if( backupOfFile.isEmpty() )
+        return true;
+
+    QString errorString;
+    const bool success = restoreFile( backupOfFile, filename, &errorString );
+    if(!success)
+        setError( UserDefinedError, tr("Cannot restore backup file for %1: %2").arg(filename, errorString) );
+    return success;
+}
+
+bool PrependFileOperation::testOperation()
+{
+    const QStringList args = arguments();
+    if( args.count() != 2 && args.count() != 3 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 2 or 3 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    if( args.count() == 3 && QTextCodec::codecForName( args.at(2).toLatin1() ) == 0 )
+    {
+        setError( UserDefinedError, tr( "Unknown text codec: %1" ).arg( args.at(2) ) );
+        return false;
+    }
+
+    const QFileInfo fi( absolutePath( args.first() ) );
+    if( fi.exists() ? !fi.isFile() || !fi.isWritable() : !isWritableDirectory( fi.absolutePath() ) )
+    {
+        setError( UserDefinedError, tr("Cannot write to file %1").arg( fi.absoluteFilePath() ) );
+        return false;
+    }
+
+    if( fi.exists() && !fi.isReadable() )
+    {
+        setError( UserDefinedError, tr( "Cannot open file %1 for reading" ).arg( fi.absoluteFilePath() ) );
+        return false;
+    }
+    return true;
+}
+
+UpdateOperation::Cost PrependFileOperation::estimateCost() const
+{
+    Cost cost;
+    const QStringList args = arguments();
+    if( args.count() != 2 && args.count() != 3 )
+        return cost;
+
+    const QFileInfo fi( absolutePath( args.first() ) );
+    QTextCodec* const codec = args.count() == 2 ? 0 : QTextCodec::codecForName( args.at(2).toLatin1() );
+
+    // the file is rewritten into a new file, the backup is a hard link to the old one
+    cost.known = true;
+    cost.filesTouched = fi.exists() ? 2 : 1;
+    cost.bytesRead = fi.size();
+    cost.bytesWritten = fi.size() + encodedSize( args.at(1), codec );
+    cost.requiredPaths << fi.absolutePath();
+    if( !fi.exists() )
+        cost.createdPaths << fi.absoluteFilePath();
+    return cost;
+}
+
+PrependFileOperation* PrependFileOperation::clone() const
+{
+    return UpdateOperation::clone< PrependFileOperation >();
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+// KDUpdater::CopyTreeOperation, KDUpdater::SyncTreeOperation
+////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    /**
+     * \internal
+     * A file or directory changed by a tree operation, relative to the root of the tree. The
+     * entries of an operation are recorded in the manifest of its backup directory, so the
+     * whole tree can be restored when the operation is undone.
+     */
+    struct TreeEntry
+    {
+        enum Action
+        {
+            CreateDirectory = 'd',
+            CreateFile = 'f',
+            ReplaceFile = 'r',
+            RemoveFile = 'x',
+            RemoveDirectory = 'y',
+            KeepFile = 'k'
+        };
+
+        TreeEntry()
+            : action( CreateFile )
+        {
+        }
+
+        TreeEntry( Action a, const QString& p )
+            : action( a ),
+              path( p )
+        {
+        }
+
+        Action action;
+        QString path;
+        QString error;
+    };
+
+    /**
+     * \internal
+     * Backs up, changes or restores the files of a tree operation. Called for each entry on
+     * the global thread pool by QtConcurrent::blockingMap(), failures are stored in the entry.
+     */
+    struct TreeWorker
+    {
+        enum Task
+        {
+            Backup,
+            Apply,
+            Undo
+        };
+
+        TreeWorker( Task t, const QString& s, const QString& d, const QString& b, DirectoryHandles* h, bool sync = false )
+            : task( t ),
+              source( s ),
+              destination( d ),
+              backup( b ),
+              handles( h ),
+              synchronize( sync )
+        {
+        }
+
+        void operator()( TreeEntry& entry ) const;
+
+        Task task;
+        QString source;
+        QString destination;
+        QString backup;
+        DirectoryHandles* handles;
+        bool synchronize;
+    };
+}
+
+/**
+ * \internal
+ * Returns the absolute path of \a path relative to the tree at \a root.
+ */
+static QString treePath( const QString& root, const QString& path )
+{
+    return path.isEmpty() ? root : root + QLatin1Char( '/' ) + path;
+}
+
+/**
+ * \internal
+ * Lists the directories and files of the tree at \a root in one walk, relative to \a root.
+ * Directories are sorted, so parents come before their children. Symbolic links are listed as
+ * files and not followed.
+ */
+static void listTree( const QString& root, QStringList* directories, QStringList* files )
+{
+    const int prefixLength = root.length() + 1;
+    QDirIterator it( root, QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden | QDir::System, QDirIterator::Subdirectories );
+    while( it.hasNext() )
+    {
+        it.next();
+        const QFileInfo info = it.fileInfo();
+        const QString path = it.filePath().mid( prefixLength );
+        if( info.isDir() && !info.isSymLink() )
+            directories->append( path );
+        else
+            files->append( path );
+    }
+    directories->sort();
+}
+
+/**
+ * \internal
+ * Returns true if the files \a fileName and \a other have the same contents.
+ */
+static bool haveSameContents( const QString& fileName, const QString& other )
+{
+    QFile file( fileName );
+    QFile otherFile( other );
+    if( file.size() != otherFile.size() || !file.open( QIODevice::ReadOnly ) || !otherFile.open( QIODevice::ReadOnly ) )
+        return false;
+
+    while( !file.atEnd() )
+    {
+        const QByteArray block = file.read( 64 * 1024 );
+        if( block.isEmpty() || otherFile.read( block.size() ) != block )
+            return false;
+    }
+    return otherFile.atEnd();
+}
+
+/**
+ * \internal
+ * Returns true if a synchronizing tree operation must not remove \a path, which is
+ * \a relativePath in the destination tree: the state of an installer in a .kdupdater directory,
+ * with its journal and staging directory, and anything inside, equal to or containing one of
+ * \a keptPaths.
+ */
+static bool isKeptBySync( const QString& path, const QString& relativePath, const QStringList& keptPaths )
+{
+    if( relativePath.split( QLatin1Char( '/' ) ).contains( QLatin1String( ".kdupdater" ) ) )
+        return true;
+
+    const QString cleanPath = QDir::cleanPath( path );
+    for( QStringList::const_iterator it = keptPaths.begin(); it != keptPaths.end(); ++it )
+    {
+        const QString kept = QDir::cleanPath( *it );
+        if( cleanPath == kept || cleanPath.startsWith( kept + QLatin1Char( '/' ) ) || kept.startsWith( cleanPath + QLatin1Char( '/' ) ) )
+            return true;
+    }
+    return false;
+}
+
+void TreeWorker::operator()( TreeEntry& entry ) const
+{
+    if( entry.action == TreeEntry::CreateDirectory || entry.action == TreeEntry::RemoveDirectory || entry.action == TreeEntry::KeepFile )
+        return;
+
+    const QString target = treePath( destination, entry.path );
+    const QString backupFile = treePath( backup, entry.path );
+    QString errorString;
+
+    switch( task )
+    {
+    case Backup:
+        if( entry.action == TreeEntry::CreateFile )
+        {
+            const QFileInfo fi( target );
+            if( !fi.exists() && !fi.isSymLink() )
+                return;
+            if( synchronize && haveSameContents( treePath( source, entry.path ), target ) )
+            {
+                entry.action = TreeEntry::KeepFile;
+                return;
+            }
+            entry.action = TreeEntry::ReplaceFile;
+        }
+
+        // Replaced and removed files are unlinked, not written to, so hard links are sufficient backups
+        if( !linkFileAt( handles, target, backupFile, &errorString ) )
+            entry.error = CopyTreeOperation::tr("Cannot create backup of %1: %2").arg( target, errorString );
+        return;
+
+    case Apply:
+        if( entry.action == TreeEntry::RemoveFile )
+        {
+            if( !removeFileAt( handles, target, &errorString ) )
+                entry.error = CopyTreeOperation::tr("Cannot delete file %1: %2").arg( target, errorString );
+        }
+        else if( !copyFile( treePath( source, entry.path ), target, &errorString ) )
+        {
+            entry.error = CopyTreeOperation::tr("Cannot copy file to %1: %2").arg( target, errorString );
+        }
+        return;
+
+    case Undo:
+        if( entry.action == TreeEntry::CreateFile )
+        {
+            // the file was not created if the operation failed before
+            const QFileInfo fi( target );
+            if( !removeFileAt( handles, target, &errorString ) && ( fi.exists() || fi.isSymLink() ) )
+                entry.error = CopyTreeOperation::tr("Cannot delete file %1: %2").arg( target, errorString );
+        }
+        else if( !renameFileAt( handles, backupFile, target, &errorString ) )
+        {
+            entry.error = CopyTreeOperation::tr("Cannot restore backup file for %1: %2").arg( target, errorString );
+        }
+        return;
+    }
+}
+
+/**
+ * \internal
+ * Returns the first error of \a entries, or an empty string if there is none.
+ */
+static QString firstTreeError( const QVector< TreeEntry >& entries )
+{
+    for( QVector< TreeEntry >::const_iterator it = entries.begin(); it != entries.end(); ++it )
+    {
+        if( !it->error.isEmpty() )
+            return it->error;
+    }
+    return QString();
+}
+
+/**
+ * \internal
+ * Removes the directory tree at \a path, deleting the files concurrently on the global thread pool.
+ */
+static bool removeTree( const QString& path, QString* errorString )
+{
+    QStringList directories;
+    QStringList files;
+    listTree( path, &directories, &files );
+
+    QVector< TreeEntry > entries;
+    entries.reserve( files.count() );
+    for( QStringList::const_iterator it = files.begin(); it != files.end(); ++it )
+        entries.append( TreeEntry( TreeEntry::RemoveFile, *it ) );
+    DirectoryHandles handles;
+    QtConcurrent::blockingMap( entries, TreeWorker( TreeWorker::Apply, QString(), path, QString(), &handles ) );
+
+    *errorString = firstTreeError( entries );
+    if( !errorString->isEmpty() )
+        return false;
+
+    directories.prepend( QString() );
+    for( int i = directories.count() - 1; i >= 0; --i )
+    {
+        const QString directory = treePath( path, directories.at( i ) );
+        if( !QDir().rmdir( directory ) )
+        {
+            *errorString = CopyTreeOperation::tr("Cannot remove directory %1").arg( directory );
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * \internal
+ * Writes the manifest of a tree operation, \a entries without the files kept, to \a backupDirectory.
+ */
+static bool writeTreeManifest( const QString& backupDirectory, const QVector< TreeEntry >& entries, QString* errorString )
+{
+    KDSaveFile file( backupDirectory + QLatin1String( "/manifest" ) );
+    if( !file.open( QIODevice::WriteOnly ) )
+    {
+        *errorString = file.errorString();
+        return false;
+    }
+
+    QTextStream stream( &file );
+    stream.setCodec( "UTF-8" );
+    for( QVector< TreeEntry >::const_iterator it = entries.begin(); it != entries.end(); ++it )
+    {
+        if( it->action != TreeEntry::KeepFile )
+            stream << QLatin1Char( static_cast< char >( it->action ) ) << QLatin1Char( ' ' ) << it->path << QLatin1Char( '\n' );
+    }
+    stream.flush();
+
+    if( !file.commit( KDSaveFile::OverwriteExistingFile ) )
+    {
+        *errorString = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * \internal
+ * Reads the manifest of a tree operation from \a backupDirectory into \a entries.
+ */
+static bool readTreeManifest( const QString& backupDirectory, QVector< TreeEntry >* entries, QString* errorString )
+{
+    QFile file( backupDirectory + QLatin1String( "/manifest" ) );
+    if( !file.open( QIODevice::ReadOnly ) )
+    {
+        *errorString = file.errorString();
+        return false;
+    }
+
+    QTextStream stream( &file );
+    stream.setCodec( "UTF-8" );
+    while( !stream.atEnd() )
+    {
+        const QString line = stream.readLine();
+        if( line.length() < 2 )
+            continue;
+        entries->append( TreeEntry( static_cast< TreeEntry::Action >( line.at( 0 ).toLatin1() ), line.mid( 2 ) ) );
+    }
+    return true;
+}
+
+CopyTreeOperation::CopyTreeOperation()
+    : synchronize( false )
+{
+    setName( QLatin1String( "CopyTree" ) );
+}
+
+/*!
+   Creates a tree operation which also removes the files and directories of the destination
+   tree missing in the source tree if \a sync is true, and leaves unchanged files alone. The
+   state of the installer, the packages info and update sources of the target and the source
+   tree itself are never removed.
+*/
+CopyTreeOperation::CopyTreeOperation( bool sync )
+    : synchronize( sync )
+{
+    setName( QLatin1String( sync ? "SyncTree" : "CopyTree" ) );
+}
+
+CopyTreeOperation::~CopyTreeOperation()
+{
+    const QString backupDirectory = value( QLatin1String( "backupDirectory" ) ).toString();
+    QString errorString;
+    if( !backupDirectory.isEmpty() && QFileInfo( backupDirectory ).isDir() )
+        removeTree( backupDirectory, &errorString );
+}
+
+/*!
+   Walks the source and destination trees once and records the changes in a manifest in a
+   backup directory next to the destination. The destination files that are replaced or removed
+   are backed up there as hard links, concurrently on the global thread pool.
+*/
+void CopyTreeOperation::backup()
+{
+    clearValue( QLatin1String( "backupDirectory" ) );
+    const QStringList args = arguments();
+    if( args.count() != 2 )
+        return;
+
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
+
+    QStringList directories;
+    QStringList files;
+    listTree( source, &directories, &files );
+
+    QVector< TreeEntry > entries;
+    entries.reserve( directories.count() + files.count() + 1 );
+    directories.prepend( QString() );
+    for( QStringList::const_iterator it = directories.begin(); it != directories.end(); ++it )
+    {
+        const QFileInfo fi( treePath( dest, *it ) );
+        if( !fi.isDir() || fi.isSymLink() )
+            entries.append( TreeEntry( TreeEntry::CreateDirectory, *it ) );
+    }
+    for( QStringList::const_iterator it = files.begin(); it != files.end(); ++it )
+    {
+        // links to directories are not followed
+        if( !QFileInfo( treePath( source, *it ) ).isDir() )
+            entries.append( TreeEntry( TreeEntry::CreateFile, *it ) );
+    }
+
+    QStringList destDirectories;
+    QStringList destFiles;
+    if( synchronize && QFileInfo( dest ).isDir() )
+    {
+        const QSet< QString > sourceDirectories = QSet< QString >::fromList( directories );
+        const QSet< QString > sourceFiles = QSet< QString >::fromList( files );
+        listTree( dest, &destDirectories, &destFiles );
+        destDirectories.prepend( QString() );
+
+        // The state of the installer and the source tree, which is usually staged in the
+        // target, are never removed, and neither are the directories containing them
+        QStringList keptPaths;
+        keptPaths << source;
+        if( const Target* const t = target() )
+        {
+            const QDir targetDir( t->directory() );
+            keptPaths << targetDir.absoluteFilePath( QLatin1String( ".kdupdater" ) )
+                      << targetDir.absoluteFilePath( QLatin1String( "UpdateScheduler.xml" ) )
+                      << t->packagesXMLFileName() << t->updateSourcesXMLFileName();
+        }
 
-PrependFileOperation::PrependFileOperation()
-{
-    setName(QLatin1String( "PrependFile" ));
-}
+        QSet< QString > keptEntries;
+        const QStringList destEntries = destDirectories + destFiles;
+        for( QStringList::const_iterator it = destEntries.begin(); it != destEntries.end(); ++it )
+        {
+            if( it->isEmpty() || !isKeptBySync( treePath( dest, *it ), *it, keptPaths ) )
+                continue;
+            for( QString path = *it; !path.isEmpty(); path = path.left( qMax( path.lastIndexOf( QLatin1Char( '/' ) ), 0 ) ) )
+                keptEntries.insert( path );
+        }
 
-PrependFileOperation::~PrependFileOperation()
-{
+        for( QStringList::const_iterator it = destDirectories.begin(); it != destDirectories.end(); ++it )
+        {
+            if( !sourceDirectories.contains( *it ) && !keptEntries.contains( *it ) )
+                entries.append( TreeEntry( TreeEntry::RemoveDirectory, *it ) );
+        }
+        for( QStringList::const_iterator it = destFiles.begin(); it != destFiles.end(); ++it )
+        {
+            if( !sourceFiles.contains( *it ) && !keptEntries.contains( *it ) )
+                entries.append( TreeEntry( TreeEntry::RemoveFile, *it ) );
+        }
+    }
 
-}
+    // the backup directory is on the file system of the destination, so backups are hard links
+    const QFileInfo destInfo( dest );
+    const QString backupDirectory = backupFileName( QDir( existingPath( destInfo.absolutePath() ) ).filePath( destInfo.fileName() ) );
+    if( backupDirectory.isEmpty() || !QDir().mkdir( backupDirectory ) )
+    {
+        setError( UserDefinedError, tr("Cannot create backup directory for %1").arg( dest ) );
+        return;
+    }
 
-void PrependFileOperation::backup()
-{
-    const QString filename = arguments().first();
+    // the backups mirror the existing directories of the destination
+    DirectoryHandles handles;
+    const QString backupFiles = backupDirectory + QLatin1String( "/files" );
+    const QStringList& backupDirectories = synchronize ? destDirectories : directories;
+    QString errorString;
+    for( QStringList::const_iterator it = backupDirectories.begin(); it != backupDirectories.end() && errorString.isEmpty(); ++it )
+    {
+        if( QFileInfo( treePath( dest, *it ) ).isDir() )
+            createDirectoryAt( &handles, treePath( backupFiles, *it ), &errorString );
+    }
 
-    QFile file( filename );
-    if( !file.exists() )
-        return; // nothing to backup
+    if( errorString.isEmpty() )
+    {
+        QtConcurrent::blockingMap( entries, TreeWorker( TreeWorker::Backup, source, dest, backupFiles, &handles, synchronize ) );
+        errorString = firstTreeError( entries );
+    }
 
-    setValue( QLatin1String( "backupOfFile" ), backupFileName( filename ) );
-    if( !file.copy( value( QLatin1String( "backupOfFile" ) ).toString() ) )
+    if( errorString.isEmpty() && writeTreeManifest( backupDirectory, entries, &errorString ) )
     {
-        setError( UserDefinedError, tr("Cannot backup file %1: %2").arg(filename, file.errorString()) );
-        clearValue( QLatin1String( "backupOfFile" ) );
+        setValue( QLatin1String( "backupDirectory" ), backupDirectory );
+        return;
     }
+
+    setError( UserDefinedError, tr("Cannot backup %1: %2").arg( dest, errorString ) );
+    removeTree( backupDirectory, &errorString );
 }
 
-bool PrependFileOperation::performOperation()
+/*!
+   Creates the missing directories, then copies the files concurrently on the global thread pool,
+   each one atomically. A synchronizing operation also removes the files and directories missing
+   in the source tree.
+*/
+bool CopyTreeOperation::performOperation()
 {
-    // This operation takes two arguments. First argument is the name
-    // of the file into which a text has to be appended. Second argument
-    // is the text to preend.
-    // Optionally, a third parameter defines the text codec to be used
-    const QStringList args = this->arguments();
-    if( args.count() != 2 && args.count() != 3 )
+    // We need two args: the source directory and the destination directory
+    const QStringList args = arguments();
+    if( args.count() != 2 )
     {
-        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 2 or 3 expected.").arg( args.count() ) );
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 2 expected.").arg( args.count() ) );
         return false;
     }
 
-    const QString& fName = args.first();
-    const QString& text = args.at(1);
-    QTextCodec* const codec = args.count() == 2 ? 0 : QTextCodec::codecForName( args.at(2).toLatin1() );
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
+    const QString backupDirectory = value( QLatin1String( "backupDirectory" ) ).toString();
 
-    if( codec == 0 && args.count() == 3 )
+    QVector< TreeEntry > entries;
+    QString errorString;
+    if( backupDirectory.isEmpty() || !readTreeManifest( backupDirectory, &entries, &errorString ) )
     {
-        setError( UserDefinedError, tr( "Unknown text codec:").arg( args.at(2) ) );
+        setError( UserDefinedError, tr("Cannot copy %1 to %2: the backup is missing").arg( source, dest ) );
         return false;
     }
 
-    /*
-    If Append can append text into an empty file, Prepend should be
-    able to prepend text into an empty file as well. 
-    */
-
-    // Load the file first.
-    QString fContents;
-
-    QFile file(fName);
-    if( file.exists() ) // the file not existing is no problem
+    // parents come before their children
+    DirectoryHandles handles;
+    for( QVector< TreeEntry >::const_iterator it = entries.begin(); it != entries.end(); ++it )
     {
-        if( !file.open( QFile::ReadOnly | QFile::Text ) )
+        const QString directory = treePath( dest, it->path );
+        if( it->action == TreeEntry::CreateDirectory && !createDirectoryAt( &handles, directory, &errorString ) )
         {
-            setError( UserDefinedError, tr( "Cannot open file %1 for reading: %2" ).arg( fName, file.errorString() ) );
-        return false;
+            setError( UserDefinedError, tr("Cannot create directory %1: %2").arg( directory, errorString ) );
+            return false;
+        }
     }
-        QTextStream stream( &file );
-        if( codec )
-            stream.setCodec( codec );
-        stream.setAutoDetectUnicode( true );
-        fContents = stream.readAll();
-    file.close();
-    } 
 
-    // Prepend text to the file text
-    fContents = text + fContents;
+    QtConcurrent::blockingMap( entries, TreeWorker( TreeWorker::Apply, source, dest, backupDirectory + QLatin1String( "/files" ), &handles ) );
+    errorString = firstTreeError( entries );
+    if( !errorString.isEmpty() )
+    {
+        setError( UserDefinedError, errorString );
+        return false;
+    }
 
-    // Now re-open the file in write only mode.
-    if( !file.open( QFile::WriteOnly | QFile::Text ) )
+    // the removed directories are empty now, children come after their parents
+    for( int i = entries.count() - 1; i >= 0; --i )
+    {
+        const QString directory = treePath( dest, entries.at( i ).path );
+        if( entries.at( i ).action == TreeEntry::RemoveDirectory && !QDir().rmdir( directory ) )
         {
-        setError( UserDefinedError, tr("Cannot open file %1 for writing: %2").arg(fName, file.errorString() ) );
+            setError( UserDefinedError, tr("Cannot remove directory %1").arg( directory ) );
             return false;
         }
+    }
+    return true;
+}
 
-    QTextStream stream( &file );
-    if( codec )
-        stream.setCodec( codec );
-    stream.setAutoDetectUnicode( true );
-    stream << fContents;
-    stream.flush();
-    if( stream.status() != QTextStream::Ok )
+/*!
+   Restores the whole destination tree from the manifest: recreates the removed directories,
+   deletes the created files and restores the backups concurrently, then removes the created
+   directories. Also restores partially performed operations.
+*/
+bool CopyTreeOperation::undoOperation()
+{
+    const QString dest = absolutePath( arguments().last() );
+    const QString backupDirectory = value( QLatin1String( "backupDirectory" ) ).toString();
+
+    // without a backup nothing was changed
+    if( backupDirectory.isEmpty() )
+        return true;
+
+    QVector< TreeEntry > entries;
+    QString errorString;
+    if( !readTreeManifest( backupDirectory, &entries, &errorString ) )
     {
-        setError( UserDefinedError, tr( "Error while writing data to %1" ).arg( fName ) );
+        setError( UserDefinedError, tr("Cannot read the backup of %1: %2").arg( dest, errorString ) );
         return false;
     }
 
+    DirectoryHandles handles;
+    for( QVector< TreeEntry >::const_iterator it = entries.begin(); it != entries.end(); ++it )
+    {
+        if( it->action == TreeEntry::RemoveDirectory )
+            createDirectoryAt( &handles, treePath( dest, it->path ), &errorString );
+    }
+
+    QtConcurrent::blockingMap( entries, TreeWorker( TreeWorker::Undo, QString(), dest, backupDirectory + QLatin1String( "/files" ), &handles ) );
+    errorString = firstTreeError( entries );
+
+    for( int i = entries.count() - 1; i >= 0; --i )
+    {
+        const QString directory = treePath( dest, entries.at( i ).path );
+        if( entries.at( i ).action == TreeEntry::CreateDirectory && QFileInfo( directory ).isDir() && !QDir().rmdir( directory ) && errorString.isEmpty() )
+            errorString = tr("Cannot remove directory %1").arg( directory );
+    }
+
+    if( !errorString.isEmpty() )
+    {
+        setError( UserDefinedError, errorString );
+        return false;
+    }
     return true;
 }
 
-bool PrependFileOperation::undoOperation()
+/*!
+   Restores the destination tree from the manifest, like undoOperation(), which handles
+   partially performed operations.
+*/
+bool CopyTreeOperation::restoreBackup()
 {
-    // bockupOfFile being empty -> file didn't exist before -> no error
-    const QString filename = arguments().first();
-    const QString backupOfFile = value( QLatin1String( "backupOfFile" ) ).toString();
-    if( !backupOfFile.isEmpty() && !QFile::exists( backupOfFile ) )
+    return undoOperation();
+}
+
+bool CopyTreeOperation::testOperation()
+{
+    const QStringList args = arguments();
+    if( args.count() != 2 )
     {
-        setError( UserDefinedError, tr("Cannot find backup file for %1").arg(filename) );
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 2 expected.").arg( args.count() ) );
         return false;
     }
 
-    QFile file( filename );
-    if ( !file.remove() ) {
-        setError( UserDefinedError, tr("Cannot restore backup file for %1: %2").arg(filename, file.errorString()) );
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
+    const QFileInfo sourceInfo( source );
+    if( !sourceInfo.isDir() )
+    {
+        setError( UserDefinedError, tr("Cannot copy %1: it is not a directory").arg( source ) );
         return false;
     }
 
-    // got deleted? We might be done, if it didn't exist before
-    if( backupOfFile.isEmpty() )
-        return true;
+    const QFileInfo destInfo( dest );
+    if( destInfo.exists() && !destInfo.isDir() )
+    {
+        setError( UserDefinedError, tr("Cannot copy %1 to %2: the destination is not a directory").arg( source, dest ) );
+        return false;
+    }
 
-    QFile backupF( backupOfFile );
-    const bool success = backupF.rename( filename );
-    if(!success)
-        setError( UserDefinedError, tr("Cannot restore backup file for %1: %2").arg(filename, backupF.errorString()) );
+    // the backup directory is created next to the destination
+    const QString destDir = existingPath( destInfo.absolutePath() );
+    if( !isWritableDirectory( destDir ) || ( destInfo.exists() && !isWritableDirectory( dest ) ) )
+    {
+        setError( UserDefinedError, tr("Cannot copy %1 to %2: directory %3 is not writable").arg( source, dest, destInfo.exists() ? dest : destDir ) );
+        return false;
+    }
+    return true;
+}
+
+UpdateOperation::Cost CopyTreeOperation::estimateCost() const
+{
+    Cost cost;
+    const QStringList args = arguments();
+    if( args.count() != 2 )
+        return cost;
+
+    const QString source = absolutePath( args.first() );
+    const QString dest = absolutePath( args.last() );
+
+    // backups are hard links, synchronizing reads the existing files for comparison
+    cost.known = true;
+    const qint64 size = treeSize( source, &cost.filesTouched );
+    cost.bytesRead = synchronize ? 2 * size : size;
+    cost.bytesWritten = size;
+    cost.requiredPaths << source;
+    cost.createdPaths << dest;
+    if( synchronize )
+        cost.removedPaths << dest;
+    return cost;
+}
+
+CopyTreeOperation* CopyTreeOperation::clone() const
+{
+    return UpdateOperation::clone< CopyTreeOperation >();
+}
+
+SyncTreeOperation::SyncTreeOperation()
+    : CopyTreeOperation( true )
+{
+}
+
+SyncTreeOperation::~SyncTreeOperation()
+{
+}
+
+SyncTreeOperation* SyncTreeOperation::clone() const
+{
+    return UpdateOperation::clone< SyncTreeOperation >();
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+// KDUpdater::DeleteTreeOperation
+////////////////////////////////////////////////////////////////////////////
+
+DeleteTreeOperation::DeleteTreeOperation()
+{
+    setName( QLatin1String( "DeleteTree" ) );
+}
+
+/*!
+   Deletes the tree moved aside by the operation, concurrently on the global thread pool.
+*/
+DeleteTreeOperation::~DeleteTreeOperation()
+{
+    const QString backup = value( QLatin1String( "backupOfTree" ) ).toString();
+    QString errorString;
+    if( !backup.isEmpty() && QFileInfo( backup ).isDir() )
+        removeTree( backup, &errorString );
+}
+
+void DeleteTreeOperation::backup()
+{
+    // The tree is renamed to its backup, which is deleted when the operation is done
+    const QString directory = absolutePath( arguments().first() );
+    setValue( QLatin1String( "backupOfTree" ), backupFileName( directory ) );
+}
+
+bool DeleteTreeOperation::performOperation()
+{
+    const QStringList args = arguments();
+    if( args.count() != 1 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 1 expected.").arg( args.count() ) );
+        return false;
+    }
 
+    const QString directory = absolutePath( args.first() );
+    const QString backup = value( QLatin1String( "backupOfTree" ) ).toString();
+    QString errorString;
+    const bool success = !backup.isEmpty() && moveFile( directory, backup, &errorString );
+    if( !success )
+        setError( UserDefinedError, tr("Cannot delete directory %1: %2").arg( directory, errorString ) );
     return success;
 }
 
-bool PrependFileOperation::testOperation()
+bool DeleteTreeOperation::undoOperation()
+{
+    const QString directory = absolutePath( arguments().first() );
+    const QString backup = value( QLatin1String( "backupOfTree" ) ).toString();
+
+    // the tree was not moved aside
+    if( backup.isEmpty() || !QFileInfo( backup ).isDir() )
+        return true;
+
+    QString errorString;
+    const bool success = moveFile( backup, directory, &errorString );
+    if( !success )
+        setError( UserDefinedError, tr("Cannot restore directory %1: %2").arg( directory, errorString ) );
+    return success;
+}
+
+/*!
+   Moves the tree back if it was moved aside.
+*/
+bool DeleteTreeOperation::restoreBackup()
+{
+    return undoOperation();
+}
+
+bool DeleteTreeOperation::testOperation()
 {
-    // TODO
+    const QStringList args = arguments();
+    if( args.count() != 1 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 1 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    const QFileInfo fi( absolutePath( args.first() ) );
+    if( !fi.isDir() || fi.isSymLink() )
+    {
+        setError( UserDefinedError, tr("Cannot delete directory %1: it does not exist").arg( fi.absoluteFilePath() ) );
+        return false;
+    }
+
+    if( !isWritableDirectory( fi.absolutePath() ) )
+    {
+        setError( UserDefinedError, tr("Cannot delete directory %1: directory %2 is not writable").arg( fi.absoluteFilePath(), fi.absolutePath() ) );
+        return false;
+    }
     return true;
 }
 
-PrependFileOperation* PrependFileOperation::clone() const
+UpdateOperation::Cost DeleteTreeOperation::estimateCost() const
 {
-    return UpdateOperation::clone< PrependFileOperation >();
+    Cost cost;
+    const QStringList args = arguments();
+    if( args.count() != 1 )
+        return cost;
+
+    const QString directory = absolutePath( args.first() );
+
+    // the tree is renamed, its files are deleted once the update is done
+    cost.known = true;
+    cost.filesTouched = 1;
+    cost.requiredPaths << directory;
+    cost.removedPaths << directory;
+    return cost;
+}
+
+DeleteTreeOperation* DeleteTreeOperation::clone() const
+{
+    return UpdateOperation::clone< DeleteTreeOperation >();
 }
 
 
@@ -942,11 +2292,11 @@ bool ExecuteOperation::performOperation()
                                    };
         success = CreateProcess( 0, const_cast< wchar_t* >( static_cast< const wchar_t* >( arguments.utf16() ) ),
                                  0, 0, FALSE, CREATE_UNICODE_ENVIRONMENT | CREATE_NEW_CONSOLE, 0,
-                                 0,
+                                 workingDirectory().isEmpty() ? 0 : reinterpret_cast< const wchar_t* >( QDir::toNativeSeparators( workingDirectory() ).utf16() ),
                                  &startupInfo, &pinfo );
 
 #else
-        success = QProcess::startDetached( args.front(), args.mid( 1 ) );
+        success = QProcess::startDetached( args.front(), args.mid( 1 ), workingDirectory() );
 #endif
     }
     else
@@ -954,6 +2304,7 @@ bool ExecuteOperation::performOperation()
     {
         QProcess process;
         process.setReadChannelMode( QProcess::ForwardedChannels );
+        process.setWorkingDirectory( workingDirectory() );
     	process.start( args.front(), args.mid( 1 ) );
     	success = process.waitForFinished( -1 );
     }
@@ -991,7 +2342,12 @@ bool ExecuteOperation::undoOperation()
 
 bool ExecuteOperation::testOperation()
 {
-    // TODO
+    // what the process does cannot be tested
+    if( arguments().isEmpty() )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: no arguments given, at least one expected.") );
+        return false;
+    }
     return true;
 }
 
@@ -1017,6 +2373,7 @@ UpdatePackageOperation::~UpdatePackageOperation()
 
 void UpdatePackageOperation::backup()
 {
+    const QMutexLocker locker( packagesInfoMutex() );
     const PackageInfo info = target()->packagesInfo()->packageInfo( target()->packagesInfo()->findPackageInfo( arguments().first() ) );
     setValue( QLatin1String( "oldVersion" ), info.version );
     setValue( QLatin1String( "oldDate" ), info.lastUpdateDate );
@@ -1035,7 +2392,8 @@ bool UpdatePackageOperation::performOperation()
 
     const QString& packageName = args.at( 0 );
     const QString& version = args.at( 1 );
-    const QDate date = QDate::fromString( args.at( 2 ) );
+    const QDate date = QDate::fromString( args.at( 2 ), Qt::ISODate );
+    const QMutexLocker locker( packagesInfoMutex() );
     const bool success = target()->packagesInfo()->updatePackage( packageName, version, date );
     if(!success)
         setError( UserDefinedError, tr("Cannot update %1-%2").arg( packageName, version ) );
@@ -1049,6 +2407,7 @@ bool UpdatePackageOperation::undoOperation()
     const QString version = arguments().at( 1 );
     const QString oldVersion = value( QLatin1String( "oldVersion" ) ).toString();
     const QDate oldDate = value( QLatin1String( "oldDate" ) ).toDate();
+    const QMutexLocker locker( packagesInfoMutex() );
     const bool success = target()->packagesInfo()->updatePackage( packageName, oldVersion, oldDate );
     if(!success)
         setError( UserDefinedError, tr("Cannot restore %1-%2").arg( packageName, version ) );
@@ -1058,10 +2417,30 @@ bool UpdatePackageOperation::undoOperation()
 
 bool UpdatePackageOperation::testOperation()
 {
-    // TODO
+    const QStringList args = arguments();
+    if( args.count() != 3 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 3 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    const QMutexLocker locker( packagesInfoMutex() );
+    if( target()->packagesInfo()->findPackageInfo( args.first() ) == -1 )
+    {
+        setError( UserDefinedError, tr("Cannot update %1-%2: the package is not installed").arg( args.at( 0 ), args.at( 1 ) ) );
+        return false;
+    }
     return true;
 }
 
+UpdateOperation::Cost UpdatePackageOperation::estimateCost() const
+{
+    // changes the packages info in memory, which is written once for all updates
+    Cost cost;
+    cost.known = true;
+    return cost;
+}
+
 UpdatePackageOperation* UpdatePackageOperation::clone() const
 {
     return UpdateOperation::clone< UpdatePackageOperation >();
@@ -1084,6 +2463,7 @@ UpdateCompatOperation::~UpdateCompatOperation()
 
 void UpdateCompatOperation::backup()
 {
+    const QMutexLocker locker( packagesInfoMutex() );
     setValue( QLatin1String( "oldCompatLevel" ), target()->packagesInfo()->compatLevel() );
 }
 
@@ -1098,6 +2478,7 @@ bool UpdateCompatOperation::performOperation()
     }
 
     const int level = args.first().toInt();
+    const QMutexLocker locker( packagesInfoMutex() );
     target()->packagesInfo()->setCompatLevel( level );
     return true;
 }
@@ -1110,17 +2491,131 @@ bool UpdateCompatOperation::undoOperation()
         return false;
     }
 
+    const QMutexLocker locker( packagesInfoMutex() );
     target()->packagesInfo()->setCompatLevel( value( QLatin1String( "oldCompatLevel" ) ).toInt() );
     return true;
 }
 
 bool UpdateCompatOperation::testOperation()
 {
-    // TODO
+    const QStringList args = arguments();
+    if( args.count() != 1 )
+    {
+        setError( InvalidArguments, tr("Invalid arguments: %1 arguments given, 1 expected.").arg( args.count() ) );
+        return false;
+    }
+
+    bool ok = false;
+    args.first().toInt( &ok );
+    if( !ok )
+    {
+        setError( InvalidArguments, tr("Invalid compat level %1").arg( args.first() ) );
+        return false;
+    }
     return true;
 }
 
+UpdateOperation::Cost UpdateCompatOperation::estimateCost() const
+{
+    // changes the packages info in memory, which is written once for all updates
+    Cost cost;
+    cost.known = true;
+    return cost;
+}
+
 UpdateCompatOperation* UpdateCompatOperation::clone() const
 {
     return UpdateOperation::clone< UpdateCompatOperation >();
 }
+
+#ifdef KDTOOLSCORE_UNITTESTS
+
+#include "kdupdaterupdateoperationfactory.h"
+
+#include <KDUnitTest/Test>
+
+#include <QUuid>
+
+static bool writeTestFile( const QString& fileName, const QByteArray& contents )
+{
+    QDir().mkpath( QFileInfo( fileName ).absolutePath() );
+    QFile file( fileName );
+    return file.open( QIODevice::WriteOnly ) && file.write( contents ) == contents.size();
+}
+
+static QByteArray readTestFile( const QString& fileName )
+{
+    QFile file( fileName );
+    return file.open( QIODevice::ReadOnly ) ? file.readAll() : QByteArray();
+}
+
+KDAB_UNITTEST_SIMPLE( TreeOperations, "kdupdater" ) {
+    const QDir dir( QDir::temp().filePath( QString::fromLatin1( "kdupdater-tree-test%1" ).arg( QUuid::createUuid().toString() ) ) );
+    const QString dest = dir.filePath( QLatin1String( "target" ) );
+    const QString source = dest + QLatin1String( "/.kdupdater/staging/update/data" );
+
+    Target target;
+    target.setDirectory( dest );
+
+    assertTrue( writeTestFile( source + QLatin1String( "/a.txt" ), "new a" ) );
+    assertTrue( writeTestFile( source + QLatin1String( "/sub/b.txt" ), "new b" ) );
+    assertTrue( writeTestFile( dest + QLatin1String( "/a.txt" ), "old a" ) );
+    assertTrue( writeTestFile( dest + QLatin1String( "/stale.txt" ), "stale" ) );
+    assertTrue( writeTestFile( dest + QLatin1String( "/stale/c.txt" ), "stale c" ) );
+    assertTrue( writeTestFile( dest + QLatin1String( "/.kdupdater/journal" ), "journal" ) );
+    assertTrue( writeTestFile( dest + QLatin1String( "/UpdateScheduler.xml" ), "scheduler" ) );
+    assertTrue( writeTestFile( dest + QLatin1String( "/Packages.xml" ), "packages" ) );
+    assertTrue( writeTestFile( dest + QLatin1String( "/plugins/.kdupdater/journal" ), "nested journal" ) );
+
+    {
+        // Synchronizing removes the stale files, but not the state of the installer
+        UpdateOperation* const sync = UpdateOperationFactory::instance().create( QLatin1String( "SyncTree" ), QStringList() << source << dest, &target );
+        assertNotNull( sync );
+        assertTrue( sync->testOperation() );
+        sync->backup();
+        assertTrue( sync->performOperation() );
+        assertEqual( readTestFile( dest + QLatin1String( "/a.txt" ) ), QByteArray( "new a" ) );
+        assertEqual( readTestFile( dest + QLatin1String( "/sub/b.txt" ) ), QByteArray( "new b" ) );
+        assertFalse( QFile::exists( dest + QLatin1String( "/stale.txt" ) ) );
+        assertFalse( QFile::exists( dest + QLatin1String( "/stale" ) ) );
+        assertEqual( readTestFile( source + QLatin1String( "/a.txt" ) ), QByteArray( "new a" ) );
+        assertEqual( readTestFile( dest + QLatin1String( "/.kdupdater/journal" ) ), QByteArray( "journal" ) );
+        assertEqual( readTestFile( dest + QLatin1String( "/UpdateScheduler.xml" ) ), QByteArray( "scheduler" ) );
+        assertEqual( readTestFile( dest + QLatin1String( "/Packages.xml" ) ), QByteArray( "packages" ) );
+        assertEqual( readTestFile( dest + QLatin1String( "/plugins/.kdupdater/journal" ) ), QByteArray( "nested journal" ) );
+
+        // Undoing restores the removed and replaced files and removes the created ones
+        assertTrue( sync->undoOperation() );
+        assertEqual( readTestFile( dest + QLatin1String( "/a.txt" ) ), QByteArray( "old a" ) );
+        assertEqual( readTestFile( dest + QLatin1String( "/stale.txt" ) ), QByteArray( "stale" ) );
+        assertEqual( readTestFile( dest + QLatin1String( "/stale/c.txt" ) ), QByteArray( "stale c" ) );
+        assertFalse( QFile::exists( dest + QLatin1String( "/sub" ) ) );
+        delete sync;
+    }
+    {
+        // Copying leaves the files missing in the source alone
+        UpdateOperation* const copy = UpdateOperationFactory::instance().create( QLatin1String( "CopyTree" ), QStringList() << source << dest, &target );
+        copy->backup();
+        assertTrue( copy->performOperation() );
+        assertEqual( readTestFile( dest + QLatin1String( "/a.txt" ) ), QByteArray( "new a" ) );
+        assertEqual( readTestFile( dest + QLatin1String( "/stale.txt" ) ), QByteArray( "stale" ) );
+        assertTrue( copy->undoOperation() );
+        assertEqual( readTestFile( dest + QLatin1String( "/a.txt" ) ), QByteArray( "old a" ) );
+        delete copy;
+    }
+    {
+        // Deleting a tree moves it aside until the operation is destroyed
+        const QString stale = dest + QLatin1String( "/stale" );
+        UpdateOperation* const remove = UpdateOperationFactory::instance().create( QLatin1String( "DeleteTree" ), QStringList() << stale, &target );
+        remove->backup();
+        assertTrue( remove->performOperation() );
+        assertFalse( QFile::exists( stale ) );
+        assertTrue( remove->undoOperation() );
+        assertEqual( readTestFile( stale + QLatin1String( "/c.txt" ) ), QByteArray( "stale c" ) );
+        delete remove;
+    }
+
+    assertTrue( QDir( dir.path() ).removeRecursively() );
+}
+
+#endif // KDTOOLSCORE_UNITTESTS
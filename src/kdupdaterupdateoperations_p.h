@@ -30,8 +30,21 @@
 
 namespace KDUpdater
 {
+    /*!
+       \internal
+       An operation which can restore the state from before it was performed from its backup
+       alone, without knowing whether it was performed completely, partially or not at all.
+       Recovery uses this for operations interrupted between backup() and the record that they
+       were performed.
+    */
+    class InterruptibleOperation
+    {
+    public:
+        virtual ~InterruptibleOperation() {}
+        virtual bool restoreBackup() = 0;
+    };
 
-    class CopyOperation : public UpdateOperation
+    class CopyOperation : public UpdateOperation, public InterruptibleOperation
     {
         Q_DECLARE_TR_FUNCTIONS( CopyOperation )
     public:
@@ -41,11 +54,13 @@ namespace KDUpdater
         void backup();
         bool performOperation();
         bool undoOperation();
+        bool restoreBackup();
         bool testOperation();
+        Cost estimateCost() const;
         CopyOperation* clone() const;
     };
 
-    class MoveOperation : public UpdateOperation
+    class MoveOperation : public UpdateOperation, public InterruptibleOperation
     {
         Q_DECLARE_TR_FUNCTIONS( MoveOperation )
     public:
@@ -55,11 +70,13 @@ namespace KDUpdater
         void backup();
         bool performOperation();
         bool undoOperation();
+        bool restoreBackup();
         bool testOperation();
+        Cost estimateCost() const;
         MoveOperation* clone() const;
     };
 
-    class DeleteOperation : public UpdateOperation
+    class DeleteOperation : public UpdateOperation, public InterruptibleOperation
     {
         Q_DECLARE_TR_FUNCTIONS( DeleteOperation )
     public:
@@ -69,11 +86,13 @@ namespace KDUpdater
         void backup();
         bool performOperation();
         bool undoOperation();
+        bool restoreBackup();
         bool testOperation();
+        Cost estimateCost() const;
         DeleteOperation* clone() const;
     };
 
-    class MkdirOperation : public UpdateOperation
+    class MkdirOperation : public UpdateOperation, public InterruptibleOperation
     {
         Q_DECLARE_TR_FUNCTIONS( MkdirOperation )
     public:
@@ -83,11 +102,15 @@ namespace KDUpdater
         void backup();
         bool performOperation();
         bool undoOperation();
+        bool restoreBackup();
         bool testOperation();
+        Cost estimateCost() const;
         MkdirOperation* clone() const;
+
+        static QString directoryPath( const QString& workingDirectory, const QString& dirName );
     };
 
-    class RmdirOperation : public UpdateOperation
+    class RmdirOperation : public UpdateOperation, public InterruptibleOperation
     {
         Q_DECLARE_TR_FUNCTIONS( RmdirOperation )
     public:
@@ -97,11 +120,13 @@ namespace KDUpdater
         void backup();
         bool performOperation();
         bool undoOperation();
+        bool restoreBackup();
         bool testOperation();
+        Cost estimateCost() const;
         RmdirOperation* clone() const;
     };
 
-    class AppendFileOperation : public UpdateOperation
+    class AppendFileOperation : public UpdateOperation, public InterruptibleOperation
     {
         Q_DECLARE_TR_FUNCTIONS( AppendFileOperation )
     public:
@@ -111,11 +136,13 @@ namespace KDUpdater
         void backup();
         bool performOperation();
         bool undoOperation();
+        bool restoreBackup();
         bool testOperation();
+        Cost estimateCost() const;
         AppendFileOperation* clone() const;
     };
 
-    class PrependFileOperation : public UpdateOperation
+    class PrependFileOperation : public UpdateOperation, public InterruptibleOperation
     {
         Q_DECLARE_TR_FUNCTIONS( PrependFileOperation )
     public:
@@ -125,10 +152,59 @@ namespace KDUpdater
         void backup();
         bool performOperation();
         bool undoOperation();
+        bool restoreBackup();
         bool testOperation();
+        Cost estimateCost() const;
         PrependFileOperation* clone() const;
     };
 
+    class CopyTreeOperation : public UpdateOperation, public InterruptibleOperation
+    {
+        Q_DECLARE_TR_FUNCTIONS( CopyTreeOperation )
+    public:
+        CopyTreeOperation();
+        ~CopyTreeOperation();
+
+        void backup();
+        bool performOperation();
+        bool undoOperation();
+        bool restoreBackup();
+        bool testOperation();
+        Cost estimateCost() const;
+        CopyTreeOperation* clone() const;
+
+    protected:
+        explicit CopyTreeOperation( bool synchronize );
+
+    private:
+        bool synchronize;
+    };
+
+    class SyncTreeOperation : public CopyTreeOperation
+    {
+    public:
+        SyncTreeOperation();
+        ~SyncTreeOperation();
+
+        SyncTreeOperation* clone() const;
+    };
+
+    class DeleteTreeOperation : public UpdateOperation, public InterruptibleOperation
+    {
+        Q_DECLARE_TR_FUNCTIONS( DeleteTreeOperation )
+    public:
+        DeleteTreeOperation();
+        ~DeleteTreeOperation();
+
+        void backup();
+        bool performOperation();
+        bool undoOperation();
+        bool restoreBackup();
+        bool testOperation();
+        Cost estimateCost() const;
+        DeleteTreeOperation* clone() const;
+    };
+
     class ExecuteOperation : public QObject, public UpdateOperation
     {
         Q_OBJECT
@@ -166,6 +242,7 @@ namespace KDUpdater
         bool performOperation();
         bool undoOperation();
         bool testOperation();
+        Cost estimateCost() const;
         UpdatePackageOperation* clone() const;
     };
 
@@ -180,6 +257,7 @@ namespace KDUpdater
         bool performOperation();
         bool undoOperation();
         bool testOperation();
+        Cost estimateCost() const;
         UpdateCompatOperation* clone() const;
     };
 
@@ -0,0 +1,782 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#include "kdupdaterupdatescheduler.h"
+#include "kdupdatertarget.h"
+#include "kdupdaterupdatefinder.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QDomDocument>
+#include <QDomElement>
+#include <QFile>
+#include <QMap>
+#include <QThread>
+#include <QTimer>
+#include <QUrl>
+
+#include <kdsavefile.h>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#elif defined(Q_OS_UNIX)
+#include <stdlib.h>
+#endif
+
+/*!
+   \ingroup kdupdater
+   \class KDUpdater::UpdateScheduler kdupdaterupdatescheduler.h KDUpdaterUpdateScheduler
+   \brief Periodically checks a \ref KDUpdater::Target for updates in the background
+
+   Instead of implementing its own timer around \ref KDUpdater::UpdateFinder, an application can
+   create an UpdateScheduler and call \ref start(). The scheduler then runs an update check every
+   \ref interval seconds, taking care of the following
+
+   \li A random delay of up to \ref jitter seconds is added to every check, so that many hosts
+   configured with the same interval do not contact the update servers at the same time.
+   \li If a check fails, the next check is delayed exponentially, starting with \ref retryInterval
+   and limited by \ref maximumBackoff.
+   \li Update sources whose Updates.xml could not be fetched are remembered as dead and skipped
+   by the following checks, again with an exponentially growing retry delay.
+   \li If \ref onlyWhenIdle is set, checks are postponed while the system is busy, see
+   \ref isSystemIdle().
+
+   The time of the last and the next check, the failure count and the dead update sources are
+   stored in \ref stateFileName, so that the schedule survives restarts of the application.
+
+   \code
+   KDUpdater::UpdateScheduler scheduler( target );
+   scheduler.setInterval( 24 * 60 * 60 );
+   QObject::connect( &scheduler, SIGNAL(updatesAvailable(int)), &mainWindow, SLOT(showUpdatesAvailable()) );
+   scheduler.start();
+   \endcode
+
+   Once a check succeeded, the following checks first compare the version stamps of the
+   update sources (see \ref KDUpdater::UpdateFinder::setVersionStampCheckEnabled()). If nothing
+   changed, the updates found before are kept and Updates.xml is not fetched again.
+
+   \note The \ref KDUpdater::Update objects returned by \ref updates() are owned by the
+   \ref updateFinder() of the last check that found changes. They are deleted when a later
+   check finds changes or fails.
+*/
+
+/*!
+   \fn void KDUpdater::UpdateScheduler::checkStarted()
+
+   This signal is emitted when an update check starts.
+*/
+
+/*!
+   \fn void KDUpdater::UpdateScheduler::checkFinished( bool success )
+
+   This signal is emitted when an update check finished. \a success is false if the
+   check could not be completed.
+*/
+
+/*!
+   \fn void KDUpdater::UpdateScheduler::updatesAvailable( int count )
+
+   This signal is emitted when an update check found \a count updates. The updates can be
+   fetched via \ref updates(). It is not emitted again if a later check finds that the update
+   sources did not change.
+*/
+
+using namespace KDUpdater;
+
+static const int DefaultInterval = 24 * 60 * 60;
+static const int DefaultJitter = 60 * 60;
+static const int DefaultRetryInterval = 15 * 60;
+static const int DefaultMaximumBackoff = 24 * 60 * 60;
+
+// While the system is busy, the idle state is polled at this interval
+static const int IdleRetryInterval = 5 * 60;
+// QTimer cannot handle arbitrary long intervals, long waits are split
+static const int MaximumTimerInterval = 60 * 60 * 1000;
+
+#if defined(Q_OS_WIN)
+// Seconds without user input after which the system is considered idle
+static const DWORD IdleInputThreshold = 5 * 60;
+#elif defined(Q_OS_UNIX)
+// The system is considered idle below this load average per CPU
+static const double IdleLoadThreshold = 0.25;
+#endif
+
+static void addTextChildHelper(QDomNode *node,
+                               const QString &tag,
+                               const QString &text)
+{
+    QDomElement domElement = node->ownerDocument().createElement(tag);
+    const QDomText domText = node->ownerDocument().createTextNode(text);
+
+    domElement.appendChild(domText);
+    node->appendChild(domElement);
+}
+
+static QString dateToString( const QDateTime& date )
+{
+    return date.isValid() ? date.toString( Qt::ISODate ) : QString();
+}
+
+static QDateTime dateFromString( const QString& text )
+{
+    QDateTime date = QDateTime::fromString( text, Qt::ISODate );
+    date.setTimeSpec( Qt::UTC );
+    return date;
+}
+
+//
+// Private
+//
+class UpdateScheduler::Private
+{
+public:
+    struct DeadSource
+    {
+        DeadSource() : failureCount( 0 ) {}
+
+        int failureCount;
+        QDateTime retryAfter;
+    };
+
+    explicit Private( UpdateScheduler* qq ) :
+        q( qq ),
+        target( 0 ),
+        updateType( PackageUpdate ),
+        interval( DefaultInterval ),
+        jitter( DefaultJitter ),
+        retryInterval( DefaultRetryInterval ),
+        maximumBackoff( DefaultMaximumBackoff ),
+        onlyWhenIdle( false ),
+        active( false ),
+        checking( false ),
+        stateLoaded( false ),
+        failureCount( 0 ),
+        finder( 0 )
+    {
+        randomState = quint32( QDateTime::currentMSecsSinceEpoch() ) ^ quint32( QCoreApplication::applicationPid() ) ^ quint32( quintptr( qq ) );
+        if( randomState == 0 )
+            randomState = 0x9E3779B9;
+    }
+
+    ~Private()
+    {
+        delete finder;
+    }
+
+    UpdateScheduler* const q;
+    Target* target;
+    UpdateTypes updateType;
+    int interval;
+    int jitter;
+    int retryInterval;
+    int maximumBackoff;
+    bool onlyWhenIdle;
+    QString stateFileName;
+
+    bool active;
+    bool checking;
+    bool stateLoaded;
+    QTimer timer;
+    quint32 randomState;
+
+    // Persistent state
+    QDateTime lastCheck;
+    QDateTime lastSuccessfulCheck;
+    QDateTime nextCheck;
+    int failureCount;
+    QMap<QUrl, DeadSource> deadSources;
+
+    UpdateFinder* finder;
+    QMap<QUrl, QByteArray> versionStamps;
+
+    int randomDelay( int maximum );
+    int backoffDelay( int failures ) const;
+    QString effectiveStateFileName() const;
+    void loadState();
+    void saveState() const;
+    void schedule( const QDateTime& when );
+    void armTimer();
+    void runCheck();
+    void slotTimeout();
+};
+
+/*!
+   \internal
+
+   Returns a random delay in the range [0, \a maximum], using a xorshift generator which is
+   seeded per instance. This keeps the global qrand() sequence of the application untouched.
+*/
+int UpdateScheduler::Private::randomDelay( int maximum )
+{
+    if( maximum <= 0 )
+        return 0;
+
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return int( randomState % ( quint32( maximum ) + 1 ) );
+}
+
+/*!
+   \internal
+
+   Returns the delay after \a failures consecutive failures: retryInterval doubled for each
+   further failure, limited by maximumBackoff.
+*/
+int UpdateScheduler::Private::backoffDelay( int failures ) const
+{
+    qint64 delay = qMax( retryInterval, 1 );
+    for( int i = 1; i < failures && delay < maximumBackoff; ++i )
+        delay *= 2;
+    return int( qMin( delay, qint64( qMax( maximumBackoff, retryInterval ) ) ) );
+}
+
+QString UpdateScheduler::Private::effectiveStateFileName() const
+{
+    if( !stateFileName.isEmpty() || !target )
+        return stateFileName;
+    return QString::fromLatin1( "%1/UpdateScheduler.xml" ).arg( target->directory() );
+}
+
+/*!
+   \internal
+
+   Reads the scheduler state written by a previous instance.
+*/
+void UpdateScheduler::Private::loadState()
+{
+    stateLoaded = true;
+
+    QFile file( effectiveStateFileName() );
+    if( !file.open( QIODevice::ReadOnly ) )
+        return;
+
+    QDomDocument doc;
+    QString parseErrorMessage;
+    int parseErrorLine;
+    int parseErrorColumn;
+    if( !doc.setContent( &file, &parseErrorMessage, &parseErrorLine, &parseErrorColumn ) )
+    {
+        qDebug() << "Ignoring invalid update scheduler state in" << file.fileName() << ":"
+                 << parseErrorMessage << "at line" << parseErrorLine << ", column" << parseErrorColumn;
+        return;
+    }
+
+    const QDomElement rootE = doc.documentElement();
+    if( rootE.tagName() != QLatin1String( "UpdateScheduler" ) )
+        return;
+
+    deadSources.clear();
+    for( QDomNode childNode = rootE.firstChild(); !childNode.isNull(); childNode = childNode.nextSibling() )
+    {
+        const QDomElement childE = childNode.toElement();
+        if( childE.isNull() )
+            continue;
+
+        if( childE.tagName() == QLatin1String( "LastCheck" ) )
+            lastCheck = dateFromString( childE.text() );
+        else if( childE.tagName() == QLatin1String( "LastSuccessfulCheck" ) )
+            lastSuccessfulCheck = dateFromString( childE.text() );
+        else if( childE.tagName() == QLatin1String( "NextCheck" ) )
+            nextCheck = dateFromString( childE.text() );
+        else if( childE.tagName() == QLatin1String( "FailureCount" ) )
+            failureCount = childE.text().toInt();
+        else if( childE.tagName() == QLatin1String( "DeadSource" ) )
+        {
+            const QUrl url( childE.firstChildElement( QLatin1String( "Url" ) ).text() );
+            if( url.isEmpty() )
+                continue;
+
+            DeadSource source;
+            source.failureCount = childE.firstChildElement( QLatin1String( "FailureCount" ) ).text().toInt();
+            source.retryAfter = dateFromString( childE.firstChildElement( QLatin1String( "RetryAfter" ) ).text() );
+            deadSources.insert( url, source );
+        }
+    }
+}
+
+/*!
+   \internal
+
+   Writes the scheduler state to the state file.
+*/
+void UpdateScheduler::Private::saveState() const
+{
+    const QString fileName = effectiveStateFileName();
+    if( fileName.isEmpty() )
+        return;
+
+    QDomDocument doc;
+    QDomElement root = doc.createElement( QLatin1String( "UpdateScheduler" ) );
+    doc.appendChild( root );
+
+    addTextChildHelper( &root, QLatin1String( "LastCheck" ), dateToString( lastCheck ) );
+    addTextChildHelper( &root, QLatin1String( "LastSuccessfulCheck" ), dateToString( lastSuccessfulCheck ) );
+    addTextChildHelper( &root, QLatin1String( "NextCheck" ), dateToString( nextCheck ) );
+    addTextChildHelper( &root, QLatin1String( "FailureCount" ), QString::number( failureCount ) );
+
+    for( QMap<QUrl, DeadSource>::const_iterator it = deadSources.begin(); it != deadSources.end(); ++it )
+    {
+        QDomElement source = doc.createElement( QLatin1String( "DeadSource" ) );
+        addTextChildHelper( &source, QLatin1String( "Url" ), it.key().toString() );
+        addTextChildHelper( &source, QLatin1String( "FailureCount" ), QString::number( it->failureCount ) );
+        addTextChildHelper( &source, QLatin1String( "RetryAfter" ), dateToString( it->retryAfter ) );
+        root.appendChild( source );
+    }
+
+    KDSaveFile file( fileName );
+    if( !file.open( QFile::WriteOnly ) )
+    {
+        qDebug() << "Cannot write update scheduler state to" << fileName;
+        return;
+    }
+
+    file.write( doc.toByteArray( 4 ) );
+    file.commit( KDSaveFile::OverwriteExistingFile );
+}
+
+void UpdateScheduler::Private::schedule( const QDateTime& when )
+{
+    nextCheck = when;
+    armTimer();
+}
+
+void UpdateScheduler::Private::armTimer()
+{
+    if( !active || checking )
+        return;
+
+    const qint64 msecs = QDateTime::currentDateTimeUtc().msecsTo( nextCheck );
+    timer.start( int( qBound( qint64( 0 ), msecs, qint64( MaximumTimerInterval ) ) ) );
+}
+
+/*!
+   \internal
+*/
+void UpdateScheduler::Private::slotTimeout()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+
+    // Long waits are split into several timer intervals.
+    if( now < nextCheck )
+    {
+        armTimer();
+        return;
+    }
+
+    if( onlyWhenIdle && !q->isSystemIdle() )
+    {
+        schedule( now.addSecs( IdleRetryInterval + randomDelay( qMin( jitter, IdleRetryInterval ) ) ) );
+        return;
+    }
+
+    runCheck();
+}
+
+/*!
+   \internal
+
+   Runs an update finder, updates the dead update sources and computes the time of the next
+   check from the outcome.
+*/
+void UpdateScheduler::Private::runCheck()
+{
+    if( !stateLoaded )
+        loadState();
+
+    checking = true;
+    timer.stop();
+    emit q->checkStarted();
+
+    UpdateFinder* const checkFinder = new UpdateFinder( target );
+    checkFinder->setUpdateType( updateType );
+
+    // Version stamps only help while the updates found with them are still at hand.
+    if( finder )
+    {
+        checkFinder->setVersionStampCheckEnabled( true );
+        checkFinder->setVersionStamps( versionStamps );
+    }
+
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    QList<QUrl> ignoredSources;
+    for( QMap<QUrl, DeadSource>::const_iterator it = deadSources.begin(); it != deadSources.end(); ++it )
+    {
+        if( it->retryAfter.isValid() && it->retryAfter > now )
+            ignoredSources.append( it.key() );
+    }
+    checkFinder->setIgnoredUpdateSources( ignoredSources );
+
+    checkFinder->run();
+
+    const bool success = checkFinder->isFinished();
+    const bool unchanged = checkFinder->isUnchanged();
+    const QList<QUrl> failedSources = checkFinder->failedUpdateSources();
+    now = QDateTime::currentDateTimeUtc();
+
+    // Keep the previous updates if nothing changed, otherwise replace them.
+    if( unchanged )
+    {
+        delete checkFinder;
+    }
+    else
+    {
+        delete finder;
+        finder = checkFinder;
+        versionStamps = success ? finder->versionStamps() : QMap<QUrl, QByteArray>();
+    }
+
+    // Sources that were contacted again and did not fail are alive again.
+    for( QMap<QUrl, DeadSource>::iterator it = deadSources.begin(); it != deadSources.end(); )
+    {
+        if( ignoredSources.contains( it.key() ) || failedSources.contains( it.key() ) )
+            ++it;
+        else
+            it = deadSources.erase( it );
+    }
+    for( QList<QUrl>::const_iterator it = failedSources.begin(); it != failedSources.end(); ++it )
+    {
+        DeadSource& source = deadSources[ *it ];
+        ++source.failureCount;
+        source.retryAfter = now.addSecs( backoffDelay( source.failureCount ) );
+    }
+
+    lastCheck = now;
+    if( success )
+    {
+        failureCount = 0;
+        lastSuccessfulCheck = now;
+        nextCheck = now.addSecs( interval + randomDelay( jitter ) );
+    }
+    else
+    {
+        ++failureCount;
+        nextCheck = now.addSecs( backoffDelay( failureCount ) + randomDelay( jitter ) );
+    }
+
+    saveState();
+    checking = false;
+    armTimer();
+
+    emit q->checkFinished( success );
+    if( success && !unchanged && !finder->updates().isEmpty() )
+        emit q->updatesAvailable( finder->updates().count() );
+}
+
+//
+// UpdateScheduler
+//
+
+/*!
+   Constructs an update scheduler for \a target with \a parent.
+*/
+UpdateScheduler::UpdateScheduler( Target * target, QObject * parent )
+    : QObject( parent ),
+      d( new Private( this ) )
+{
+    d->target = target;
+    d->timer.setSingleShot( true );
+    connect( &d->timer, SIGNAL(timeout()), this, SLOT(slotTimeout()) );
+}
+
+/*!
+   Destructor
+*/
+UpdateScheduler::~UpdateScheduler()
+{
+}
+
+/*!
+   Returns the target that is checked for updates.
+*/
+Target * UpdateScheduler::target() const
+{
+    return d->target;
+}
+
+/*!
+   Sets the \a type of updates searched, see \ref KDUpdater::UpdateFinder::updateType.
+*/
+void UpdateScheduler::setUpdateType( UpdateTypes type )
+{
+    d->updateType = type;
+}
+
+UpdateTypes UpdateScheduler::updateType() const
+{
+    return d->updateType;
+}
+
+void UpdateScheduler::setInterval( int seconds )
+{
+    d->interval = qMax( seconds, 1 );
+}
+
+/*!
+  \property KDUpdater::UpdateScheduler::interval
+
+  The time between two successful update checks in seconds. Defaults to one day.
+
+  Get this property's value using %interval(), and set it using %setInterval().
+*/
+int UpdateScheduler::interval() const
+{
+    return d->interval;
+}
+
+void UpdateScheduler::setJitter( int seconds )
+{
+    d->jitter = qMax( seconds, 0 );
+}
+
+/*!
+  \property KDUpdater::UpdateScheduler::jitter
+
+  The maximum random delay in seconds added to every scheduled check. The first check after
+  \ref start() is delayed by a random amount up to this value as well, if it is overdue.
+  Defaults to one hour.
+
+  Get this property's value using %jitter(), and set it using %setJitter().
+*/
+int UpdateScheduler::jitter() const
+{
+    return d->jitter;
+}
+
+void UpdateScheduler::setMaximumBackoff( int seconds )
+{
+    d->maximumBackoff = qMax( seconds, 1 );
+}
+
+/*!
+  \property KDUpdater::UpdateScheduler::maximumBackoff
+
+  The maximum delay in seconds before retrying a failed check or a dead update source.
+  Defaults to one day.
+
+  Get this property's value using %maximumBackoff(), and set it using %setMaximumBackoff().
+*/
+int UpdateScheduler::maximumBackoff() const
+{
+    return d->maximumBackoff;
+}
+
+void UpdateScheduler::setRetryInterval( int seconds )
+{
+    d->retryInterval = qMax( seconds, 1 );
+}
+
+/*!
+  \property KDUpdater::UpdateScheduler::retryInterval
+
+  The delay in seconds before the first retry of a failed check or a dead update source. The
+  delay doubles with every further failure, up to \ref maximumBackoff. Defaults to 15 minutes.
+
+  Get this property's value using %retryInterval(), and set it using %setRetryInterval().
+*/
+int UpdateScheduler::retryInterval() const
+{
+    return d->retryInterval;
+}
+
+void UpdateScheduler::setOnlyWhenIdle( bool onlyWhenIdle )
+{
+    d->onlyWhenIdle = onlyWhenIdle;
+}
+
+/*!
+  \property KDUpdater::UpdateScheduler::onlyWhenIdle
+
+  If true, due checks are postponed until \ref isSystemIdle() returns true. Defaults to false.
+
+  Get this property's value using %onlyWhenIdle(), and set it using %setOnlyWhenIdle().
+*/
+bool UpdateScheduler::onlyWhenIdle() const
+{
+    return d->onlyWhenIdle;
+}
+
+void UpdateScheduler::setStateFileName( const QString & fileName )
+{
+    if( d->stateFileName == fileName )
+        return;
+
+    d->stateFileName = fileName;
+    d->stateLoaded = false;
+}
+
+/*!
+  \property KDUpdater::UpdateScheduler::stateFileName
+
+  The file the scheduler state is persisted in. Defaults to UpdateScheduler.xml in the
+  directory of the target. The state is read when the scheduler is started.
+
+  Get this property's value using %stateFileName(), and set it using %setStateFileName().
+*/
+QString UpdateScheduler::stateFileName() const
+{
+    return d->effectiveStateFileName();
+}
+
+/*!
+   Returns true if the scheduler has been started.
+*/
+bool UpdateScheduler::isActive() const
+{
+    return d->active;
+}
+
+/*!
+   Returns true while an update check is running.
+*/
+bool UpdateScheduler::isChecking() const
+{
+    return d->checking;
+}
+
+/*!
+   Returns the time (in UTC) of the last check.
+*/
+QDateTime UpdateScheduler::lastCheck() const
+{
+    return d->lastCheck;
+}
+
+/*!
+   Returns the time (in UTC) of the last successful check.
+*/
+QDateTime UpdateScheduler::lastSuccessfulCheck() const
+{
+    return d->lastSuccessfulCheck;
+}
+
+/*!
+   Returns the time (in UTC) the next check is scheduled for.
+*/
+QDateTime UpdateScheduler::nextCheck() const
+{
+    return d->nextCheck;
+}
+
+/*!
+   Returns the number of consecutive failed checks.
+*/
+int UpdateScheduler::failureCount() const
+{
+    return d->failureCount;
+}
+
+/*!
+   Returns the urls of the update sources that failed in recent checks and are skipped
+   until their retry delay has passed.
+*/
+QList<QUrl> UpdateScheduler::deadUpdateSources() const
+{
+    return d->deadSources.keys();
+}
+
+/*!
+   Returns the update finder of the last check that found changes, or 0 if no check was run yet.
+*/
+UpdateFinder * UpdateScheduler::updateFinder() const
+{
+    return d->finder;
+}
+
+/*!
+   Returns the updates found by the last check.
+*/
+QList<Update*> UpdateScheduler::updates() const
+{
+    return d->finder ? d->finder->updates() : QList<Update*>();
+}
+
+/*!
+   Starts scheduling update checks. If the persisted next check is overdue, a check is
+   run after a random delay of up to \ref jitter seconds.
+*/
+void UpdateScheduler::start()
+{
+    if( d->active )
+        return;
+
+    if( !d->stateLoaded )
+        d->loadState();
+
+    d->active = true;
+
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    if( !d->nextCheck.isValid() || d->nextCheck <= now )
+        d->schedule( now.addSecs( d->randomDelay( d->jitter ) ) );
+    else
+        d->armTimer();
+}
+
+/*!
+   Stops scheduling update checks. A running check is not interrupted.
+*/
+void UpdateScheduler::stop()
+{
+    d->active = false;
+    d->timer.stop();
+}
+
+/*!
+   Runs an update check immediately, regardless of the schedule and idle state. Does nothing
+   if a check is already running.
+*/
+void UpdateScheduler::checkNow()
+{
+    if( d->checking )
+        return;
+
+    d->runCheck();
+}
+
+/*!
+   Returns true if the system is idle enough for an update check. Only consulted if
+   \ref onlyWhenIdle is set.
+
+   The default implementation considers the system idle if there was no user input for
+   five minutes on Windows, and if the load average per CPU is below 0.25 on Unix.
+   Reimplement this function to use a different policy.
+*/
+bool UpdateScheduler::isSystemIdle() const
+{
+#if defined(Q_OS_WIN)
+    LASTINPUTINFO info;
+    info.cbSize = sizeof( info );
+    if( !GetLastInputInfo( &info ) )
+        return true;
+    return GetTickCount() - info.dwTime >= IdleInputThreshold * 1000;
+#elif defined(Q_OS_UNIX)
+    double load[ 1 ];
+    if( getloadavg( load, 1 ) != 1 )
+        return true;
+    return load[ 0 ] < IdleLoadThreshold * qMax( QThread::idealThreadCount(), 1 );
+#else
+    return true;
+#endif
+}
+
+#include "moc_kdupdaterupdatescheduler.cpp"
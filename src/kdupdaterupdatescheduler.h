@@ -0,0 +1,114 @@
+/****************************************************************************
+** Copyright (C) 2001-2012 Klaralvdalens Datakonsult AB.  All rights reserved.
+**
+** This file is part of the KD Tools library.
+**
+** Licensees holding valid commercial KD Tools licenses may use this file in
+** accordance with the KD Tools Commercial License Agreement provided with
+** the Software.
+**
+**
+** This file may be distributed and/or modified under the terms of the GNU
+** Lesser General Public License version 2 and version 3 as published by the
+** Free Software Foundation and appearing in the file LICENSE.LGPL included.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Contact info@kdab.net if any conditions of this licensing are not
+** clear to you.
+**
+**********************************************************************/
+
+#ifndef __KDTOOLS_KDUPDATERUPDATESCHEDULER_H__
+#define __KDTOOLS_KDUPDATERUPDATESCHEDULER_H__
+
+#include "kdupdater.h"
+#include <pimpl_ptr.h>
+
+#include <QtCore/QObject>
+#include <QtCore/QList>
+
+QT_BEGIN_NAMESPACE
+class QDateTime;
+class QUrl;
+QT_END_NAMESPACE
+
+namespace KDUpdater
+{
+    class Target;
+    class Update;
+    class UpdateFinder;
+
+    class KDUPDATER_EXPORT UpdateScheduler : public QObject
+    {
+        Q_OBJECT
+        Q_PROPERTY( int interval READ interval WRITE setInterval )
+        Q_PROPERTY( int jitter READ jitter WRITE setJitter )
+        Q_PROPERTY( int maximumBackoff READ maximumBackoff WRITE setMaximumBackoff )
+        Q_PROPERTY( int retryInterval READ retryInterval WRITE setRetryInterval )
+        Q_PROPERTY( bool onlyWhenIdle READ onlyWhenIdle WRITE setOnlyWhenIdle )
+        Q_PROPERTY( QString stateFileName READ stateFileName WRITE setStateFileName )
+
+    public:
+        explicit UpdateScheduler( Target * target, QObject * parent=0 );
+        ~UpdateScheduler();
+
+        Target * target() const;
+
+        void setUpdateType( UpdateTypes type );
+        UpdateTypes updateType() const;
+
+        void setInterval( int seconds );
+        int interval() const;
+
+        void setJitter( int seconds );
+        int jitter() const;
+
+        void setMaximumBackoff( int seconds );
+        int maximumBackoff() const;
+
+        void setRetryInterval( int seconds );
+        int retryInterval() const;
+
+        void setOnlyWhenIdle( bool onlyWhenIdle );
+        bool onlyWhenIdle() const;
+
+        void setStateFileName( const QString & fileName );
+        QString stateFileName() const;
+
+        bool isActive() const;
+        bool isChecking() const;
+
+        QDateTime lastCheck() const;
+        QDateTime lastSuccessfulCheck() const;
+        QDateTime nextCheck() const;
+        int failureCount() const;
+        QList<QUrl> deadUpdateSources() const;
+
+        UpdateFinder * updateFinder() const;
+        QList<Update*> updates() const;
+
+    public Q_SLOTS:
+        void start();
+        void stop();
+        void checkNow();
+
+    Q_SIGNALS:
+        void checkStarted();
+        void checkFinished( bool success );
+        void updatesAvailable( int count );
+
+    protected:
+        virtual bool isSystemIdle() const;
+
+    private:
+        Q_PRIVATE_SLOT( d, void slotTimeout() )
+
+        class Private;
+        kdtools::pimpl_ptr< Private > d;
+    };
+
+}
+
+#endif
@@ -222,9 +222,9 @@ void UpdatesDialog::Private::setCurrentUpdate( int index )
     ui.previousPackageButton->setEnabled( index != 0 );
 
     const QDir appdir( update->target()->directory() );
-    if (update->data( QLatin1String( "ReleaseNotes" ) ).isValid()) {
+    if (!update->releaseNotes().isEmpty()) {
         ui.releaseNotesGroup->show();
-        ui.releaseNotesView->setSource( update->data( QLatin1String( "ReleaseNotes" ) ).toUrl());
+        ui.releaseNotesView->setSource( update->releaseNotes() );
     }
     else {
         ui.releaseNotesGroup->hide();
@@ -236,7 +236,7 @@ QString UpdatesDialog::Private::packageDescription( const Update* update ) const
 {
     const PackagesInfo * const packages = update->target()->packagesInfo();
     const PackageInfo info = packages->packageInfo(
-        packages->findPackageInfo(update->data( QLatin1String( "Name" ) ).toString()));
+        packages->findPackageInfo(update->packageName()));
 
     const QDir appdir( update->target()->directory() );
     const QPixmap pixmap(appdir.filePath(info.pixmap));
@@ -248,8 +248,8 @@ QString UpdatesDialog::Private::packageDescription( const Update* update ) const
     QString description = tr("<b>A new package update is available for %1!</b><br/><br/>"
                              "The package %2 %3 is now available -- you have version %4")
                           .arg(packages->targetName(),
-                               update->data( QLatin1String( "Name" ) ).toString(),
-                               update->data( QLatin1String( "Version" ) ).toString(),
+                               update->packageName(),
+                               update->version(),
                                info.version);
 
     if (!info.title.isEmpty() || !info.description.isEmpty() ) {
@@ -263,10 +263,10 @@ QString UpdatesDialog::Private::packageDescription( const Update* update ) const
         }
     }
 
-    if ( update->data( QLatin1String( "Description" ) ).isValid() ) {
+    if ( !update->description().isNull() ) {
         description += QLatin1String( "<br/><br/>" );
         description += tr( "<b>Update description:</b><br/>%1" )
-                       .arg( update->data( QLatin1String( "Description" ) ).toString() );
+                       .arg( update->description() );
     }
     return description;
 }
@@ -278,13 +278,13 @@ QString UpdatesDialog::Private::compatDescription( const Update* update ) const
     QString description = tr("<b>A new compatibility update is available for %1!</b><br/><br/>"
                              "The compatibility level %2 is now available -- you have level %3")
                           .arg(packages->targetName(),
-                               QString::number(update->data( QLatin1String( "CompatLevel" ) ).toInt()),
+                               QString::number(update->compatLevel()),
                                QString::number(packages->compatLevel()));
 
-    if ( update->data( QLatin1String( "Description" ) ).isValid() ) {
+    if ( !update->description().isNull() ) {
         description += QLatin1String( "<br/><br/>" );
         description += tr( "<b>Update description:</b> %1" )
-                       .arg( update->data( QLatin1String( "Description" ) ).toString() );
+                       .arg( update->description() );
     }
     return description;
 }
@@ -21,19 +21,131 @@
 **********************************************************************/
 
 #include "kdupdaterupdatesinfo_p.h"
+#include "kdupdaterdependencyresolver.h"
 
 #include <QCoreApplication>
-#include <QDomDocument>
-#include <QDomElement>
 #include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSet>
 #include <QSharedData>
 #include <QUrl>
+#include <QXmlStreamReader>
 
 #include <algorithm>
 #include <functional>
 
 using namespace KDUpdater;
 
+/*!
+  \internal Returns a copy of \a str that shares its data with all other interned copies of
+  equal strings. Package names, tag names and dependencies repeat across catalogs and the
+  installed packages, interning them keeps a single instance of each in memory.
+ */
+QString KDUpdater::internString( const QString& str )
+{
+    static QSet<QString> pool;
+    static QMutex mutex;
+
+    if( str.isEmpty() )
+        return QString();
+
+    const QMutexLocker locker( &mutex );
+    const QSet<QString>::const_iterator it = pool.constFind( str );
+    if( it != pool.constEnd() )
+        return *it;
+
+    pool.insert( str );
+    return str;
+}
+
+/*!
+  \internal Returns the value of the field or extension tag \a key, for code that accesses
+  updates by tag name.
+ */
+QVariant UpdateInfo::value( const QString& key ) const
+{
+    if( key == QLatin1String( "Name" ) )
+        return name.isEmpty() ? QVariant() : QVariant( name );
+    if( key == QLatin1String( "Version" ) )
+        return version.isEmpty() ? QVariant() : QVariant( version );
+    if( key == QLatin1String( "ReleaseDate" ) )
+        return releaseDate.isValid() ? QVariant( releaseDate ) : QVariant();
+    if( key == QLatin1String( "Title" ) )
+        return title.isNull() ? QVariant() : QVariant( title );
+    if( key == QLatin1String( "Description" ) )
+        return description.isNull() ? QVariant() : QVariant( description );
+    if( key == QLatin1String( "CompatLevel" ) )
+        return compatLevel < 0 ? QVariant() : QVariant( compatLevel );
+    if( key == QLatin1String( "RequiredCompatLevel" ) )
+        return requiredCompatLevel < 0 ? QVariant() : QVariant( requiredCompatLevel );
+    if( key == QLatin1String( "ReleaseNotes" ) )
+        return releaseNotes.isEmpty() ? QVariant() : QVariant( releaseNotes );
+    if( key == QLatin1String( "Dependencies" ) )
+        return dependencies.isEmpty() ? QVariant() : QVariant( dependencies );
+
+    const QMap<QString, QString>::const_iterator it = extras.constFind( key );
+    return it == extras.constEnd() ? QVariant() : QVariant( *it );
+}
+
+/*!
+  \internal Returns the text of the element the reader is positioned at, including the text of
+  all child elements, and advances the reader to its end element.
+ */
+static QString readText( QXmlStreamReader& reader )
+{
+    return reader.readElementText( QXmlStreamReader::IncludeChildElements );
+}
+
+/*!
+  \internal Returns the value of the attribute \a name in \a attributes, or \a defaultValue if
+  there is no such attribute.
+ */
+static QString attributeValue( const QXmlStreamAttributes& attributes, const char* name, const char* defaultValue = 0 )
+{
+    const QLatin1String key( name );
+    if( !attributes.hasAttribute( key ) )
+        return defaultValue ? QString::fromLatin1( defaultValue ) : QString();
+    return attributes.value( key ).toString();
+}
+
+/*!
+  \internal Stores the text of the element \a reader is positioned at in the field of \a info
+  it belongs to. Returns false without reading anything if the element is no field of UpdateInfo.
+ */
+static bool parseUpdateInfoField( UpdateInfo& info, QXmlStreamReader& reader )
+{
+    const QStringRef tagName = reader.name();
+    if( tagName == QLatin1String( "Name" ) )
+        info.name = internString( readText( reader ) );
+    else if( tagName == QLatin1String( "Version" ) )
+        info.version = internString( readText( reader ) );
+    else if( tagName == QLatin1String( "ReleaseDate" ) )
+        info.releaseDate = QDate::fromString( readText( reader ), Qt::ISODate );
+    else if( tagName == QLatin1String( "Title" ) )
+        info.title = readText( reader );
+    else if( tagName == QLatin1String( "Description" ) )
+        info.description = readText( reader );
+    else if( tagName == QLatin1String( "CompatLevel" ) )
+        info.compatLevel = readText( reader ).toInt();
+    else if( tagName == QLatin1String( "RequiredCompatLevel" ) )
+        info.requiredCompatLevel = readText( reader ).toInt();
+    else if( tagName == QLatin1String( "ReleaseNotes" ) )
+        info.releaseNotes = QUrl( readText( reader ) );
+    else
+        return false;
+    return true;
+}
+
+/*!
+  \internal Stores the element \a reader is positioned at as extension tag of \a info.
+ */
+static void parseExtraField( UpdateInfo& info, QXmlStreamReader& reader )
+{
+    const QString tagName = internString( reader.name().toString() );
+    info.extras.insert( tagName, readText( reader ) );
+}
+
 //
 // KDUpdater::UpdatesInfo::Private
 //
@@ -53,8 +165,8 @@ public:
     QVector<UpdateInfo> updateInfoList;
 
     void parseFile(const QString& updateXmlFile);
-    bool parsePackageUpdateElement(const QDomElement & updateE);
-    bool parseCompatUpdateElement(const QDomElement & updateE);
+    bool parsePackageUpdateElement(QXmlStreamReader& reader);
+    bool parseCompatUpdateElement(QXmlStreamReader& reader);
 
     void setInvalidContentError( const QString& detail );
 };
@@ -91,15 +203,53 @@ struct CompatLevelIsNot : public std::unary_function< UpdateInfo, bool >
     bool operator()( const UpdateInfo& info ) const
     {
         if( info.type == CompatUpdate )
-            return info.data.value( QLatin1String( "CompatLevel" ) ) != compatLevel;
+            return info.compatLevel != compatLevel;
         else
-            return info.data.value( QLatin1String( "RequiredCompatLevel" ) ) != compatLevel;
+            return info.requiredCompatLevel != compatLevel;
     }
     
 private:
-    const QVariant compatLevel;
+    const int compatLevel;
 };
 
+/*!
+  \internal Returns the dependencies listed in the Dependencies element \a reader is positioned
+  at. Dependencies are either given as DependsOn child elements or as a comma separated list.
+ */
+static QStringList parseDependenciesElement( QXmlStreamReader& reader )
+{
+    QStringList deps;
+    QString text;
+    while( !reader.atEnd() )
+    {
+        const QXmlStreamReader::TokenType token = reader.readNext();
+        if( token == QXmlStreamReader::EndElement )
+            break;
+
+        if( token == QXmlStreamReader::Characters )
+        {
+            text += reader.text();
+        }
+        else if( token == QXmlStreamReader::StartElement )
+        {
+            const bool dependsOn = reader.name() == QLatin1String( "DependsOn" );
+            const QString childText = readText( reader );
+            text += childText;
+            const QString dep = childText.trimmed();
+            if( dependsOn && !dep.isEmpty() )
+                deps.append( internString( dep ) );
+        }
+    }
+
+    if( deps.isEmpty() )
+    {
+        deps = DependencyResolver::parseDependencies( text );
+        for( QStringList::iterator it = deps.begin(); it != deps.end(); ++it )
+            *it = internString( *it );
+    }
+    return deps;
+}
+
 void UpdatesInfo::Private::setInvalidContentError(const QString& detail)
 {
     error = UpdatesInfo::InvalidContentError;
@@ -116,59 +266,63 @@ void UpdatesInfo::Private::parseFile(const QString& updateXmlFile)
         return;
     }
 
-    QDomDocument doc;
-    QString parseErrorMessage;
-    int parseErrorLine;
-    int parseErrorColumn;
-    if( !doc.setContent( &file, &parseErrorMessage, &parseErrorLine, &parseErrorColumn ) )
-    {
-        error = UpdatesInfo::InvalidXmlError;
-        errorMessage = tr("Parse error in %1 at %2, %3: %4")
-                      .arg( updateXmlFile, 
-                            QString::number( parseErrorLine ),
-                            QString::number( parseErrorColumn ),
-                            parseErrorMessage );
-        return;
-    }
+    // The catalog is read into one buffer and parsed in a single streaming pass, without
+    // building a document tree first. Only the values kept in UpdateInfo get allocated.
+    const QByteArray content = file.readAll();
+    file.close();
 
-    const QDomElement rootE = doc.documentElement();
-    if( rootE.tagName() != QLatin1String( "Updates" ) )
+    QXmlStreamReader reader( content );
+    if( reader.readNextStartElement() )
     {
-        setInvalidContentError(tr("root element %1 unexpected, should be \"Updates\"").arg(rootE.tagName()));
-        return;
-    }
+        if( reader.name() != QLatin1String( "Updates" ) )
+        {
+            setInvalidContentError(tr("root element %1 unexpected, should be \"Updates\"").arg(reader.name().toString()));
+            return;
+        }
 
-    const QDomNodeList childNodes = rootE.childNodes();
-    for(int i=0; i<childNodes.count(); i++)
-    {
-        const QDomNode childNode = childNodes.at(i);
-        const QDomElement childE = childNode.toElement();
-        if( childE.isNull() )
-            continue;
+        updateInfoList.reserve( content.count( "<PackageUpdate" ) + content.count( "<CompatUpdate" ) );
 
-        if ( childE.tagName() == QLatin1String( "TargetName" ) ||
-             childE.tagName() == QLatin1String( "ApplicationName" ) ) // backwards compat
-            targetName = childE.text();
-        else if ( childE.tagName() == QLatin1String( "TargetVersion" ) ||
-                  childE.tagName() == QLatin1String( "ApplicationVersion" ) ) // backwards compat
-            targetVersion = childE.text();
-        else if( childE.tagName() == QLatin1String( "RequiredCompatLevel" ) )
-            compatLevel = childE.text().toInt();
-        else if( childE.tagName() == QLatin1String( "PackageUpdate" ) ) {
-            const bool res = parsePackageUpdateElement( childE );
-            if (!res) {
-                //error handled in subroutine
-                return;
-            }
-        } else if( childE.tagName() == QLatin1String( "CompatUpdate" ) ) {
-            const bool res = parseCompatUpdateElement( childE );
-            if (!res) {
-                //error handled in subroutine
-                return;
+        while( reader.readNextStartElement() )
+        {
+            const QStringRef tagName = reader.name();
+            if ( tagName == QLatin1String( "TargetName" ) ||
+                 tagName == QLatin1String( "ApplicationName" ) ) // backwards compat
+                targetName = readText( reader );
+            else if ( tagName == QLatin1String( "TargetVersion" ) ||
+                      tagName == QLatin1String( "ApplicationVersion" ) ) // backwards compat
+                targetVersion = readText( reader );
+            else if( tagName == QLatin1String( "RequiredCompatLevel" ) )
+                compatLevel = readText( reader ).toInt();
+            else if( tagName == QLatin1String( "PackageUpdate" ) ) {
+                const bool res = parsePackageUpdateElement( reader );
+                if (!res) {
+                    //error handled in subroutine
+                    return;
+                }
+            } else if( tagName == QLatin1String( "CompatUpdate" ) ) {
+                const bool res = parseCompatUpdateElement( reader );
+                if (!res) {
+                    //error handled in subroutine
+                    return;
+                }
+            } else {
+                reader.skipCurrentElement();
             }
         }
     }
 
+    if( reader.hasError() )
+    {
+        error = UpdatesInfo::InvalidXmlError;
+        errorMessage = tr("Parse error in %1 at %2, %3: %4")
+                      .arg( updateXmlFile, 
+                            QString::number( reader.lineNumber() ),
+                            QString::number( reader.columnNumber() ),
+                            reader.errorString() );
+        updateInfoList.clear();
+        return;
+    }
+
     if ( targetName.isEmpty() )
     {
         setInvalidContentError( tr("TargetName element is missing") );
@@ -181,56 +335,56 @@ void UpdatesInfo::Private::parseFile(const QString& updateXmlFile)
         return;
     }
     
+    updateInfoList.squeeze();
     error = UpdatesInfo::NoError;
     errorMessage.clear();
 }
 
-bool UpdatesInfo::Private::parsePackageUpdateElement(const QDomElement & updateE)
+bool UpdatesInfo::Private::parsePackageUpdateElement(QXmlStreamReader& reader)
 {
-    if( updateE.isNull() )
-        return false;
-
     UpdateInfo info;
     info.type = PackageUpdate;
 
-    const QDomNodeList childNodes = updateE.childNodes();
-    for(int i=0; i<childNodes.count(); i++)
+    while( reader.readNextStartElement() )
     {
-        const QDomNode childNode = childNodes.at(i);
-        const QDomElement childE = childNode.toElement();
-        if( childE.isNull() )
+        if( parseUpdateInfoField( info, reader ) ) {
             continue;
-
-        if( childE.tagName() == QLatin1String( "ReleaseNotes" ) ) {
-            info.data[childE.tagName()] = QUrl(childE.text());
         }
-        else if( childE.tagName() == QLatin1String( "UpdateFile" ) )
+        else if( reader.name() == QLatin1String( "UpdateFile" ) )
         {
+            const QXmlStreamAttributes attributes = reader.attributes();
             KDUpdater::UpdateFileInfo ufInfo;
-            ufInfo.arch = childE.attribute(QLatin1String( "Arch" ), QLatin1String( "i386" ));
-            ufInfo.platformRegEx = childE.attribute(QLatin1String( "platform-regex" ), QLatin1String( ".*" ));
-            ufInfo.compressedSize = childE.attribute( QLatin1String( "CompressedSize" ) ).toLongLong();
-            ufInfo.uncompressedSize = childE.attribute( QLatin1String( "UncompressedSize" ) ).toLongLong();
-            ufInfo.sha1sum = QByteArray::fromHex( childE.attribute( QLatin1String( "sha1sum" ) ).toLatin1() );
-            ufInfo.fileName = childE.text();
+            ufInfo.arch = internString( attributeValue( attributes, "Arch", "i386" ) );
+            ufInfo.platformRegEx = internString( attributeValue( attributes, "platform-regex", ".*" ) );
+            ufInfo.compressedSize = attributeValue( attributes, "CompressedSize" ).toLongLong();
+            ufInfo.uncompressedSize = attributeValue( attributes, "UncompressedSize" ).toLongLong();
+            ufInfo.sha1sum = QByteArray::fromHex( attributeValue( attributes, "sha1sum" ).toLatin1() );
+            ufInfo.fileName = readText( reader );
             info.updateFiles.append(ufInfo);
         }
+        else if( reader.name() == QLatin1String( "Dependencies" ) ) {
+            info.dependencies = parseDependenciesElement( reader );
+        }
         else {
-            info.data[childE.tagName()] = childE.text();
+            parseExtraField( info, reader );
         }
     }
 
-    if (!info.data.contains( QLatin1String( "Name" ) ))
+    // a truncated element is reported as XML error by parseFile()
+    if( reader.hasError() )
+        return true;
+
+    if (info.name.isEmpty())
     {
         setInvalidContentError(tr("PackageUpdate element without Name"));
         return false;
     }
-    else if (!info.data.contains( QLatin1String( "Version" ) ))
+    else if (info.version.isEmpty())
     {
         setInvalidContentError(tr("PackageUpdate element without Version"));
         return false;
     }
-    else if (!info.data.contains( QLatin1String( "ReleaseDate" ) ))
+    else if (!info.releaseDate.isValid())
     {
         setInvalidContentError(tr("PackageUpdate element without ReleaseDate"));
         return false;
@@ -245,45 +399,43 @@ bool UpdatesInfo::Private::parsePackageUpdateElement(const QDomElement & updateE
     return true;
 }
 
-bool UpdatesInfo::Private::parseCompatUpdateElement(const QDomElement & updateE)
+bool UpdatesInfo::Private::parseCompatUpdateElement(QXmlStreamReader& reader)
 {
-    if( updateE.isNull() )
-        return false;
-
     UpdateInfo info;
     info.type = CompatUpdate;
 
-    for( QDomNode childNode = updateE.firstChild(); !childNode.isNull(); childNode = childNode.nextSiblingElement() )
+    while( reader.readNextStartElement() )
     {
-        const QDomElement childE = childNode.toElement();
-        if( childE.isNull() )
+        if( parseUpdateInfoField( info, reader ) ) {
             continue;
-
-        if( childE.tagName() == QLatin1String( "ReleaseNotes" ) ) {
-            info.data[childE.tagName()] = QUrl(childE.text());
         }
-        else if( childE.tagName() == QLatin1String( "UpdateFile" ) )
+        else if( reader.name() == QLatin1String( "UpdateFile" ) )
         {
+            const QXmlStreamAttributes attributes = reader.attributes();
             UpdateFileInfo ufInfo;
-            ufInfo.platformRegEx = childE.attribute(QLatin1String( "platform-regex" ), QLatin1String( ".*" ));
-            ufInfo.compressedSize = childE.attribute( QLatin1String( "compressed-size" ) ).toLongLong();
-            ufInfo.uncompressedSize = childE.attribute( QLatin1String( "uncompressed-size" ) ).toLongLong();
-            ufInfo.arch = childE.attribute(QLatin1String( "Arch" ), QLatin1String( "i386" ));
-            ufInfo.fileName = childE.text();
+            ufInfo.platformRegEx = internString( attributeValue( attributes, "platform-regex", ".*" ) );
+            ufInfo.compressedSize = attributeValue( attributes, "compressed-size" ).toLongLong();
+            ufInfo.uncompressedSize = attributeValue( attributes, "uncompressed-size" ).toLongLong();
+            ufInfo.arch = internString( attributeValue( attributes, "Arch", "i386" ) );
+            ufInfo.fileName = readText( reader );
             info.updateFiles.append(ufInfo);
         }
         else {
-            info.data[childE.tagName()] = childE.text();
+            parseExtraField( info, reader );
         }
     }
 
-    if (!info.data.contains( QLatin1String( "CompatLevel" ) ))
+    // a truncated element is reported as XML error by parseFile()
+    if( reader.hasError() )
+        return true;
+
+    if (info.compatLevel < 0)
     {
         setInvalidContentError(tr("CompatUpdate element without CompatLevel"));
         return false;
     }
     
-    if (!info.data.contains( QLatin1String( "ReleaseDate" ) ))
+    if (!info.releaseDate.isValid())
     {
         setInvalidContentError(tr("CompatUpdate element without ReleaseDate"));
         return false;
@@ -308,10 +460,21 @@ UpdatesInfo::UpdatesInfo()
 {
 }
 
+UpdatesInfo::UpdatesInfo( const UpdatesInfo& other )
+    : d( other.d )
+{
+}
+
 UpdatesInfo::~UpdatesInfo()
 {
 }
 
+UpdatesInfo& UpdatesInfo::operator=( const UpdatesInfo& other )
+{
+    d = other.d;
+    return *this;
+}
+
 bool UpdatesInfo::isValid() const
 {
     return d->error == NoError;
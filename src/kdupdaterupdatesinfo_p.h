@@ -25,9 +25,12 @@
 
 #include "kdupdater.h"
 
+#include <QtCore/QDate>
 #include <QtCore/QSharedDataPointer>
 #include <QtCore/QString>
+#include <QtCore/QStringList>
 #include <QtCore/QMap>
+#include <QtCore/QUrl>
 #include <QtCore/QVariant>
 #include <QtCore/QVector>
 
@@ -36,6 +39,8 @@
 
 namespace KDUpdater
 {
+    QString internString( const QString& str );
+
     struct UpdateFileInfo
     {
         UpdateFileInfo()
@@ -54,12 +59,25 @@ namespace KDUpdater
     struct UpdateInfo
     {
         UpdateInfo()
-            : type( 0 )
+            : type( 0 ),
+              compatLevel( -1 ),
+              requiredCompatLevel( -1 )
         {
         }
         int type;
-        QMap<QString, QVariant> data;
+        QString name;
+        QString version;
+        QDate releaseDate;
+        QString title;
+        QString description;
+        int compatLevel;
+        int requiredCompatLevel;
+        QUrl releaseNotes;
+        QStringList dependencies;
+        QMap<QString, QString> extras;
         QVector<UpdateFileInfo> updateFiles;
+
+        QVariant value( const QString& key ) const;
     };
 
     class UpdatesInfo
@@ -75,8 +93,11 @@ namespace KDUpdater
         };
 
         UpdatesInfo();
+        UpdatesInfo( const UpdatesInfo& other );
         ~UpdatesInfo();
 
+        UpdatesInfo& operator=( const UpdatesInfo& other );
+
         bool isValid() const;
         QString errorString() const;
         Error error() const;
@@ -217,9 +217,9 @@ QVariant UpdatesModel::data( const QModelIndex& index, int role ) const
         switch( index.column() )
         {
         case 1: // name
-            return update->data( QLatin1String( "Name" ) );
+            return update->packageName();
         case 2: // version
-            return update->data( QLatin1String( "Version" ) );
+            return update->version();
         case 3: // size
             return Private::niceSizeText( update->compressedSize() );
         }
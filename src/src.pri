@@ -13,7 +13,11 @@ INSTALLHEADERS = \
            $$PWD/kdupdaterupdateoperation.h \
            $$PWD/kdupdaterupdateoperationfactory.h \
            $$PWD/kdupdaterupdatefinder.h \
+           $$PWD/kdupdaterbatchupdatefinder.h \
            $$PWD/kdupdaterupdateinstaller.h \
+           $$PWD/kdupdaterinstallplan.h \
+           $$PWD/kdupdaterdependencyresolver.h \
+           $$PWD/kdupdaterupdatescheduler.h \
            $$PWD/kdupdatertask.h \
            $$PWD/kdupdaterfiledownloader.h \
            $$PWD/kdupdaterfiledownloaderfactory.h \
@@ -34,6 +38,11 @@ INSTALLHEADERS = \
 PRIVATEHEADERS = $$PWD/kdupdaterfiledownloader_p.h \
                  $$PWD/kdupdaterupdateoperations_p.h \
                  $$PWD/kdupdaterupdatesinfo_p.h \
+                 $$PWD/kdupdateroperationjournal_p.h \
+                 $$PWD/kdupdaterdirectoryswap_p.h \
+                 $$PWD/kdupdaterfileutils_p.h \
+                 $$PWD/kdupdaterfilewritebatch_p.h \
+                 $$PWD/kdupdaterupdateinstructions_p.h \
 
 SOURCES += $$PWD/kdupdaterpackagesinfo.cpp \
            $$PWD/kdupdaterapplication.cpp \
@@ -45,10 +54,19 @@ SOURCES += $$PWD/kdupdaterpackagesinfo.cpp \
            $$PWD/kdupdaterfiledownloaderfactory.cpp \
            $$PWD/kdupdaterupdateoperation.cpp \
            $$PWD/kdupdaterupdateoperations.cpp \
+           $$PWD/kdupdaterfileutils.cpp \
+           $$PWD/kdupdaterfilewritebatch.cpp \
            $$PWD/kdupdaterupdateoperationfactory.cpp \
            $$PWD/kdupdaterupdatesinfo.cpp \
            $$PWD/kdupdaterupdatefinder.cpp \
+           $$PWD/kdupdaterbatchupdatefinder.cpp \
            $$PWD/kdupdaterupdateinstaller.cpp \
+           $$PWD/kdupdaterinstallplan.cpp \
+           $$PWD/kdupdaterupdateinstructions.cpp \
+           $$PWD/kdupdateroperationjournal.cpp \
+           $$PWD/kdupdaterdirectoryswap.cpp \
+           $$PWD/kdupdaterdependencyresolver.cpp \
+           $$PWD/kdupdaterupdatescheduler.cpp \
            $$PWD/kdupdatertask.cpp \
            $$PWD/kdupdaterpackagesmodel.cpp \
            $$PWD/kdupdaterupdatesourcesmodel.cpp \
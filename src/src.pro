@@ -17,7 +17,7 @@ macx {
     QMAKE_LFLAGS_SONAME = -Wl,-install_name,$$KDUPDATER_LIB_PATH/
 }
 
-QT          += xml network
+QT          += xml network concurrent
 CONFIG += create_prl
 DEFINES += emit=""
 DEFINES += QT_NO_KEYWORDS QT_NO_CAST_TO_ASCII QT_NO_CAST_FROM_ASCII QT_NO_CAST_FROM_BYTEARRAY
@@ -22,12 +22,14 @@
 
 #include "kdupdaterufcompressor.h"
 #include "kdupdaterufcompresscommon_p.h"
+#include "kdupdaterupdateinstructions_p.h"
 
 #include <QCryptographicHash>
 #include <QtDebug>
 #include <QDir>
 #include <QFile>
 #include <QFileInfo>
+#include <QMap>
 #include <QPointer>
 #include <QDataStream>
 
@@ -149,6 +151,39 @@ bool KDUpdater::UFCompressor::compress()
     if(sourceInfo.isDir())
         d->updateUFHeader(sourcePath, QDir(d->source), header);
 
+    // Add every UpdateInstructions.xml in compiled form, so installing does not have to parse it
+    QMap<QString, QByteArray> compiledInstructions;
+    for(int i=0; i<header.fileList.count(); i++)
+    {
+        const QString fileName = header.fileList[i];
+        if(header.isDirList[i] || QFileInfo(fileName).fileName() != QLatin1String( "UpdateInstructions.xml" ))
+            continue;
+
+        const QString completeFileName = QString::fromLatin1( "%1/%2" ).arg(sourcePath, fileName);
+        QFile xmlFile( completeFileName );
+        if ( !xmlFile.open( QFile::ReadOnly ) ) {
+            d->setError( tr( "Could not open input file \"%1\" to compress: %2").arg( completeFileName, xmlFile.errorString() ) );
+            return false;
+        }
+
+        QString errorString;
+        const QByteArray compiled = KDUpdater::UpdateInstructions::compile( xmlFile.readAll(), &errorString );
+        if ( compiled.isEmpty() ) {
+            d->setError( tr( "Could not compile \"%1\": %2").arg( completeFileName, errorString ) );
+            return false;
+        }
+
+        const QString compiledFileName = KDUpdater::UpdateInstructions::compiledFileName( fileName );
+        compiledInstructions.insert( compiledFileName, compiled );
+        if( !header.fileList.contains( compiledFileName ) )
+        {
+            const quint64 permissions = header.permList[i];
+            header.fileList << compiledFileName;
+            header.permList << permissions;
+            header.isDirList << false;
+        }
+    }
+
     // open the uf file for writing
     QFile ufFile( d->ufFileName );
     //this should actually use temp files for security, for now remove partial files if saving failed  
@@ -177,6 +212,14 @@ bool KDUpdater::UFCompressor::compress()
         KDUpdater::UFEntry ufEntry;
         ufEntry.fileName = header.fileList[i];
 
+        if ( compiledInstructions.contains( ufEntry.fileName ) ) {
+            ufEntry.fileData = qCompress( compiledInstructions.value( ufEntry.fileName ) );
+            ufEntry.permissions = header.permList[i];
+            ufDS << ufEntry;
+            ufEntry.addToHash(hash);
+            continue;
+        }
+
         QString completeFileName = QString::fromLatin1( "%1/%2" ).arg(sourcePath, ufEntry.fileName);
         QFile zeFile( completeFileName );
         if ( !zeFile.open( QFile::ReadOnly ) ) {